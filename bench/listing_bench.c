@@ -0,0 +1,449 @@
+/**
+ * Benchmark building a directory listing against the strcat based builder it
+ * replaced, on directories of growing size. The old builder rescans the whole
+ * page for every row it adds, so it is only run on the smaller directories.
+ *
+ * Usage: listing_bench [entries...]
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dir_listing.h"
+#include "utils.h"
+
+#define LEGACY_MAX_ENTRIES 20000 // Larger directories take minutes
+#define LEGACY_BUFF_SIZE 4096
+#define HEAD_SIZE 64
+#define INIT_DIR_ENTRIES 16
+#define DIR_EVERY 50      // One entry in this many is a directory
+#define MIN_RUN_SECS 0.5  // Repeat each builder for at least this long
+
+static const long DEFAULT_ENTRIES[] = { 1000, 10000, 100000 };
+static const int NUM_DEFAULT_ENTRIES = sizeof(DEFAULT_ENTRIES) / sizeof(long);
+
+/*=====================================*/
+/*     strcat page builder (original)  */
+/*=====================================*/
+
+static int legacy_resize(char **buffer, size_t *max, size_t required)
+{
+    // Already have enough space
+    if (required < (*max - 1))
+        return 0;
+
+    // Keep doubling until we have enough space
+    size_t new_size = *max;
+    do
+    {
+        new_size *= 2;
+    } while ((new_size + 1) < required);
+
+    // Try and resize
+    char *tmp = realloc(*buffer, new_size);
+    if (tmp == NULL)
+        return 1;
+
+    // Resize succeeded, update values
+    *buffer = tmp;
+    *max = new_size;
+    return 0;
+}
+
+static int legacy_shrink_to_fit(char **buffer, size_t *size)
+{
+    // Check if we can shrink
+    size_t len = strnlen(*buffer, *size) + 1;
+    if ((len - 1) == *size)
+        return 0;
+
+    char *tmp = realloc(*buffer, len);
+    if (tmp == NULL)
+        return 1;
+
+    // Ensure we null terminate (shouldn't be needed, but just to be safe)
+    tmp[len - 1] = '\0';
+
+    *buffer = tmp;
+    *size = len;
+
+    return 0;
+}
+
+static int legacy_compare(const void *a, const void *b)
+{
+    struct dirent **e1 = (struct dirent **) a;
+    struct dirent **e2 = (struct dirent **) b;
+
+    // Both are either files or directories so they can be compared
+    if ((*e1)->d_type == (*e2)->d_type)
+    {
+        int result = 0;
+        char *n1 = NULL, *n2 = NULL;
+
+        // Duplicate the names so we can convert them to lowercase without
+        // modifying the original file/directory name
+        n1 = strdup((*e1)->d_name);
+        if (n1 == NULL)
+        {
+            // strdup failed, try and compare what we have
+            return strcmp((*e1)->d_name, (*e2)->d_name);
+        }
+
+        n2 = strdup((*e2)->d_name);
+        if (n2 == NULL)
+        {
+            // strdup failed, try and compare what we have
+            free(n1);
+            return strcmp((*e1)->d_name, (*e2)->d_name);
+        }
+
+        // Ensure the names are all lowercase and compare
+        result = strcmp(lowerstr(n1), lowerstr(n2));
+        free(n1);
+        free(n2);
+        return result;
+    }
+    // e1 is a directory, and e2 is not, so e1 comes first
+    else if ((*e1)->d_type == DT_DIR && (*e2)->d_type != DT_DIR)
+        return -1;
+    else // e2 is a directory, and e1 is not, so e2 comes first
+        return 1;
+}
+
+static void legacy_free_list(struct dirent **dir, size_t size)
+{
+    for (int x = 0; x < (int) size; x++)
+        free(dir[x]);
+    free(dir);
+}
+
+
+static struct dirent **legacy_dir_tree(const char *path, size_t *items)
+{
+    size_t max = INIT_DIR_ENTRIES;
+    size_t i = 0;
+    struct dirent **dir_elms = NULL, **tmp = NULL;
+    DIR *d = opendir(path);
+    if (d == NULL)
+        goto get_dir_tree_end;
+
+    struct dirent *dir;
+    dir_elms = calloc(max, sizeof(struct dirent *));
+    while ((dir = readdir(d)) != NULL)
+    {
+        // Make sure our list has enough space
+        if (i == max)
+        {
+            size_t t_max = max * 2;
+            tmp = realloc(dir_elms, (t_max * sizeof(struct dirent *)));
+            if (tmp == NULL)
+                goto get_dir_tree_close_d;
+            dir_elms = tmp;
+            max = t_max;
+        }
+
+        // Allocate space for the new entry
+        dir_elms[i] = malloc(sizeof(struct dirent));
+        if (dir_elms[i] == NULL)
+            goto get_dir_tree_close_d;
+
+        // Add the entry to the list
+        memset(dir_elms[i], 0, sizeof(struct dirent));
+        strcpy(dir_elms[i]->d_name, dir->d_name);
+        dir_elms[i]->d_type = dir->d_type;
+        i++;
+    }
+get_dir_tree_close_d:
+    closedir(d);
+
+get_dir_tree_end:
+    *items = i;
+
+    // Sort the contents to ensure directories are first
+    // and everything is alphabetized
+    qsort(dir_elms, i, sizeof(struct dirent *), legacy_compare);
+    return dir_elms;
+}
+
+static void legacy_dir_html(const char *path, const char *full_path,
+                            char **buffer, size_t *b_size)
+{
+    unsigned char slash = path[strlen(path) - 1] != '/';
+    char file_path[PATH_MAX + NAME_MAX + 2] = { 0 };
+    const char *align_right = "style=\"text-align: right\"";
+    char end[] = "</table>\n</html>";
+
+    // Header for the HTML page
+    snprintf(*buffer, *b_size - 1,
+             "<!DOCTYPE html>\n<head>"
+             "<style>\ntd{\npadding-right: 30px;\ntext-align: left;\n}\n"
+             "</style>\n</head>\n"
+             "<h1>Index of %s%s</h1>\n"
+             "<table>\n",
+             path, slash ? "/" : "");
+    size_t buff_len = strlen(*buffer);
+
+    // Get all the files and directories in the given directory
+    size_t items;
+    struct dirent **dir = legacy_dir_tree(full_path, &items);
+    if (dir == NULL)
+        goto create_dir_html_end;
+
+    // Create the HTML to display each entry in the given directory
+    for (int x = 0; x < (int) items; x++)
+    {
+        if (strcmp(dir[x]->d_name, ".") == 0)
+            continue;
+
+        // Create the file path for the given entry
+        size_t d_name_len = strlen(dir[x]->d_name) + 1;
+        char *local_path = calloc(strlen(path) + d_name_len + slash,
+                                  sizeof(char));
+        if (local_path != NULL)
+            sprintf(local_path, "%s%s%s", path, slash ? "/" : "",
+                    dir[x]->d_name);
+        snprintf(file_path, sizeof(file_path), "%s/%s", full_path,
+                 dir[x]->d_name);
+
+        // Allocate memory for all the HTML that will comprise this entry
+        size_t row_max = (HEAD_SIZE * 3) + (d_name_len * 2)
+                         + (strlen(align_right) * 2) + 1;
+        char *table_row = calloc(row_max, sizeof(char));
+        if (table_row == NULL)
+        {
+            free(local_path);
+            goto create_dir_html_end;
+        }
+
+        // Allocate memory for the HTML that will comprise the file size
+        char *size_str = calloc(strlen(align_right) + HEAD_SIZE, sizeof(char));
+        if (size_str == NULL)
+        {
+            free(local_path);
+            free(table_row);
+            goto create_dir_html_end;
+        }
+
+        struct stat stats = { 0 };
+        stat(file_path, &stats);
+
+        // Get the time the file/directory was last modified
+        char time_str[HEAD_SIZE] = { 0 };
+#if __APPLE__
+        strftime(time_str, sizeof(time_str), "%d-%b-%Y %R",
+                 gmtime(&stats.st_mtimespec.tv_sec));
+#else
+        strftime(time_str, sizeof(time_str), "%d-%b-%Y %R",
+                 gmtime(&stats.st_mtim.tv_sec));
+#endif
+
+        // Get the size of the file, if applicable
+        sprintf(size_str, "<td %s>", align_right);
+        if (stats.st_size && (dir[x]->d_type != DT_DIR))
+            // Not casting throws a warning on macOS
+            sprintf(size_str + strlen(size_str), "%ld</td>\n",
+                    (long) stats.st_size);
+        else
+            sprintf(size_str + strlen(size_str), "-<td>\n");
+
+        // Create an entry in the table for the current file/directory
+        snprintf(table_row, row_max,
+                 "<tr>\n"
+                 "<td><a href=\"/%s%s\">%s%s</a></td>\n"
+                 "<td>%s</td>\n"
+                 "%s"
+                 "</tr>\n",
+                 local_path, (dir[x]->d_type == DT_DIR) ? "/" : "",
+                 dir[x]->d_name, (dir[x]->d_type == DT_DIR) ? "/" : "",
+                 time_str, size_str);
+
+        // Make sure the buffer is large enough
+        if (legacy_resize(buffer, b_size, (buff_len + strlen(table_row) + 1))
+            != 0)
+        {
+            free(local_path);
+            free(table_row);
+            free(size_str);
+            legacy_free_list(dir, items);
+            return;
+        }
+
+        // Add the new entry's HTML to the total HTML
+        strcat(*buffer, table_row);
+        buff_len = strlen(*buffer);
+
+        free(size_str);
+        free(table_row);
+        free(local_path);
+    }
+
+create_dir_html_end:
+    // List of dirent structs is no longer needed
+    legacy_free_list(dir, items);
+
+    // Make sure the buffer is large enough to hold the HTML footer
+    if (legacy_resize(buffer, b_size, (buff_len + sizeof(end) + 1)) != 0)
+        return;
+
+    // Add the HTML footer and remove any unneeded space
+    strcat(*buffer, end);
+    legacy_shrink_to_fit(buffer, b_size);
+}
+
+
+static char *legacy_render(const char *path, const char *full_path,
+                           size_t *size)
+{
+    size_t max = LEGACY_BUFF_SIZE;
+    char *buff = calloc(max, sizeof(char));
+    if (buff == NULL)
+        return NULL;
+    legacy_dir_html(path, full_path, &buff, &max);
+    *size = strlen(buff);
+    return buff;
+}
+
+/*=====================================*/
+/*               Driver                */
+/*=====================================*/
+
+/**
+ * @brief Get the current time of the monotonic clock
+ * @return The time (unit: s)
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/**
+ * @brief Fill the directory with files of assorted sizes and some directories
+ * @param dir The directory to fill
+ * @param entries Number of entries to create
+ * @return 0 on success, 1 if something went wrong
+ */
+static int make_fixture(const char *dir, long entries)
+{
+    char path[PATH_MAX + 32];
+    if (mkdir(dir, 0755) != 0)
+        return 1;
+    for (long x = 0; x < entries; x++)
+    {
+        snprintf(path, sizeof(path), "%s/entry-%07ld", dir, x);
+        if (x % DIR_EVERY == 0)
+        {
+            if (mkdir(path, 0755) != 0)
+                return 1;
+            continue;
+        }
+
+        // Sparse files, so a large size costs nothing to make
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, (x * 7919) % 1000000) != 0)
+            return 1;
+        close(fd);
+    }
+    return 0;
+}
+
+/**
+ * @brief Remove everything make_fixture() created
+ * @param dir The directory to remove
+ * @param entries Number of entries it was filled with
+ */
+static void remove_fixture(const char *dir, long entries)
+{
+    char path[PATH_MAX + 32];
+    for (long x = 0; x < entries; x++)
+    {
+        snprintf(path, sizeof(path), "%s/entry-%07ld", dir, x);
+        if (x % DIR_EVERY == 0)
+            rmdir(path);
+        else
+            unlink(path);
+    }
+    rmdir(dir);
+}
+
+/**
+ * @brief Time how long it takes to build the directory's listing
+ * @param dir The directory to list
+ * @param render The builder to time
+ * @param size Where to store the size of the page
+ * @return Milliseconds per listing, or -1 if the builder failed
+ */
+static double run(const char *dir,
+                  char *(*render)(const char *, const char *, size_t *),
+                  size_t *size)
+{
+    long runs = 0;
+    double start = now();
+    double elapsed = 0;
+    do
+    {
+        char *page = render("bench", dir, size);
+        if (page == NULL)
+            return -1;
+        free(page);
+        runs++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_RUN_SECS);
+    return (elapsed * 1000) / runs;
+}
+
+int main(int argc, char **argv)
+{
+    char root[] = "/tmp/listing_bench.XXXXXX";
+    if (mkdtemp(root) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    int num_sizes = (argc > 1) ? argc - 1 : NUM_DEFAULT_ENTRIES;
+    printf("%8s %10s %14s %14s %12s %8s\n", "entries", "page (KB)",
+           "strcat (ms)", "builder (ms)", "ns/entry", "speedup");
+    for (int x = 0; x < num_sizes; x++)
+    {
+        long entries = (argc > 1) ? strtol(argv[x + 1], NULL, 10)
+                                  : DEFAULT_ENTRIES[x];
+        if (entries <= 0)
+            continue;
+
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%ld", root, entries);
+        if (make_fixture(dir, entries) != 0)
+        {
+            perror("make_fixture");
+            remove_fixture(dir, entries);
+            break;
+        }
+
+        size_t size = 0;
+        double builder = run(dir, render_dir_listing, &size);
+        printf("%8ld %10zu ", entries, size / 1024);
+        if (entries <= LEGACY_MAX_ENTRIES)
+        {
+            size_t legacy_size = 0;
+            double legacy = run(dir, legacy_render, &legacy_size);
+            printf("%14.2f %14.2f %12.0f %7.1fx\n", legacy, builder,
+                   (builder * 1e6) / entries, legacy / builder);
+        }
+        else
+            printf("%14s %14.2f %12.0f %8s\n", "-", builder,
+                   (builder * 1e6) / entries, "-");
+        remove_fixture(dir, entries);
+    }
+
+    rmdir(root);
+    return 0;
+}
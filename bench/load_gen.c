@@ -0,0 +1,1058 @@
+/**
+ * Load generator for the server. Each thread drives its share of the
+ * connections with epoll, either sending the next request as soon as the
+ * last one is answered, or at a fixed rate. At a fixed rate, latency is
+ * measured from when each request was due to be sent rather than from when
+ * it was, so a server that stalls is not hidden by the requests that queued
+ * up behind it (coordinated omission).
+ *
+ * The URL file has one request per line: an optional weight, an optional
+ * method (GET if there is none), the target, then optionally one more
+ * header field, such as "3 /index.html" or "HEAD /files/ Accept: text/html".
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * Usage: load_gen [-t threads] [-c connections] [-d seconds] [-R rate]
+ *                 [-u url_file] [-n] [-j] [host:port]
+ */
+#define _GNU_SOURCE // Needed for memmem
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_TARGET "127.0.0.1:4080"
+#define DEFAULT_THREADS 2
+#define DEFAULT_CONNECTIONS 32
+#define DEFAULT_DURATION 10 // Seconds
+#define MAX_URLS 1024
+#define MAX_EVENTS 256
+#define HEAD_MAX 8192      // Longest response header
+#define RECV_SIZE 65536    // Bytes read at a time
+#define RETRY_DELAY 10     // Wait before connecting again (unit: ms)
+#define MAX_WAIT 10        // Longest epoll_wait, so the end is noticed (ms)
+#define SUB_BUCKET_BITS 4  // 16 buckets for each power of two
+#define MAX_VALUE_BITS 40  // Longest latency kept, about 18 minutes in ns
+#define NUM_BUCKETS ((MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS)
+#define NS_PER_SEC 1000000000ULL
+
+/**
+ * @enum ConnState
+ * @brief Where a connection is in its request
+ */
+enum ConnState
+{
+    CONN_IDLE = 0,        //!< Waiting to send the next request
+    CONN_CONNECTING = 1,  //!< Waiting for the connection to open
+    CONN_SENDING = 2,     //!< Sending the request
+    CONN_HEAD = 3,        //!< Reading the response header
+    CONN_BODY = 4,        //!< Reading a body with a Content-Length
+    CONN_CHUNK_SIZE = 5,  //!< Reading the size line of a chunk
+    CONN_CHUNK_DATA = 6,  //!< Reading the data of a chunk
+    CONN_CHUNK_END = 7,   //!< Reading the CRLF after a chunk's data
+    CONN_TRAILER = 8,     //!< Reading the trailer after the last chunk
+    CONN_UNTIL_CLOSE = 9, //!< Reading a body that ends with the connection
+};
+
+/**
+ * @struct Url
+ * @brief A request to send, and how often to pick it
+ */
+typedef struct
+{
+    char *request;       //!< The whole request
+    size_t len;          //!< Length of request
+    bool head;           //!< It is a HEAD request, so responses have no body
+    uint64_t weight_end; //!< Running total of the weights, up to this one
+} Url;
+
+/**
+ * @struct Conn
+ * @brief A connection to the server
+ */
+typedef struct
+{
+    int fd;               //!< The socket, -1 if it is not open
+    int state;            //!< The ConnState of the connection
+    const Url *url;       //!< The request being sent
+    size_t sent;          //!< Bytes of the request sent
+    uint64_t due;         //!< When the next request should go out (ns)
+    uint64_t started;     //!< When the latency is measured from (ns)
+    uint64_t remaining;   //!< Bytes left of the body or chunk
+    size_t line_len;      //!< Length of the trailer line being read
+    bool close_after;     //!< The server is closing after this response
+    int status;           //!< Status code of the response
+    size_t head_len;      //!< Bytes in head
+    char head[HEAD_MAX];  //!< The response header read so far
+} Conn;
+
+/**
+ * @struct Worker
+ * @brief A thread's connections, along with everything it measured
+ */
+typedef struct
+{
+    pthread_t thread;             //!< The thread
+    int epoll_fd;                 //!< Watches the thread's connections
+    int timer_fd;                 //!< Wakes the thread when a request is due
+    Conn *conns;                  //!< The thread's connections
+    int num_conns;                //!< Number of connections
+    uint64_t rng;                 //!< State for picking URLs
+    uint64_t requests;            //!< Responses read in full
+    uint64_t bytes;               //!< Bytes read
+    uint64_t connect_errors;      //!< Connections that could not be opened
+    uint64_t read_errors;         //!< Connections lost mid-response
+    uint64_t status_classes[6];   //!< Responses by the first digit of status
+    uint64_t latency_sum;         //!< Sum of the latencies (ns)
+    uint64_t latency_max;         //!< Longest latency (ns)
+    uint64_t buckets[NUM_BUCKETS]; //!< Latencies, as a histogram
+} Worker;
+
+static Url urls[MAX_URLS];
+static int num_urls = 0;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len = 0;
+static uint64_t interval = 0; // Between requests on a connection, 0 for max
+static bool close_conns = false;
+static uint64_t start_time = 0;
+static uint64_t end_time = 0;
+
+/**
+ * @brief Get the current time of the monotonic clock
+ * @return Time since an unspecified starting point (unit: ns)
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*=====================================*/
+/*          Latency histogram          */
+/*=====================================*/
+
+/**
+ * @brief Get the bucket a latency is counted in
+ *
+ * Latencies below 16ns get a bucket each. Past that, each power of two is
+ * split into 16 buckets, so each is accurate to within about 6%
+ * @param ns The latency (unit: ns)
+ * @return The index of the bucket
+ */
+static size_t bucket_of(uint64_t ns)
+{
+    if (ns >= (1ULL << MAX_VALUE_BITS))
+        ns = (1ULL << MAX_VALUE_BITS) - 1;
+    if (ns < (1 << SUB_BUCKET_BITS))
+        return ns;
+
+    int shift = (63 - __builtin_clzll(ns)) - SUB_BUCKET_BITS;
+    return ((size_t) (shift + 1) << SUB_BUCKET_BITS)
+           + ((ns >> shift) - (1 << SUB_BUCKET_BITS));
+}
+
+/**
+ * @brief Get the longest latency counted in a bucket
+ * @param bucket The index of the bucket
+ * @return The latency (unit: ns)
+ */
+static uint64_t bucket_max(size_t bucket)
+{
+    if (bucket < (1 << SUB_BUCKET_BITS))
+        return bucket;
+
+    int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+    uint64_t sub = (bucket & ((1 << SUB_BUCKET_BITS) - 1))
+                   + (1 << SUB_BUCKET_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * @brief Get a percentile of the latencies
+ * @param buckets The histogram
+ * @param count The number of latencies in it
+ * @param percentile The percentile, from 0 to 100
+ * @return The latency (unit: ns)
+ */
+static uint64_t get_percentile(const uint64_t *buckets, uint64_t count,
+                               double percentile)
+{
+    uint64_t seen = 0;
+    for (size_t x = 0; x < NUM_BUCKETS; x++)
+    {
+        seen += buckets[x];
+        if (count > 0 && seen >= percentile / 100 * count)
+            return bucket_max(x);
+    }
+    return 0;
+}
+
+/*=====================================*/
+/*             Connections             */
+/*=====================================*/
+
+/**
+ * @brief Pick the next URL to request, by weight
+ * @param worker The thread picking it
+ * @return The URL
+ */
+static const Url *pick_url(Worker *worker)
+{
+    if (num_urls == 1)
+        return &urls[0];
+
+    // xorshift64
+    worker->rng ^= worker->rng << 13;
+    worker->rng ^= worker->rng >> 7;
+    worker->rng ^= worker->rng << 17;
+    uint64_t pick = worker->rng % urls[num_urls - 1].weight_end;
+    int x = 0;
+    while (urls[x].weight_end <= pick)
+        x++;
+    return &urls[x];
+}
+
+/**
+ * @brief Close the connection
+ * @param conn The connection
+ */
+static void close_conn(Conn *conn)
+{
+    if (conn->fd != -1)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_IDLE;
+}
+
+/**
+ * @brief Start opening a connection to the server
+ * @param worker The thread the connection belongs to
+ * @param conn The connection
+ * @return True if the connection is opening
+ */
+static bool open_conn(Worker *worker, Conn *conn)
+{
+    conn->fd = socket(server_addr.ss_family,
+                      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1)
+    {
+        perror("socket");
+        return false;
+    }
+
+    // Requests are small and sent in one go, so there is nothing to batch
+    int on = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        close_conn(conn);
+        return false;
+    }
+
+    if (connect(conn->fd, (struct sockaddr *) &server_addr, server_addr_len)
+            == -1
+        && errno != EINPROGRESS)
+    {
+        close_conn(conn);
+        return false;
+    }
+    conn->state = CONN_CONNECTING;
+    return true;
+}
+
+/**
+ * @brief Send as much of the request as the socket will take
+ * @param conn The connection
+ * @return False if the connection was lost
+ */
+static bool send_request(Conn *conn)
+{
+    while (conn->sent < conn->url->len)
+    {
+        ssize_t res = send(conn->fd, conn->url->request + conn->sent,
+                           conn->url->len - conn->sent, MSG_NOSIGNAL);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        conn->sent += res;
+    }
+    conn->state = CONN_HEAD;
+    conn->head_len = 0;
+    return true;
+}
+
+/**
+ * @brief Start the connection's next request
+ *
+ * A closed connection is opened first, which counts towards the latency
+ * @param worker The thread the connection belongs to
+ * @param conn The connection
+ * @param now The current time (unit: ns)
+ */
+static void start_request(Worker *worker, Conn *conn, uint64_t now)
+{
+    conn->url = pick_url(worker);
+    conn->sent = 0;
+    conn->started = (interval > 0) ? conn->due : now;
+    if (conn->fd == -1 && !open_conn(worker, conn))
+    {
+        worker->connect_errors++;
+        conn->due = now + RETRY_DELAY * 1000000ULL;
+        return;
+    }
+    if (conn->state == CONN_IDLE)
+    {
+        conn->state = CONN_SENDING;
+        if (!send_request(conn))
+        {
+            worker->read_errors++;
+            close_conn(conn);
+        }
+    }
+}
+
+/**
+ * @brief Find a header field in the response header
+ * @param head The response header, NUL terminated
+ * @param name The name of the field, with its colon
+ * @return The value of the field, or NULL if there is none
+ */
+static const char *find_field(const char *head, const char *name)
+{
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line != NULL;
+         line = strstr(line, "\r\n"))
+    {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0)
+        {
+            const char *value = line + name_len;
+            while (*value == ' ' || *value == '\t')
+                value++;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Work out how the body of the response is framed
+ * @param conn The connection, with the whole header in head
+ * @return The ConnState to read the body in, or CONN_IDLE if there is none
+ */
+static int parse_head(Conn *conn)
+{
+    conn->head[conn->head_len] = '\0';
+    conn->status = (conn->head_len > 12) ? atoi(conn->head + 9) : 0;
+
+    const char *connection = find_field(conn->head, "Connection:");
+    conn->close_after = connection != NULL
+                        && strncasecmp(connection, "close", 5) == 0;
+
+    if (conn->url->head || conn->status < 200 || conn->status == 204
+        || conn->status == 304)
+        return CONN_IDLE;
+
+    const char *encoding = find_field(conn->head, "Transfer-Encoding:");
+    if (encoding != NULL && strncasecmp(encoding, "chunked", 7) == 0)
+    {
+        conn->remaining = 0;
+        return CONN_CHUNK_SIZE;
+    }
+    const char *length = find_field(conn->head, "Content-Length:");
+    if (length != NULL)
+    {
+        conn->remaining = strtoull(length, NULL, 10);
+        return (conn->remaining > 0) ? CONN_BODY : CONN_IDLE;
+    }
+    conn->close_after = true;
+    return CONN_UNTIL_CLOSE;
+}
+
+/**
+ * @brief Count the response, then get the connection ready for the next one
+ * @param worker The thread the connection belongs to
+ * @param conn The connection
+ * @param now The current time (unit: ns)
+ */
+static void finish_response(Worker *worker, Conn *conn, uint64_t now)
+{
+    // Responses finished after the end are left out, like those still
+    // going
+    if (now < end_time)
+    {
+        uint64_t latency = now - conn->started;
+        worker->requests++;
+        worker->latency_sum += latency;
+        if (latency > worker->latency_max)
+            worker->latency_max = latency;
+        worker->buckets[bucket_of(latency)]++;
+        worker->status_classes[(conn->status / 100) % 6]++;
+    }
+
+    conn->state = CONN_IDLE;
+    if (close_conns || conn->close_after)
+        close_conn(conn);
+
+    // At a fixed rate the schedule is kept, even if it has fallen behind
+    conn->due = (interval > 0) ? conn->due + interval : now;
+    if (conn->due <= now)
+        start_request(worker, conn, now);
+}
+
+/**
+ * @brief Read the response header out of the data
+ * @param conn The connection
+ * @param data The data read
+ * @param len The length of the data
+ * @return Bytes of the data that were part of the header, or -1 if the
+ * header is too large
+ */
+static ssize_t read_head(Conn *conn, const char *data, size_t len)
+{
+    size_t room = HEAD_MAX - 1 - conn->head_len;
+    size_t take = (len < room) ? len : room;
+    size_t from = (conn->head_len > 3) ? conn->head_len - 3 : 0;
+    memcpy(conn->head + conn->head_len, data, take);
+    size_t old_len = conn->head_len;
+    conn->head_len += take;
+
+    const char *end = memmem(conn->head + from, conn->head_len - from,
+                             "\r\n\r\n", 4);
+    if (end == NULL)
+        return (conn->head_len == HEAD_MAX - 1) ? -1 : (ssize_t) take;
+
+    conn->head_len = (end - conn->head) + 4;
+    conn->state = parse_head(conn);
+    return conn->head_len - old_len;
+}
+
+/**
+ * @brief Read the size line of a chunk out of the data
+ * @param conn The connection
+ * @param data The data read
+ * @param len The length of the data
+ * @return Bytes of the data that were part of the line
+ */
+static size_t read_chunk_size(Conn *conn, const char *data, size_t len)
+{
+    for (size_t x = 0; x < len; x++)
+    {
+        char c = data[x];
+        if (c == '\n')
+        {
+            conn->state = (conn->remaining > 0) ? CONN_CHUNK_DATA
+                                                : CONN_TRAILER;
+            conn->line_len = 0;
+            return x + 1;
+        }
+
+        // Chunk extensions, after a ';', are skipped along with the CR
+        if (conn->line_len == 0 && c >= '0' && c <= '9')
+            conn->remaining = conn->remaining * 16 + (c - '0');
+        else if (conn->line_len == 0 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            conn->remaining = conn->remaining * 16 + ((c | 0x20) - 'a' + 10);
+        else
+            conn->line_len = 1;
+    }
+    return len;
+}
+
+/**
+ * @brief Feed the data read from the connection through its response
+ * @param worker The thread the connection belongs to
+ * @param conn The connection
+ * @param data The data read
+ * @param len The length of the data
+ * @param now The current time (unit: ns)
+ * @return False if the response is malformed, or was not expected
+ */
+static bool read_response(Worker *worker, Conn *conn, const char *data,
+                          size_t len, uint64_t now)
+{
+    while (len > 0)
+    {
+        size_t used = len;
+        ssize_t res;
+        switch (conn->state)
+        {
+            case CONN_HEAD:
+                if ((res = read_head(conn, data, len)) < 0)
+                    return false;
+                used = res;
+                if (conn->state == CONN_IDLE)
+                {
+                    finish_response(worker, conn, now);
+                    return len == used; // Nothing was pipelined
+                }
+                break;
+            case CONN_BODY:
+            case CONN_CHUNK_DATA:
+            case CONN_CHUNK_END:
+                used = (len < conn->remaining) ? len : conn->remaining;
+                conn->remaining -= used;
+                if (conn->remaining > 0)
+                    break;
+                if (conn->state == CONN_CHUNK_DATA)
+                {
+                    conn->state = CONN_CHUNK_END;
+                    conn->remaining = 2;
+                }
+                else if (conn->state == CONN_CHUNK_END)
+                    conn->state = CONN_CHUNK_SIZE;
+                else
+                {
+                    finish_response(worker, conn, now);
+                    return len == used;
+                }
+                break;
+            case CONN_CHUNK_SIZE:
+                used = read_chunk_size(conn, data, len);
+                break;
+            case CONN_TRAILER:
+                // Ends with an empty line
+                used = 0;
+                while (used < len && conn->state == CONN_TRAILER)
+                {
+                    char c = data[used++];
+                    if (c == '\n' && conn->line_len == 0)
+                        conn->state = CONN_IDLE;
+                    else if (c == '\n')
+                        conn->line_len = 0;
+                    else if (c != '\r')
+                        conn->line_len++;
+                }
+                if (conn->state == CONN_IDLE)
+                {
+                    finish_response(worker, conn, now);
+                    return len == used;
+                }
+                break;
+            case CONN_UNTIL_CLOSE:
+                break;
+            default:
+                return false;
+        }
+        data += used;
+        len -= used;
+    }
+    return true;
+}
+
+/**
+ * @brief Handle an event on one of the worker's connections
+ * @param worker The thread the connection belongs to
+ * @param conn The connection
+ * @param events The events on the connection
+ * @param buff Where to read into, RECV_SIZE bytes
+ */
+static void handle_event(Worker *worker, Conn *conn, uint32_t events,
+                         char *buff)
+{
+    uint64_t now = now_ns();
+    if (conn->state == CONN_CONNECTING)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0)
+        {
+            worker->connect_errors++;
+            close_conn(conn);
+            conn->due = now + RETRY_DELAY * 1000000ULL;
+            return;
+        }
+        if (!(events & EPOLLOUT))
+            return;
+        conn->state = CONN_SENDING;
+    }
+    if (conn->state == CONN_SENDING && !send_request(conn))
+    {
+        worker->read_errors++;
+        close_conn(conn);
+        return;
+    }
+
+    while (conn->fd != -1)
+    {
+        ssize_t res = recv(conn->fd, buff, RECV_SIZE, 0);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (res <= 0)
+        {
+            // A body read until the end is done, and an idle connection
+            // the server let go of is only opened again
+            if (conn->state == CONN_UNTIL_CLOSE)
+                finish_response(worker, conn, now);
+            else if (conn->state != CONN_IDLE)
+                worker->read_errors++;
+            int state = conn->state;
+            if (conn->fd != -1 && state != CONN_CONNECTING
+                && state != CONN_SENDING)
+                close_conn(conn);
+            return;
+        }
+
+        worker->bytes += res;
+        if (!read_response(worker, conn, buff, res, now))
+        {
+            worker->read_errors++;
+            close_conn(conn);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Drive the worker's connections until the end of the run
+ * @param arg The Worker
+ * @return Always NULL
+ */
+static void *worker_thread(void *arg)
+{
+    Worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    char *buff = malloc(RECV_SIZE);
+    if (buff == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    uint64_t now = now_ns();
+    while (now < end_time)
+    {
+        // Start whatever is due, and wake up for the next due. epoll_wait
+        // only waits whole milliseconds, which would add to the latency
+        uint64_t next_due = end_time;
+        for (int x = 0; x < worker->num_conns; x++)
+        {
+            Conn *conn = &worker->conns[x];
+            if (conn->state != CONN_IDLE)
+                continue;
+            if (conn->due <= now)
+                start_request(worker, conn, now);
+            else if (conn->due < next_due)
+                next_due = conn->due;
+        }
+        struct itimerspec due = { 0 };
+        due.it_value.tv_sec = next_due / NS_PER_SEC;
+        due.it_value.tv_nsec = next_due % NS_PER_SEC;
+        timerfd_settime(worker->timer_fd, TFD_TIMER_ABSTIME, &due, NULL);
+
+        int ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS,
+                               MAX_WAIT);
+        if (ready == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        for (int x = 0; x < ready; x++)
+        {
+            if (events[x].data.ptr == NULL)
+            {
+                uint64_t expirations;
+                if (read(worker->timer_fd, &expirations, sizeof(expirations))
+                    == -1 && errno != EAGAIN)
+                    perror("read");
+                continue;
+            }
+            handle_event(worker, events[x].data.ptr, events[x].events, buff);
+        }
+        now = now_ns();
+    }
+
+    for (int x = 0; x < worker->num_conns; x++)
+        close_conn(&worker->conns[x]);
+    free(buff);
+    return NULL;
+}
+
+/*=====================================*/
+/*               Set up                */
+/*=====================================*/
+
+/**
+ * @brief Add a URL to the mix
+ * @param method The method of the request
+ * @param target The target of the request
+ * @param field An extra header field to send, or an empty string
+ * @param weight How often to pick it, against the other URLs
+ * @param host The value of the Host field
+ * @return 0 on success, 1 if something went wrong
+ */
+static int add_url(const char *method, const char *target, const char *field,
+                   uint64_t weight, const char *host)
+{
+    if (num_urls == MAX_URLS)
+    {
+        fprintf(stderr, "Error: More than %d URLs\n", MAX_URLS);
+        return 1;
+    }
+
+    Url *url = &urls[num_urls];
+    const char *fmt = "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                      "User-Agent: load_gen\r\n%s%s%s\r\n";
+    const char *conn = close_conns ? "Connection: close\r\n" : "";
+    const char *crlf = (*field != '\0') ? "\r\n" : "";
+    int len = snprintf(NULL, 0, fmt, method, target, host, field, crlf, conn);
+    url->request = malloc(len + 1);
+    if (url->request == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    sprintf(url->request, fmt, method, target, host, field, crlf, conn);
+    url->len = len;
+    url->head = strcmp(method, "HEAD") == 0;
+    url->weight_end = weight + ((num_urls > 0) ? urls[num_urls - 1].weight_end
+                                               : 0);
+    num_urls++;
+    return 0;
+}
+
+/**
+ * @brief Load the URL mix
+ * @param file Path of the URL file
+ * @param host The value of the Host field
+ * @return 0 on success, 1 if something went wrong
+ */
+static int load_urls(const char *file, const char *host)
+{
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL)
+    {
+        perror(file);
+        return 1;
+    }
+
+    char line[4096];
+    int res = 0;
+    while (res == 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *pos = line + strspn(line, " \t");
+        if (*pos == '\0' || *pos == '#')
+            continue;
+
+        uint64_t weight = 1;
+        if (*pos >= '0' && *pos <= '9')
+            weight = strtoull(pos, &pos, 10);
+
+        // Targets start with '/', or are '*' for the whole server
+        char *method = "GET";
+        pos += strspn(pos, " \t");
+        if (*pos != '/' && *pos != '*')
+        {
+            method = strsep(&pos, " \t");
+            pos = (pos != NULL) ? pos + strspn(pos, " \t") : "";
+        }
+        char *target = strsep(&pos, " \t");
+        char *field = (pos != NULL) ? pos + strspn(pos, " \t") : "";
+        if (*target == '\0')
+        {
+            fprintf(stderr, "Error: No target in %s: %s\n", file, line);
+            res = 1;
+        }
+        else if (weight > 0)
+            res = add_url(method, target, field, weight, host);
+    }
+    fclose(fp);
+    if (res == 0 && num_urls == 0)
+    {
+        fprintf(stderr, "Error: No URLs in %s\n", file);
+        res = 1;
+    }
+    return res;
+}
+
+/**
+ * @brief Look up the server's address
+ * @param target The server, as host:port
+ * @return 0 on success, 1 if something went wrong
+ */
+static int resolve_target(const char *target)
+{
+    char host[256];
+    const char *colon = strrchr(target, ':');
+    if (colon == NULL || (size_t) (colon - target) >= sizeof(host))
+    {
+        fprintf(stderr, "Error: Expected host:port, not %s\n", target);
+        return 1;
+    }
+    memcpy(host, target, colon - target);
+    host[colon - target] = '\0';
+
+    struct addrinfo hints = { 0 };
+    struct addrinfo *res = NULL;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, colon + 1, &hints, &res);
+    if (error != 0)
+    {
+        fprintf(stderr, "Error: %s: %s\n", target, gai_strerror(error));
+        return 1;
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**
+ * @brief Print how to use the load generator
+ * @param name The name it was run as
+ */
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [host:port]\n"
+            "  -t threads      Threads to run (default %d)\n"
+            "  -c connections  Connections across all threads (default %d)\n"
+            "  -d seconds      How long to run (default %d)\n"
+            "  -R rate         Requests per second across all connections,\n"
+            "                  latency is corrected for coordinated omission\n"
+            "                  (default as fast as the server answers)\n"
+            "  -u file         URL mix, one [weight] [method] target [field]\n"
+            "                  per line\n"
+            "                  (default /)\n"
+            "  -n              Open a new connection for every request\n"
+            "  -j              Print the results as JSON\n",
+            name, DEFAULT_THREADS, DEFAULT_CONNECTIONS, DEFAULT_DURATION);
+}
+
+/*=====================================*/
+/*               Results               */
+/*=====================================*/
+
+static const double PERCENTILES[] = { 50, 90, 99, 99.9, 99.99 };
+static const int NUM_PERCENTILES = sizeof(PERCENTILES) / sizeof(double);
+
+/**
+ * @brief Print what the workers measured
+ * @param workers The workers
+ * @param threads Number of workers
+ * @param connections Number of connections
+ * @param target The server
+ * @param rate The fixed rate, 0 if there was none
+ * @param json Print JSON rather than a table
+ */
+static void print_results(const Worker *workers, int threads,
+                          int connections, const char *target, double rate,
+                          bool json)
+{
+    static uint64_t buckets[NUM_BUCKETS];
+    Worker total = { 0 };
+    for (int x = 0; x < threads; x++)
+    {
+        const Worker *worker = &workers[x];
+        total.requests += worker->requests;
+        total.bytes += worker->bytes;
+        total.connect_errors += worker->connect_errors;
+        total.read_errors += worker->read_errors;
+        total.latency_sum += worker->latency_sum;
+        if (worker->latency_max > total.latency_max)
+            total.latency_max = worker->latency_max;
+        for (int y = 0; y < 6; y++)
+            total.status_classes[y] += worker->status_classes[y];
+        for (int y = 0; y < NUM_BUCKETS; y++)
+            buckets[y] += worker->buckets[y];
+    }
+
+    double secs = (double) (end_time - start_time) / NS_PER_SEC;
+    double mean = total.requests > 0
+                      ? (double) total.latency_sum / total.requests / 1000
+                      : 0;
+    if (json)
+    {
+        printf("{\"target\": \"%s\", \"threads\": %d, \"connections\": %d, "
+               "\"keep_alive\": %s, \"rate\": %.0f, \"seconds\": %.3f, "
+               "\"requests\": %llu, \"rps\": %.1f, \"bytes\": %llu, "
+               "\"connect_errors\": %llu, \"read_errors\": %llu, ",
+               target, threads, connections, close_conns ? "false" : "true",
+               rate, secs, (unsigned long long) total.requests,
+               total.requests / secs, (unsigned long long) total.bytes,
+               (unsigned long long) total.connect_errors,
+               (unsigned long long) total.read_errors);
+        printf("\"status\": {\"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, "
+               "\"5xx\": %llu}, \"latency_us\": {\"mean\": %.1f, ",
+               (unsigned long long) total.status_classes[2],
+               (unsigned long long) total.status_classes[3],
+               (unsigned long long) total.status_classes[4],
+               (unsigned long long) total.status_classes[5], mean);
+        for (int x = 0; x < NUM_PERCENTILES; x++)
+            printf("\"p%g\": %.1f, ", PERCENTILES[x],
+                   get_percentile(buckets, total.requests, PERCENTILES[x])
+                       / 1000.0);
+        printf("\"max\": %.1f}}\n", total.latency_max / 1000.0);
+        return;
+    }
+
+    printf("%.1fs against %s, %d threads, %d connections, %s, ", secs,
+           target, threads, connections,
+           close_conns ? "closed" : "keep-alive");
+    if (rate > 0)
+        printf("%.0f requests/s\n", rate);
+    else
+        printf("max throughput\n");
+    printf("  Requests:     %llu (%.1f/s)\n",
+           (unsigned long long) total.requests, total.requests / secs);
+    printf("  Transfer:     %.2f MB/s\n", total.bytes / secs / 1e6);
+    printf("  Status:       2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n",
+           (unsigned long long) total.status_classes[2],
+           (unsigned long long) total.status_classes[3],
+           (unsigned long long) total.status_classes[4],
+           (unsigned long long) total.status_classes[5]);
+    printf("  Errors:       connect %llu, read %llu\n",
+           (unsigned long long) total.connect_errors,
+           (unsigned long long) total.read_errors);
+    printf("  Latency (us): mean %.1f", mean);
+    for (int x = 0; x < NUM_PERCENTILES; x++)
+        printf(", p%g %.1f", PERCENTILES[x],
+               get_percentile(buckets, total.requests, PERCENTILES[x])
+                   / 1000.0);
+    printf(", max %.1f\n", total.latency_max / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    int threads = DEFAULT_THREADS;
+    int connections = DEFAULT_CONNECTIONS;
+    double duration = DEFAULT_DURATION;
+    double rate = 0;
+    const char *url_file = NULL;
+    bool json = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:R:u:njh")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'R':
+                rate = atof(optarg);
+                break;
+            case 'u':
+                url_file = optarg;
+                break;
+            case 'n':
+                close_conns = true;
+                break;
+            case 'j':
+                json = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    const char *target = (optind < argc) ? argv[optind] : DEFAULT_TARGET;
+    if (threads <= 0 || connections <= 0 || duration <= 0 || rate < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads > connections)
+        threads = connections;
+
+    if (resolve_target(target) != 0)
+        return 1;
+    if ((url_file != NULL) ? load_urls(url_file, target) != 0
+                           : add_url("GET", "/", "", 1, target) != 0)
+        return 1;
+
+    // Each connection takes its share of the rate
+    if (rate > 0)
+        interval = (uint64_t) (connections * (double) NS_PER_SEC / rate);
+
+    Worker *workers = calloc(threads, sizeof(Worker));
+    Conn *conns = calloc(connections, sizeof(Conn));
+    if (workers == NULL || conns == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    start_time = now_ns();
+    end_time = start_time + (uint64_t) (duration * NS_PER_SEC);
+    int next = 0;
+    for (int x = 0; x < threads; x++)
+    {
+        Worker *worker = &workers[x];
+        worker->conns = &conns[next];
+        worker->num_conns = connections / threads
+                            + (x < connections % threads ? 1 : 0);
+        worker->rng = 0x9e3779b97f4a7c15ULL * (x + 1);
+        for (int y = 0; y < worker->num_conns; y++)
+        {
+            // Spread the first requests out, so they do not all go at once
+            Conn *conn = &worker->conns[y];
+            conn->fd = -1;
+            conn->state = CONN_IDLE;
+            conn->due = start_time + interval * (next + y) / connections;
+        }
+        next += worker->num_conns;
+
+        worker->epoll_fd = epoll_create1(0);
+        worker->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        struct epoll_event ev = { 0 };
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (worker->epoll_fd == -1 || worker->timer_fd == -1
+            || epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->timer_fd,
+                         &ev) == -1)
+        {
+            perror("epoll");
+            return 1;
+        }
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker)
+            != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    for (int x = 0; x < threads; x++)
+    {
+        pthread_join(workers[x].thread, NULL);
+        close(workers[x].timer_fd);
+        close(workers[x].epoll_fd);
+    }
+    print_results(workers, threads, connections, target, rate, json);
+
+    for (int x = 0; x < num_urls; x++)
+        free(urls[x].request);
+    free(conns);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,486 @@
+/**
+ * Microbenchmarks of the functions every request goes through: finding the
+ * end of a request and parsing it, looking up its header fields and the
+ * content type of the file it asks for, logging it, and rendering directory
+ * listings.
+ * Each is run over a corpus of realistic requests, or directories of a few
+ * sizes, and reported as nanoseconds and heap allocations per call. The
+ * arena is reset after every call, as it is after every request.
+ *
+ * Usage: microbench [-j] [-t seconds] [name...]
+ *   -j          Print the results as JSON, for tracking them over time
+ *   -t seconds  Least time to run each benchmark for (default 0.5)
+ *   name        Only run benchmarks whose names contain one of these
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "arena.h"
+#include "content_map.h"
+#include "defaults.h"
+#include "dir_listing.h"
+#include "file_cache.h"
+#include "http.h"
+#include "reader.h"
+#include "utils.h"
+
+#define DEFAULT_RUN_SECS 0.5 // Least time to run each benchmark for
+#define BATCH 64             // Calls made between reading the clock
+#define DIR_EVERY 50         // One entry in this many is a directory
+#define HEAD_SIZE 64
+#define CACHE_BUDGET (64 * 1024 * 1024)
+
+// The settings the server's objects read, defined in server.c for the server
+char *SERVER_NAME = DEFAULT_SERVER_NAME;
+char *HTML_PATH = NULL;
+uint16_t THREAD_POOL_SIZE = DEFAULT_THREAD_POOL_SIZE;
+uint16_t BUFF_SIZE = DEFAULT_BUFF_SIZE;
+uint32_t CONN_TIMEOUT_LEN = DEFAULT_TIMEOUT;
+bool ERROR_PAGES = DEFAULT_ERROR_PAGES;
+bool PRECOMPRESSED = DEFAULT_PRECOMPRESSED;
+bool COMPRESSION = DEFAULT_COMPRESSION;
+uint8_t COMPRESS_LEVEL = DEFAULT_COMPRESS_LEVEL;
+uint32_t COMPRESS_MIN = DEFAULT_COMPRESS_MIN_SIZE;
+char COMPRESS_TYPES[COMPRESS_TYPES_LEN] = DEFAULT_COMPRESS_TYPES;
+CacheRule CACHE_RULES[MAX_CACHE_RULES];
+uint8_t NUM_CACHE_RULES = 0;
+bool STATUS_PAGE = DEFAULT_STATUS_PAGE;
+
+/**
+ * @brief Requests as clients send them, from the smallest possible to a
+ * browser's, along with some with bodies and some that are malformed
+ */
+static const char *const REQUESTS[] = {
+    "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+    "GET /style.css HTTP/1.1\r\nHost: example.com\r\n"
+    "User-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n",
+    "GET /assets/js/app.min.js HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "If-None-Match: \"65f1c2a4-1a2b\"\r\n"
+    "If-Modified-Since: Wed, 13 Mar 2024 10:15:00 GMT\r\n\r\n",
+    "GET /files/?offset=100&limit=50 HTTP/1.1\r\nHost: localhost:8080\r\n"
+    "Accept: application/json\r\nAccept-Encoding: gzip\r\n\r\n",
+    "GET /videos/clip.mp4 HTTP/1.1\r\nHost: example.com\r\n"
+    "Range: bytes=1048576-2097151\r\nIf-Range: \"65f1c2a4-9c4000\"\r\n\r\n",
+    "HEAD /index.html HTTP/1.1\r\nHost: example.com\r\n"
+    "Connection: close\r\n\r\n",
+    "OPTIONS * HTTP/1.1\r\nHost: example.com\r\n\r\n",
+    "POST /form HTTP/1.1\r\nHost: example.com\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 27\r\n\r\nname=alice&message=hello+x",
+    "GET /index.html HTTP/1.0\r\n\r\n",
+    "GET /index.html HTTP/2.0\r\nHost: example.com\r\n\r\n",
+    "GET /index.html\r\nHost: example.com\r\n\r\n",
+    "get / HTTP/1.1\r\nHost: example.com\r\n\r\n",
+};
+static const size_t NUM_REQUESTS = sizeof(REQUESTS) / sizeof(char *);
+
+/**
+ * @brief Names of fields looked up while serving a request, some of which
+ * requests rarely have
+ */
+static const char *const FIELDS[] = {
+    "Connection",    "Accept-Encoding", "If-None-Match", "If-Modified-Since",
+    "Range",         "Content-Length",  "Transfer-Encoding",
+};
+static const size_t NUM_FIELDS = sizeof(FIELDS) / sizeof(char *);
+
+/**
+ * @brief Files requested, weighted towards the usual assets of a site
+ */
+static const char *const FILES[] = {
+    "index.html", "style.css",  "app.min.js", "logo.png",   "photo.JPG",
+    "data.json",  "font.woff2", "README",     "backup.tar.gz", "clip.mp4",
+    "about.html", "print.css",  "icon.ico",   "feed.xml",   "vendor.js",
+};
+static const size_t NUM_FILES = sizeof(FILES) / sizeof(char *);
+
+/**
+ * @struct Listing
+ * @brief A generated directory to list
+ */
+typedef struct
+{
+    long entries;          //!< Number of entries in the directory
+    char dir[PATH_MAX];    //!< Path to the directory
+    struct stat stats;     //!< Stats of the directory
+} Listing;
+
+/**
+ * @struct Bench
+ * @brief A function to benchmark
+ */
+typedef struct
+{
+    const char *name;        //!< Name of the benchmark
+    void (*op)(size_t call); //!< Makes one call, call counts up from 0
+    Listing *listing;        //!< The directory it lists, if any
+    void (*settle)(void);    //!< Called between batches untimed, or NULL
+} Bench;
+
+static char *requests[sizeof(REQUESTS) / sizeof(char *)];
+static size_t request_lens[sizeof(REQUESTS) / sizeof(char *)];
+static HttpRequest parsed;
+static Listing *listing = NULL;
+static Listing listings[2] = { { .entries = 100 }, { .entries = 5000 } };
+static volatile size_t sink = 0; // Keeps results from being optimised out
+
+/**
+ * @brief Get the current time of the monotonic clock
+ * @return Time since an unspecified starting point (unit: ns)
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*=====================================*/
+/*             Benchmarks              */
+/*=====================================*/
+
+static void op_reader_check(size_t call)
+{
+    static HttpRequest req;
+    size_t x = call % NUM_REQUESTS;
+    RequestReader reader = { 0 };
+    reader.buff = requests[x];
+    reader.size = request_lens[x];
+    reader.capacity = request_lens[x];
+    sink += reader_check(&reader, &req);
+}
+
+static void op_parse_request(size_t call)
+{
+    static HttpRequest req;
+    size_t x = call % NUM_REQUESTS;
+    req.buff = requests[x];
+    req.size = request_lens[x];
+    sink += parse_request(&req);
+}
+
+static void op_get_header(size_t call)
+{
+    sink += (size_t) get_header(&parsed, FIELDS[call % NUM_FIELDS]);
+}
+
+static void op_access_log_request(size_t call)
+{
+    access_log_request(&parsed, 200, call);
+}
+
+/**
+ * @brief Wait for the logger to make room for the next batch, so every call
+ * is timed copying a record into the ring rather than finding it full
+ */
+static void settle_access_log(void)
+{
+    while (access_log_pending() > LOG_RING_SIZE - BATCH)
+        sched_yield();
+}
+
+static void op_get_type_from_map(size_t call)
+{
+    // As the server gets the content type of a file
+    char ext[HEAD_SIZE] = { 0 };
+    strncpy(ext, get_filename_ext(FILES[call % NUM_FILES]), sizeof(ext) - 1);
+    sink += (size_t) get_type_from_map(lowerstr(ext));
+}
+
+static void op_render_dir_listing(size_t call)
+{
+    size_t size = 0;
+    char *page = render_dir_listing("/files", listing->dir, &size);
+    sink += size;
+    free(page);
+}
+
+static void op_get_dir_listing(size_t call)
+{
+    ListingQuery query = { 0, SIZE_MAX, false };
+    CachedFile *page = get_dir_listing("/files", listing->dir,
+                                       &listing->stats, &query);
+    if (page != NULL)
+    {
+        sink += page->size;
+        file_cache_release(page);
+    }
+}
+
+static void op_get_dir_listing_page(size_t call)
+{
+    // Walk through the pages, as a client paging through the listing would
+    ListingQuery query = { 0, 100, call % 2 == 1 };
+    query.offset = (call / 2 * query.limit) % listing->entries;
+    CachedFile *page = get_dir_listing("/files", listing->dir,
+                                       &listing->stats, &query);
+    if (page != NULL)
+    {
+        sink += page->size;
+        file_cache_release(page);
+    }
+}
+
+static Bench BENCHES[] = {
+    { "reader_check", op_reader_check, NULL },
+    { "parse_request", op_parse_request, NULL },
+    { "get_header", op_get_header, NULL },
+    { "get_type_from_map", op_get_type_from_map, NULL },
+    { "access_log_request", op_access_log_request, NULL, settle_access_log },
+    { "render_dir_listing/100", op_render_dir_listing, &listings[0] },
+    { "render_dir_listing/5000", op_render_dir_listing, &listings[1] },
+    { "get_dir_listing/100", op_get_dir_listing, &listings[0] },
+    { "get_dir_listing/5000", op_get_dir_listing, &listings[1] },
+    { "get_dir_listing/5000/page", op_get_dir_listing_page, &listings[1] },
+};
+static const int NUM_BENCHES = sizeof(BENCHES) / sizeof(Bench);
+
+/*=====================================*/
+/*               Driver                */
+/*=====================================*/
+
+/**
+ * @brief Fill the directory with files of assorted sizes and some directories
+ * @param dir The directory to fill
+ * @param entries Number of entries to create
+ * @return 0 on success, 1 if something went wrong
+ */
+static int make_fixture(const char *dir, long entries)
+{
+    char path[PATH_MAX + 32];
+    if (mkdir(dir, 0755) != 0)
+        return 1;
+    for (long x = 0; x < entries; x++)
+    {
+        snprintf(path, sizeof(path), "%s/entry-%07ld", dir, x);
+        if (x % DIR_EVERY == 0)
+        {
+            if (mkdir(path, 0755) != 0)
+                return 1;
+            continue;
+        }
+
+        // Sparse files, so a large size costs nothing to make
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, (x * 7919) % 1000000) != 0)
+            return 1;
+        close(fd);
+    }
+    return 0;
+}
+
+/**
+ * @brief Remove everything make_fixture() created
+ * @param dir The directory to remove
+ * @param entries Number of entries it was filled with
+ */
+static void remove_fixture(const char *dir, long entries)
+{
+    char path[PATH_MAX + 32];
+    for (long x = 0; x < entries; x++)
+    {
+        snprintf(path, sizeof(path), "%s/entry-%07ld", dir, x);
+        if (x % DIR_EVERY == 0)
+            rmdir(path);
+        else
+            unlink(path);
+    }
+    rmdir(dir);
+}
+
+/**
+ * @brief Check if the benchmark was asked for
+ * @param name Name of the benchmark
+ * @param filters Names given on the command line
+ * @param num_filters Number of filters, 0 to run every benchmark
+ * @return True if it should be run
+ */
+static bool selected(const char *name, char **filters, int num_filters)
+{
+    for (int x = 0; x < num_filters; x++)
+        if (strstr(name, filters[x]) != NULL)
+            return true;
+    return num_filters == 0;
+}
+
+/**
+ * @brief Call the benchmark's function until the time is up
+ *
+ * A first batch of calls is made untimed, so caches and the arena are warm.
+ * Only the batches are timed, not the benchmark settling between them
+ * @param bench The benchmark to run
+ * @param run_secs Least time to run for
+ * @param ns_per_op Where to store the time each call took (unit: ns)
+ * @param allocs_per_op Where to store the heap allocations each call made
+ * @return Number of calls timed
+ */
+static uint64_t run(const Bench *bench, double run_secs, double *ns_per_op,
+                    double *allocs_per_op)
+{
+    listing = bench->listing;
+    for (size_t x = 0; x < BATCH; x++)
+    {
+        bench->op(x);
+        arena_reset();
+    }
+
+    if (bench->settle != NULL)
+        bench->settle();
+
+    uint64_t calls = 0;
+    uint64_t allocs = get_alloc_count();
+    uint64_t end = now_ns() + (uint64_t) (run_secs * 1e9);
+    uint64_t elapsed = 0;
+    uint64_t batch_end = 0;
+    do
+    {
+        uint64_t batch_start = now_ns();
+        for (size_t x = 0; x < BATCH; x++)
+        {
+            bench->op(calls + x);
+            arena_reset();
+        }
+        calls += BATCH;
+        batch_end = now_ns();
+        elapsed += batch_end - batch_start;
+        if (bench->settle != NULL)
+            bench->settle();
+    } while (batch_end < end);
+
+    *ns_per_op = (double) elapsed / calls;
+    *allocs_per_op = (double) (get_alloc_count() - allocs) / calls;
+    return calls;
+}
+
+int main(int argc, char **argv)
+{
+    bool json = false;
+    double run_secs = DEFAULT_RUN_SECS;
+    int opt;
+    while ((opt = getopt(argc, argv, "jt:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                json = true;
+                break;
+            case 't':
+                run_secs = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-t seconds] [name...]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    // The parsers expect the request in a writable buffer with room for a
+    // NUL, as the reader leaves it
+    for (size_t x = 0; x < NUM_REQUESTS; x++)
+    {
+        request_lens[x] = strlen(REQUESTS[x]);
+        requests[x] = malloc(request_lens[x] + 1);
+        if (requests[x] == NULL)
+        {
+            perror("malloc");
+            return 1;
+        }
+        memcpy(requests[x], REQUESTS[x], request_lens[x] + 1);
+    }
+    parsed.buff = requests[2];
+    parsed.size = request_lens[2];
+    if (parse_request(&parsed) != PARSE_STATUS_DONE)
+    {
+        fprintf(stderr, "Error: The browser request did not parse\n");
+        return 1;
+    }
+
+    char root[] = "/tmp/microbench.XXXXXX";
+    if (mkdtemp(root) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    int res = 0;
+    for (int x = 0; res == 0 && x < 2; x++)
+    {
+        Listing *l = &listings[x];
+        snprintf(l->dir, sizeof(l->dir), "%s/%ld", root, l->entries);
+        if (make_fixture(l->dir, l->entries) != 0
+            || stat(l->dir, &l->stats) != 0)
+        {
+            perror("make_fixture");
+            res = 1;
+        }
+    }
+    if (res == 0 && file_cache_init(CACHE_BUDGET, CACHE_BUDGET, true) != 0)
+        res = 1;
+    if (res == 0 && dir_listing_init(CACHE_BUDGET, true) != 0)
+        res = 1;
+    if (res == 0 && access_log_init("/dev/null", LOG_FORMAT_COMBINED) != 0)
+        res = 1;
+
+    if (res == 0 && json)
+        printf("{\"alloc_stats\": %s, \"benchmarks\": [",
+               get_alloc_count() > 0 ? "true" : "false");
+    else if (res == 0)
+        printf("%-28s %12s %12s %12s\n", "benchmark", "calls", "ns/op",
+               "allocs/op");
+    bool first = true;
+    for (int x = 0; res == 0 && x < NUM_BENCHES; x++)
+    {
+        const Bench *bench = &BENCHES[x];
+        if (!selected(bench->name, argv + optind, argc - optind))
+            continue;
+
+        double ns_per_op = 0, allocs_per_op = 0;
+        uint64_t calls = run(bench, run_secs, &ns_per_op, &allocs_per_op);
+        if (json)
+            printf("%s\n  {\"name\": \"%s\", \"calls\": %llu, "
+                   "\"ns_per_op\": %.2f, \"allocs_per_op\": %.3f}",
+                   first ? "" : ",", bench->name, (unsigned long long) calls,
+                   ns_per_op, allocs_per_op);
+        else
+            printf("%-28s %12llu %12.1f %12.3f\n", bench->name,
+                   (unsigned long long) calls, ns_per_op, allocs_per_op);
+        fflush(stdout);
+        first = false;
+    }
+    if (res == 0 && json)
+        printf("\n]}\n");
+
+    access_log_free();
+    dir_listing_free();
+    file_cache_free();
+    for (int x = 0; x < 2; x++)
+        if (listings[x].dir[0] != '\0')
+            remove_fixture(listings[x].dir, listings[x].entries);
+    rmdir(root);
+    for (size_t x = 0; x < NUM_REQUESTS; x++)
+        free(requests[x]);
+    return res;
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Train a server built with -fprofile-generate on the requests in
+# pgo_urls.txt, so release-pgo can lay out and optimise the code for them.
+# Each mode of the server is trained, over keep-alive connections and over a
+# new connection for every request. The profile is written when the server
+# exits.
+#
+# Set SERVER to the server to train, and DURATION to the length of each run
+# in seconds (default 2).
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+duration=${DURATION:-2}
+
+for mode in event_loop thread_pool ; do
+	for conns in keep-alive closed ; do
+		args=(-u "$bench_dir/pgo_urls.txt" -d "$duration" -c 4)
+		if [[ $conns == closed ]] ; then
+			args+=(-n)
+		fi
+		echo "Training $mode over $conns connections"
+		MODE=$mode THREADS=4 "$bench_dir/run_bench.sh" "${args[@]}" \
+			> /dev/null || exit 1
+	done
+done
@@ -0,0 +1,193 @@
+/**
+ * Benchmark the connection queue against the mutex protected linked list it
+ * replaced. A single producer, like the thread accepting connections, feeds
+ * a pool of consumer threads, like the workers in the thread pool.
+ *
+ * Usage: queue_bench [items]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "queue.h"
+
+#define DEFAULT_ITEMS 1000000
+#define RING_DEPTH 1024
+
+static const int THREAD_COUNTS[] = { 1, 2, 4, 8, 16, 32, 64 };
+static const int NUM_THREAD_COUNTS = sizeof(THREAD_COUNTS) / sizeof(int);
+
+/*=====================================*/
+/*    Linked list queue (original)     */
+/*=====================================*/
+
+typedef struct
+{
+    int *socket;
+    uint32_t raw_ip;
+} LegacyConnection;
+
+struct legacy_node
+{
+    struct legacy_node *next;
+    LegacyConnection *conn;
+};
+
+static struct legacy_node *head = NULL;
+static struct legacy_node *tail = NULL;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_var = PTHREAD_COND_INITIALIZER;
+
+static void legacy_enqueue(LegacyConnection *conn)
+{
+    struct legacy_node *new_node = malloc(sizeof(struct legacy_node));
+    if (new_node == NULL)
+        return;
+
+    new_node->conn = conn;
+    new_node->next = NULL;
+    if (tail == NULL)
+        head = new_node;
+    else
+        tail->next = new_node;
+    tail = new_node;
+}
+
+static LegacyConnection *legacy_dequeue(void)
+{
+    if (head == NULL)
+        return NULL;
+
+    LegacyConnection *result = head->conn;
+    struct legacy_node *temp = head;
+    head = head->next;
+    if (head == NULL)
+        tail = NULL;
+    free(temp);
+    return result;
+}
+
+static void *legacy_consumer(void *arg)
+{
+    while (1)
+    {
+        LegacyConnection *pclient;
+        pthread_mutex_lock(&mutex);
+        if ((pclient = legacy_dequeue()) == NULL)
+        {
+            pthread_cond_wait(&cond_var, &mutex);
+            pclient = legacy_dequeue();
+        }
+        pthread_mutex_unlock(&mutex);
+        if (pclient == NULL)
+            continue;
+
+        int sock = *pclient->socket;
+        free(pclient->socket);
+        free(pclient);
+        if (sock < 0)
+            break;
+    }
+    return NULL;
+}
+
+static void legacy_produce(int sock)
+{
+    LegacyConnection *pclient = malloc(sizeof(LegacyConnection));
+    pclient->socket = malloc(sizeof(int));
+    *pclient->socket = sock;
+    pclient->raw_ip = 0;
+    pthread_mutex_lock(&mutex);
+    legacy_enqueue(pclient);
+    pthread_cond_signal(&cond_var);
+    pthread_mutex_unlock(&mutex);
+}
+
+/*=====================================*/
+/*        Lock-free ring queue         */
+/*=====================================*/
+
+static void *ring_consumer(void *arg)
+{
+    while (1)
+    {
+        Connection conn;
+        dequeue_wait(&conn);
+        if (conn.socket < 0)
+            break;
+    }
+    return NULL;
+}
+
+static void ring_produce(int sock)
+{
+    Connection conn = { sock, 0 };
+    while (!enqueue_conn(&conn))
+        sched_yield();
+}
+
+/*=====================================*/
+/*               Driver                */
+/*=====================================*/
+
+/**
+ * @brief Time how long it takes the consumers to get through the items
+ * @param threads Number of consumer threads
+ * @param items Number of items to push through the queue
+ * @param consumer Function run by each consumer
+ * @param produce Function to add an item to the queue
+ * @return Millions of items per second
+ */
+static double run(int threads, long items, void *(*consumer)(void *),
+                  void (*produce)(int))
+{
+    pthread_t pool[threads];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int x = 0; x < threads; x++)
+        pthread_create(&pool[x], NULL, consumer, NULL);
+    for (long x = 0; x < items; x++)
+        produce((int) (x & 0xffff));
+
+    // One negative socket per thread tells it to stop
+    for (int x = 0; x < threads; x++)
+        produce(-1);
+    for (int x = 0; x < threads; x++)
+        pthread_join(pool[x], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec)
+                  + ((end.tv_nsec - start.tv_nsec) / 1e9);
+    return (items / secs) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    long items = (argc > 1) ? strtol(argv[1], NULL, 10) : DEFAULT_ITEMS;
+    if (items <= 0)
+        items = DEFAULT_ITEMS;
+
+    if (queue_init(RING_DEPTH) != 0)
+    {
+        perror("queue_init");
+        return 1;
+    }
+
+    printf("%ld connections, 1 producer\n", items);
+    printf("%8s %16s %16s %8s\n", "threads", "list (M/s)", "ring (M/s)",
+           "speedup");
+    for (int x = 0; x < NUM_THREAD_COUNTS; x++)
+    {
+        int threads = THREAD_COUNTS[x];
+        double list = run(threads, items, legacy_consumer, legacy_produce);
+        double ring = run(threads, items, ring_consumer, ring_produce);
+        printf("%8d %16.2f %16.2f %7.2fx\n", threads, list, ring,
+               ring / list);
+    }
+
+    queue_free();
+    return 0;
+}
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+# Benchmark the server against a generated tree of files, so every run serves
+# the same content. The server is started in a temporary directory of its
+# own, load_gen is run against it, then the server is stopped.
+#
+# With no arguments, a keep-alive and a closed connection run are made at
+# max throughput. Otherwise load_gen is run once with the arguments given,
+# which are added after the URL mix of the tree, so -u still replaces it.
+#
+# Set SERVER to the server to run (default bench/server), PORT to the port it
+# listens on (default 4090), MODE to its mode (default event_loop), THREADS
+# to its threads (default 4) and DURATION to the length of each default run
+# in seconds (default 5).
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+server=$(realpath "${SERVER:-$bench_dir/server}")
+port=${PORT:-4090}
+mode=${MODE:-event_loop}
+threads=${THREADS:-4}
+duration=${DURATION:-5}
+load_gen="$bench_dir/load_gen"
+
+if [[ ! -x $server || ! -x $load_gen ]] ; then
+	echo "Build $server and $load_gen first, with make bench" >&2
+	exit 1
+fi
+
+work=$(mktemp -d)
+trap 'kill -INT $pid 2>/dev/null; wait $pid 2>/dev/null; rm -rf "$work"' EXIT
+
+# The tree: pages and assets of a few sizes, a directory to list, and a
+# weighted mix of requests for them, a few of which are not found
+html="$work/html"
+mkdir -p "$html/files"
+line="<p>The quick brown fox jumps over the lazy dog, again and again.</p>"
+yes "$line" | head -c 2048 > "$html/index.html"
+yes "body { margin: 0 auto; padding: 1em; color: #333; }" \
+	| head -c 16384 > "$html/style.css"
+yes "function f(x) { return x * 2 + 1; }" | head -c 65536 > "$html/app.js"
+yes "$line" | head -c 1048576 > "$html/large.html"
+for (( i=0; i<200; i++ )) ; do
+	printf "%s\n" "$line" > "$html/files/file_$i.txt"
+done
+cat > "$work/urls.txt" << EOF
+# weight path
+40 /index.html
+20 /style.css
+10 /app.js
+1 /large.html
+5 /files/
+20 /files/file_7.txt
+4 /missing.html
+EOF
+
+cat > "$work/http.conf" << EOF
+html_root $html
+port $port
+mode $mode
+threads $threads
+max_requests 1000000
+access_log off
+EOF
+
+(cd "$work" && exec "$server" > "$work/server.log" 2>&1) &
+pid=$!
+
+# Wait for the server to listen
+for (( i=0; i<50; i++ )) ; do
+	if (exec 3<> "/dev/tcp/127.0.0.1/$port") 2>/dev/null ; then
+		break
+	fi
+	sleep 0.1
+done
+if ! kill -0 $pid 2>/dev/null ; then
+	echo "The server did not start:" >&2
+	cat "$work/server.log" >&2
+	exit 1
+fi
+
+target="127.0.0.1:$port"
+if [[ $# -gt 0 ]] ; then
+	"$load_gen" -u "$work/urls.txt" "$@" "$target"
+else
+	"$load_gen" -u "$work/urls.txt" -d "$duration" "$target"
+	"$load_gen" -u "$work/urls.txt" -d "$duration" -n "$target"
+fi
@@ -0,0 +1,73 @@
+#ifndef HTTP_ACCESS_LOG_H
+#define HTTP_ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defaults.h"
+#include "http.h"
+
+#define LOG_RING_SIZE 512     // Records each thread can have waiting
+#define LOG_FLUSH_INTERVAL 10 // Time the logger sleeps when idle (unit: ms)
+
+/**
+ * @brief Start the logger thread
+ *
+ * Messages always go to stdout. Requests go to the access log, which may be
+ * stdout as well
+ * @param target Path of the access log, "stdout", or "off" to not log
+ * requests
+ * @param format The LogFormat to write requests in
+ * @return 0 on success, 1 if something went wrong
+ */
+int access_log_init(const char *target, uint8_t format);
+
+/**
+ * @brief Write out everything still waiting, then stop the logger thread
+ * @note Must not be called while other threads may still log
+ */
+void access_log_free(void);
+
+/**
+ * @brief Log a request that was responded to
+ *
+ * Copies what the log line needs into the thread's ring, which the logger
+ * thread drains, so no locks are taken and nothing is written here. If the
+ * ring is full the request is dropped from the log and counted instead
+ * @param req The HTTP request
+ * @param status The status code sent back
+ * @param bytes The number of bytes of body sent back
+ */
+void access_log_request(const HttpRequest *req, uint16_t status,
+                        uint64_t bytes);
+
+/**
+ * @brief Log a message to stdout, in the same way as requests
+ * @param text The message, which should end with a newline
+ * @param len The length of the message
+ */
+void log_write(const char *text, size_t len);
+
+/**
+ * @brief Log a printf style message to stdout
+ * @param format printf style format of the message
+ * @param ... Values for the format
+ * @see log_write()
+ */
+void log_printf(const char *format, ...);
+
+/**
+ * @brief Get the number of records the calling thread logged that the logger
+ * thread has not taken yet
+ * @return The number of records waiting in the thread's ring
+ */
+size_t access_log_pending(void);
+
+/**
+ * @brief Get the number of log records that were dropped because a ring was
+ * full
+ * @return The number of requests and messages dropped
+ */
+uint64_t get_log_dropped(void);
+
+#endif /* HTTP_ACCESS_LOG_H */
@@ -0,0 +1,47 @@
+#ifndef HTTP_ARENA_H
+#define HTTP_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_BLOCK_SIZE 65536  // Smallest block the arena allocates
+#define ARENA_KEEP_SIZE 1048576 // Most memory kept between requests
+
+/**
+ * @brief Allocate memory that lives until the end of the current request
+ *
+ * Each thread has its own arena, so no locks are taken. The memory is
+ * handed out of blocks that are kept from one request to the next, so once
+ * a thread has served a few requests this never calls malloc()
+ * @param size The number of bytes to allocate
+ * @return The memory, aligned for any type, or NULL if out of memory
+ * @attention The memory must not be freed, and must not be used once
+ * arena_reset() is called
+ */
+void *arena_alloc(size_t size);
+
+/**
+ * @brief Take back everything the thread allocated from its arena
+ *
+ * Called once a request is done. Blocks are kept for the next request, up to
+ * ARENA_KEEP_SIZE bytes of them
+ */
+void arena_reset(void);
+
+/**
+ * @brief Free every block in the thread's arena
+ */
+void arena_free(void);
+
+/**
+ * @brief Get the number of heap allocations the thread has made
+ *
+ * Only counted in debug builds, where the server is linked with
+ * --wrap=malloc and friends. Allocations made inside libraries, other than
+ * through the arena, are not seen
+ * @return The number of calls to malloc(), calloc() and realloc(), or 0 if
+ * allocations are not being counted
+ */
+uint64_t get_alloc_count(void);
+
+#endif /* HTTP_ARENA_H */
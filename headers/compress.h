@@ -0,0 +1,136 @@
+#ifndef HTTP_COMPRESS_H
+#define HTTP_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+#include "http.h"
+
+#define MAX_COMPRESS_SIZE (16 * 1024 * 1024) // Larger bodies are sent as is
+
+/**
+ * @struct CompressStats
+ * @brief Running totals of the work done compressing responses
+ */
+typedef struct
+{
+    uint64_t count;     //!< Number of bodies compressed
+    uint64_t bytes_in;  //!< Bytes before compressing
+    uint64_t bytes_out; //!< Bytes after compressing
+    uint64_t cpu_ns;    //!< CPU time spent compressing (unit: ns)
+} CompressStats;
+
+/// A body being compressed as it is produced
+typedef struct deflate_stream DeflateStream;
+
+/**
+ * @brief Check if a body should be compressed before it is sent
+ * @param type The content type of the body
+ * @param size The size of the body
+ * @return True if compression is on, and the type and size qualify
+ */
+bool should_compress(const char *type, size_t size);
+
+/**
+ * @brief Pick the coding to compress a body with
+ * @param accept The value of the Accept-Encoding field, or NULL
+ * @return CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE, or
+ * CONTENT_ENCODING_IDENTITY if the client accepts neither
+ */
+int choose_compression(const StrSlice *accept);
+
+/**
+ * @brief Compress the data with COMPRESS_LEVEL
+ * @param data The data to compress
+ * @param size The size of the data
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @param out Where to store the compressed data
+ * @param out_size Where to store the size of the compressed data
+ * @return True on success
+ * @attention If the function returns true, out must be freed when done
+ */
+bool compress_data(const char *data, size_t size, int encoding, char **out,
+                   size_t *out_size);
+
+/**
+ * @brief Compress the data for the current response only
+ *
+ * Like compress_data(), but the output comes from the thread's arena
+ * @param data The data to compress
+ * @param size The size of the data
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @param out Where to store the compressed data, which lasts until the end
+ * of the request and must not be freed
+ * @param out_size Where to store the size of the compressed data
+ * @return True on success
+ */
+bool compress_temp(const char *data, size_t size, int encoding, char **out,
+                   size_t *out_size);
+
+/**
+ * @brief Start compressing a body that is produced a piece at a time
+ *
+ * The stream lives in the thread's arena, so it only lasts until the end of
+ * the request
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @return The stream, or NULL if it could not be started
+ * @attention If the function does not return NULL, the returned stream must be
+ * ended with deflate_stream_free() when done
+ */
+DeflateStream *deflate_stream_new(int encoding);
+
+/**
+ * @brief Compress the next piece of the body
+ *
+ * Compressed data is held back until a whole buffer of it is ready
+ * @param stream The stream to compress with
+ * @param data The piece of the body
+ * @param len The length of the piece
+ * @param write Where to write the compressed data
+ * @param ctx Passed to write
+ * @return True if everything written was accepted
+ */
+bool deflate_stream_write(DeflateStream *stream, const char *data, size_t len,
+                          BodyWriter write, void *ctx);
+
+/**
+ * @brief Write out the rest of the compressed body
+ * @param stream The stream to finish
+ * @param write Where to write the compressed data
+ * @param ctx Passed to write
+ * @return True if everything written was accepted
+ */
+bool deflate_stream_finish(DeflateStream *stream, BodyWriter write, void *ctx);
+
+/**
+ * @brief End the stream, its memory is taken back with the arena's
+ * @param stream The stream to end, may be NULL
+ */
+void deflate_stream_free(DeflateStream *stream);
+
+/**
+ * @brief Get a compressed copy of the file
+ *
+ * The copy is kept in the file cache, under the path, modification time and
+ * coding, so each version of the file is only compressed once
+ * @param path The resolved path to the file
+ * @param stats The current stats of the file
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @param type The content type of the file
+ * @return The compressed copy, or NULL if the file could not be compressed
+ * @attention If the function does not return NULL, the returned file must be
+ * released with file_cache_release() when done
+ */
+CachedFile *compress_file(const char *path, const struct stat *stats,
+                          int encoding, const char *type);
+
+/**
+ * @brief Get the totals of all the compressing done so far
+ * @param stats Where to store the totals
+ */
+void get_compress_stats(CompressStats *stats);
+
+#endif /* HTTP_COMPRESS_H */
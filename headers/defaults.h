@@ -1,28 +1,108 @@
-#ifndef HTTP_CONF_DEFAULTS_H
-#define HTTP_CONF_DEFAULTS_H
-
-#include <stdint.h>
-
-#ifdef DOCKER
-#define CFG_FILE "/etc/http_server/http.conf"
-#else
-#define CFG_FILE "http.conf"
-#endif /* DOCKER */
-#define DEFAULT_SERVER_NAME "HTTP Server"
-#define DEFAULT_PATH "/var/www/html"
-#define DEFAULT_SERVER_PORT 4080
-#define DEFAULT_THREAD_POOL_SIZE 20
-#define DEFAULT_TIMEOUT 1000 // 1000 milliseconds
-#define DEFAULT_BACKLOG 100
-#define DEFAULT_BUFF_SIZE 4096 // In bytes
-#define MIN_BUFF_SIZE 2048     // In bytes
-
-extern char *SERVER_NAME;         //!< The name of the server
-extern char *HTML_PATH;           //!< Path to the root HTML directory
-extern uint16_t SERVER_PORT;      //!< Port the webserver will be available on
-extern uint16_t THREAD_POOL_SIZE; //!< Number of threads in the thread pool
-extern uint16_t SERVER_BACKLOG;   //!< Max queue len for pending connections
-extern uint16_t BUFF_SIZE;        //!< Buffer size for in/out messages
-extern uint32_t CONN_TIMEOUT_LEN; //!< Timeout for socket (unit: ms)
-
-#endif /* HTTP_CONF_DEFAULTS_H */
+#ifndef HTTP_CONF_DEFAULTS_H
+#define HTTP_CONF_DEFAULTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef DOCKER
+#define CFG_FILE "/etc/http_server/http.conf"
+#else
+#define CFG_FILE "http.conf"
+#endif /* DOCKER */
+#define DEFAULT_SERVER_NAME "HTTP Server"
+#define DEFAULT_PATH "/var/www/html"
+#define DEFAULT_SERVER_PORT 4080
+#define DEFAULT_THREAD_POOL_SIZE 20
+#define DEFAULT_TIMEOUT 1000 // 1000 milliseconds
+#define DEFAULT_BACKLOG 100
+#define DEFAULT_BUFF_SIZE 4096 // In bytes
+#define MIN_BUFF_SIZE 2048     // In bytes
+#define DEFAULT_SERVER_MODE SERVER_MODE_THREAD_POOL
+#define DEFAULT_KEEP_ALIVE_TIMEOUT 5000   // 5000 milliseconds, in event_loop
+#define DEFAULT_POOL_KEEP_ALIVE_TIMEOUT 0 // Off, in thread_pool
+#define DEFAULT_MAX_REQUESTS 100          // Per connection
+#define DEFAULT_QUEUE_DEPTH 1024          // Connections waiting for a thread
+#define DEFAULT_REUSE_PORT false
+#define DEFAULT_CPU_AFFINITY false
+#define DEFAULT_CACHE_SIZE 65536    // In kilobytes, 0 turns the cache off
+#define DEFAULT_CACHE_MAX_FILE 1024 // In kilobytes
+#define DEFAULT_CACHE_REVALIDATE true
+#define DEFAULT_DIR_INDEX_CACHE 16384 // In kilobytes, 0 turns it off
+#define DEFAULT_PATH_CACHE_SIZE 1024 // Paths kept open, 0 turns it off
+#define DEFAULT_PATH_CACHE_TTL 2000  // 2000 milliseconds
+#define DEFAULT_ERROR_PAGES false
+#define DEFAULT_PRECOMPRESSED true
+#define DEFAULT_COMPRESSION false
+#define DEFAULT_COMPRESS_LEVEL 6       // 1 (fastest) to 9 (smallest)
+#define DEFAULT_COMPRESS_MIN_SIZE 1024 // In bytes
+#define DEFAULT_COMPRESS_TYPES                                                 \
+    "text/html,text/css,text/javascript,text/plain,text/csv,text/xml,"         \
+    "application/json"
+#define COMPRESS_TYPES_LEN 256 // Longest compression_types value
+#define MAX_CACHE_RULES 16     // Most cache_control rules the config can have
+#define DEFAULT_ACCESS_LOG "stdout"
+#define DEFAULT_LOG_FORMAT LOG_FORMAT_COMMON
+#define DEFAULT_STATUS_PAGE false
+
+/**
+ * @enum ServerMode
+ * @brief How the server should distribute connections to its threads
+ */
+enum ServerMode
+{
+    SERVER_MODE_THREAD_POOL = 0, //!< One blocking connection per worker
+    SERVER_MODE_EVENT_LOOP = 1   //!< Non-blocking sockets, one epoll per worker
+};
+
+/**
+ * @enum LogFormat
+ * @brief How requests are written to the access log
+ */
+enum LogFormat
+{
+    LOG_FORMAT_COMMON = 0,  //!< Common Log Format
+    LOG_FORMAT_COMBINED = 1 //!< Common Log Format plus Referer and User-Agent
+};
+
+/**
+ * @struct CacheRule
+ * @brief The Cache-Control value to send with files of an extension
+ */
+typedef struct
+{
+    char ext[8];    //!< The file extension, or "*" for every other file
+    char value[64]; //!< The value of the Cache-Control field
+} CacheRule;
+
+extern char *SERVER_NAME;         //!< The name of the server
+extern char *HTML_PATH;           //!< Path to the root HTML directory
+extern uint16_t SERVER_PORT;      //!< Port the webserver will be available on
+extern uint16_t THREAD_POOL_SIZE; //!< Number of threads in the thread pool
+extern uint16_t SERVER_BACKLOG;   //!< Max queue len for pending connections
+extern uint16_t BUFF_SIZE;        //!< Buffer size for in/out messages
+extern uint32_t CONN_TIMEOUT_LEN; //!< Timeout for socket (unit: ms)
+extern uint8_t SERVER_MODE;       //!< The ServerMode the server is running in
+extern uint32_t KEEP_ALIVE_LEN;   //!< Idle time between requests (unit: ms)
+extern uint16_t MAX_REQUESTS;     //!< Max requests over a single connection
+extern uint32_t QUEUE_DEPTH;      //!< Max connections waiting for a thread
+extern bool REUSE_PORT;           //!< Give each thread its own listener
+extern bool CPU_AFFINITY;         //!< Pin each thread to its own CPU
+extern uint32_t CACHE_SIZE;       //!< Memory for cached files (unit: KB)
+extern uint32_t CACHE_MAX_FILE;   //!< Largest file to cache (unit: KB)
+extern bool CACHE_REVALIDATE;     //!< Check cached files are up to date
+extern uint32_t DIR_INDEX_CACHE;  //!< Memory for directory indexes (unit: KB)
+extern uint32_t PATH_CACHE_SIZE;  //!< Most resolved paths to keep open
+extern uint32_t PATH_CACHE_TTL;   //!< Time a resolved path is kept (unit: ms)
+extern bool ERROR_PAGES;          //!< Load <code>.html error pages
+extern bool PRECOMPRESSED;        //!< Send .br, .zst and .gz copies of files
+extern bool COMPRESSION;          //!< Compress responses on the fly
+extern uint8_t COMPRESS_LEVEL;    //!< zlib compression level
+extern uint32_t COMPRESS_MIN;     //!< Smallest body to compress (unit: B)
+extern char COMPRESS_TYPES[];     //!< Comma separated types to compress
+extern CacheRule CACHE_RULES[];   //!< Cache-Control values by extension
+extern uint8_t NUM_CACHE_RULES;   //!< Number of rules in CACHE_RULES
+extern char ACCESS_LOG[];         //!< Access log path, "stdout" or "off"
+extern uint8_t LOG_FORMAT;        //!< The LogFormat of the access log
+extern bool STATUS_PAGE;          //!< Serve metrics at STATUS_PATH
+
+#endif /* HTTP_CONF_DEFAULTS_H */
@@ -0,0 +1,128 @@
+#ifndef HTTP_DIR_LISTING_H
+#define HTTP_DIR_LISTING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+#include "http.h"
+
+#define MAX_DIR_WATCHES 4096 // Most directories watched for changes at once
+#define MAX_WATCH_KEYS 16    // Most cached pages of one directory's listing
+
+/**
+ * @struct ListingQuery
+ * @brief Which entries of a directory to list, and how
+ */
+typedef struct
+{
+    size_t offset; //!< Index of the first entry to list
+    size_t limit;  //!< Most entries to list, SIZE_MAX for all of them
+    bool json;     //!< List the entries as JSON rather than HTML
+} ListingQuery;
+
+/**
+ * @brief Start caching directory indexes, and watching listed directories
+ * for changes
+ *
+ * On Linux a thread reads inotify events and drops the listings of any
+ * directory that changes. Elsewhere, or if inotify cannot be used, cached
+ * listings are only checked against the directory's stats
+ * @param index_size Max number of bytes of directory indexes to hold, apart
+ * from the file cache. 0 reads the directory for every page rendered
+ * @param revalidate Check that the directory has not changed on every hit
+ * @return 0 on success, 1 if directories cannot be watched
+ */
+int dir_listing_init(size_t index_size, bool revalidate);
+
+/**
+ * @brief Stop watching directories for changes, and free the cached indexes
+ * @note Must be called before file_cache_free()
+ */
+void dir_listing_free(void);
+
+/**
+ * @brief Read the offset and limit parameters from the query of a request
+ *
+ * Other parameters are ignored, and json is always set to false
+ * @param query The query of the request, without the '?'
+ * @param lq Where to store the parameters
+ * @return False if offset or limit is not a number
+ */
+bool parse_listing_query(const StrSlice *query, ListingQuery *lq);
+
+/**
+ * @brief Get the content type of a listing
+ * @param query How the listing is rendered
+ * @return The content type
+ */
+const char *get_listing_type(const ListingQuery *query);
+
+/**
+ * @brief Render the whole HTML page displaying the contents of the directory
+ *
+ * Nothing is cached, the directory is read and sorted every time
+ * @param path The local path to the directory to display the contents of
+ * @param full_path The resolved path to the directory
+ * @param size Where to store the size of the page
+ * @return The page, or NULL if out of memory
+ * @attention If the function does not return NULL, the returned page must be
+ * freed when done
+ */
+char *render_dir_listing(const char *path, const char *full_path,
+                         size_t *size);
+
+/**
+ * @brief Look for a page of the directory's listing in the cache, without
+ * rendering it
+ * @param path The local path to the directory to display the contents of
+ * @param full_path The resolved path to the directory
+ * @param stats The current stats of the directory
+ * @param query The entries to list, and how
+ * @return The page, or NULL if it is not cached or is out of date
+ * @attention If the function does not return NULL, the returned file must be
+ * released with file_cache_release() when done
+ */
+CachedFile *find_dir_listing(const char *path, const char *full_path,
+                             const struct stat *stats,
+                             const ListingQuery *query);
+
+/**
+ * @brief Get a page of the listing displaying the contents of the directory
+ *
+ * The page is kept in the file cache, so listing the same directory again is
+ * only a memory copy until something in the directory changes. Pages are
+ * rendered from a sorted index of the directory, which is cached as well, so
+ * the directory is only read and sorted once for all of its pages
+ * @param path The local path to the directory to display the contents of
+ * @param full_path The resolved path to the directory
+ * @param stats The current stats of the directory
+ * @param query The entries to list, and how
+ * @return The page, or NULL if out of memory
+ * @attention If the function does not return NULL, the returned file must be
+ * released with file_cache_release() when done
+ */
+CachedFile *get_dir_listing(const char *path, const char *full_path,
+                            const struct stat *stats,
+                            const ListingQuery *query);
+
+/**
+ * @brief Render a page of the directory's listing straight to a writer
+ *
+ * Only a bounded piece of the page is held at a time, rather than all of it.
+ * If the whole page fits in the file cache, a copy is kept there as well
+ * @param path The local path to the directory to display the contents of
+ * @param full_path The resolved path to the directory
+ * @param stats The current stats of the directory
+ * @param query The entries to list, and how
+ * @param write Where to write the page
+ * @param ctx Passed to write
+ * @return True on success, false if out of memory or the writer failed
+ */
+bool stream_dir_listing(const char *path, const char *full_path,
+                        const struct stat *stats, const ListingQuery *query,
+                        BodyWriter write, void *ctx);
+
+#endif /* HTTP_DIR_LISTING_H */
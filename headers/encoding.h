@@ -0,0 +1,83 @@
+#ifndef HTTP_ENCODING_H
+#define HTTP_ENCODING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "http.h"
+#include "path_cache.h"
+
+/**
+ * @enum ContentEncoding
+ * @brief The content codings the server can send
+ *
+ * Ordered from the smallest output to the largest, which is also the order
+ * they are preferred in when the client likes them equally
+ */
+enum ContentEncoding
+{
+    CONTENT_ENCODING_IDENTITY = 0, //!< Sent as is
+    CONTENT_ENCODING_BR = 1,       //!< Brotli
+    CONTENT_ENCODING_ZSTD = 2,     //!< Zstandard
+    CONTENT_ENCODING_GZIP = 3,     //!< Gzip
+    CONTENT_ENCODING_DEFLATE = 4,  //!< Zlib, only compressed on the fly
+    NUM_CONTENT_ENCODINGS = 5
+};
+
+/**
+ * @brief Parse the value of an Accept-Encoding field
+ * @param value The value of the field, or NULL if the request has none
+ * @param quality Where to store how much the client wants each
+ * ContentEncoding, in thousandths (0 to 1000). Must hold
+ * NUM_CONTENT_ENCODINGS
+ * @ref https://www.rfc-editor.org/rfc/rfc7231#section-5.3.4
+ */
+void parse_accept_encoding(const StrSlice *value, int *quality);
+
+/**
+ * @brief Find how much the client wants a media type, from its Accept field
+ *
+ * The most specific range that matches the type decides, so a range naming
+ * the type wins over one naming only its top-level type, which wins over a
+ * range matching any type
+ * @param value The value of the Accept field, or NULL if the request has none
+ * @param type The media type, such as "application/json"
+ * @return The weight, in thousandths (0 to 1000)
+ * @ref https://www.rfc-editor.org/rfc/rfc7231#section-5.3.2
+ */
+int get_media_quality(const StrSlice *value, const char *type);
+
+/**
+ * @brief Get the name of the content coding, as used in Content-Encoding
+ * @param encoding The ContentEncoding
+ * @return The name, or NULL for CONTENT_ENCODING_IDENTITY
+ */
+const char *get_encoding_name(int encoding);
+
+/**
+ * @brief Check if files of the content type are worth compressing
+ * @param type The content type of the file
+ * @return True for text, JSON and the like
+ */
+bool is_compressible(const char *type);
+
+/**
+ * @brief Find a precompressed copy of the file the client can accept
+ *
+ * The copies sit next to the file, with the coding's extension added
+ * (index.html.br, index.html.zst or index.html.gz). A copy older than the
+ * file is out of date and never used
+ * @param accept The value of the Accept-Encoding field, or NULL
+ * @param path The path to the file
+ * @param stats The stats of the file, replaced by the copy's if one is found
+ * @param copy Where to store the opened copy, only set if one is found
+ * @return The ContentEncoding of the copy, or CONTENT_ENCODING_IDENTITY if
+ * there is none the client accepts
+ * @attention If the function does not return CONTENT_ENCODING_IDENTITY, copy
+ * must be released with path_cache_release() when done
+ */
+int find_precompressed(const StrSlice *accept, const char *path,
+                       struct stat *stats, CachedPath **copy);
+
+#endif /* HTTP_ENCODING_H */
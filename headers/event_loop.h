@@ -0,0 +1,17 @@
+#ifndef HTTP_EVENT_LOOP_H
+#define HTTP_EVENT_LOOP_H
+
+/**
+ * @brief Function run by each thread when in SERVER_MODE_EVENT_LOOP
+ *
+ * Accepts connections from the listening socket and multiplexes them on the
+ * thread's own edge-triggered epoll instance. Each connection is read as data
+ * becomes available and is only handed off once a full request has arrived.
+ * Responses are sent without blocking, and whatever the socket will not take
+ * is sent as it becomes writable
+ * @param arg Pointer to the listening socket
+ * @return NULL
+ */
+void *event_loop_thread(void *arg);
+
+#endif /* HTTP_EVENT_LOOP_H */
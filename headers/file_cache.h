@@ -0,0 +1,103 @@
+#ifndef HTTP_FILE_CACHE_H
+#define HTTP_FILE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "lru_table.h"
+
+/**
+ * @struct CachedFile
+ * @brief A file held in memory by the file cache
+ */
+typedef struct cached_file
+{
+    LruEntry entry;    //!< Its place in the cache, keyed by resolved path
+    char *data;        //!< Contents of the file
+    size_t size;       //!< Size of the file
+    struct stat stats; //!< Stats of the file when it was read
+    const char *type;  //!< The content type of the file
+    uint32_t refs;     //!< Number of users, including the cache
+} CachedFile;
+
+/**
+ * @brief Initialize the file cache
+ * @param budget Max number of bytes of files to hold, 0 disables the cache
+ * @param max_file Files larger than this (in bytes) are never cached
+ * @param revalidate Check that the file has not changed on every hit
+ * @return 0 on success, 1 if something went wrong
+ */
+int file_cache_init(size_t budget, size_t max_file, bool revalidate);
+
+/**
+ * @brief Free every file in the cache
+ * @note Must not be called while any files are still in use
+ */
+void file_cache_free(void);
+
+/**
+ * @brief Look up a file in the cache
+ * @param path The resolved path to the file
+ * @param stats The current stats of the file, compared against the cached
+ * copy's when revalidating
+ * @return The cached file, or NULL if it is not cached or has changed
+ * @attention If the function does not return NULL, the returned file must be
+ * released with file_cache_release() when done
+ */
+CachedFile *file_cache_get(const char *path, const struct stat *stats);
+
+/**
+ * @brief Read the file into the cache
+ * @param path The resolved path to the file
+ * @param fd An open file descriptor for the file
+ * @param stats The stats of the file
+ * @param type The content type of the file
+ * @return The cached file, or NULL if it could not be cached
+ * @attention If the function does not return NULL, the returned file must be
+ * released with file_cache_release() when done
+ */
+CachedFile *file_cache_add(const char *path, int fd, const struct stat *stats,
+                           const char *type);
+
+/**
+ * @brief Put data that is already in memory into the cache
+ *
+ * Used for data made from a file, such as a compressed copy of it, under a
+ * path of its own. Data that cannot be cached is still returned, and freed
+ * once it is released
+ * @param path The key to cache the data under
+ * @param data The data, which the cache takes ownership of
+ * @param size The size of the data
+ * @param stats The stats of the file the data was made from
+ * @param type The content type of the data
+ * @return The cached data, or NULL if out of memory (data is freed)
+ * @attention If the function does not return NULL, the returned file must be
+ * released with file_cache_release() when done
+ */
+CachedFile *file_cache_insert(const char *path, char *data, size_t size,
+                              const struct stat *stats, const char *type);
+
+/**
+ * @brief Check if data of the given size would be kept by the cache
+ * @param size The size of the data
+ * @return True if the cache is on and the data is not too large for it
+ */
+bool file_cache_fits(size_t size);
+
+/**
+ * @brief Take the file out of the cache, if it is there
+ *
+ * Threads still using the file keep their copy until they release it
+ * @param path The key the file is cached under
+ */
+void file_cache_remove(const char *path);
+
+/**
+ * @brief Let the cache know the file is no longer being used
+ * @param file The file to release
+ */
+void file_cache_release(CachedFile *file);
+
+#endif /* HTTP_FILE_CACHE_H */
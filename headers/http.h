@@ -1,174 +1,312 @@
-#ifndef HTTP_H
-#define HTTP_H
-
-#include <stdbool.h>
-#include <stddef.h>
-#include <stdint.h>
-#include <stdio.h>
-
-/**
- * @enum RequestType
- * @brief Enum for each of the diffrent HTTP request types
- * @ref https://developer.mozilla.org/en-US/docs/Web/HTTP/Methods
- */
-enum RequestType
-{
-    REQUEST_TYPE_INVALID = 0,
-    REQUEST_TYPE_GET = 1,
-    REQUEST_TYPE_POST = 2,
-    REQUEST_TYPE_HEAD = 3,
-    REQUEST_TYPE_OPTIONS = 4,
-    REQUEST_TYPE_PUT = 5,
-    REQUEST_TYPE_PATCH = 6,
-    REQUEST_TYPE_DELETE = 7,
-    REQUEST_TYPE_CONNECT = 8,
-    REQUEST_TYPE_TRACE = 9
-};
-
-/**
- * @struct HttpRequest
- * @brief Container to hold a single HTTP request
- */
-typedef struct
-{
-    char ip[16];  //!< The IP address of the client
-    char *buff;   //!< The full HTTP Request
-    size_t size;  //!< The size of buff
-    uint8_t type; //!< The RequestType for this HTTP request
-} HttpRequest;
-
-/**
- * @brief Check if ending of the buffer is the end of an HTTP request
- * @param buff The buffer to check
- * @param size The size of the buffer
- * @return True if the ending is that of an HTTP request
- */
-bool http_ending(const char *buff, size_t size);
-
-/**
- * @brief Parse the type of request this HTTP request and set the RequestType
- * @param req The HTTP Request to parse
- */
-void parse_reqest_type(HttpRequest *req);
-
-/**
- * @brief Validate the HTTP version
- * @param req The HTTP request
- * @return If the HTTP version is valid
- */
-bool validate_http_ver(HttpRequest *req);
-
-/**
- * @brief Send response to the client and close the socket
- * @param buff The buffer containing the response to send
- * @param size The size of the buffer
- * @param sock The socket to send to
- */
-void send_response(const char *buff, size_t size, int *sock);
-
-/**
- * @brief Send error message to the client and close the socket
- * @param err The error message to send
- * @param sock The socket to send to
- */
-void send_error(const char *err, int *sock);
-
-/**
- * @brief Send back the requested file from the GET request
- * @param req The HTTP request
- * @param sock The socket to send the request on
- */
-void send_requested_file(HttpRequest *req, int *sock);
-
-/*=====================================*/
-/*       Success Response Codes        */
-/*=====================================*/
-
-/**
- * @brief Send 200 OK message to the client
- * @param sock The socket to send to
- * @param fp File descriptor fo the file being sent
- * @param file The name of the file
- * @param type The type of request from the user
- */
-void send_200(int *sock, FILE *fp, const char *file, uint8_t type);
-
-/**
- * @brief Send a 204 No Content message to the client and close the socket
- * @param sock The socket to send to
- * @param type The type of request from the user
- */
-void send_204(int *sock, uint8_t type);
-
-/*=====================================*/
-/*        Error Response Codes         */
-/*=====================================*/
-
-/**
- * @brief Write an Bad Request message to the client and close the socket
- * @param sock The socket to send to
- */
-void send_400_error(int *sock);
-
-/**
- * @brief Send Forbidden message to the client and close the socket
- * @param sock The socket to send to
- */
-void send_403_error(int *sock);
-
-/**
- * @brief Send File Not Found message to the client and close the socket
- * @param sock The socket to send to
- */
-void send_404_error(int *sock);
-
-/**
- * @brief Send Method not allowed message to the client and close the socket
- * @param sock The socket to send to
- */
-void send_405_error(int *sock);
-
-/**
- * @brief Send Timeout message to the client and close the socket
- * @param sock The socket to send to
- */
-void send_408_error(int *sock);
-
-/**
- * @brief Request by the client is longer than the we are willing to interpret
- * @param sock The socket to send to
- */
-void send_413_error(int *sock);
-
-#ifdef TEAPOT
-/**
- * @brief We refuses to brew coffee because we're, permanently, a teapot
- * @ref https://developer.mozilla.org/en-US/docs/Web/HTTP/Status/418
- * @param sock The socket to send to
- */
-void send_418_error(int *sock);
-#endif /* TEAPOT */
-
-/**
- * @brief Header field in the clients request is too long
- * @param sock The socket to send to
- */
-void send_431_error(int *sock);
-
-/*=====================================*/
-/*     Server Error Response Codes     */
-/*=====================================*/
-
-/**
- * @brief Send a Server Error message to the client and close the socket
- * @param sock The socket to send to
- */
-void send_500_error(int *sock);
-
-/**
- * @brief Write an invalid HTTP Ver message to the client and close the socket
- * @param sock The socket to send to
- */
-void send_505_error(int *sock);
-
-#endif /* HTTP_H */
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define SOCKET_ERROR (-1)
+#define MAX_HEADERS 32 // Most header fields a request can have
+
+/**
+ * @enum RequestType
+ * @brief Enum for each of the diffrent HTTP request types
+ * @ref https://developer.mozilla.org/en-US/docs/Web/HTTP/Methods
+ */
+enum RequestType
+{
+    REQUEST_TYPE_INVALID = 0,
+    REQUEST_TYPE_GET = 1,
+    REQUEST_TYPE_POST = 2,
+    REQUEST_TYPE_HEAD = 3,
+    REQUEST_TYPE_OPTIONS = 4,
+    REQUEST_TYPE_PUT = 5,
+    REQUEST_TYPE_PATCH = 6,
+    REQUEST_TYPE_DELETE = 7,
+    REQUEST_TYPE_CONNECT = 8,
+    REQUEST_TYPE_TRACE = 9
+};
+
+/**
+ * @enum ParseStatus
+ * @brief Result of parsing an HTTP request
+ */
+enum ParseStatus
+{
+    PARSE_STATUS_DONE = 0,       //!< The whole request was parsed
+    PARSE_STATUS_INCOMPLETE = 1, //!< The request has not been fully read
+    PARSE_STATUS_INVALID = 2,    //!< The request is malformed
+    PARSE_STATUS_TOO_LARGE = 3   //!< The request has too many header fields
+};
+
+/**
+ * @enum ErrorPage
+ * @brief The error responses the server can send
+ */
+enum ErrorPage
+{
+    ERROR_PAGE_400 = 0,
+    ERROR_PAGE_403 = 1,
+    ERROR_PAGE_404 = 2,
+    ERROR_PAGE_405 = 3,
+    ERROR_PAGE_408 = 4,
+    ERROR_PAGE_413 = 5,
+    ERROR_PAGE_418 = 6,
+    ERROR_PAGE_431 = 7,
+    ERROR_PAGE_500 = 8,
+    ERROR_PAGE_503 = 9,
+    ERROR_PAGE_505 = 10,
+    NUM_ERROR_PAGES = 11
+};
+
+/**
+ * @struct StrSlice
+ * @brief A piece of a larger string, which is not NUL terminated
+ */
+typedef struct
+{
+    const char *ptr; //!< Start of the slice
+    size_t len;      //!< Length of the slice
+} StrSlice;
+
+/**
+ * @struct HttpHeader
+ * @brief A single header field of an HTTP request
+ */
+typedef struct
+{
+    StrSlice name;  //!< Name of the field
+    StrSlice value; //!< Value of the field, without surrounding whitespace
+} HttpHeader;
+
+/**
+ * @struct HttpRequest
+ * @brief Container to hold a single HTTP request
+ *
+ * Every slice points into buff, so they are only valid as long as it is
+ */
+typedef struct
+{
+    char ip[16];                     //!< The IP address of the client
+    char *buff;                      //!< The full HTTP Request
+    size_t size;                     //!< The size of buff
+    size_t head_len;                 //!< Length up to the end of the headers
+    uint8_t type;                    //!< The RequestType for this request
+    bool keep_alive;                 //!< Keep the connection open
+    StrSlice method;                 //!< The request method
+    StrSlice target;                 //!< The full request target
+    StrSlice path;                   //!< The target without the query
+    StrSlice query;                  //!< The query, without the '?'
+    StrSlice version;                //!< The HTTP version
+    HttpHeader headers[MAX_HEADERS]; //!< The header fields
+    uint8_t num_headers;             //!< Number of header fields
+} HttpRequest;
+
+/**
+ * @struct ResponseBody
+ * @brief The body of a response, either in memory or read from a stream
+ */
+typedef struct
+{
+    int fd;                    //!< The file to send, when data is NULL
+    const char *data;          //!< The body, if it is already in memory
+    size_t size;               //!< The size of the body
+    const char *type;          //!< The content type of the body
+    const struct stat *stats;  //!< The file's stats, NULL if generated
+    const char *cache_control; //!< The Cache-Control value, or NULL
+    const char *encoding;      //!< The Content-Encoding value, or NULL
+    const char *vary;          //!< The Vary value, or NULL
+} ResponseBody;
+
+/**
+ * @brief Takes the next piece of a body that is produced as it is sent
+ * @param ctx Where the piece is going
+ * @param data The piece of the body
+ * @param len The length of the piece
+ * @return True if the piece was accepted, false to stop producing the body
+ */
+typedef bool (*BodyWriter)(void *ctx, const char *data, size_t len);
+
+/**
+ * @brief Parse the request line and header fields of the HTTP request
+ *
+ * The request is walked once, filling in the slices and RequestType of req.
+ * Nothing is copied or allocated
+ * @param req The HTTP request, with buff and size set
+ * @return The resulting ParseStatus
+ */
+int parse_request(HttpRequest *req);
+
+/**
+ * @brief Find a header field in a parsed request
+ * @param req The parsed HTTP request
+ * @param name The name of the field, matched case-insensitively
+ * @return The value of the first matching field, or NULL if there is none
+ */
+const StrSlice *get_header(const HttpRequest *req, const char *name);
+
+/**
+ * @brief Send back the response to a request parsed by parse_request()
+ *
+ * If the connection is closed while responding, sock is set to SOCKET_ERROR.
+ * Otherwise, the connection is being kept alive for the next request
+ * @param req The HTTP request to handle
+ * @param sock The socket to send the response on
+ */
+void handle_request(HttpRequest *req, int *sock);
+
+/**
+ * @brief Send back the error for a request that could not be read, logging
+ * it like any other
+ * @param req The request, with its IP address and as much of its request
+ * line as could be made out
+ * @param page The ErrorPage to send
+ * @param sock The socket to send the error on, set to SOCKET_ERROR once closed
+ */
+void reject_request(const HttpRequest *req, int page, int *sock);
+
+/**
+ * @brief Render the parts of the responses that never change
+ *
+ * This includes every error response, using the custom error pages in the
+ * HTML root if ERROR_PAGES is on
+ * @note Must be called once the config has been loaded, before any requests
+ * are handled
+ * @return 0 on success, 1 if something went wrong
+ */
+int init_response_headers(void);
+
+/**
+ * @brief Free the responses rendered by init_response_headers()
+ */
+void free_response_headers(void);
+
+/**
+ * @brief Send error response to the client and close the socket
+ * @param page The ErrorPage to send
+ * @param sock The socket to send to, set to SOCKET_ERROR once closed
+ */
+void send_error(int page, int *sock);
+
+/**
+ * @brief Send back the requested file from the GET request
+ * @param req The HTTP request
+ * @param sock The socket to send the request on
+ */
+void send_requested_file(HttpRequest *req, int *sock);
+
+/*=====================================*/
+/*       Success Response Codes        */
+/*=====================================*/
+
+/**
+ * @brief Send 200 OK message to the client
+ *
+ * Files (bodies with stats) also accept byte ranges. A GET with a Range
+ * field gets 206 Partial Content with just those bytes, or 416 Range Not
+ * Satisfiable if none of them are in the file
+ * @param sock The socket to send to
+ * @param body The body of the response
+ * @param req The HTTP request from the user
+ */
+void send_200(int *sock, const ResponseBody *body, HttpRequest *req);
+
+/**
+ * @brief Send a 304 Not Modified message to the client
+ *
+ * Only the header is sent, with the same validators a 200 would have
+ * @param sock The socket to send to
+ * @param body The body the client already has, with stats set
+ * @param req The HTTP request from the user
+ */
+void send_304(int *sock, const ResponseBody *body, HttpRequest *req);
+
+/**
+ * @brief Send a 204 No Content message to the client
+ *
+ * The socket is closed unless the connection is being kept alive
+ * @param sock The socket to send to
+ * @param req The HTTP request from the user
+ */
+void send_204(int *sock, HttpRequest *req);
+
+/*=====================================*/
+/*        Error Response Codes         */
+/*=====================================*/
+
+/**
+ * @brief Write an Bad Request message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_400_error(int *sock);
+
+/**
+ * @brief Send Forbidden message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_403_error(int *sock);
+
+/**
+ * @brief Send File Not Found message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_404_error(int *sock);
+
+/**
+ * @brief Send Method not allowed message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_405_error(int *sock);
+
+/**
+ * @brief Send Timeout message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_408_error(int *sock);
+
+/**
+ * @brief Request by the client is longer than the we are willing to interpret
+ * @param sock The socket to send to
+ */
+void send_413_error(int *sock);
+
+#ifdef TEAPOT
+/**
+ * @brief We refuses to brew coffee because we're, permanently, a teapot
+ * @ref https://developer.mozilla.org/en-US/docs/Web/HTTP/Status/418
+ * @param sock The socket to send to
+ */
+void send_418_error(int *sock);
+#endif /* TEAPOT */
+
+/**
+ * @brief Header field in the clients request is too long
+ * @param sock The socket to send to
+ */
+void send_431_error(int *sock);
+
+/*=====================================*/
+/*     Server Error Response Codes     */
+/*=====================================*/
+
+/**
+ * @brief Send a Server Error message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_500_error(int *sock);
+
+/**
+ * @brief Send Service Unavailable message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_503_error(int *sock);
+
+/**
+ * @brief Write an invalid HTTP Ver message to the client and close the socket
+ * @param sock The socket to send to
+ */
+void send_505_error(int *sock);
+
+#endif /* HTTP_H */
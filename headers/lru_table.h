@@ -0,0 +1,117 @@
+#ifndef HTTP_LRU_TABLE_H
+#define HTTP_LRU_TABLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LRU_SHARDS 16   // Independently locked parts of a table
+#define LRU_BUCKETS 256 // Hash buckets in each shard
+
+/**
+ * @struct LruEntry
+ * @brief The part of a cached item the table uses to find and evict it
+ *
+ * It must be the first member of the item, so an entry can be cast back to
+ * the item it belongs to
+ */
+typedef struct lru_entry
+{
+    struct lru_entry *next;     //!< Next entry in the same hash bucket
+    struct lru_entry *lru_prev; //!< The entry used more recently
+    struct lru_entry *lru_next; //!< The entry used less recently
+    char *key;                  //!< The key the item is found by
+    uint32_t hash;              //!< Hash of the key
+} LruEntry;
+
+/**
+ * @struct LruShard
+ * @brief A part of the table with its own lock, hash table and LRU list
+ *
+ * Keys are spread across the shards by their hash, so threads using
+ * different items rarely wait on each other
+ */
+typedef struct
+{
+    pthread_mutex_t lock;           //!< Protects everything in the shard
+    LruEntry *buckets[LRU_BUCKETS]; //!< Hash table of the entries
+    LruEntry *lru_head;             //!< The most recently used entry
+    LruEntry *lru_tail;             //!< The least recently used entry
+    size_t used;                    //!< What the owner counts against it
+} LruShard;
+
+/**
+ * @struct LruTable
+ * @brief A hash table of items kept in least recently used order
+ *
+ * The table only links the entries. Allocating, freeing and deciding what to
+ * evict is left to the cache that owns it
+ */
+typedef struct
+{
+    LruShard shards[LRU_SHARDS]; //!< The parts of the table
+} LruTable;
+
+/**
+ * @brief Hash the key (FNV-1a)
+ * @param key The key to hash
+ * @return The hash of the key
+ */
+uint32_t lru_hash(const char *key);
+
+/**
+ * @brief Initialize an empty table
+ * @param table The table to initialize
+ * @return 0 on success, 1 if something went wrong
+ */
+int lru_table_init(LruTable *table);
+
+/**
+ * @brief Free the table's locks
+ * @param table The table, which the owner has already emptied
+ */
+void lru_table_destroy(LruTable *table);
+
+/**
+ * @brief Get the shard a hash belongs to
+ * @param table The table to look in
+ * @param hash The hash of the key
+ * @return The shard holding the key
+ */
+LruShard *lru_table_shard(LruTable *table, uint32_t hash);
+
+/**
+ * @brief Find the key in the shard's hash table
+ * @param shard The shard to search
+ * @param key The key to find
+ * @param hash The hash of the key
+ * @return The entry, or NULL if it is not in the shard
+ * @note The shard's lock must be held
+ */
+LruEntry *lru_find(LruShard *shard, const char *key, uint32_t hash);
+
+/**
+ * @brief Add the entry to the shard, as the most recently used
+ * @param shard The shard to add to
+ * @param entry The entry, with its key and hash set
+ * @note The shard's lock must be held
+ */
+void lru_insert(LruShard *shard, LruEntry *entry);
+
+/**
+ * @brief Take the entry out of the shard, without freeing it
+ * @param shard The shard holding the entry
+ * @param entry The entry to remove
+ * @note The shard's lock must be held
+ */
+void lru_remove(LruShard *shard, LruEntry *entry);
+
+/**
+ * @brief Mark the entry as the most recently used
+ * @param shard The shard holding the entry
+ * @param entry The entry that was used
+ * @note The shard's lock must be held
+ */
+void lru_touch(LruShard *shard, LruEntry *entry);
+
+#endif /* HTTP_LRU_TABLE_H */
@@ -0,0 +1,101 @@
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATUS_PATH "/_status" // Where the metrics are served
+#define METRICS_TYPE "text/plain; version=0.0.4"
+
+/**
+ * @enum MetricsPhase
+ * @brief The parts of serving a request that are timed
+ */
+enum MetricsPhase
+{
+    METRICS_PHASE_QUEUE = 0, //!< From being accepted to a thread taking it
+    METRICS_PHASE_PARSE = 1, //!< Parsing the request line and headers
+    METRICS_PHASE_OPEN = 2,  //!< Resolving and opening the requested path
+    METRICS_PHASE_SEND = 3,  //!< Building and sending the response
+    NUM_METRICS_PHASES = 4
+};
+
+/**
+ * @brief Start collecting metrics
+ * @param enabled If metrics should be collected at all. When they are not,
+ * every other function returns straight away
+ */
+void metrics_init(bool enabled);
+
+/**
+ * @brief Free every thread's metrics
+ * @note Must not be called while other threads may still count
+ */
+void metrics_free(void);
+
+/**
+ * @brief Get the time to measure a phase from
+ * @return The monotonic clock (unit: ns), or 0 if metrics are off, so the
+ * clock is not read for nothing
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Record how long a phase of a request took
+ *
+ * Times are kept in a histogram with 16 buckets for each power of two, so
+ * they are accurate to within about 6%, like an HDR histogram
+ * @param phase The MetricsPhase that was timed
+ * @param ns How long it took (unit: ns)
+ */
+void metrics_record(int phase, uint64_t ns);
+
+/**
+ * @brief Count a response being sent
+ * @param status The status code of the response
+ */
+void metrics_count_response(uint16_t status);
+
+/**
+ * @brief Count bytes of body that were sent
+ * @param bytes The number of bytes
+ */
+void metrics_add_bytes(uint64_t bytes);
+
+/**
+ * @brief Count a connection being opened
+ */
+void metrics_conn_opened(void);
+
+/**
+ * @brief Count a connection being closed
+ */
+void metrics_conn_closed(void);
+
+/**
+ * @brief Add to the time the calling thread spent serving connections
+ * @param ns The time spent (unit: ns)
+ */
+void metrics_add_busy(uint64_t ns);
+
+/**
+ * @brief Count heap allocations made while handling a request
+ *
+ * Only rendered when the server is built with ALLOC_STATS
+ * @param allocs The number of allocations
+ */
+void metrics_add_allocs(uint64_t allocs);
+
+/**
+ * @brief Render every metric in the Prometheus text format
+ *
+ * Each thread counts into its own shard, which are only added up here, so
+ * counting never makes threads fight over a cache line
+ * @param len Where to store the length of the text
+ * @return The text, allocated with arena_alloc(), or NULL if out of memory
+ * @ref https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+char *render_metrics(size_t *len);
+
+#endif /* HTTP_METRICS_H */
@@ -0,0 +1,91 @@
+#ifndef HTTP_PATH_CACHE_H
+#define HTTP_PATH_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "lru_table.h"
+
+/**
+ * @enum PathCacheStatus
+ * @brief What became of opening a path
+ */
+enum PathCacheStatus
+{
+    PATH_CACHE_FOUND = 0,     //!< The path exists, and is open if it is a file
+    PATH_CACHE_NOT_FOUND = 1, //!< The path could not be resolved
+    PATH_CACHE_FORBIDDEN = 2, //!< The file could not be opened for reading
+    PATH_CACHE_ERROR = 3      //!< Something else went wrong, such as no fds
+};
+
+/**
+ * @struct CachedPath
+ * @brief A path that was resolved and opened, along with what came of it
+ */
+typedef struct cached_path
+{
+    LruEntry entry;    //!< Its place in the cache, keyed by the path asked for
+    char *real_path;   //!< The resolved path, NULL if not found
+    int fd;            //!< The open file, -1 if it is not open
+    int status;        //!< The PathCacheStatus of opening it
+    struct stat stats; //!< Stats of the file when it was opened
+    uint64_t expires;  //!< When to resolve it again (unit: ms)
+    uint32_t refs;     //!< Number of users, including the cache
+} CachedPath;
+
+/**
+ * @brief Initialize the path cache
+ *
+ * Every cached file holds a descriptor, so no more than a quarter of the
+ * process's RLIMIT_NOFILE are held, whatever max_entries is
+ * @param max_entries Most paths to hold, 0 disables the cache
+ * @param ttl How long a path is trusted before it is resolved again (unit: ms)
+ * @return 0 on success, 1 if something went wrong
+ */
+int path_cache_init(size_t max_entries, uint32_t ttl);
+
+/**
+ * @brief Close every file in the cache
+ * @note Must not be called while any paths are still in use
+ */
+void path_cache_free(void);
+
+/**
+ * @brief Resolve the path and open the file it leads to
+ *
+ * Recently opened paths come from the cache, which only takes a stat of the
+ * open file. Paths that do not exist are remembered as well, so they are not
+ * resolved again either. A cached file that was deleted or replaced since it
+ * was opened is opened again, anything else is only noticed once the entry
+ * expires. The file descriptor is shared, so it must only be read with
+ * pread() or sendfile(), never read() or lseek()
+ * @param path The path to open
+ * @param entry Where to store the opened path, only set if it was found
+ * @param stats Where to store the current stats of the file
+ * @return The PathCacheStatus of opening the path
+ * @attention If PATH_CACHE_FOUND is returned, entry must be released with
+ * path_cache_release() when done
+ */
+int path_cache_open(const char *path, CachedPath **entry, struct stat *stats);
+
+/**
+ * @brief Close cached files to free up file descriptors
+ *
+ * For when the process runs out of them. Expired paths are dropped along with
+ * the least recently used half of the rest. Files still in use are closed
+ * once they are released
+ * @return The number of files closed straight away
+ */
+size_t path_cache_shed(void);
+
+/**
+ * @brief Let the cache know the path is no longer being used
+ *
+ * The file is closed once it has left the cache and nothing is using it
+ * @param entry The path to release, may be NULL
+ */
+void path_cache_release(CachedPath *entry);
+
+#endif /* HTTP_PATH_CACHE_H */
@@ -1,6 +1,8 @@
 #ifndef HTTP_QUEUE_H
 #define HTTP_QUEUE_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -9,38 +11,58 @@
  */
 typedef struct
 {
-    int *socket;     //!< The connections socket
-    uint32_t raw_ip; //!< The IP address of the connection
+    int socket;         //!< The connections socket
+    uint32_t raw_ip;    //!< The IP address of the connection
+    uint64_t queued_at; //!< When it was queued, 0 if not timed (unit: ns)
 } Connection;
 
 /**
- * @struct node
- * @brief Object to contain elements on the queue
+ * @brief Allocate the queue
+ *
+ * The queue is a fixed size, lock-free ring that any number of threads can
+ * add to and take from at the same time. Threads only sleep, and only need
+ * to be woken up, once the queue runs dry
+ * @param depth The number of connections the queue can hold, rounded up to
+ * the next power of two
+ * @return 0 on success, 1 if something went wrong
  */
-struct node
-{
-    struct node *next; //!< The next connection in the queue
-    Connection *conn;  //!< The connection
-};
-typedef struct node node_t;
+int queue_init(size_t depth);
 
 /**
- * @brief Add the socket for the new connection to the queue
- * @param client_socket The socket for the connection to add
+ * @brief Free the memory used by the queue
  */
-void enqueue(int *client_socket);
+void queue_free(void);
 
 /**
  * @brief Add the connection to the queue
- * @param conn The connection to add
+ *
+ * If a thread is sleeping in dequeue_wait(), one is woken up to take it
+ * @param conn The connection to add, which is copied into the queue
+ * @return True if the connection was added, false if the queue is full
+ */
+bool enqueue_conn(const Connection *conn);
+
+/**
+ * @brief Take the connection at the front of the queue
+ * @param conn Where to store the connection
+ * @return True if there was a connection, false if the queue is empty
+ */
+bool dequeue(Connection *conn);
+
+/**
+ * @brief Take the connection at the front of the queue, sleeping until there
+ * is one if the queue is empty
+ * @param conn Where to store the connection
  */
-void enqueue_conn(Connection *conn);
+void dequeue_wait(Connection *conn);
 
 /**
- * @brief Pop the top element off the queue and return it
- * @return The pointer to a connection if there is one
- * @note Returns NULL if the queue is empty
+ * @brief Get the number of connections waiting in the queue
+ *
+ * Other threads can be adding and taking connections at the same time, so
+ * this is only a snapshot
+ * @return The number of connections
  */
-Connection *dequeue(void);
+size_t queue_length(void);
 
 #endif /* HTTP_QUEUE_H */
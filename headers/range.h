@@ -0,0 +1,47 @@
+#ifndef HTTP_RANGE_H
+#define HTTP_RANGE_H
+
+#include <stddef.h>
+
+#include "http.h"
+
+#define MAX_RANGES 8 // More ranges than this and the whole file is sent
+
+/**
+ * @enum RangeStatus
+ * @brief Result of parsing a Range header field
+ */
+enum RangeStatus
+{
+    RANGE_STATUS_IGNORE = 0,       //!< Send the whole file instead (200)
+    RANGE_STATUS_OK = 1,           //!< Send the ranges (206)
+    RANGE_STATUS_UNSATISFIABLE = 2 //!< None of the ranges are in the file
+};
+
+/**
+ * @struct ByteRange
+ * @brief A range of bytes in a file
+ */
+typedef struct
+{
+    size_t start; //!< Offset of the first byte
+    size_t len;   //!< Number of bytes
+} ByteRange;
+
+/**
+ * @brief Parse the value of a Range header field
+ *
+ * Ranges that start past the end of the file are dropped, and the rest are
+ * clamped to the file. A malformed value, a unit other than bytes, or more
+ * than MAX_RANGES ranges means the field should be ignored
+ * @param value The value of the Range field
+ * @param size The size of the file
+ * @param ranges Where to store the ranges, must hold MAX_RANGES
+ * @param count Where to store the number of ranges
+ * @return The resulting RangeStatus
+ * @ref https://www.rfc-editor.org/rfc/rfc7233#section-2.1
+ */
+int parse_range(const StrSlice *value, size_t size, ByteRange *ranges,
+                int *count);
+
+#endif /* HTTP_RANGE_H */
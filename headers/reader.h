@@ -0,0 +1,103 @@
+#ifndef HTTP_READER_H
+#define HTTP_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+/**
+ * @enum ReaderStatus
+ * @brief What a RequestReader holds after checking it
+ */
+enum ReaderStatus
+{
+    READER_STATUS_READY = 0,         //!< A full request is ready
+    READER_STATUS_NEED_MORE = 1,     //!< The request is not fully read yet
+    READER_STATUS_INVALID = 2,       //!< The request is malformed (400)
+    READER_STATUS_TOO_LARGE = 3,     //!< The body is too large (413)
+    READER_STATUS_HEAD_TOO_LARGE = 4 //!< The headers are too large (431)
+};
+
+/**
+ * @struct RequestReader
+ * @brief Bytes read from a connection, kept across reads until they add up
+ * to a full request
+ *
+ * The buffer starts small and grows as needed, up to BUFF_SIZE. Anything
+ * read past the end of a request is kept for the next one, so pipelined
+ * requests are not lost
+ */
+typedef struct
+{
+    char *buff;      //!< The bytes read so far
+    size_t size;     //!< Number of bytes in buff
+    size_t capacity; //!< Size of buff, not counting room for a NUL
+    size_t scanned;  //!< Bytes already searched for the end of the headers
+    size_t head_len; //!< Length of the headers, 0 until they are complete
+    size_t req_len;  //!< Length of the headers and body
+} RequestReader;
+
+/**
+ * @brief Initialize the reader
+ * @param reader The reader to initialize
+ * @return 0 on success, 1 if something went wrong
+ */
+int reader_init(RequestReader *reader);
+
+/**
+ * @brief Free the memory used by the reader
+ * @param reader The reader to free
+ */
+void reader_free(RequestReader *reader);
+
+/**
+ * @brief Empty the reader, keeping its buffer for the next connection
+ * @param reader The reader to empty
+ */
+void reader_reset(RequestReader *reader);
+
+/**
+ * @brief Read from the socket into the reader
+ *
+ * A single read is made, growing the buffer first if it is full
+ * @param reader The reader to read into
+ * @param sock The socket to read from
+ * @return The number of bytes read, 0 on EOF, or -1 on error (errno is set)
+ */
+ssize_t reader_recv(RequestReader *reader, int sock);
+
+/**
+ * @brief Check if the reader holds a full request, and parse it if it does
+ *
+ * The search for the end of the headers picks up from where the last check
+ * left off, so each byte is only looked at once
+ * @param reader The reader to check
+ * @param req Where to store the parsed request
+ * @return The resulting ReaderStatus
+ */
+int reader_check(RequestReader *reader, HttpRequest *req);
+
+/**
+ * @brief Drop the request that was just handled
+ *
+ * Any bytes after it are moved to the front, ready to be checked
+ * @param reader The reader holding the request
+ */
+void reader_consume(RequestReader *reader);
+
+/**
+ * @brief Send the client the error matching the status, closing the socket
+ *
+ * The request is logged with whatever came before its first line break as
+ * its request line, as it may not have been parsed
+ * @param reader The reader holding the request
+ * @param req The request from reader_check(), with its IP address set
+ * @param status The ReaderStatus from reader_check()
+ * @param sock The socket to send to
+ */
+void reader_reject(const RequestReader *reader, HttpRequest *req, int status,
+                   int *sock);
+
+#endif /* HTTP_READER_H */
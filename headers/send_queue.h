@@ -0,0 +1,121 @@
+#ifndef HTTP_SEND_QUEUE_H
+#define HTTP_SEND_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SEND_QUEUE_MAX 4194304 // Most bytes of body copied into a queue
+
+/**
+ * @enum SendQueueStatus
+ * @brief Result of flushing a SendQueue
+ */
+enum SendQueueStatus
+{
+    SEND_QUEUE_DONE = 0,  //!< Everything queued was sent
+    SEND_QUEUE_AGAIN = 1, //!< The socket is full, wait until it is writable
+    SEND_QUEUE_ERROR = 2  //!< The connection failed
+};
+
+/**
+ * @struct SendSegment
+ * @brief A piece of a response waiting to be sent, either copied bytes or
+ * part of a file
+ */
+typedef struct send_segment
+{
+    struct send_segment *next; //!< The segment sent after this one
+    int fd;                    //!< The file to send from, -1 for data
+    off_t offset;              //!< Offset of the next byte in fd or data
+    size_t len;                //!< Bytes left to send
+    char data[];               //!< The bytes, if fd is -1
+} SendSegment;
+
+/**
+ * @struct SendQueue
+ * @brief What is left of the responses on a non-blocking socket
+ *
+ * Responses are sent straight away until the socket is full. Whatever would
+ * have blocked is queued instead, and sent once the socket is writable again
+ */
+typedef struct
+{
+    SendSegment *head; //!< The segment to send next
+    SendSegment *tail; //!< The segment queued last
+    size_t bytes;      //!< Bytes of data copied into the queue
+    bool close_after;  //!< Close the connection once the queue is sent
+    bool failed;       //!< A send failed, so nothing more is sent
+} SendQueue;
+
+/**
+ * @brief Set the queue the calling thread's responses are sent through
+ *
+ * While a queue is set, sends on the socket never block. With no queue,
+ * responses are sent with blocking calls
+ * @param queue The queue, or NULL to send with blocking calls
+ */
+void send_queue_attach(SendQueue *queue);
+
+/**
+ * @brief Get the queue the calling thread's responses are sent through
+ * @return The queue, or NULL if there is none
+ */
+SendQueue *send_queue_current(void);
+
+/**
+ * @brief Send the buffers, queueing whatever does not fit in the socket
+ *
+ * Once something is queued, everything after it is queued as well, so the
+ * bytes go out in order. If more than SEND_QUEUE_MAX bytes pile up, such as
+ * while streaming a large body, waits up to CONN_TIMEOUT_LEN for the client
+ * to take some of them
+ * @param queue The queue of the socket
+ * @param sock The socket to send to
+ * @param iov The buffers to send, which may be changed
+ * @param count The number of buffers
+ * @param flags Flags for sendmsg, on top of MSG_NOSIGNAL
+ * @return False if the connection failed
+ */
+bool send_queue_write(SendQueue *queue, int sock, struct iovec *iov,
+                      int count, int flags);
+
+/**
+ * @brief Send part of a file, queueing whatever does not fit in the socket
+ *
+ * A file is never copied into the queue. Its descriptor is duplicated, and
+ * the rest is sent from it later
+ * @param queue The queue of the socket
+ * @param sock The socket to send to
+ * @param fd The file to send from
+ * @param offset Offset of the first byte to send
+ * @param len Number of bytes to send
+ * @return False if the connection failed
+ */
+bool send_queue_file(SendQueue *queue, int sock, int fd, off_t offset,
+                     size_t len);
+
+/**
+ * @brief Send as much of the queue as the socket will take
+ * @param queue The queue of the socket
+ * @param sock The socket to send to
+ * @param progress Where to store if anything was sent
+ * @return The resulting SendQueueStatus
+ */
+int send_queue_flush(SendQueue *queue, int sock, bool *progress);
+
+/**
+ * @brief Check if anything is waiting in the queue
+ * @param queue The queue to check
+ * @return True if nothing is waiting
+ */
+bool send_queue_empty(const SendQueue *queue);
+
+/**
+ * @brief Drop everything in the queue, ready for the next connection
+ * @param queue The queue to empty
+ */
+void send_queue_clear(SendQueue *queue);
+
+#endif /* HTTP_SEND_QUEUE_H */
@@ -1,111 +1,216 @@
-#ifndef HTTP_UTILS_H
-#define HTTP_UTILS_H
-
-#include <dirent.h>
-#include <limits.h>
-#include <stddef.h>
-#include <stdint.h>
-#include <stdio.h>
-
-/**
- * @struct ConfigOptions
- * @brief Configuration options for the server to use at run time
- */
-typedef struct
-{
-    char server_name[24];    //!< Name for the server
-    char path[PATH_MAX + 1]; //!< Path the HTML directory
-    uint32_t timeout;        //!< Request timeout length (in milliseconds)
-    uint16_t threads;        //!< Number of threads the server should run with
-    uint16_t port;           //!< The port the server should run on
-    uint16_t backlog;        //!< Max queue len for pending connections
-    uint16_t buff_size;      //!< The size to use to create buffers
-} ConfigOptions;
-
-/**
- * @brief Write the current time to the provided string
- * @param time_str The string to store the time string in
- */
-void get_time(char *time_str);
-
-/**
- * @brief Get the size of the given file
- * @param fp File descriptor of the file to get the size of
- * @return File size (in bytes)
- */
-size_t get_file_size(FILE *fp);
-
-/**
- * @brief Get the files file extention
- * @param filename The name of the file to get the extention of
- * @return The file extention
- */
-const char *get_filename_ext(const char *filename);
-
-/**
- * @brief Return an initialized ConfigOptions struct
- * @return Initialized ConfigOptions
- */
-ConfigOptions init_config_opts(void);
-
-/**
- * @brief Parse the config file and return its properties
- * @param config File descriptor of the config file to read the contents of
- * @return Properties of how the server should be configured
- */
-ConfigOptions parse_config(FILE *config);
-
-/**
- * @brief Trim the leading and trailing white space from the string
- * @param str The string to trim
- * @return The string with no leading or trailing whitespace
- */
-char *trim(char *str);
-
-/**
- * @brief Return the given string in all lowercase
- * @param str The string to convert to lowercase
- * @return The given string in all lowercase
- */
-char *lowerstr(char *str);
-
-/**
- * @brief Resize the buffer if needed
- * @param buffer The buffer to resize
- * @param max The current maximum size of the buffer
- * @param required The minimum size the buffer needs to be
- * @return 0 on success, 1 if something went wrong
- */
-int buff_resize(char **buffer, size_t *max, size_t required);
-
-/**
- * @brief Shink the buffer to the minimum size required
- * @param buffer The buffer to shrink
- * @param size The resulting new size of the buffer
- * @return 0 on success, 1 if something went wrong
- */
-int buff_shrink_to_fit(char **buffer, size_t *size);
-
-/**
- * @brief Comparison function, for qsort, to sort elements in a directory
- *
- * Sorts directories followed by regular files, both in alphabetical order
- * @param a First directory element to compare
- * @param b Second directory element to compare
- * @return -1: (a < b), 0: (a == b), 1: (a > b)
- */
-int compare_dir_elms(const void *a, const void *b);
-
-/**
- * @brief Free the memory in the given list of directory contents
- * @param dir The list of dirent structs to free
- * @param size The number of dirent structs
- */
-void free_dir_list(struct dirent **dir, size_t size);
-
-/**
- * @brief Write the default http.conf file
- */
-void gen_http_cfg(void);
-
-#endif /* HTTP_UTILS_H */
+#ifndef HTTP_UTILS_H
+#define HTTP_UTILS_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "defaults.h"
+
+#define HTTP_DATE_LEN 29 // Sun, 06 Nov 1994 08:49:37 GMT
+
+/**
+ * @struct ConfigOptions
+ * @brief Configuration options for the server to use at run time
+ */
+typedef struct
+{
+    char server_name[24];    //!< Name for the server
+    char path[PATH_MAX + 1]; //!< Path the HTML directory
+    uint32_t timeout;        //!< Request timeout length (in milliseconds)
+    uint32_t keep_alive;     //!< Idle connection timeout (in milliseconds)
+    uint32_t queue_depth;    //!< Max connections waiting for a thread
+    uint32_t cache_size;     //!< Memory for cached files (in kilobytes)
+    uint32_t cache_max_file; //!< Largest file to cache (in kilobytes)
+    uint32_t dir_index;      //!< Memory for directory indexes (in kilobytes)
+    uint32_t path_cache_max; //!< Most resolved paths to keep open
+    uint32_t path_cache_ttl; //!< Time to keep a resolved path (in milliseconds)
+    uint32_t compress_min;   //!< Smallest body to compress (in bytes)
+    uint16_t threads;        //!< Number of threads the server should run with
+    uint16_t port;           //!< The port the server should run on
+    uint16_t backlog;        //!< Max queue len for pending connections
+    uint16_t buff_size;      //!< The size to use to create buffers
+    uint16_t max_requests;   //!< Max requests to serve per connection
+    uint8_t mode;            //!< The ServerMode the server should run in
+    uint8_t compress_level;  //!< zlib compression level, 1 to 9
+    uint8_t log_format;      //!< The LogFormat of the access log
+    bool reuse_port;         //!< Give each thread its own listening socket
+    bool cpu_affinity;       //!< Pin each thread to its own CPU
+    bool cache_revalidate;   //!< Check cached files are up to date
+    bool error_pages;        //!< Load custom error pages from the HTML root
+    bool precompressed;      //!< Send precompressed copies of files
+    bool compression;        //!< Compress responses on the fly
+    bool status_page;        //!< Serve the server's metrics
+    uint8_t num_cache_rules; //!< Number of rules in cache_rules
+    /// Content types to compress, separated by commas
+    char compress_types[COMPRESS_TYPES_LEN];
+    /// The Cache-Control values to send, by extension
+    CacheRule cache_rules[MAX_CACHE_RULES];
+    /// Where to write the access log, "stdout" or "off"
+    char access_log[PATH_MAX + 1];
+} ConfigOptions;
+
+/**
+ * @struct StrBuilder
+ * @brief A string that is only ever added to, which keeps track of its length
+ * so adding to it never has to scan what is already there
+ */
+typedef struct
+{
+    char *data;  //!< The string, always NUL terminated
+    size_t len;  //!< Length of the string
+    size_t max;  //!< Size of the allocation
+    bool failed; //!< Ran out of memory, so the string is incomplete
+} StrBuilder;
+
+/**
+ * @brief Format the time as an HTTP date (IMF-fixdate)
+ * @param t The time to format
+ * @param date_str The string to store the date in, which must hold at least
+ * HTTP_DATE_LEN + 1 characters
+ * @ref https://www.rfc-editor.org/rfc/rfc7231#section-7.1.1.1
+ */
+void format_http_date(time_t t, char *date_str);
+
+/**
+ * @brief Parse an HTTP date (IMF-fixdate)
+ *
+ * The obsolete RFC 850 and asctime formats are not accepted, which only
+ * means a conditional request is answered in full
+ * @param str The date to parse, which does not need to be NUL terminated
+ * @param len The length of the date
+ * @param t Where to store the time
+ * @return True if the date is valid
+ * @ref https://www.rfc-editor.org/rfc/rfc7231#section-7.1.1.1
+ */
+bool parse_http_date(const char *str, size_t len, time_t *t);
+
+/**
+ * @brief Write the current time as an HTTP date to the provided string
+ *
+ * The date is shared by all threads and only rebuilt once a second
+ * @param date_str The string to store the date in, which must hold at least
+ * HTTP_DATE_LEN + 1 characters
+ */
+void get_http_date(char *date_str);
+
+/**
+ * @brief Get the current time of the monotonic clock
+ * @return Time since an unspecified starting point (unit: ms)
+ */
+uint64_t get_monotonic_ms(void);
+
+/**
+ * @brief Get the size of the given file
+ * @param fp File descriptor of the file to get the size of
+ * @return File size (in bytes)
+ */
+size_t get_file_size(FILE *fp);
+
+/**
+ * @brief Check if a file on disk is still the one it was when first stat'd
+ * @param a The stats of the file when it was read
+ * @param b The current stats of the file
+ * @return True if nothing about the file has changed
+ */
+bool same_file_stats(const struct stat *a, const struct stat *b);
+
+/**
+ * @brief Read the whole file into memory
+ * @param fd The file descriptor to read from
+ * @param size The size of the file
+ * @return The contents of the file, or NULL if it could not be read
+ * @attention If the function does not return NULL, the returned buffer must
+ * be freed when done
+ */
+char *read_file_data(int fd, size_t size);
+
+/**
+ * @brief Get the files file extention
+ * @param filename The name of the file to get the extention of
+ * @return The file extention
+ */
+const char *get_filename_ext(const char *filename);
+
+/**
+ * @brief Return an initialized ConfigOptions struct
+ * @return Initialized ConfigOptions
+ */
+ConfigOptions init_config_opts(void);
+
+/**
+ * @brief Parse the config file and return its properties
+ * @param config File descriptor of the config file to read the contents of
+ * @return Properties of how the server should be configured
+ */
+ConfigOptions parse_config(FILE *config);
+
+/**
+ * @brief Trim the leading and trailing white space from the string
+ * @param str The string to trim
+ * @return The string with no leading or trailing whitespace
+ */
+char *trim(char *str);
+
+/**
+ * @brief Return the given string in all lowercase
+ * @param str The string to convert to lowercase
+ * @return The given string in all lowercase
+ */
+char *lowerstr(char *str);
+
+/**
+ * @brief Start an empty string builder
+ * @param sb The builder to start
+ * @param size The number of bytes to allocate up front
+ * @return True on success
+ * @attention The builder must be freed with str_builder_free(), or its string
+ * taken with str_builder_take(), when done
+ */
+bool str_builder_init(StrBuilder *sb, size_t size);
+
+/**
+ * @brief Add characters to the end of the string
+ *
+ * Running out of memory marks the builder as failed, after which nothing
+ * more is added
+ * @param sb The builder to add to
+ * @param str The characters to add, which do not need to be NUL terminated
+ * @param len The number of characters to add
+ */
+void str_builder_append(StrBuilder *sb, const char *str, size_t len);
+
+/**
+ * @brief Add formatted text to the end of the string
+ * @param sb The builder to add to
+ * @param fmt The printf style format of the text
+ * @param ... The values to format
+ */
+void str_builder_appendf(StrBuilder *sb, const char *fmt, ...);
+
+/**
+ * @brief Take the finished string out of the builder
+ * @param sb The builder to take the string from
+ * @param len Where to store the length of the string, may be NULL
+ * @return The string, or NULL if the builder ran out of memory
+ * @attention If the function does not return NULL, the returned string must
+ * be freed when done
+ */
+char *str_builder_take(StrBuilder *sb, size_t *len);
+
+/**
+ * @brief Free the builder's string
+ * @param sb The builder to free
+ */
+void str_builder_free(StrBuilder *sb);
+
+/**
+ * @brief Write the default http.conf file
+ */
+void gen_http_cfg(void);
+
+#endif /* HTTP_UTILS_H */
@@ -0,0 +1,581 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+#define CACHE_LINE 64
+#define MAX_LOG_RINGS 1024   // Most threads that can log
+#define LOG_BUFF_SIZE 65536  // Bytes batched into each write
+#define LOG_LINE_MAX 4096    // Longest line a record can turn into
+#define LOG_REQUEST_LEN 256  // Longest request line kept
+#define LOG_FIELD_LEN 128    // Longest Referer or User-Agent kept
+#define MAX_TEXT_RECORDS 32  // Most records one message can take
+
+/**
+ * @enum RecordKind
+ * @brief What a LogRecord holds
+ */
+enum RecordKind
+{
+    RECORD_REQUEST = 0, //!< A request, for the access log
+    RECORD_TEXT = 1     //!< A piece of a message, for stdout
+};
+
+/**
+ * @struct RequestRecord
+ * @brief What the access log needs to know about a request
+ *
+ * The strings are not terminated, and are cut short if they do not fit
+ */
+typedef struct
+{
+    time_t time;                    //!< When the request was responded to
+    uint64_t bytes;                 //!< Bytes of body sent back
+    uint16_t status;                //!< Status code sent back
+    uint16_t request_len;           //!< Length of request
+    uint16_t referer_len;           //!< Length of referer, 0 if there is none
+    uint16_t agent_len;             //!< Length of agent, 0 if there is none
+    char ip[16];                    //!< The IP address of the client
+    char request[LOG_REQUEST_LEN];  //!< The request line
+    char referer[LOG_FIELD_LEN];    //!< The Referer field
+    char agent[LOG_FIELD_LEN];      //!< The User-Agent field
+} RequestRecord;
+
+/**
+ * @struct LogRecord
+ * @brief A slot in a thread's ring
+ */
+typedef struct
+{
+    uint8_t kind; //!< The RecordKind of the record
+    uint16_t len; //!< Length of text
+    union
+    {
+        RequestRecord request;               //!< A request
+        char text[sizeof(RequestRecord)];    //!< A piece of a message
+    };
+} LogRecord;
+
+/**
+ * @struct LogRing
+ * @brief Records written by one thread, waiting for the logger thread
+ *
+ * Only the thread that owns the ring moves head, and only the logger thread
+ * moves tail, so neither side needs a lock. Positions only ever grow, and
+ * are wrapped when a record is looked up
+ */
+typedef struct
+{
+    /// The next position the owner writes to
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    atomic_uint_fast64_t dropped; //!< Records lost because the ring was full
+    size_t tail_seen;             //!< The last tail the owner loaded
+    /// The next position the logger reads from
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) LogRecord records[LOG_RING_SIZE]; //!< The records
+} LogRing;
+
+/**
+ * @struct LogOutput
+ * @brief Lines waiting to be written out together
+ */
+typedef struct
+{
+    int fd;                   //!< Where the lines are written
+    size_t len;               //!< Bytes waiting in buff
+    char buff[LOG_BUFF_SIZE]; //!< The lines
+} LogOutput;
+
+static LogRing *_Atomic rings[MAX_LOG_RINGS];
+static atomic_size_t num_rings = 0;
+static _Thread_local LogRing *ring = NULL;
+static _Thread_local bool ring_failed = false;
+
+/// Records lost by threads that could not get a ring
+static atomic_uint_fast64_t ringless_dropped = 0;
+
+static atomic_bool running = false;
+static pthread_t logger;
+static uint8_t log_format = LOG_FORMAT_COMMON;
+
+/// Only touched by the logger thread once it is started
+static LogOutput console = { STDOUT_FILENO, 0 };
+static LogOutput file = { -1, 0 };
+static LogOutput *access_out = NULL;
+static uint64_t dropped_reported = 0;
+
+/**
+ * @brief Get the ring of the calling thread, creating it the first time
+ * @return The ring, or NULL if the thread cannot have one
+ */
+static LogRing *get_ring(void)
+{
+    if (ring != NULL || ring_failed)
+        return ring;
+
+    ring_failed = true;
+    size_t index = atomic_fetch_add(&num_rings, 1);
+    if (index >= MAX_LOG_RINGS)
+        return NULL;
+
+    LogRing *new_ring = aligned_alloc(CACHE_LINE, sizeof(LogRing));
+    if (new_ring == NULL)
+        return NULL;
+    atomic_init(&new_ring->head, 0);
+    atomic_init(&new_ring->dropped, 0);
+    atomic_init(&new_ring->tail, 0);
+    new_ring->tail_seen = 0;
+
+    // Publishing the ring last means the logger never sees it half made
+    atomic_store_explicit(&rings[index], new_ring, memory_order_release);
+    ring_failed = false;
+    ring = new_ring;
+    return ring;
+}
+
+/**
+ * @brief Make room for records in the calling thread's ring
+ * @param count The number of records
+ * @return The ring if there was room, counting the records as dropped
+ * otherwise
+ */
+static LogRing *reserve_records(size_t count)
+{
+    LogRing *own = get_ring();
+    if (own == NULL)
+    {
+        atomic_fetch_add_explicit(&ringless_dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    // The tail is only loaded again when the ring looks full, so the
+    // logger's cache line is left alone most of the time
+    size_t head = atomic_load_explicit(&own->head, memory_order_relaxed);
+    if (head + count - own->tail_seen > LOG_RING_SIZE)
+    {
+        own->tail_seen = atomic_load_explicit(&own->tail,
+                                              memory_order_acquire);
+        if (head + count - own->tail_seen > LOG_RING_SIZE)
+        {
+            atomic_fetch_add_explicit(&own->dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+    return own;
+}
+
+/**
+ * @brief Get the record at a position in the ring
+ * @param from The ring
+ * @param pos The position, which can be past the end of the ring
+ * @return The record
+ */
+static LogRecord *record_at(LogRing *from, size_t pos)
+{
+    return &from->records[pos % LOG_RING_SIZE];
+}
+
+/**
+ * @brief Hand the records written since head to the logger thread
+ * @param own The calling thread's ring
+ * @param count The number of records written
+ */
+static void publish_records(LogRing *own, size_t count)
+{
+    size_t head = atomic_load_explicit(&own->head, memory_order_relaxed);
+    atomic_store_explicit(&own->head, head + count, memory_order_release);
+}
+
+/**
+ * @brief Copy at most max bytes of the slice into a record
+ * @param dest Where to copy to
+ * @param max The most bytes to copy
+ * @param slice The slice to copy, may be NULL
+ * @return The number of bytes copied
+ */
+static uint16_t copy_field(char *dest, size_t max, const StrSlice *slice)
+{
+    if (slice == NULL)
+        return 0;
+    size_t len = (slice->len < max) ? slice->len : max;
+    memcpy(dest, slice->ptr, len);
+    return len;
+}
+
+void access_log_request(const HttpRequest *req, uint16_t status,
+                        uint64_t bytes)
+{
+    if (access_out == NULL || !atomic_load(&running))
+        return;
+    LogRing *own = reserve_records(1);
+    if (own == NULL)
+        return;
+
+    size_t head = atomic_load_explicit(&own->head, memory_order_relaxed);
+    LogRecord *record = record_at(own, head);
+    RequestRecord *entry = &record->request;
+    record->kind = RECORD_REQUEST;
+    entry->time = time(NULL);
+    entry->status = status;
+    entry->bytes = bytes;
+    memcpy(entry->ip, req->ip, sizeof(entry->ip));
+
+    // The request line runs from the start of the method to the end of the
+    // version
+    StrSlice line = { req->method.ptr,
+                      (req->version.ptr + req->version.len)
+                          - req->method.ptr };
+    entry->request_len = copy_field(entry->request, LOG_REQUEST_LEN, &line);
+    entry->referer_len = 0;
+    entry->agent_len = 0;
+    if (log_format == LOG_FORMAT_COMBINED)
+    {
+        entry->referer_len = copy_field(entry->referer, LOG_FIELD_LEN,
+                                        get_header(req, "Referer"));
+        entry->agent_len = copy_field(entry->agent, LOG_FIELD_LEN,
+                                      get_header(req, "User-Agent"));
+    }
+    publish_records(own, 1);
+}
+
+void log_write(const char *text, size_t len)
+{
+    if (!atomic_load(&running))
+    {
+        fwrite(text, 1, len, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    // Long messages are split over records, which all go in at once so they
+    // are not mixed up with other threads' messages
+    size_t per_record = sizeof(((LogRecord *) NULL)->text);
+    size_t count = (len + per_record - 1) / per_record;
+    if (count > MAX_TEXT_RECORDS)
+    {
+        count = MAX_TEXT_RECORDS;
+        len = count * per_record;
+    }
+    LogRing *own = reserve_records(count);
+    if (own == NULL)
+        return;
+
+    size_t head = atomic_load_explicit(&own->head, memory_order_relaxed);
+    for (size_t x = 0; x < count; x++)
+    {
+        LogRecord *record = record_at(own, head + x);
+        size_t part = (len < per_record) ? len : per_record;
+        record->kind = RECORD_TEXT;
+        record->len = part;
+        memcpy(record->text, text, part);
+        text += part;
+        len -= part;
+    }
+    publish_records(own, count);
+}
+
+void log_printf(const char *format, ...)
+{
+    char message[LOG_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (len > 0)
+        log_write(message, ((size_t) len < sizeof(message))
+                               ? (size_t) len
+                               : sizeof(message) - 1);
+}
+
+size_t access_log_pending(void)
+{
+    if (ring == NULL)
+        return 0;
+    return atomic_load_explicit(&ring->head, memory_order_relaxed)
+           - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+uint64_t get_log_dropped(void)
+{
+    uint64_t dropped = atomic_load(&ringless_dropped);
+    size_t count = atomic_load(&num_rings);
+    for (size_t x = 0; x < count && x < MAX_LOG_RINGS; x++)
+    {
+        LogRing *from = atomic_load_explicit(&rings[x], memory_order_acquire);
+        if (from != NULL)
+            dropped += atomic_load_explicit(&from->dropped,
+                                            memory_order_relaxed);
+    }
+    return dropped;
+}
+
+/**
+ * @brief Write out every line waiting in the output
+ * @param out The output to flush
+ */
+static void flush_output(LogOutput *out)
+{
+    size_t sent = 0;
+    while (sent < out->len)
+    {
+        ssize_t res = write(out->fd, out->buff + sent, out->len - sent);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1)
+        {
+            // There is nowhere left to report it, so the lines are lost
+            break;
+        }
+        sent += res;
+    }
+    out->len = 0;
+}
+
+/**
+ * @brief Make sure the output has room for another line
+ * @param out The output
+ * @param len The most the line can take
+ * @return Where to write the line
+ */
+static char *output_space(LogOutput *out, size_t len)
+{
+    if (LOG_BUFF_SIZE - out->len < len)
+        flush_output(out);
+    return out->buff + out->len;
+}
+
+/**
+ * @brief Write a quoted field of the log line, escaping quotes, backslashes
+ * and anything that is not printable
+ *
+ * Referer and User-Agent come straight from the client, so they must not be
+ * able to end the field or the line early
+ * @param dest Where to write the field
+ * @param src The field
+ * @param len The length of the field, 0 to write "-"
+ * @return The number of bytes written
+ */
+static size_t write_quoted(char *dest, const char *src, size_t len)
+{
+    static const char HEX[] = "0123456789abcdef";
+    char *pos = dest;
+    *pos++ = '"';
+    if (len == 0)
+        *pos++ = '-';
+    for (size_t x = 0; x < len; x++)
+    {
+        unsigned char c = src[x];
+        if (c == '"' || c == '\\')
+        {
+            *pos++ = '\\';
+            *pos++ = c;
+        }
+        else if (c < 0x20 || c >= 0x7f)
+        {
+            *pos++ = '\\';
+            *pos++ = 'x';
+            *pos++ = HEX[c >> 4];
+            *pos++ = HEX[c & 0xf];
+        }
+        else
+            *pos++ = c;
+    }
+    *pos++ = '"';
+    return pos - dest;
+}
+
+/**
+ * @brief Format the time the way the Common Log Format has it
+ *
+ * Requests come in order, so the last second formatted is kept
+ * @param time The time to format
+ * @return The formatted time, such as 10/Oct/2000:13:55:36 +0000
+ */
+static const char *format_log_time(time_t time)
+{
+    static time_t last = -1;
+    static char formatted[64];
+    if (time != last)
+    {
+        struct tm tm;
+        gmtime_r(&time, &tm);
+        strftime(formatted, sizeof(formatted), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        last = time;
+    }
+    return formatted;
+}
+
+/**
+ * @brief Add the request's line to the access log
+ * @param entry The request
+ * @ref https://httpd.apache.org/docs/current/logs.html#common
+ */
+static void write_request(const RequestRecord *entry)
+{
+    char *line = output_space(access_out, LOG_LINE_MAX);
+    size_t len = sprintf(line, "%.*s - - [%s] ",
+                         (int) strnlen(entry->ip, sizeof(entry->ip)),
+                         entry->ip, format_log_time(entry->time));
+    len += write_quoted(line + len, entry->request, entry->request_len);
+
+    // A body of nothing is written as "-"
+    if (entry->bytes == 0)
+        len += sprintf(line + len, " %u -", entry->status);
+    else
+        len += sprintf(line + len, " %u %llu", entry->status,
+                       (unsigned long long) entry->bytes);
+
+    if (log_format == LOG_FORMAT_COMBINED)
+    {
+        line[len++] = ' ';
+        len += write_quoted(line + len, entry->referer, entry->referer_len);
+        line[len++] = ' ';
+        len += write_quoted(line + len, entry->agent, entry->agent_len);
+    }
+    line[len++] = '\n';
+    access_out->len += len;
+}
+
+/**
+ * @brief Write out every record waiting in the ring
+ * @param from The ring
+ * @return True if there were any records
+ */
+static bool drain_ring(LogRing *from)
+{
+    size_t tail = atomic_load_explicit(&from->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&from->head, memory_order_acquire);
+    for (size_t pos = tail; pos != head; pos++)
+    {
+        const LogRecord *record = record_at(from, pos);
+        if (record->kind == RECORD_REQUEST)
+            write_request(&record->request);
+        else
+        {
+            char *dest = output_space(&console, record->len);
+            memcpy(dest, record->text, record->len);
+            console.len += record->len;
+        }
+    }
+
+    // The records are copied out, so the owner can have the slots back
+    atomic_store_explicit(&from->tail, head, memory_order_release);
+    return head != tail;
+}
+
+/**
+ * @brief Write out every record waiting in every ring
+ * @return True if there were any records
+ */
+static bool drain_rings(void)
+{
+    bool busy = false;
+    size_t count = atomic_load(&num_rings);
+    for (size_t x = 0; x < count && x < MAX_LOG_RINGS; x++)
+    {
+        LogRing *from = atomic_load_explicit(&rings[x], memory_order_acquire);
+        if (from != NULL)
+            busy |= drain_ring(from);
+    }
+
+    // Let whoever reads the log know that lines are missing from it
+    uint64_t dropped = get_log_dropped();
+    if (dropped != dropped_reported)
+    {
+        char *dest = output_space(&console, LOG_LINE_MAX);
+        console.len += sprintf(dest, "Dropped %llu log records, the logger "
+                                     "could not keep up\n",
+                               (unsigned long long) (dropped
+                                                     - dropped_reported));
+        dropped_reported = dropped;
+    }
+
+    if (file.len > 0)
+        flush_output(&file);
+    if (console.len > 0)
+        flush_output(&console);
+    return busy;
+}
+
+/**
+ * @brief Drain the rings until the logger is stopped, sleeping whenever they
+ * are empty
+ * @param arg Unused
+ * @return Always NULL
+ */
+static void *logger_thread(void *arg)
+{
+    (void) arg;
+    struct timespec idle = { 0, LOG_FLUSH_INTERVAL * 1000000L };
+    while (atomic_load(&running))
+    {
+        if (!drain_rings())
+            nanosleep(&idle, NULL);
+    }
+
+    // Pick up anything logged while it was stopping
+    drain_rings();
+    return NULL;
+}
+
+int access_log_init(const char *target, uint8_t format)
+{
+    log_format = format;
+    if (strcmp(target, "off") == 0)
+        access_out = NULL;
+    else if (strcmp(target, "stdout") == 0)
+        access_out = &console;
+    else
+    {
+        file.fd = open(target, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                       0644);
+        if (file.fd == -1)
+        {
+            perror("open");
+            return 1;
+        }
+        access_out = &file;
+    }
+
+    // Anything printed before now must come out before the logger's lines
+    fflush(stdout);
+    atomic_store(&running, true);
+    if (pthread_create(&logger, NULL, logger_thread, NULL) != 0)
+    {
+        perror("pthread_create");
+        atomic_store(&running, false);
+        access_log_free();
+        return 1;
+    }
+    return 0;
+}
+
+void access_log_free(void)
+{
+    if (atomic_exchange(&running, false))
+        pthread_join(logger, NULL);
+
+    size_t count = atomic_load(&num_rings);
+    for (size_t x = 0; x < count && x < MAX_LOG_RINGS; x++)
+    {
+        free(atomic_load(&rings[x]));
+        atomic_store(&rings[x], NULL);
+    }
+    atomic_store(&num_rings, 0);
+    ring = NULL;
+    ring_failed = false;
+
+    if (file.fd != -1)
+        close(file.fd);
+    file.fd = -1;
+    access_out = NULL;
+}
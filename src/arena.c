@@ -0,0 +1,157 @@
+#include <stdalign.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/**
+ * @struct ArenaBlock
+ * @brief A block of memory that allocations are handed out of
+ */
+typedef struct arena_block
+{
+    struct arena_block *next; //!< The block after this one
+    size_t size;              //!< Bytes the block can hold
+    size_t used;              //!< Bytes handed out of the block
+    /// The memory itself
+    alignas(max_align_t) unsigned char data[];
+} ArenaBlock;
+
+/**
+ * @struct Arena
+ * @brief The blocks a thread allocates from
+ */
+typedef struct
+{
+    ArenaBlock *head;    //!< The first block
+    ArenaBlock *current; //!< The block being allocated from
+} Arena;
+
+static _Thread_local Arena arena = { NULL, NULL };
+
+#ifdef ALLOC_STATS
+static _Thread_local uint64_t thread_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    thread_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    thread_allocs++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    thread_allocs++;
+    return __real_realloc(ptr, size);
+}
+#endif /* ALLOC_STATS */
+
+/**
+ * @brief Round the size up to the alignment of any type
+ * @param size The size to round up
+ * @return The rounded size
+ */
+static size_t align_size(size_t size)
+{
+    size_t align = alignof(max_align_t);
+    return (size + align - 1) & ~(align - 1);
+}
+
+/**
+ * @brief Add a new block to the end of the arena
+ * @param size The least the block must hold
+ * @return The block, or NULL if out of memory
+ */
+static ArenaBlock *add_block(size_t size)
+{
+    if (size < ARENA_BLOCK_SIZE)
+        size = ARENA_BLOCK_SIZE;
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    if (arena.current == NULL)
+        arena.head = block;
+    else
+    {
+        // Blocks past the current one are empty, so they go after the new one
+        block->next = arena.current->next;
+        arena.current->next = block;
+    }
+    return block;
+}
+
+void *arena_alloc(size_t size)
+{
+    size = align_size(size);
+    ArenaBlock *block = arena.current;
+
+    // Move on to the blocks kept from earlier requests, which are empty
+    while (block != NULL && block->size - block->used < size)
+    {
+        block = block->next;
+        if (block != NULL)
+            block->used = 0;
+    }
+    if (block == NULL && (block = add_block(size)) == NULL)
+        return NULL;
+
+    arena.current = block;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arena_reset(void)
+{
+    // Keep the blocks that fit in ARENA_KEEP_SIZE, free the rest
+    size_t kept = 0;
+    ArenaBlock **link = &arena.head;
+    while (*link != NULL)
+    {
+        ArenaBlock *block = *link;
+        if (kept + block->size <= ARENA_KEEP_SIZE)
+        {
+            kept += block->size;
+            link = &block->next;
+            continue;
+        }
+        *link = block->next;
+        free(block);
+    }
+
+    arena.current = arena.head;
+    if (arena.head != NULL)
+        arena.head->used = 0;
+}
+
+void arena_free(void)
+{
+    while (arena.head != NULL)
+    {
+        ArenaBlock *next = arena.head->next;
+        free(arena.head);
+        arena.head = next;
+    }
+    arena.current = NULL;
+}
+
+uint64_t get_alloc_count(void)
+{
+#ifdef ALLOC_STATS
+    return thread_allocs;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,319 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "defaults.h"
+#include "encoding.h"
+#include "utils.h"
+
+#define GZIP_WINDOW_BITS (MAX_WBITS + 16) // Adds the gzip header and trailer
+#define STREAM_CHUNK 16384                // Compressed bytes sent at a time
+
+/**
+ * @struct deflate_stream
+ * @brief A body being compressed as it is produced
+ */
+struct deflate_stream
+{
+    z_stream strm;          //!< The zlib stream
+    uint64_t cpu_ns;        //!< CPU time spent compressing so far
+    char out[STREAM_CHUNK]; //!< Compressed data waiting to be written
+};
+
+static atomic_uint_fast64_t total_count = 0;
+static atomic_uint_fast64_t total_in = 0;
+static atomic_uint_fast64_t total_out = 0;
+static atomic_uint_fast64_t total_cpu_ns = 0;
+
+/**
+ * @brief Get the CPU time used by the calling thread
+ * @return The CPU time (unit: ns)
+ */
+static uint64_t get_thread_cpu_ns(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/**
+ * @brief Check if the content type is in the compression_types list
+ * @param type The content type to look for
+ * @return True if it is listed
+ */
+static bool type_listed(const char *type)
+{
+    size_t len = strlen(type);
+    for (const char *pos = COMPRESS_TYPES; *pos != '\0';)
+    {
+        const char *end = strchr(pos, ',');
+        size_t item_len = (end != NULL) ? (size_t) (end - pos) : strlen(pos);
+        if (item_len == len && strncmp(pos, type, len) == 0)
+            return true;
+        pos += item_len + (end != NULL);
+    }
+    return false;
+}
+
+bool should_compress(const char *type, size_t size)
+{
+    return COMPRESSION && size >= COMPRESS_MIN
+           && size <= MAX_COMPRESS_SIZE && type_listed(type);
+}
+
+int choose_compression(const StrSlice *accept)
+{
+    int quality[NUM_CONTENT_ENCODINGS];
+    parse_accept_encoding(accept, quality);
+    if (quality[CONTENT_ENCODING_GZIP] > 0
+        && quality[CONTENT_ENCODING_GZIP] >= quality[CONTENT_ENCODING_DEFLATE])
+        return CONTENT_ENCODING_GZIP;
+    if (quality[CONTENT_ENCODING_DEFLATE] > 0)
+        return CONTENT_ENCODING_DEFLATE;
+    return CONTENT_ENCODING_IDENTITY;
+}
+
+/**
+ * @brief Allocate memory for zlib from the thread's arena
+ * @param opaque Unused
+ * @param items Number of items
+ * @param size Size of each item
+ * @return The memory, or NULL if out of memory
+ */
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+    (void) opaque;
+    return arena_alloc((size_t) items * size);
+}
+
+/**
+ * @brief Let zlib give back memory, which the arena takes back by itself
+ * @param opaque Unused
+ * @param ptr Unused
+ */
+static void zlib_free(voidpf opaque, voidpf ptr)
+{
+    (void) opaque;
+    (void) ptr;
+}
+
+/**
+ * @brief Start a zlib stream at COMPRESS_LEVEL
+ *
+ * The stream's state, a few hundred kilobytes, comes from the thread's arena,
+ * so the stream must be done with before the request is
+ * @param strm The stream to start
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @return True on success
+ */
+static bool init_deflate(z_stream *strm, int encoding)
+{
+    memset(strm, 0, sizeof(z_stream));
+    strm->zalloc = zlib_alloc;
+    strm->zfree = zlib_free;
+    int window = (encoding == CONTENT_ENCODING_GZIP) ? GZIP_WINDOW_BITS
+                                                     : MAX_WBITS;
+    return deflateInit2(strm, COMPRESS_LEVEL, Z_DEFLATED, window, 8,
+                        Z_DEFAULT_STRATEGY)
+           == Z_OK;
+}
+
+/**
+ * @brief Add to the running totals of the work done compressing
+ * @param bytes_in Bytes before compressing
+ * @param bytes_out Bytes after compressing
+ * @param cpu_ns CPU time spent compressing (unit: ns)
+ */
+static void add_stats(uint64_t bytes_in, uint64_t bytes_out, uint64_t cpu_ns)
+{
+    atomic_fetch_add(&total_count, 1);
+    atomic_fetch_add(&total_in, bytes_in);
+    atomic_fetch_add(&total_out, bytes_out);
+    atomic_fetch_add(&total_cpu_ns, cpu_ns);
+}
+
+/**
+ * @brief Compress the data in one go
+ * @param data The data to compress
+ * @param size The size of the data
+ * @param encoding CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE
+ * @param in_arena Take the output from the thread's arena, not the heap
+ * @param out Where to store the compressed data
+ * @param out_size Where to store the size of the compressed data
+ * @return True on success
+ */
+static bool run_compress(const char *data, size_t size, int encoding,
+                         bool in_arena, char **out, size_t *out_size)
+{
+    uint64_t start = get_thread_cpu_ns();
+    z_stream strm;
+    if (!init_deflate(&strm, encoding))
+        return false;
+
+    // Big enough for the whole output, so it is done in one call
+    size_t bound = deflateBound(&strm, size);
+    *out = in_arena ? arena_alloc(bound) : malloc(bound);
+    if (*out == NULL)
+    {
+        deflateEnd(&strm);
+        return false;
+    }
+    strm.next_in = (Bytef *) data;
+    strm.avail_in = size;
+    strm.next_out = (Bytef *) *out;
+    strm.avail_out = bound;
+    int result = deflate(&strm, Z_FINISH);
+    *out_size = strm.total_out;
+    deflateEnd(&strm);
+    if (result != Z_STREAM_END)
+    {
+        if (!in_arena)
+            free(*out);
+        return false;
+    }
+
+    add_stats(size, *out_size, get_thread_cpu_ns() - start);
+    return true;
+}
+
+bool compress_data(const char *data, size_t size, int encoding, char **out,
+                   size_t *out_size)
+{
+    return run_compress(data, size, encoding, false, out, out_size);
+}
+
+bool compress_temp(const char *data, size_t size, int encoding, char **out,
+                   size_t *out_size)
+{
+    return run_compress(data, size, encoding, true, out, out_size);
+}
+
+DeflateStream *deflate_stream_new(int encoding)
+{
+    DeflateStream *stream = arena_alloc(sizeof(DeflateStream));
+    if (stream == NULL || !init_deflate(&stream->strm, encoding))
+        return NULL;
+    stream->cpu_ns = 0;
+    stream->strm.next_out = (Bytef *) stream->out;
+    stream->strm.avail_out = sizeof(stream->out);
+    return stream;
+}
+
+/**
+ * @brief Run the data through the stream, writing out every full buffer
+ * @param stream The stream to compress with
+ * @param data The data to compress
+ * @param len The length of the data
+ * @param flush Z_NO_FLUSH, or Z_FINISH to end the stream
+ * @param write Where to write the compressed data
+ * @param ctx Passed to write
+ * @return True if everything written was accepted
+ */
+static bool run_deflate(DeflateStream *stream, const char *data, size_t len,
+                        int flush, BodyWriter write, void *ctx)
+{
+    uint64_t start = get_thread_cpu_ns();
+    z_stream *strm = &stream->strm;
+    strm->next_in = (Bytef *) data;
+    strm->avail_in = len;
+
+    int result = Z_OK;
+    while (strm->avail_in > 0
+           || (flush == Z_FINISH && result != Z_STREAM_END))
+    {
+        result = deflate(strm, flush);
+        if (result == Z_STREAM_ERROR)
+            return false;
+
+        // Only send full buffers, apart from the last one
+        size_t out_len = sizeof(stream->out) - strm->avail_out;
+        if (strm->avail_out == 0 || (result == Z_STREAM_END && out_len > 0))
+        {
+            stream->cpu_ns += get_thread_cpu_ns() - start;
+            if (!write(ctx, stream->out, out_len))
+                return false;
+            start = get_thread_cpu_ns();
+            strm->next_out = (Bytef *) stream->out;
+            strm->avail_out = sizeof(stream->out);
+        }
+    }
+    stream->cpu_ns += get_thread_cpu_ns() - start;
+    return true;
+}
+
+bool deflate_stream_write(DeflateStream *stream, const char *data, size_t len,
+                          BodyWriter write, void *ctx)
+{
+    return run_deflate(stream, data, len, Z_NO_FLUSH, write, ctx);
+}
+
+bool deflate_stream_finish(DeflateStream *stream, BodyWriter write, void *ctx)
+{
+    if (!run_deflate(stream, NULL, 0, Z_FINISH, write, ctx))
+        return false;
+    add_stats(stream->strm.total_in, stream->strm.total_out, stream->cpu_ns);
+    return true;
+}
+
+void deflate_stream_free(DeflateStream *stream)
+{
+    if (stream != NULL)
+        deflateEnd(&stream->strm);
+}
+
+CachedFile *compress_file(const char *path, const struct stat *stats,
+                          int encoding, const char *type)
+{
+    // The key changes with the file, so an old copy is never found
+    char key[PATH_MAX + 64];
+    snprintf(key, sizeof(key), "%s:%lld:%s", path,
+             (long long) stats->st_mtime, get_encoding_name(encoding));
+    CachedFile *file = file_cache_get(key, stats);
+    if (file != NULL)
+        return file;
+
+    // Compress the file's cached contents if they are there, rather than
+    // reading it again
+    const char *data = NULL;
+    char *buff = NULL;
+    CachedFile *original = file_cache_get(path, stats);
+    if (original != NULL)
+        data = original->data;
+    else
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+            return NULL;
+        buff = read_file_data(fd, stats->st_size);
+        close(fd);
+        if (buff == NULL)
+            return NULL;
+        data = buff;
+    }
+
+    char *out = NULL;
+    size_t out_size = 0;
+    bool compressed = compress_data(data, stats->st_size, encoding, &out,
+                                    &out_size);
+    file_cache_release(original);
+    free(buff);
+    if (!compressed)
+        return NULL;
+    return file_cache_insert(key, out, out_size, stats, type);
+}
+
+void get_compress_stats(CompressStats *stats)
+{
+    stats->count = atomic_load(&total_count);
+    stats->bytes_in = atomic_load(&total_in);
+    stats->bytes_out = atomic_load(&total_out);
+    stats->cpu_ns = atomic_load(&total_cpu_ns);
+}
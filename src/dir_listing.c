@@ -0,0 +1,1301 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "dir_listing.h"
+#include "lru_table.h"
+#include "utils.h"
+
+#define INIT_DIR_ENTRIES 64
+#define INIT_NAMES_SIZE 4096 // Bytes of entry names before the arena grows
+#define INIT_PAGE_SIZE 8192  // Bytes of the page before it grows
+#define ROW_SIZE 160         // Rough size of an entry, not counting its name
+#define TIME_SIZE 32         // 16-Oct-2026 18:06
+#define LISTING_CHUNK 16384  // Bytes of the page written out at a time
+#define LISTING_KEY_SIZE ((PATH_MAX * 2) + 64) // See prepare_listing()
+
+/**
+ * @struct DirEntry
+ * @brief An entry in a directory, while the directory is being read
+ */
+typedef struct
+{
+    const char *name; //!< Name of the entry, once the arena stops growing
+    size_t offset;    //!< Offset of the name in the names arena
+    size_t name_len;  //!< Length of the name
+    off_t size;       //!< Size of the entry (in bytes)
+    time_t mtime;     //!< Time the entry was last modified
+    bool is_dir;      //!< The entry is a directory
+} DirEntry;
+
+/**
+ * @struct IndexEntry
+ * @brief What a listing shows about one entry in a directory
+ */
+typedef struct
+{
+    int64_t size;      //!< Size of the entry (in bytes)
+    int64_t mtime;     //!< Time the entry was last modified
+    uint32_t name;     //!< Offset of the name in the index's names
+    uint16_t name_len; //!< Length of the name
+    bool is_dir;       //!< The entry is a directory
+} IndexEntry;
+
+/**
+ * @struct DirIndex
+ * @brief The sorted contents of a directory
+ *
+ * Kept in the index cache as one block, so any page of a listing can be
+ * rendered without reading or sorting the directory again. The names of the
+ * entries follow the entries, each NUL terminated
+ */
+typedef struct
+{
+    size_t count;         //!< Number of entries, not counting "." and ".."
+    size_t names_len;     //!< Total length of the names
+    int64_t parent_mtime; //!< Time the parent directory was last modified
+    IndexEntry entries[]; //!< The entries, in the order they are listed
+} DirIndex;
+
+/**
+ * @struct ListingKey
+ * @brief Where something made from a directory is cached, and how to tell if
+ * the directory changed while it was being made
+ */
+typedef struct
+{
+    char key[LISTING_KEY_SIZE]; //!< The cache key
+    int wd;                     //!< The inotify watch descriptor
+    uint32_t generation;        //!< The directory's generation before reading
+    bool watched;               //!< The directory is being watched
+} ListingKey;
+
+/**
+ * @struct CachedIndex
+ * @brief A directory's index, held in memory by the index cache
+ */
+typedef struct
+{
+    LruEntry entry;    //!< Its place in the cache, keyed by resolved path
+    DirIndex *index;   //!< The sorted contents of the directory
+    size_t size;       //!< Size of the index
+    struct stat stats; //!< Stats of the directory when it was read
+    uint32_t refs;     //!< Number of users, including the cache
+} CachedIndex;
+
+/**
+ * @struct ListingTee
+ * @brief A listing being written out and copied for the cache at once
+ */
+typedef struct
+{
+    BodyWriter write; //!< Where the listing is going
+    void *ctx;        //!< Passed to write
+    StrBuilder copy;  //!< The listing so far, while it fits in the cache
+    bool keeping;     //!< The copy is still being made
+} ListingTee;
+
+/**
+ * @brief Comparison function, for qsort, to sort entries in a directory
+ *
+ * Sorts directories followed by everything else, both in alphabetical order
+ * ignoring case
+ * @param a First entry to compare
+ * @param b Second entry to compare
+ * @return -1: (a < b), 0: (a == b), 1: (a > b)
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    const DirEntry *e1 = a;
+    const DirEntry *e2 = b;
+    if (e1->is_dir != e2->is_dir)
+        return e1->is_dir ? -1 : 1;
+
+    int result = strcasecmp(e1->name, e2->name);
+    return (result != 0) ? result : strcmp(e1->name, e2->name);
+}
+
+/**
+ * @brief Get the contents of the directory, sorted for a listing
+ *
+ * The names are copied back to back into one arena rather than allocated one
+ * by one, and each entry is stat'ed relative to the open directory
+ * @param full_path The resolved path to the directory
+ * @param names The arena to store the names in
+ * @param count Where to store the number of entries found
+ * @param parent_mtime Where to store the time ".." was last modified
+ * @return The entries, without "." and "..", or NULL if the directory could
+ * not be read
+ * @attention If the function does not return NULL, the returned entries must
+ * be freed when done, and only point into names until it is freed
+ */
+static DirEntry *read_dir_entries(const char *full_path, StrBuilder *names,
+                                  size_t *count, int64_t *parent_mtime)
+{
+    DIR *d = opendir(full_path);
+    if (d == NULL)
+        return NULL;
+
+    int fd = dirfd(d);
+    size_t max = INIT_DIR_ENTRIES;
+    size_t items = 0;
+    DirEntry *entries = malloc(max * sizeof(DirEntry));
+    struct dirent *dir;
+    while (entries != NULL && (dir = readdir(d)) != NULL)
+    {
+        struct stat stats = { 0 };
+        if (strcmp(dir->d_name, ".") == 0)
+            continue;
+        if (strcmp(dir->d_name, "..") == 0)
+        {
+            fstatat(fd, dir->d_name, &stats, 0);
+            *parent_mtime = stats.st_mtime;
+            continue;
+        }
+
+        // Make sure our list has enough space
+        if (items == max)
+        {
+            DirEntry *tmp = realloc(entries, max * 2 * sizeof(DirEntry));
+            if (tmp == NULL)
+            {
+                free(entries);
+                entries = NULL;
+                break;
+            }
+            entries = tmp;
+            max *= 2;
+        }
+
+        fstatat(fd, dir->d_name, &stats, 0);
+
+        // The arena may move as it grows, so only the offset is kept for now
+        DirEntry *entry = &entries[items++];
+        entry->name_len = strlen(dir->d_name);
+        entry->offset = names->len;
+        entry->size = stats.st_size;
+        entry->mtime = stats.st_mtime;
+        entry->is_dir = (dir->d_type == DT_UNKNOWN) ? S_ISDIR(stats.st_mode)
+                                                     : dir->d_type == DT_DIR;
+        str_builder_append(names, dir->d_name, entry->name_len + 1);
+    }
+    closedir(d);
+
+    if (entries == NULL || names->failed)
+    {
+        free(entries);
+        return NULL;
+    }
+    for (size_t x = 0; x < items; x++)
+        entries[x].name = names->data + entries[x].offset;
+
+    // Sort the contents to ensure directories are first
+    // and everything is alphabetized
+    qsort(entries, items, sizeof(DirEntry), compare_entries);
+    *count = items;
+    return entries;
+}
+
+/**
+ * @brief Read and sort the directory into a DirIndex
+ *
+ * A directory that cannot be read gets an index with no entries
+ * @param full_path The resolved path to the directory
+ * @param size Where to store the size of the index
+ * @return The index, or NULL if out of memory
+ * @attention If the function does not return NULL, the returned index must be
+ * freed when done
+ */
+static DirIndex *build_dir_index(const char *full_path, size_t *size)
+{
+    StrBuilder names;
+    if (!str_builder_init(&names, INIT_NAMES_SIZE))
+        return NULL;
+    size_t items = 0;
+    int64_t parent_mtime = 0;
+    DirEntry *entries = read_dir_entries(full_path, &names, &items,
+                                         &parent_mtime);
+    if (entries == NULL)
+        names.len = 0;
+
+    *size = sizeof(DirIndex) + (items * sizeof(IndexEntry)) + names.len;
+    DirIndex *index = malloc(*size);
+    if (index == NULL)
+    {
+        free(entries);
+        str_builder_free(&names);
+        return NULL;
+    }
+    index->count = items;
+    index->names_len = names.len;
+    index->parent_mtime = parent_mtime;
+
+    // The names are stored in the order they are listed, after the entries
+    char *index_names = (char *) &index->entries[items];
+    uint32_t pos = 0;
+    for (size_t x = 0; x < items; x++)
+    {
+        IndexEntry *entry = &index->entries[x];
+        entry->size = entries[x].size;
+        entry->mtime = entries[x].mtime;
+        entry->name = pos;
+        entry->name_len = entries[x].name_len;
+        entry->is_dir = entries[x].is_dir;
+        memcpy(index_names + pos, entries[x].name, entry->name_len + 1);
+        pos += entry->name_len + 1;
+    }
+    free(entries);
+    str_builder_free(&names);
+    return index;
+}
+
+/**
+ * @brief Get the name of an entry in the index
+ * @param index The index holding the entry
+ * @param entry The entry
+ * @return The name of the entry
+ */
+static const char *entry_name(const DirIndex *index, const IndexEntry *entry)
+{
+    return (const char *) &index->entries[index->count] + entry->name;
+}
+
+/**
+ * @brief Write out the page so far, if it has grown large enough
+ * @param page The part of the page not yet written
+ * @param write Where to write the page, or NULL to keep all of it
+ * @param ctx Passed to write
+ * @param force Write out what there is, however little
+ * @return True unless the page could not be written
+ */
+static bool flush_page(StrBuilder *page, BodyWriter write, void *ctx,
+                       bool force)
+{
+    if (write == NULL || page->failed
+        || (page->len < LISTING_CHUNK && !force))
+        return !page->failed;
+
+    bool written = page->len == 0 || write(ctx, page->data, page->len);
+    page->len = 0;
+    page->data[0] = '\0';
+    return written;
+}
+
+/**
+ * @brief Add a row for one entry to an HTML listing
+ * @param page The page to add to
+ * @param path The local path to the directory, followed by slash
+ * @param slash "/" if path does not end in one, otherwise ""
+ * @param name The name of the entry
+ * @param is_dir If the entry is a directory
+ * @param size The size of the entry
+ * @param time_str The time the entry was last modified, formatted
+ */
+static void add_html_row(StrBuilder *page, const char *path,
+                         const char *slash, const char *name, bool is_dir,
+                         int64_t size, const char *time_str)
+{
+    static const char no_size[] = "-</td>\n</tr>\n";
+    const char *dir_slash = is_dir ? "/" : "";
+    str_builder_appendf(page,
+                        "<tr>\n"
+                        "<td><a href=\"/%s%s%s%s\">%s%s</a></td>\n"
+                        "<td>%s</td>\n"
+                        "<td style=\"text-align: right\">",
+                        path, slash, name, dir_slash, name, dir_slash,
+                        time_str);
+
+    // Get the size of the file, if applicable
+    if (size && !is_dir)
+        str_builder_appendf(page, "%lld</td>\n</tr>\n", (long long) size);
+    else
+        str_builder_append(page, no_size, sizeof(no_size) - 1);
+}
+
+/**
+ * @brief Format the time as a listing shows it
+ * @param t The time to format
+ * @param time_str Where to store the time, which must hold TIME_SIZE
+ */
+static void format_entry_time(int64_t t, char *time_str)
+{
+    struct tm tm;
+    time_t tt = t;
+    gmtime_r(&tt, &tm);
+    strftime(time_str, TIME_SIZE, "%d-%b-%Y %R", &tm);
+}
+
+/**
+ * @brief Add a link to another page of the listing
+ * @param page The page to add to
+ * @param text The text of the link
+ * @param offset The offset of the page being linked to
+ * @param limit The number of entries on each page, SIZE_MAX for no limit
+ */
+static void add_page_link(StrBuilder *page, const char *text, size_t offset,
+                          size_t limit)
+{
+    if (limit == SIZE_MAX)
+        str_builder_appendf(page, "<a href=\"?offset=%zu\">%s</a>\n", offset,
+                            text);
+    else
+        str_builder_appendf(page,
+                            "<a href=\"?offset=%zu&amp;limit=%zu\">%s</a>\n",
+                            offset, limit, text);
+}
+
+/**
+ * @brief Render a page of the listing as HTML
+ * @param path The local path to the directory
+ * @param index The contents of the directory
+ * @param query The part of the listing to render
+ * @param page The builder to render into
+ * @param write Where to write the page as it is rendered, or NULL
+ * @param ctx Passed to write
+ * @return True unless the writer failed
+ */
+static bool write_html(const char *path, const DirIndex *index,
+                       const ListingQuery *query, StrBuilder *page,
+                       BodyWriter write, void *ctx)
+{
+    size_t path_len = strlen(path);
+    const char *slash = (path_len > 0 && path[path_len - 1] != '/') ? "/"
+                                                                    : "";
+    size_t start = (query->offset < index->count) ? query->offset
+                                                  : index->count;
+    size_t rows = index->count - start;
+    if (query->limit < rows)
+        rows = query->limit;
+
+    // Header for the HTML page
+    str_builder_appendf(page,
+                        "<!DOCTYPE html>\n<head>"
+                        "<style>\ntd{\npadding-right: 30px;\ntext-align: "
+                        "left;\n}\n</style>\n</head>\n"
+                        "<h1>Index of %s%s</h1>\n"
+                        "<table>\n",
+                        path, slash);
+
+    // The parent directory leads every page
+    char time_str[TIME_SIZE] = { 0 };
+    format_entry_time(index->parent_mtime, time_str);
+    add_html_row(page, path, slash, "..", true, 0, time_str);
+
+    // Create the HTML to display each entry in the given directory. Entries
+    // modified in the same minute share the formatted time
+    int64_t time_minute = INT64_MIN;
+    bool written = true;
+    for (size_t x = start; x < start + rows && written; x++)
+    {
+        const IndexEntry *entry = &index->entries[x];
+        if (entry->mtime / 60 != time_minute)
+        {
+            time_minute = entry->mtime / 60;
+            format_entry_time(entry->mtime, time_str);
+        }
+        add_html_row(page, path, slash, entry_name(index, entry),
+                     entry->is_dir, entry->size, time_str);
+        written = flush_page(page, write, ctx, false);
+    }
+    str_builder_append(page, "</table>\n", 9);
+
+    // Links to the pages either side of this one
+    if (start > 0 || start + rows < index->count)
+    {
+        if (rows > 0)
+            str_builder_appendf(page, "<p>Entries %zu to %zu of %zu</p>\n",
+                                start + 1, start + rows, index->count);
+        else
+            str_builder_appendf(page, "<p>No entries past %zu</p>\n",
+                                index->count);
+        str_builder_append(page, "<p>\n", 4);
+        if (start > 0)
+            add_page_link(page, "Previous",
+                          (start > query->limit) ? start - query->limit : 0,
+                          query->limit);
+        if (start + rows < index->count)
+            add_page_link(page, "Next", start + rows, query->limit);
+        str_builder_append(page, "</p>\n", 5);
+    }
+
+    // Add the HTML footer
+    str_builder_append(page, "</html>", 7);
+    return written;
+}
+
+/**
+ * @brief Add a string to a JSON document, quoted and escaped
+ * @param page The document to add to
+ * @param str The string to add
+ */
+static void add_json_string(StrBuilder *page, const char *str)
+{
+    str_builder_append(page, "\"", 1);
+    const char *run = str;
+    for (; *str != '\0'; str++)
+    {
+        unsigned char c = *str;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        // Add everything up to the character, then the character escaped
+        str_builder_append(page, run, str - run);
+        if (c == '"' || c == '\\')
+            str_builder_appendf(page, "\\%c", c);
+        else
+            str_builder_appendf(page, "\\u%04x", c);
+        run = str + 1;
+    }
+    str_builder_append(page, run, str - run);
+    str_builder_append(page, "\"", 1);
+}
+
+/**
+ * @brief Render a page of the listing as JSON
+ *
+ * {"path": "/dir/", "total": 2, "offset": 0, "entries": [
+ * {"name": "sub", "type": "directory", "mtime": 1792173640},
+ * {"name": "a.txt", "type": "file", "size": 6, "mtime": 1792173640}]}
+ * @param path The local path to the directory
+ * @param index The contents of the directory
+ * @param query The part of the listing to render
+ * @param page The builder to render into
+ * @param write Where to write the page as it is rendered, or NULL
+ * @param ctx Passed to write
+ * @return True unless the writer failed
+ */
+static bool write_json(const char *path, const DirIndex *index,
+                       const ListingQuery *query, StrBuilder *page,
+                       BodyWriter write, void *ctx)
+{
+    static const char sep[] = ",\n{\"name\": ";
+    size_t path_len = strlen(path);
+    const char *slash = (path_len > 0 && path[path_len - 1] != '/') ? "/"
+                                                                    : "";
+    size_t start = (query->offset < index->count) ? query->offset
+                                                  : index->count;
+    size_t rows = index->count - start;
+    if (query->limit < rows)
+        rows = query->limit;
+
+    char dir_path[PATH_MAX + 3];
+    snprintf(dir_path, sizeof(dir_path), "/%s%s", path, slash);
+    str_builder_append(page, "{\"path\": ", 9);
+    add_json_string(page, dir_path);
+    str_builder_appendf(page,
+                        ", \"total\": %zu, \"offset\": %zu, \"entries\": [",
+                        index->count, start);
+
+    bool written = true;
+    for (size_t x = start; x < start + rows && written; x++)
+    {
+        const IndexEntry *entry = &index->entries[x];
+        // Only the entries after the first are preceded by a comma
+        const char *next = (x > start) ? sep : sep + 1;
+        str_builder_append(page, next, strlen(next));
+        add_json_string(page, entry_name(index, entry));
+        if (entry->is_dir)
+            str_builder_append(page, ", \"type\": \"directory\"", 21);
+        else
+            str_builder_appendf(page, ", \"type\": \"file\", \"size\": %lld",
+                                (long long) entry->size);
+        str_builder_appendf(page, ", \"mtime\": %lld}",
+                            (long long) entry->mtime);
+        written = flush_page(page, write, ctx, false);
+    }
+    str_builder_append(page, "]}\n", 3);
+    return written;
+}
+
+/**
+ * @brief Render a page of the listing
+ *
+ * Without a writer the whole page is built in memory. With one, the page is
+ * handed over every LISTING_CHUNK bytes, so only that much is held at once
+ * @param path The local path to the directory
+ * @param index The contents of the directory
+ * @param query The part of the listing to render, and how
+ * @param page The builder to render into, which this starts
+ * @param write Where to write the page as it is rendered, or NULL
+ * @param ctx Passed to write
+ * @return True on success, false if out of memory or the writer failed
+ * @attention The page must be freed with str_builder_free(), or taken with
+ * str_builder_take(), when done, whether this succeeds or not
+ */
+static bool write_listing(const char *path, const DirIndex *index,
+                          const ListingQuery *query, StrBuilder *page,
+                          BodyWriter write, void *ctx)
+{
+    // Room for every entry up front, so the page is usually never copied
+    size_t rows = (query->limit < index->count) ? query->limit : index->count;
+    size_t page_size = INIT_PAGE_SIZE + (rows * ROW_SIZE);
+    if (index->count > 0)
+        page_size += (index->names_len / index->count) * rows * 2;
+    if (write != NULL)
+        page_size = LISTING_CHUNK * 2;
+    if (!str_builder_init(page, page_size))
+        return false;
+
+    bool written = query->json
+                       ? write_json(path, index, query, page, write, ctx)
+                       : write_html(path, index, query, page, write, ctx);
+    return written && flush_page(page, write, ctx, true);
+}
+
+/// Indexes are kept apart from the file cache, as the index of a large
+/// directory is larger than any file it keeps. One lock is enough, as an
+/// index is only needed when the page asked for is not cached
+static LruShard indexes = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static size_t index_budget = 0;
+static bool check_index_stats = false;
+
+/**
+ * @brief Drop one reference to the index, freeing it if it was the last
+ * @param cached The index to drop a reference to
+ * @note The lock of indexes must be held
+ */
+static void drop_index_ref(CachedIndex *cached)
+{
+    if (--cached->refs > 0)
+        return;
+    free(cached->index);
+    free(cached->entry.key);
+    free(cached);
+}
+
+/**
+ * @brief Take the index out of the cache
+ *
+ * The index is only freed once the last thread using it releases it
+ * @param cached The index to remove
+ * @note The lock of indexes must be held
+ */
+static void remove_index(CachedIndex *cached)
+{
+    lru_remove(&indexes, &cached->entry);
+    indexes.used -= cached->size;
+    drop_index_ref(cached);
+}
+
+/**
+ * @brief Drop the cached index of the directory, if there is one
+ * @param full_path The resolved path to the directory
+ */
+static void drop_index(const char *full_path)
+{
+    uint32_t hash = lru_hash(full_path);
+    pthread_mutex_lock(&indexes.lock);
+    LruEntry *entry = lru_find(&indexes, full_path, hash);
+    if (entry != NULL)
+        remove_index((CachedIndex *) entry);
+    pthread_mutex_unlock(&indexes.lock);
+}
+
+#ifdef __linux__
+/// Changes that alter what a listing shows
+#define WATCH_MASK                                                             \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY           \
+     | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * @struct DirWatch
+ * @brief A listed directory being watched for changes
+ */
+typedef struct
+{
+    int wd;                     //!< The inotify watch descriptor
+    uint32_t generation;        //!< Number of times the directory has changed
+    uint32_t hash;              //!< Hash of the path
+    char *path;                 //!< Resolved path to the directory
+    char *keys[MAX_WATCH_KEYS]; //!< The cache keys of the directory's pages
+    size_t num_keys;            //!< Number of keys in keys
+    size_t next_key;            //!< The key replaced next, once keys is full
+} DirWatch;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t watch_thread;
+static DirWatch watches[MAX_DIR_WATCHES];
+static size_t num_watches = 0;
+static int inotify_fd = -1;
+
+/**
+ * @brief Find the watch with the given watch descriptor
+ * @param wd The watch descriptor
+ * @return The watch, or NULL if there is none
+ * @note watch_lock must be held
+ */
+static DirWatch *find_watch(int wd)
+{
+    for (size_t x = 0; x < num_watches; x++)
+    {
+        if (watches[x].wd == wd)
+            return &watches[x];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drop every cached listing of the directory
+ * @param watch The directory that changed
+ * @note watch_lock must be held
+ */
+static void drop_listings(DirWatch *watch)
+{
+    watch->generation++;
+    drop_index(watch->path);
+    for (size_t x = 0; x < watch->num_keys; x++)
+    {
+        file_cache_remove(watch->keys[x]);
+        free(watch->keys[x]);
+    }
+    watch->num_keys = 0;
+    watch->next_key = 0;
+}
+
+/**
+ * @brief Stop tracking the watch, once the kernel has removed it
+ * @param watch The watch to forget
+ * @note watch_lock must be held
+ */
+static void forget_watch(DirWatch *watch)
+{
+    drop_listings(watch);
+    free(watch->path);
+    *watch = watches[--num_watches];
+}
+
+/**
+ * @brief Watch the directory for changes
+ * @param full_path The resolved path to the directory
+ * @param wd Where to store the watch descriptor
+ * @param generation Where to store the directory's current generation
+ * @return True if the directory is being watched
+ */
+static bool watch_dir(const char *full_path, int *wd, uint32_t *generation)
+{
+    if (inotify_fd == -1)
+        return false;
+
+    uint32_t hash = lru_hash(full_path);
+    pthread_mutex_lock(&watch_lock);
+    DirWatch *watch = NULL;
+    for (size_t x = 0; x < num_watches && watch == NULL; x++)
+    {
+        if (watches[x].hash == hash && strcmp(watches[x].path, full_path) == 0)
+            watch = &watches[x];
+    }
+
+    if (watch == NULL && num_watches < MAX_DIR_WATCHES)
+    {
+        int new_wd = inotify_add_watch(inotify_fd, full_path,
+                                       WATCH_MASK | IN_ONLYDIR);
+        watch = (new_wd != -1) ? find_watch(new_wd) : NULL;
+        if (new_wd != -1 && watch == NULL)
+        {
+            watch = &watches[num_watches];
+            memset(watch, 0, sizeof(DirWatch));
+            watch->wd = new_wd;
+            watch->hash = hash;
+            watch->path = strdup(full_path);
+            if (watch->path != NULL)
+                num_watches++;
+            else
+                watch = NULL;
+        }
+    }
+
+    if (watch != NULL)
+    {
+        *wd = watch->wd;
+        *generation = watch->generation;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return watch != NULL;
+}
+
+/**
+ * @brief Remember the key of a cached page of the directory's listing, so it
+ * is dropped when the directory changes
+ *
+ * Only the last MAX_WATCH_KEYS pages of a directory stay cached, dropping
+ * the oldest to make room, so paging through a large directory does not grow
+ * the list. A dropped page is rendered again from the cached index
+ * @param wd The watch descriptor of the directory
+ * @param generation The generation from watch_dir()
+ * @param key The cache key of the page
+ * @return False if the directory changed, or the key could not be remembered
+ */
+static bool watch_page(int wd, uint32_t generation, const char *key)
+{
+    pthread_mutex_lock(&watch_lock);
+    DirWatch *watch = find_watch(wd);
+    bool kept = watch != NULL && watch->generation == generation;
+
+    // The page may have been evicted and cached again since it was remembered
+    bool known = false;
+    for (size_t x = 0; kept && x < watch->num_keys && !known; x++)
+        known = strcmp(watch->keys[x], key) == 0;
+
+    char *copy = (kept && !known) ? strdup(key) : NULL;
+    if (copy == NULL)
+        kept = kept && known;
+    else if (watch->num_keys < MAX_WATCH_KEYS)
+        watch->keys[watch->num_keys++] = copy;
+    else
+    {
+        char **oldest = &watch->keys[watch->next_key];
+        file_cache_remove(*oldest);
+        free(*oldest);
+        *oldest = copy;
+        watch->next_key = (watch->next_key + 1) % MAX_WATCH_KEYS;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return kept;
+}
+
+/**
+ * @brief Check if the directory has changed since the generation was read
+ * @param wd The watch descriptor of the directory
+ * @param generation The generation from watch_dir()
+ * @return True if it has changed, or is no longer watched
+ */
+static bool dir_changed(int wd, uint32_t generation)
+{
+    pthread_mutex_lock(&watch_lock);
+    DirWatch *watch = find_watch(wd);
+    bool changed = watch == NULL || watch->generation != generation;
+    pthread_mutex_unlock(&watch_lock);
+    return changed;
+}
+
+/**
+ * @brief Read inotify events, dropping the listings of directories that change
+ * @param arg Unused
+ * @return NULL
+ */
+static void *watch_events(void *arg)
+{
+    (void) arg;
+    union
+    {
+        struct inotify_event event; // Keeps the buffer aligned for events
+        char buff[4096];
+    } events;
+
+    while (true)
+    {
+        ssize_t len = read(inotify_fd, events.buff, sizeof(events.buff));
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        pthread_mutex_lock(&watch_lock);
+        for (char *pos = events.buff; pos < events.buff + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *) pos;
+            DirWatch *watch = find_watch(event->wd);
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost, so any listing may be out of date
+                for (size_t x = 0; x < num_watches; x++)
+                    drop_listings(&watches[x]);
+            }
+            else if (watch != NULL && (event->mask & IN_IGNORED))
+                forget_watch(watch);
+            else if (watch != NULL)
+                drop_listings(watch);
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+        pthread_mutex_unlock(&watch_lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the thread reading inotify events
+ * @return 0 on success, 1 if something went wrong
+ */
+static int start_watching(void)
+{
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1)
+    {
+        perror("inotify_init1");
+        return 1;
+    }
+    if (pthread_create(&watch_thread, NULL, watch_events, NULL) != 0)
+    {
+        perror("pthread_create");
+        close(inotify_fd);
+        inotify_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stop the thread reading inotify events, and forget every watch
+ */
+static void stop_watching(void)
+{
+    if (inotify_fd == -1)
+        return;
+
+    // The thread spends its time blocked in read(), where it can be cancelled
+    pthread_cancel(watch_thread);
+    pthread_join(watch_thread, NULL);
+    close(inotify_fd);
+    inotify_fd = -1;
+
+    while (num_watches > 0)
+        forget_watch(&watches[num_watches - 1]);
+}
+#else
+/**
+ * @brief Without inotify no directory is watched
+ * @param full_path Unused
+ * @param wd Unused
+ * @param generation Unused
+ * @return False
+ */
+static bool watch_dir(const char *full_path, int *wd, uint32_t *generation)
+{
+    (void) full_path;
+    (void) wd;
+    (void) generation;
+    return false;
+}
+
+/**
+ * @brief Without inotify no directory is watched
+ * @param wd Unused
+ * @param generation Unused
+ * @param key Unused
+ * @return False
+ */
+static bool watch_page(int wd, uint32_t generation, const char *key)
+{
+    (void) wd;
+    (void) generation;
+    (void) key;
+    return false;
+}
+
+/**
+ * @brief Without inotify no directory is watched
+ * @param wd Unused
+ * @param generation Unused
+ * @return False
+ */
+static bool dir_changed(int wd, uint32_t generation)
+{
+    (void) wd;
+    (void) generation;
+    return false;
+}
+
+/**
+ * @brief Without inotify there is nothing to start
+ * @return 0
+ */
+static int start_watching(void)
+{
+    return 0;
+}
+
+/**
+ * @brief Without inotify there is nothing to stop
+ */
+static void stop_watching(void)
+{
+}
+#endif /* __linux__ */
+
+int dir_listing_init(size_t index_size, bool revalidate)
+{
+    index_budget = index_size;
+    check_index_stats = revalidate;
+    return start_watching();
+}
+
+void dir_listing_free(void)
+{
+    stop_watching();
+    pthread_mutex_lock(&indexes.lock);
+    while (indexes.lru_tail != NULL)
+        remove_index((CachedIndex *) indexes.lru_tail);
+    index_budget = 0;
+    pthread_mutex_unlock(&indexes.lock);
+}
+
+/**
+ * @brief Start watching the directory, before reading it, so a change while
+ * it is read is noticed
+ * @param lk The key, with its key already filled in
+ * @param full_path The resolved path to the directory
+ */
+static void watch_key(ListingKey *lk, const char *full_path)
+{
+    lk->wd = -1;
+    lk->generation = 0;
+    lk->watched = watch_dir(full_path, &lk->wd, &lk->generation);
+}
+
+/**
+ * @brief Work out the cache key of a page of a listing
+ *
+ * The directory is only watched once the page has to be rendered, so a
+ * cached page is found without taking the watch lock
+ * @param lk Where to store the key
+ * @param path The local path to the directory
+ * @param full_path The resolved path to the directory
+ * @param query The part of the listing, and how it is rendered
+ */
+static void prepare_listing(ListingKey *lk, const char *path,
+                            const char *full_path, const ListingQuery *query)
+{
+    // The page shows the path it was requested by, so that is part of the key
+    // as well. No resolved file path ends in "/\n"
+    snprintf(lk->key, sizeof(lk->key), "%s/\n%s %zu %zu %s", full_path,
+             query->json ? "json" : "html", query->offset, query->limit, path);
+}
+
+/**
+ * @brief Put a freshly rendered page of a listing into the file cache
+ * @param lk The key from before the directory was read
+ * @param data The page, which the cache takes ownership of
+ * @param size The size of the page
+ * @param stats The stats of the directory
+ * @param type The content type of the page
+ * @return The cached page, or NULL if out of memory
+ * @attention If the function does not return NULL, the returned file must be
+ * released with file_cache_release() when done
+ */
+static CachedFile *keep_listing(const ListingKey *lk, char *data, size_t size,
+                                const struct stat *stats, const char *type)
+{
+    CachedFile *listing = file_cache_insert(lk->key, data, size, stats, type);
+
+    // The directory changed while it was being read, so this may already be
+    // out of date. It is fine to use, but not to keep
+    if (listing != NULL && lk->watched && file_cache_fits(size)
+        && !watch_page(lk->wd, lk->generation, lk->key))
+        file_cache_remove(lk->key);
+    return listing;
+}
+
+/**
+ * @brief Look up the directory's index in the index cache
+ * @param full_path The resolved path to the directory
+ * @param stats The current stats of the directory, compared against the
+ * cached index's when revalidating
+ * @return The index, or NULL if it is not cached or the directory changed
+ * @attention If the function does not return NULL, the returned index must be
+ * released with release_index() when done
+ */
+static CachedIndex *find_index(const char *full_path,
+                               const struct stat *stats)
+{
+    uint32_t hash = lru_hash(full_path);
+    pthread_mutex_lock(&indexes.lock);
+    CachedIndex *cached = (CachedIndex *) lru_find(&indexes, full_path, hash);
+    if (cached != NULL && check_index_stats
+        && !same_file_stats(&cached->stats, stats))
+    {
+        remove_index(cached);
+        cached = NULL;
+    }
+    if (cached != NULL)
+    {
+        cached->refs++;
+        lru_touch(&indexes, &cached->entry);
+    }
+    pthread_mutex_unlock(&indexes.lock);
+    return cached;
+}
+
+/**
+ * @brief Put a freshly read index into the index cache
+ * @param lk The key from before the directory was read
+ * @param index The index, which the cache takes ownership of
+ * @param size The size of the index
+ * @param stats The stats of the directory
+ * @return The cached index, or NULL if out of memory
+ * @attention If the function does not return NULL, the returned index must be
+ * released with release_index() when done
+ */
+static CachedIndex *keep_index(const ListingKey *lk, DirIndex *index,
+                               size_t size, const struct stat *stats)
+{
+    CachedIndex *cached = calloc(1, sizeof(CachedIndex));
+    char *key = strdup(lk->key);
+    if (cached == NULL || key == NULL)
+    {
+        free(index);
+        free(cached);
+        free(key);
+        return NULL;
+    }
+    cached->entry.key = key;
+    cached->entry.hash = lru_hash(key);
+    cached->index = index;
+    cached->size = size;
+    cached->stats = *stats;
+
+    // Too large to keep, so it only lives until the caller releases it
+    if (size > index_budget)
+    {
+        cached->refs = 1;
+        return cached;
+    }
+    cached->refs = 2; // One for the cache, one for the caller
+
+    pthread_mutex_lock(&indexes.lock);
+    LruEntry *old = lru_find(&indexes, key, cached->entry.hash);
+    if (old != NULL)
+        remove_index((CachedIndex *) old);
+    while (indexes.lru_tail != NULL && indexes.used + size > index_budget)
+        remove_index((CachedIndex *) indexes.lru_tail);
+    lru_insert(&indexes, &cached->entry);
+    indexes.used += size;
+    pthread_mutex_unlock(&indexes.lock);
+
+    // The directory changed while it was being read, so this may already be
+    // out of date. It is fine to use, but not to keep
+    if (lk->watched && dir_changed(lk->wd, lk->generation))
+        drop_index(key);
+    return cached;
+}
+
+/**
+ * @brief Release an index from find_index() or keep_index()
+ * @param cached The index to release
+ */
+static void release_index(CachedIndex *cached)
+{
+    pthread_mutex_lock(&indexes.lock);
+    drop_index_ref(cached);
+    pthread_mutex_unlock(&indexes.lock);
+}
+
+/**
+ * @brief Get the sorted contents of the directory, reading it only if they
+ * are not cached
+ * @param full_path The resolved path to the directory
+ * @param stats The current stats of the directory
+ * @return The index, or NULL if out of memory
+ * @attention If the function does not return NULL, the returned index must be
+ * released with release_index() when done
+ */
+static CachedIndex *get_dir_index(const char *full_path,
+                                  const struct stat *stats)
+{
+    CachedIndex *cached = find_index(full_path, stats);
+    if (cached != NULL)
+        return cached;
+
+    ListingKey lk;
+    snprintf(lk.key, sizeof(lk.key), "%s", full_path);
+    watch_key(&lk, full_path);
+    size_t size = 0;
+    DirIndex *index = build_dir_index(full_path, &size);
+    if (index == NULL)
+        return NULL;
+    return keep_index(&lk, index, size, stats);
+}
+
+/**
+ * @brief Render a page of the directory's listing from its index
+ * @param path The local path to the directory
+ * @param full_path The resolved path to the directory
+ * @param stats The current stats of the directory
+ * @param query The part of the listing to render, and how
+ * @param page The builder to render into, which this starts
+ * @param write Where to write the page as it is rendered, or NULL
+ * @param ctx Passed to write
+ * @return True on success, false if out of memory or the writer failed
+ * @attention The page must be freed with str_builder_free(), or taken with
+ * str_builder_take(), when done, whether this succeeds or not
+ */
+static bool render_listing(const char *path, const char *full_path,
+                           const struct stat *stats, const ListingQuery *query,
+                           StrBuilder *page, BodyWriter write, void *ctx)
+{
+    page->data = NULL;
+    CachedIndex *cached = get_dir_index(full_path, stats);
+    if (cached == NULL)
+        return false;
+    bool written = write_listing(path, cached->index, query, page, write,
+                                 ctx);
+    release_index(cached);
+    return written;
+}
+
+/**
+ * @brief Pass the listing on, keeping a copy of it for the cache while it
+ * still fits
+ * @param ctx The ListingTee
+ * @param data The piece of the listing
+ * @param len The length of the piece
+ * @return What the tee's writer returns
+ */
+static bool tee_listing(void *ctx, const char *data, size_t len)
+{
+    ListingTee *tee = ctx;
+    if (tee->keeping && file_cache_fits(tee->copy.len + len))
+        str_builder_append(&tee->copy, data, len);
+    else if (tee->keeping)
+    {
+        str_builder_free(&tee->copy);
+        tee->keeping = false;
+    }
+    return tee->write(tee->ctx, data, len);
+}
+
+bool parse_listing_query(const StrSlice *query, ListingQuery *lq)
+{
+    lq->offset = 0;
+    lq->limit = SIZE_MAX;
+    lq->json = false;
+
+    const char *pos = query->ptr;
+    const char *end = query->ptr + query->len;
+    while (pos < end)
+    {
+        const char *param = pos;
+        while (pos < end && *pos != '&')
+            pos++;
+        size_t len = pos - param;
+        pos += (pos < end);
+
+        size_t *value = NULL;
+        const char *digit = NULL;
+        if (len > 7 && strncmp(param, "offset=", 7) == 0)
+        {
+            value = &lq->offset;
+            digit = param + 7;
+        }
+        else if (len > 6 && strncmp(param, "limit=", 6) == 0)
+        {
+            value = &lq->limit;
+            digit = param + 6;
+        }
+        else
+            continue; // Not ours
+
+        // Only plain numbers, which stop growing once they are too large
+        *value = 0;
+        for (; digit < param + len; digit++)
+        {
+            if (*digit < '0' || *digit > '9')
+                return false;
+            size_t next = (*value * 10) + (*digit - '0');
+            *value = (*value > (SIZE_MAX - 9) / 10) ? SIZE_MAX : next;
+        }
+    }
+    return true;
+}
+
+char *render_dir_listing(const char *path, const char *full_path,
+                         size_t *size)
+{
+    size_t index_size = 0;
+    DirIndex *index = build_dir_index(full_path, &index_size);
+    if (index == NULL)
+        return NULL;
+
+    ListingQuery query = { 0, SIZE_MAX, false };
+    StrBuilder page;
+    bool written = write_listing(path, index, &query, &page, NULL, NULL);
+    free(index);
+    if (!written)
+    {
+        str_builder_free(&page);
+        return NULL;
+    }
+    return str_builder_take(&page, size);
+}
+
+CachedFile *find_dir_listing(const char *path, const char *full_path,
+                             const struct stat *stats,
+                             const ListingQuery *query)
+{
+    ListingKey lk;
+    prepare_listing(&lk, path, full_path, query);
+
+    // Without a watch, entries being added or removed still show up in the
+    // directory's stats when the cache is revalidating
+    return file_cache_get(lk.key, stats);
+}
+
+CachedFile *get_dir_listing(const char *path, const char *full_path,
+                            const struct stat *stats,
+                            const ListingQuery *query)
+{
+    ListingKey lk;
+    prepare_listing(&lk, path, full_path, query);
+    CachedFile *listing = file_cache_get(lk.key, stats);
+    if (listing != NULL)
+        return listing;
+
+    watch_key(&lk, full_path);
+    StrBuilder page;
+    if (!render_listing(path, full_path, stats, query, &page, NULL, NULL))
+    {
+        str_builder_free(&page);
+        return NULL;
+    }
+
+    size_t size = 0;
+    char *data = str_builder_take(&page, &size);
+    if (data == NULL)
+        return NULL;
+    return keep_listing(&lk, data, size, stats, get_listing_type(query));
+}
+
+bool stream_dir_listing(const char *path, const char *full_path,
+                        const struct stat *stats, const ListingQuery *query,
+                        BodyWriter write, void *ctx)
+{
+    ListingKey lk;
+    prepare_listing(&lk, path, full_path, query);
+    watch_key(&lk, full_path);
+
+    ListingTee tee = { .write = write, .ctx = ctx };
+    tee.keeping = file_cache_fits(0)
+                  && str_builder_init(&tee.copy, LISTING_CHUNK * 2);
+    StrBuilder page;
+    bool written = render_listing(path, full_path, stats, query, &page,
+                                  tee_listing, &tee);
+    str_builder_free(&page);
+    if (!tee.keeping)
+        return written;
+
+    // The whole page fit, so the next request for it is a memory copy
+    size_t size = 0;
+    char *copy = written ? str_builder_take(&tee.copy, &size) : NULL;
+    if (copy != NULL)
+        file_cache_release(keep_listing(&lk, copy, size, stats,
+                                        get_listing_type(query)));
+    str_builder_free(&tee.copy);
+    return written;
+}
+
+const char *get_listing_type(const ListingQuery *query)
+{
+    return query->json ? "application/json" : "text/html";
+}
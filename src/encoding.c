@@ -0,0 +1,246 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "encoding.h"
+#include "path_cache.h"
+
+#define MAX_QUALITY 1000 // q=1, in thousandths
+
+/**
+ * @struct EncodingInfo
+ * @brief The names a content coding goes by
+ */
+typedef struct
+{
+    const char *name;  //!< The name used in Content-Encoding
+    const char *alias; //!< Another name clients may accept it by, or NULL
+    const char *ext;   //!< The extension of a precompressed copy, or NULL
+} EncodingInfo;
+
+static const EncodingInfo ENCODINGS[NUM_CONTENT_ENCODINGS] = {
+    [CONTENT_ENCODING_IDENTITY] = { "identity", NULL, "" },
+    [CONTENT_ENCODING_BR] = { "br", NULL, ".br" },
+    [CONTENT_ENCODING_ZSTD] = { "zstd", NULL, ".zst" },
+    [CONTENT_ENCODING_GZIP] = { "gzip", "x-gzip", ".gz" },
+    [CONTENT_ENCODING_DEFLATE] = { "deflate", NULL, NULL },
+};
+
+/**
+ * @brief Check if the token is the given name, ignoring case
+ * @param token The token from the field
+ * @param len The length of the token
+ * @param name The name to compare against, may be NULL
+ * @return True if they match
+ */
+static bool token_equals(const char *token, size_t len, const char *name)
+{
+    return name != NULL && strlen(name) == len
+           && strncasecmp(token, name, len) == 0;
+}
+
+/**
+ * @brief Parse the parameters after a coding or media range, looking for its
+ * weight
+ * @param pos The start of the parameters
+ * @param end The end of the parameters
+ * @return The weight, in thousandths. 1000 if there is none
+ */
+static int parse_qvalue(const char *pos, const char *end)
+{
+    while (pos < end)
+    {
+        // Skip to the start of the next parameter
+        while (pos < end && (*pos == ';' || *pos == ' ' || *pos == '\t'))
+            pos++;
+        if (end - pos < 2 || (pos[0] != 'q' && pos[0] != 'Q')
+            || pos[1] != '=')
+        {
+            while (pos < end && *pos != ';')
+                pos++;
+            continue;
+        }
+
+        // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+        pos += 2;
+        if (pos == end || (*pos != '0' && *pos != '1'))
+            return 0;
+        int quality = (*pos++ - '0') * MAX_QUALITY;
+        if (pos < end && *pos == '.')
+        {
+            pos++;
+            for (int scale = 100; scale > 0 && pos < end; scale /= 10, pos++)
+            {
+                if (*pos < '0' || *pos > '9')
+                    break;
+                quality += (*pos - '0') * scale;
+            }
+        }
+        return (quality > MAX_QUALITY) ? MAX_QUALITY : quality;
+    }
+    return MAX_QUALITY;
+}
+
+void parse_accept_encoding(const StrSlice *value, int *quality)
+{
+    // Codings that are not listed are only accepted through "*"
+    int listed[NUM_CONTENT_ENCODINGS] = { 0 };
+    int any = -1;
+    for (int x = 0; x < NUM_CONTENT_ENCODINGS; x++)
+        quality[x] = 0;
+    quality[CONTENT_ENCODING_IDENTITY] = MAX_QUALITY;
+    if (value == NULL)
+        return;
+
+    const char *pos = value->ptr;
+    const char *end = value->ptr + value->len;
+    while (pos < end)
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+            pos++;
+        const char *token = pos;
+        while (pos < end && *pos != ',' && *pos != ';' && *pos != ' '
+               && *pos != '\t')
+            pos++;
+        size_t len = pos - token;
+        const char *params = pos;
+        while (pos < end && *pos != ',')
+            pos++;
+        if (len == 0)
+            continue;
+
+        int weight = parse_qvalue(params, pos);
+        if (len == 1 && *token == '*')
+            any = weight;
+        for (int x = 0; x < NUM_CONTENT_ENCODINGS; x++)
+        {
+            if (token_equals(token, len, ENCODINGS[x].name)
+                || token_equals(token, len, ENCODINGS[x].alias))
+            {
+                quality[x] = weight;
+                listed[x] = 1;
+            }
+        }
+    }
+
+    if (any >= 0)
+    {
+        for (int x = 0; x < NUM_CONTENT_ENCODINGS; x++)
+        {
+            if (!listed[x])
+                quality[x] = any;
+        }
+    }
+}
+
+int get_media_quality(const StrSlice *value, const char *type)
+{
+    if (value == NULL)
+        return MAX_QUALITY;
+
+    // 0 is no match, then "*/*", "type/*" and the full type
+    const char *slash = strchr(type, '/');
+    size_t major_len = (slash != NULL) ? (size_t) (slash - type) : 0;
+    int best = 0;
+    int quality = 0;
+
+    const char *pos = value->ptr;
+    const char *end = value->ptr + value->len;
+    while (pos < end)
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+            pos++;
+        const char *range = pos;
+        while (pos < end && *pos != ',' && *pos != ';' && *pos != ' '
+               && *pos != '\t')
+            pos++;
+        size_t len = pos - range;
+        const char *params = pos;
+        while (pos < end && *pos != ',')
+            pos++;
+
+        int specificity = 0;
+        if (len == 3 && strncmp(range, "*/*", 3) == 0)
+            specificity = 1;
+        else if (len > 2 && len - 2 == major_len
+                 && range[major_len] == '/'
+                 && range[major_len + 1] == '*'
+                 && strncasecmp(range, type, major_len) == 0)
+            specificity = 2;
+        else if (token_equals(range, len, type))
+            specificity = 3;
+        if (specificity > best)
+        {
+            best = specificity;
+            quality = parse_qvalue(params, pos);
+        }
+    }
+    return quality;
+}
+
+const char *get_encoding_name(int encoding)
+{
+    if (encoding <= CONTENT_ENCODING_IDENTITY
+        || encoding >= NUM_CONTENT_ENCODINGS)
+        return NULL;
+    return ENCODINGS[encoding].name;
+}
+
+bool is_compressible(const char *type)
+{
+    return strncmp(type, "text/", 5) == 0
+           || strcmp(type, "application/json") == 0
+           || strcmp(type, "application/javascript") == 0
+           || strcmp(type, "application/xml") == 0
+           || strcmp(type, "image/svg+xml") == 0;
+}
+
+int find_precompressed(const StrSlice *accept, const char *path,
+                       struct stat *stats, CachedPath **copy)
+{
+    if (accept == NULL)
+        return CONTENT_ENCODING_IDENTITY;
+
+    int quality[NUM_CONTENT_ENCODINGS];
+    parse_accept_encoding(accept, quality);
+
+    // Try the codings the client wants most first
+    while (true)
+    {
+        int best = CONTENT_ENCODING_IDENTITY;
+        for (int x = CONTENT_ENCODING_IDENTITY + 1; x < NUM_CONTENT_ENCODINGS;
+             x++)
+        {
+            if (quality[x] > 0
+                && (best == CONTENT_ENCODING_IDENTITY
+                    || quality[x] > quality[best]))
+                best = x;
+        }
+        if (best == CONTENT_ENCODING_IDENTITY)
+            return best;
+        quality[best] = 0;
+
+        if (ENCODINGS[best].ext == NULL)
+            continue; // Never precompressed
+
+        // Copies that do not exist are remembered by the path cache, so
+        // they are not looked for on every request
+        char encoded_path[PATH_MAX + 1];
+        struct stat encoded_stats;
+        int len = snprintf(encoded_path, sizeof(encoded_path), "%s%s", path,
+                           ENCODINGS[best].ext);
+        if ((size_t) len >= sizeof(encoded_path)
+            || path_cache_open(encoded_path, copy, &encoded_stats)
+                   != PATH_CACHE_FOUND)
+            continue;
+        if (S_ISREG(encoded_stats.st_mode)
+            && encoded_stats.st_mtime >= stats->st_mtime)
+        {
+            *stats = encoded_stats;
+            return best;
+        }
+        path_cache_release(*copy);
+        *copy = NULL;
+    }
+}
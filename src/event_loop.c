@@ -0,0 +1,583 @@
+#define _GNU_SOURCE // Needed for accept4
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "arena.h"
+#include "defaults.h"
+#include "event_loop.h"
+#include "http.h"
+#include "metrics.h"
+#include "reader.h"
+#include "send_queue.h"
+#include "utils.h"
+
+#define MAX_EVENTS 64
+#define EVENT_LOOP_TICK_MS 500 // How often to check if we are still running
+#define ACCEPT_PAUSE_MS 100    // Wait after running out of descriptors
+#define CONN_SLAB_SIZE 64      // Connections allocated at a time
+
+typedef struct sockaddr_in SA_IN;
+typedef struct sockaddr SA;
+
+extern bool running;
+
+/**
+ * @struct EventConn
+ * @brief A connection being multiplexed by the event loop
+ */
+typedef struct event_conn
+{
+    struct event_conn *prev; //!< The previous connection in the list
+    struct event_conn *next; //!< The next connection in the list
+    int socket;              //!< The connections socket
+    uint32_t raw_ip;         //!< The IP address of the connection
+    uint64_t deadline;       //!< When the connection times out (unit: ms)
+    uint16_t served;         //!< Number of requests served so far
+    bool idle;               //!< Waiting for the next kept alive request
+    bool writing;            //!< Waiting to send the rest of a response
+    RequestReader reader;    //!< What has been read from the connection
+    SendQueue out;           //!< What is left of the response to send
+} EventConn;
+
+/**
+ * @struct EventConnSlab
+ * @brief A block of connections, allocated together
+ */
+typedef struct conn_slab
+{
+    struct conn_slab *next;          //!< The slab allocated before this one
+    EventConn conns[CONN_SLAB_SIZE]; //!< The connections
+} EventConnSlab;
+
+/**
+ * @struct EventConnList
+ * @brief List of connections, ordered by their deadline
+ *
+ * Every connection in a list gets the same timeout, so appending them as
+ * their timer starts keeps the list sorted and the next to expire is always
+ * the head
+ */
+typedef struct
+{
+    EventConn *head; //!< The connection that will time out first
+    EventConn *tail; //!< The connection that will time out last
+} EventConnList;
+
+/**
+ * @struct EventLoop
+ * @brief The state of the event loop for a single thread
+ */
+typedef struct
+{
+    int epoll_fd;          //!< The epoll instance for this thread
+    /// Connections in the middle of a request, or of sending a response
+    EventConnList reading;
+    EventConnList idle;    //!< Kept alive connections between requests
+    EventConn *spare;      //!< Released connections, ready to be reused
+    EventConnSlab *slabs;  //!< Every slab of connections allocated
+    int server_sock;       //!< The listening socket
+    uint64_t listen_at;    //!< When to accept again, 0 if accepting now
+} EventLoop;
+
+/**
+ * @brief Add the connection to the end of the list
+ * @param list The list to add to
+ * @param conn The connection to add
+ */
+static void conn_list_append(EventConnList *list, EventConn *conn)
+{
+    conn->next = NULL;
+    conn->prev = list->tail;
+    if (list->tail == NULL)
+        list->head = conn;
+    else
+        list->tail->next = conn;
+    list->tail = conn;
+}
+
+/**
+ * @brief Remove the connection from the list
+ * @param list The list to remove from
+ * @param conn The connection to remove
+ */
+static void conn_list_unlink(EventConnList *list, EventConn *conn)
+{
+    if (conn->prev == NULL)
+        list->head = conn->next;
+    else
+        conn->prev->next = conn->next;
+
+    if (conn->next == NULL)
+        list->tail = conn->prev;
+    else
+        conn->next->prev = conn->prev;
+}
+
+/**
+ * @brief Start the connection's timer and add it to the matching list
+ * @param loop The event loop the connection belongs to
+ * @param conn The connection to add
+ * @param idle If the connection is waiting for its next request
+ */
+static void conn_start_timer(EventLoop *loop, EventConn *conn, bool idle)
+{
+    conn->idle = idle;
+    if (idle)
+    {
+        conn->deadline = get_monotonic_ms() + KEEP_ALIVE_LEN;
+        conn_list_append(&loop->idle, conn);
+    }
+    else
+    {
+        conn->deadline = get_monotonic_ms() + CONN_TIMEOUT_LEN;
+        conn_list_append(&loop->reading, conn);
+    }
+}
+
+/**
+ * @brief Move the connection to the matching list and restart its timer
+ * @param loop The event loop the connection belongs to
+ * @param conn The connection to move
+ * @param idle If the connection is waiting for its next request
+ */
+static void conn_restart_timer(EventLoop *loop, EventConn *conn, bool idle)
+{
+    conn_list_unlink(conn->idle ? &loop->idle : &loop->reading, conn);
+    conn_start_timer(loop, conn, idle);
+}
+
+/**
+ * @brief Take a connection from the spares, allocating a slab of them if
+ * there are none
+ *
+ * Connections keep their reader's buffer when they are released, so once
+ * the loop has seen its busiest moment no more memory is allocated
+ * @param loop The event loop the connection belongs to
+ * @return The connection, with an empty reader, or NULL if out of memory
+ */
+static EventConn *conn_alloc(EventLoop *loop)
+{
+    if (loop->spare == NULL)
+    {
+        EventConnSlab *slab = calloc(1, sizeof(EventConnSlab));
+        if (slab == NULL)
+            return NULL;
+        slab->next = loop->slabs;
+        loop->slabs = slab;
+        for (int x = 0; x < CONN_SLAB_SIZE; x++)
+        {
+            slab->conns[x].next = loop->spare;
+            loop->spare = &slab->conns[x];
+        }
+    }
+
+    EventConn *conn = loop->spare;
+    if (conn->reader.buff == NULL && reader_init(&conn->reader) != 0)
+        return NULL;
+    reader_reset(&conn->reader);
+    loop->spare = conn->next;
+    return conn;
+}
+
+/**
+ * @brief Close the connection, if needed, and put it back with the spares
+ * @param loop The event loop the connection belongs to
+ * @param conn The connection to release
+ */
+static void conn_release(EventLoop *loop, EventConn *conn)
+{
+    conn_list_unlink(conn->idle ? &loop->idle : &loop->reading, conn);
+    if (conn->socket != SOCKET_ERROR)
+        close(conn->socket);
+    send_queue_clear(&conn->out);
+    conn->writing = false;
+    metrics_conn_closed();
+    conn->next = loop->spare;
+    loop->spare = conn;
+}
+
+/**
+ * @brief Free every slab of connections, along with their readers
+ * @param loop The event loop the connections belong to
+ */
+static void free_slabs(EventLoop *loop)
+{
+    while (loop->slabs != NULL)
+    {
+        EventConnSlab *slab = loop->slabs;
+        for (int x = 0; x < CONN_SLAB_SIZE; x++)
+            reader_free(&slab->conns[x].reader);
+        loop->slabs = slab->next;
+        free(slab);
+    }
+    loop->spare = NULL;
+}
+
+/**
+ * @brief Start waiting for connections on the listening socket
+ * @param loop The event loop for this thread
+ * @return False if the socket could not be added to the epoll instance
+ */
+static bool listen_start(EventLoop *loop)
+{
+    // A NULL pointer marks events for the listening socket. Only wake one of
+    // the threads waiting on it for each new connection, when supported
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server_sock, &ev)
+        == SOCKET_ERROR)
+    {
+        perror("epoll_ctl");
+        return false;
+    }
+    loop->listen_at = 0;
+    return true;
+}
+
+/**
+ * @brief Stop accepting for a while, after running out of file descriptors
+ *
+ * The listening socket stays readable while connections wait in its backlog,
+ * so it would otherwise wake the loop over and over until enough are closed
+ * @param loop The event loop for this thread
+ */
+static void listen_pause(EventLoop *loop)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->server_sock, NULL);
+    loop->listen_at = get_monotonic_ms() + ACCEPT_PAUSE_MS;
+}
+
+/**
+ * @brief Accept all pending connections and add them to the event loop
+ * @param server_sock The listening socket
+ * @param loop The event loop for this thread
+ */
+static void accept_connections(int server_sock, EventLoop *loop)
+{
+    while (running)
+    {
+        SA_IN client_addr;
+        socklen_t addr_size = sizeof(SA_IN);
+        int client_sock = accept4(server_sock, (SA *) &client_addr,
+                                  &addr_size, SOCK_NONBLOCK);
+        if (client_sock == SOCKET_ERROR)
+        {
+            int error = errno;
+            if (error == EINTR || error == ECONNABORTED)
+                continue;
+            if (error != EAGAIN && error != EWOULDBLOCK)
+                perror("accept");
+            if (error == EMFILE || error == ENFILE)
+                listen_pause(loop);
+            return;
+        }
+
+#ifdef VERBOSE
+        char ip[INET_ADDRSTRLEN] = { 0 };
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+        log_printf("Connected to %s\n", ip);
+#endif
+
+        EventConn *conn = conn_alloc(loop);
+        if (conn == NULL)
+        {
+            perror("malloc");
+            close(client_sock);
+            return;
+        }
+        conn->socket = client_sock;
+        conn->raw_ip = client_addr.sin_addr.s_addr;
+        conn->served = 0;
+
+        struct epoll_event ev = { 0 };
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev)
+            == SOCKET_ERROR)
+        {
+            perror("epoll_ctl");
+            close(client_sock);
+            conn->next = loop->spare;
+            loop->spare = conn;
+            continue;
+        }
+        conn_start_timer(loop, conn, false);
+        metrics_conn_opened();
+    }
+}
+
+/**
+ * @brief Wait for the socket to be writable, if part of the response is
+ * still queued
+ *
+ * The connection gets CONN_TIMEOUT_LEN to take more of the response, the
+ * same as it gets to send more of a request
+ * @param loop The event loop the connection belongs to
+ * @param conn The connection the response is being sent on
+ * @return True if the connection is waiting to send the rest
+ */
+static bool conn_wait_writable(EventLoop *loop, EventConn *conn)
+{
+    if (send_queue_empty(&conn->out))
+        return false;
+
+    conn->writing = true;
+    conn_restart_timer(loop, conn, false);
+    return true;
+}
+
+/**
+ * @brief Hand a fully read request off to be responded to
+ *
+ * The socket is never blocked on. Whatever part of the response does not
+ * fit in it is queued, and sent as the client reads the rest. Once the
+ * response is sent, a kept alive connection goes back to waiting for the
+ * next request, otherwise it is released
+ * @param loop The event loop the connection belongs to
+ * @param conn The connection the request was read from
+ * @param req The parsed request
+ * @return True if the next request can be handled straight away
+ */
+static bool dispatch_request(EventLoop *loop, EventConn *conn,
+                             HttpRequest *req)
+{
+#ifdef VERBOSE
+    log_write(req->buff, req->head_len);
+    log_write("\n", 1);
+#endif
+
+    inet_ntop(AF_INET, &conn->raw_ip, req->ip, sizeof(req->ip));
+    conn->served++;
+    req->keep_alive = KEEP_ALIVE_LEN > 0 && conn->served < MAX_REQUESTS;
+    send_queue_attach(&conn->out);
+    handle_request(req, &conn->socket);
+    send_queue_attach(NULL);
+
+    if (conn->socket == SOCKET_ERROR || conn->out.failed)
+    {
+        conn_release(loop, conn);
+        return false;
+    }
+
+    // Wait for the next request, which may already have been read
+    reader_consume(&conn->reader);
+    if (conn_wait_writable(loop, conn))
+        return false;
+    conn_restart_timer(loop, conn, true);
+    return true;
+}
+
+/**
+ * @brief Send as much of the queued response as the socket will take
+ *
+ * Once all of it is sent, the connection is released if it was being
+ * closed, otherwise it goes back to waiting for the next request
+ * @param loop The event loop the connection belongs to
+ * @param conn The connection the response is being sent on
+ * @return True if the next request can be handled
+ */
+static bool resume_writing(EventLoop *loop, EventConn *conn)
+{
+    bool progress;
+    int status = send_queue_flush(&conn->out, conn->socket, &progress);
+    if (status == SEND_QUEUE_AGAIN)
+    {
+        // Only a client that takes some of the response gets more time
+        if (progress)
+            conn_restart_timer(loop, conn, false);
+        return false;
+    }
+
+    if (status == SEND_QUEUE_ERROR || conn->out.close_after)
+    {
+        conn_release(loop, conn);
+        return false;
+    }
+    conn->writing = false;
+    conn_restart_timer(loop, conn, true);
+    return true;
+}
+
+/**
+ * @brief Handle any activity on the connection
+ *
+ * Since the socket is edge-triggered, it must be drained until it would block
+ * or we will not be notified about the data still sitting in it. Every full
+ * request read along the way is responded to in order
+ * @param loop The event loop the connection belongs to
+ * @param conn The connection with activity on it
+ * @param events The epoll events reported for the connection
+ */
+static void handle_event(EventLoop *loop, EventConn *conn, uint32_t events)
+{
+    if (events & EPOLLERR)
+    {
+        conn_release(loop, conn);
+        return;
+    }
+    if (conn->writing && !resume_writing(loop, conn))
+        return;
+
+    while (true)
+    {
+        HttpRequest req = { 0 };
+        int status = reader_check(&conn->reader, &req);
+        if (status == READER_STATUS_READY)
+        {
+            if (!dispatch_request(loop, conn, &req))
+                return;
+            continue;
+        }
+        if (status != READER_STATUS_NEED_MORE)
+        {
+            inet_ntop(AF_INET, &conn->raw_ip, req.ip, sizeof(req.ip));
+            send_queue_attach(&conn->out);
+            reader_reject(&conn->reader, &req, status, &conn->socket);
+            send_queue_attach(NULL);
+            if (!conn_wait_writable(loop, conn))
+                conn_release(loop, conn);
+            return;
+        }
+
+        ssize_t bytes_read = reader_recv(&conn->reader, conn->socket);
+        if (bytes_read > 0)
+            continue;
+        if (bytes_read == SOCKET_ERROR && errno == EINTR)
+            continue;
+        if (bytes_read == SOCKET_ERROR
+            && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        // The client hung up, or something went wrong
+        conn_release(loop, conn);
+        return;
+    }
+
+    // The client started on its next request, so it is no longer idle
+    if (conn->idle && conn->reader.size > 0)
+        conn_restart_timer(loop, conn, false);
+}
+
+/**
+ * @brief Release every connection past its deadline
+ *
+ * Clients in the middle of a request are sent a timeout message, while idle
+ * connections and those that stopped reading their response are closed
+ * quietly
+ * @param loop The event loop for this thread
+ */
+static void expire_connections(EventLoop *loop)
+{
+    uint64_t now = get_monotonic_ms();
+    while (loop->reading.head != NULL && loop->reading.head->deadline <= now)
+    {
+        // Request timeout, unless the client stopped reading the response
+        EventConn *conn = loop->reading.head;
+        if (!conn->writing)
+            send_408_error(&conn->socket);
+        conn_release(loop, conn);
+    }
+    while (loop->idle.head != NULL && loop->idle.head->deadline <= now)
+        conn_release(loop, loop->idle.head);
+}
+
+/**
+ * @brief Get how long to wait for events before a connection expires
+ * @param loop The event loop for this thread
+ * @return The time to wait (unit: ms)
+ */
+static int next_timeout(EventLoop *loop)
+{
+    uint64_t now = get_monotonic_ms();
+    uint64_t wait = EVENT_LOOP_TICK_MS;
+    EventConn *heads[] = { loop->reading.head, loop->idle.head };
+    for (size_t x = 0; x < sizeof(heads) / sizeof(EventConn *); x++)
+    {
+        if (heads[x] == NULL)
+            continue;
+        uint64_t left = (heads[x]->deadline > now) ? heads[x]->deadline - now
+                                                   : 0;
+        wait = (left < wait) ? left : wait;
+    }
+    if (loop->listen_at != 0)
+    {
+        uint64_t left = (loop->listen_at > now) ? loop->listen_at - now : 0;
+        wait = (left < wait) ? left : wait;
+    }
+    return (int) wait;
+}
+
+void *event_loop_thread(void *arg)
+{
+    int server_sock = *(int *) arg;
+    EventLoop loop = { 0 };
+    loop.server_sock = server_sock;
+    struct epoll_event events[MAX_EVENTS];
+
+    loop.epoll_fd = epoll_create1(0);
+    if (loop.epoll_fd == SOCKET_ERROR)
+    {
+        perror("epoll_create1");
+        return NULL;
+    }
+
+    if (!listen_start(&loop))
+    {
+        close(loop.epoll_fd);
+        return NULL;
+    }
+
+    while (running)
+    {
+        int ready = epoll_wait(loop.epoll_fd, events, MAX_EVENTS,
+                               next_timeout(&loop));
+        if (ready == SOCKET_ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        uint64_t start = metrics_now();
+        for (int x = 0; x < ready; x++)
+        {
+            EventConn *conn = events[x].data.ptr;
+            if (conn == NULL)
+                accept_connections(server_sock, &loop);
+            else
+                handle_event(&loop, conn, events[x].events);
+        }
+
+        expire_connections(&loop);
+        if (loop.listen_at != 0 && get_monotonic_ms() >= loop.listen_at
+            && !listen_start(&loop))
+            break;
+        if (start != 0)
+            metrics_add_busy(metrics_now() - start);
+    }
+
+    // Shutting down, close any connections still open
+    while (loop.reading.head != NULL)
+        conn_release(&loop, loop.reading.head);
+    while (loop.idle.head != NULL)
+        conn_release(&loop, loop.idle.head);
+    free_slabs(&loop);
+    arena_free();
+    close(loop.epoll_fd);
+    return NULL;
+}
@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_cache.h"
+#include "lru_table.h"
+#include "utils.h"
+
+static LruTable table;
+static size_t shard_budget = 0;
+static size_t max_file_size = 0;
+static bool check_stats = false;
+static bool enabled = false;
+
+/**
+ * @brief Free the file's memory
+ * @param file The file to free
+ */
+static void free_file(CachedFile *file)
+{
+    free(file->data);
+    free(file->entry.key);
+    free(file);
+}
+
+/**
+ * @brief Drop one reference to the file, freeing it if it was the last
+ * @param file The file to drop a reference to
+ * @note The shard's lock must be held
+ */
+static void drop_ref(CachedFile *file)
+{
+    if (--file->refs == 0)
+        free_file(file);
+}
+
+/**
+ * @brief Find the file in the shard
+ * @param shard The shard to search
+ * @param path The resolved path to the file
+ * @param hash The hash of the path
+ * @return The file, or NULL if it is not in the shard
+ */
+static CachedFile *find_file(LruShard *shard, const char *path, uint32_t hash)
+{
+    return (CachedFile *) lru_find(shard, path, hash);
+}
+
+/**
+ * @brief Take the file out of the cache
+ *
+ * The file is only freed once the last thread using it releases it
+ * @param shard The shard holding the file
+ * @param file The file to remove
+ */
+static void remove_file(LruShard *shard, CachedFile *file)
+{
+    lru_remove(shard, &file->entry);
+    shard->used -= file->size;
+    drop_ref(file);
+}
+
+int file_cache_init(size_t budget, size_t max_file, bool revalidate)
+{
+    shard_budget = budget / LRU_SHARDS;
+    max_file_size = (max_file < shard_budget) ? max_file : shard_budget;
+    check_stats = revalidate;
+    enabled = false;
+    if (lru_table_init(&table) != 0)
+        return 1;
+    enabled = budget > 0;
+    return 0;
+}
+
+void file_cache_free(void)
+{
+    for (int x = 0; x < LRU_SHARDS; x++)
+    {
+        LruShard *shard = &table.shards[x];
+        while (shard->lru_head != NULL)
+            remove_file(shard, (CachedFile *) shard->lru_head);
+    }
+    lru_table_destroy(&table);
+    enabled = false;
+}
+
+CachedFile *file_cache_get(const char *path, const struct stat *stats)
+{
+    if (!enabled)
+        return NULL;
+
+    uint32_t hash = lru_hash(path);
+    LruShard *shard = lru_table_shard(&table, hash);
+    pthread_mutex_lock(&shard->lock);
+    CachedFile *file = find_file(shard, path, hash);
+    if (file != NULL)
+    {
+        file->refs++;
+        lru_touch(shard, &file->entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (file == NULL || !check_stats)
+        return file;
+
+    // Make sure the file was not changed since it was cached
+    if (same_file_stats(&file->stats, stats))
+        return file;
+
+    pthread_mutex_lock(&shard->lock);
+    if (find_file(shard, path, hash) == file)
+    {
+        // Our own reference is still held, so this one is never the last
+        lru_remove(shard, &file->entry);
+        shard->used -= file->size;
+        file->refs--;
+    }
+    drop_ref(file);
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+}
+
+CachedFile *file_cache_add(const char *path, int fd, const struct stat *stats,
+                           const char *type)
+{
+    if (!enabled || stats->st_size < 0
+        || (size_t) stats->st_size > max_file_size)
+        return NULL;
+
+    // Read the file before taking the lock, so other threads are not held up
+    char *data = read_file_data(fd, stats->st_size);
+    if (data == NULL)
+        return NULL;
+    return file_cache_insert(path, data, stats->st_size, stats, type);
+}
+
+CachedFile *file_cache_insert(const char *path, char *data, size_t size,
+                              const struct stat *stats, const char *type)
+{
+    CachedFile *file = calloc(1, sizeof(CachedFile));
+    if (file == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    file->size = size;
+    file->data = data;
+    file->entry.key = strdup(path);
+    if (file->entry.key == NULL)
+    {
+        free_file(file);
+        return NULL;
+    }
+    file->stats = *stats;
+    file->type = type;
+    file->entry.hash = lru_hash(path);
+
+    // Too large to keep, so it only lives until the caller releases it
+    if (!enabled || size > max_file_size)
+    {
+        file->refs = 1;
+        return file;
+    }
+    file->refs = 2; // One for the cache, one for the caller
+
+    LruShard *shard = lru_table_shard(&table, file->entry.hash);
+    pthread_mutex_lock(&shard->lock);
+
+    // Another thread may have cached the file while we were reading it
+    CachedFile *old = find_file(shard, path, file->entry.hash);
+    if (old != NULL)
+        remove_file(shard, old);
+
+    // Make room by evicting the least recently used files
+    while (shard->lru_tail != NULL
+           && shard->used + file->size > shard_budget)
+        remove_file(shard, (CachedFile *) shard->lru_tail);
+
+    lru_insert(shard, &file->entry);
+    shard->used += file->size;
+    pthread_mutex_unlock(&shard->lock);
+    return file;
+}
+
+bool file_cache_fits(size_t size)
+{
+    return enabled && size <= max_file_size;
+}
+
+void file_cache_remove(const char *path)
+{
+    if (!enabled)
+        return;
+
+    uint32_t hash = lru_hash(path);
+    LruShard *shard = lru_table_shard(&table, hash);
+    pthread_mutex_lock(&shard->lock);
+    CachedFile *file = find_file(shard, path, hash);
+    if (file != NULL)
+        remove_file(shard, file);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void file_cache_release(CachedFile *file)
+{
+    if (file == NULL)
+        return;
+
+    LruShard *shard = lru_table_shard(&table, file->entry.hash);
+    pthread_mutex_lock(&shard->lock);
+    drop_ref(file);
+    pthread_mutex_unlock(&shard->lock);
+}
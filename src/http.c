@@ -1,769 +1,1780 @@
-#include <dirent.h>
-#include <limits.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
-#include <time.h>
-#include <unistd.h>
-
-#include "content_map.h"
-#include "defaults.h"
-#include "http.h"
-#include "stdio.h"
-#include "utils.h"
-
-#define ERR_SIZE 256
-#define FOOT_SIZE 256
-#define HEAD_SIZE 64
-#define CONSOLE_WIDTH 80
-#define INIT_DIR_ENTRIES 16
-
-static const char HTTP_VER[] = "HTTP/1.1";
-static const char ELLIPSES[] = " ... ";
-static const char *REQ_STRS[] = { "N/A",     "GET",  "POST",  "HEAD",
-                                  "OPTIONS", "PUT",  "PATCH", "DELETE",
-                                  "CONNECT", "TRACE" };
-static const int NUM_REQ_TYPES = sizeof(REQ_STRS) / sizeof(char *);
-
-/// List of supported HTTP methods
-static const uint8_t SUPPORTED[] = { REQUEST_TYPE_GET, REQUEST_TYPE_HEAD,
-                                     REQUEST_TYPE_OPTIONS };
-static const int NUM_SUPPORTED = sizeof(SUPPORTED) / sizeof(uint8_t);
-
-/**
- * @enum FileStatusCodes
- * @brief Status codes for the return value of get_requested_file
- */
-enum FileStatusCodes
-{
-    FILE_STATUS_CODES_SUCCESS = 0,
-    FILE_STATUS_CODES_SERVER_ERR = 1,
-    FILE_STATUS_CODES_FILE_ERR = 2
-};
-
-bool http_ending(const char *buff, size_t size)
-{
-    const char end_seq[] = "\r\n\r\n";
-    if (size < sizeof(end_seq) + 1)
-        return false;
-
-    return strcmp(buff + (size - sizeof(end_seq) + 1), end_seq) == 0;
-}
-
-/**
- * @brief Print the log message to ensure it fits in the console
- * @param preamble The start of the log message
- * @param path The path to the file
- * @param ver Should the version be displayed
- */
-static void log_message(const char *preamble, char *path, bool ver)
-{
-    char log[CONSOLE_WIDTH + 2] = { 0 };
-    size_t pre_len = strlen(preamble);
-    size_t path_len = strlen(path);
-    snprintf(log, CONSOLE_WIDTH + 1, "%s%s", preamble, path);
-
-    // Message is too long, truncate it
-    if ((pre_len + path_len) > CONSOLE_WIDTH)
-    {
-        size_t start = CONSOLE_WIDTH - sizeof(ELLIPSES);
-        start -= ver ? sizeof(HTTP_VER) : 0;
-        sprintf(log + start, "%s%s\n", ELLIPSES, ver ? HTTP_VER : "");
-    }
-    size_t len = strlen(log);
-    log[len] = (log[len - 1] != '\n') ? '\n' : '\0';
-    printf("%s", log);
-}
-
-/**
- * @brief Log the users request to the console
- * @param req The HTTP request to log
- */
-#ifndef VERBOSE // Silences compiler warning for this being unused
-static void log_request(HttpRequest *req)
-{
-    size_t line_len = 0;
-    char *line = NULL;
-    FILE *fp = fmemopen(req->buff, strlen(req->buff), "r");
-    if (fp == NULL)
-    {
-        fprintf(stderr, "Error: Unable to print users request\n");
-        return;
-    }
-
-    if (getline(&line, &line_len, fp) != -1)
-    {
-        char preamble[HEAD_SIZE] = { 0 };
-        snprintf(preamble, HEAD_SIZE - 1, "Request from %s: ", req->ip);
-        log_message(preamble, line, true);
-    }
-
-    if (line != NULL)
-        free(line);
-    fclose(fp);
-}
-#endif /* !VERBOSE */
-
-void parse_reqest_type(HttpRequest *req)
-{
-    int type;
-    char *dup = strdup(req->buff);
-    if (dup == NULL)
-    {
-        perror("strdup");
-        return;
-    }
-
-    // Compare the request against the list of possible HTTP requests
-    char *request = strtok(dup, " ");
-    for (type = 0; type < NUM_REQ_TYPES; type++)
-    {
-        if (strcmp(request, REQ_STRS[type]) == 0)
-        {
-            req->type = type;
-            break;
-        }
-    }
-
-#ifndef VERBOSE
-    // If verbose is on, this gets logged, but if its not we still want
-    // to log the request
-    log_request(req);
-#endif
-    free(dup);
-}
-
-bool validate_http_ver(HttpRequest *req)
-{
-    char *dup = strdup(req->buff);
-    if (dup == NULL)
-    {
-        perror("strdup");
-        return false;
-    }
-
-    char *line = strtok(dup, "\r");
-    size_t ver_start = (strlen(line) + 1) - sizeof(HTTP_VER);
-    bool ret = strcmp(line + ver_start, HTTP_VER) == 0;
-
-    free(dup);
-    return ret;
-}
-
-void send_response(const char *buff, size_t size, int *sock)
-{
-    write(*sock, buff, size);
-    close(*sock);
-#ifdef VERBOSE
-    printf("%s", buff);
-    printf("closing connection...\n");
-#endif
-}
-
-void send_error(const char *err, int *sock)
-{
-    char buffer[BUFF_SIZE];
-    memset(buffer, 0, BUFF_SIZE);
-    char time_str[HEAD_SIZE] = { 0 };
-    char http_err[HEAD_SIZE] = { 0 };
-
-    get_time(time_str);
-    sprintf(http_err, "<h1>%s</h1>\n", err);
-    sprintf(buffer,
-            "HTTP/1.1 %s\nDate: %s\nServer: %s\n"
-            "Content-Type: text/html; charset=UTF-8\nContent-Length: %zu\n\n",
-            err, time_str, SERVER_NAME, strlen(http_err));
-    strcat(buffer, http_err);
-
-    send_response(buffer, strlen(buffer), sock);
-}
-
-/**
- * @brief Get the value for the Content-Type portion of the header
- * @param buffer The buffer to store the Content-Type result
- * @param file The file being accessed
- * @note Not checking for all types
- * @see get_type_from_map()
- */
-static void get_content_type(char *buffer, const char *file)
-{
-    struct stat stats;
-    stat(file, &stats);
-    strcpy(buffer, "Content-Type: ");
-    char *ext = strdup(get_filename_ext(file));
-    if (ext == NULL)
-    {
-        strcat(buffer, "text/plain; charset=UTF-8\n");
-        return;
-    }
-
-    ext = lowerstr(ext);
-    if (strcmp(ext, "") == 0 && S_ISDIR(stats.st_mode))
-        strcat(buffer, "text/html");
-    else
-        strcat(buffer, get_type_from_map(ext));
-    strcat(buffer, "; charset=UTF-8\n");
-    free(ext);
-}
-
-/**
- * @brief Generate the header to be sent back to the user
- * @param buffer The buffer to hold the header
- * @param fp File descriptor fo the file being sent
- * @param file The name of the file
- * @param code The response code from the server
- * @param type The type of request from the user
- */
-static void generate_resp_head(char *buffer, FILE *fp, const char *file,
-                               const char *code, uint8_t type)
-{
-    char time_str[HEAD_SIZE] = { 0 };
-    char cont_type[HEAD_SIZE] = { 0 };
-    char file_size[HEAD_SIZE] = { 0 };
-    char allow_list[HEAD_SIZE] = { 0 };
-
-    switch (type)
-    {
-        case REQUEST_TYPE_HEAD:
-            get_content_type(cont_type, file);
-            break;
-        case REQUEST_TYPE_GET:
-            sprintf(file_size, "Content-Length: %zu", get_file_size(fp));
-            get_content_type(cont_type, file);
-            break;
-        case REQUEST_TYPE_OPTIONS:
-            strcpy(allow_list, "Allow:");
-            for (int x = 0; x < NUM_SUPPORTED; x++)
-                sprintf(allow_list + strlen(allow_list), " %s,",
-                        REQ_STRS[SUPPORTED[x]]);
-            allow_list[strlen(allow_list) - 1] = '\n';
-        default:
-            break;
-    }
-    get_time(time_str);
-    sprintf(buffer, "HTTP/1.1 %s\n%sDate: %s\nServer: %s\n%s%s\n\n", code,
-            allow_list, time_str, SERVER_NAME, cont_type, file_size);
-}
-
-/**
- * @brief Get the contents of the directory
- * @param path The path to the directory to read.
- * @param items The number if items found in the directory
- * @return Array of dirent structs for each item in the directory
- * @attention If the function does not return NULL, the returned dirent struct
- * must be freed when done
- */
-static struct dirent **get_dir_tree(const char *path, size_t *items)
-{
-    size_t max = INIT_DIR_ENTRIES;
-    size_t i = 0;
-    struct dirent **dir_elms = NULL, **tmp = NULL;
-    DIR *d = opendir(path);
-    if (d == NULL)
-        goto get_dir_tree_end;
-
-    struct dirent *dir;
-    dir_elms = calloc(max, sizeof(struct dirent *));
-    while ((dir = readdir(d)) != NULL)
-    {
-        // Make sure our list has enough space
-        if (i == max)
-        {
-            size_t t_max = max * 2;
-            tmp = realloc(dir_elms, (t_max * sizeof(struct dirent *)));
-            if (tmp == NULL)
-                goto get_dir_tree_close_d;
-            dir_elms = tmp;
-            max = t_max;
-        }
-
-        // Allocate space for the new entry
-        dir_elms[i] = malloc(sizeof(struct dirent));
-        if (dir_elms[i] == NULL)
-            goto get_dir_tree_close_d;
-
-        // Add the entry to the list
-        memset(dir_elms[i], 0, sizeof(struct dirent));
-        strcpy(dir_elms[i]->d_name, dir->d_name);
-        dir_elms[i]->d_type = dir->d_type;
-        i++;
-    }
-get_dir_tree_close_d:
-    closedir(d);
-
-get_dir_tree_end:
-    *items = i;
-
-    // Sort the contents to ensure directories are first
-    // and everything is alphabetized
-    qsort(dir_elms, i, sizeof(struct dirent *), compare_dir_elms);
-    return dir_elms;
-}
-
-/**
- * @brief Create an HTML page displaying the contents of the directory
- * @param path The local path to the directory to display the contents of
- * @param full_path The full path to the directory
- * @param buffer Pointer to the buffer to store the HTML into
- * @param b_size Pointer to the current size of the buffer
- */
-static void create_dir_html(const char *path, const char *full_path,
-                            char **buffer, size_t *b_size)
-{
-    unsigned char slash = path[strlen(path) - 1] != '/';
-    char file_path[PATH_MAX + 1] = { 0 };
-    const char *align_right = "style=\"text-align: right\"";
-    char end[] = "</table>\n</html>";
-
-    // Header for the HTML page
-    snprintf(*buffer, *b_size - 1,
-             "<!DOCTYPE html>\n<head>"
-             "<style>\ntd{\npadding-right: 30px;\ntext-align: left;\n}\n"
-             "</style>\n</head>\n"
-             "<h1>Index of %s%s</h1>\n"
-             "<table>\n",
-             path, slash ? "/" : "");
-    size_t buff_len = strlen(*buffer);
-
-    // Get all the files and directories in the given directory
-    size_t items;
-    struct dirent **dir = get_dir_tree(full_path, &items);
-    if (dir == NULL)
-        goto create_dir_html_end;
-
-    // Create the HTML to display each entry in the given directory
-    for (int x = 0; x < (int) items; x++)
-    {
-        if (strcmp(dir[x]->d_name, ".") == 0)
-            continue;
-
-        // Create the file path for the given entry
-        size_t d_name_len = strlen(dir[x]->d_name) + 1;
-        char *local_path = calloc(strlen(path) + d_name_len + slash,
-                                  sizeof(char));
-        if (local_path != NULL)
-            sprintf(local_path, "%s%s%s", path, slash ? "/" : "",
-                    dir[x]->d_name);
-        snprintf(file_path, PATH_MAX, "%s/%s", full_path, dir[x]->d_name);
-
-        // Allocate memory for all the HTML that will comprise this entry
-        size_t row_max = (HEAD_SIZE * 3) + (d_name_len * 2)
-                         + (strlen(align_right) * 2) + 1;
-        char *table_row = calloc(row_max, sizeof(char));
-        if (table_row == NULL)
-        {
-            free(local_path);
-            goto create_dir_html_end;
-        }
-
-        // Allocate memory for the HTML that will comprise the file size
-        char *size_str = calloc(strlen(align_right) + HEAD_SIZE, sizeof(char));
-        if (size_str == NULL)
-        {
-            free(local_path);
-            free(table_row);
-            goto create_dir_html_end;
-        }
-
-        struct stat stats = { 0 };
-        stat(file_path, &stats);
-
-        // Get the time the file/directory was last modified
-        char time_str[HEAD_SIZE] = { 0 };
-#if __APPLE__
-        strftime(time_str, sizeof(time_str), "%d-%b-%Y %R",
-                 gmtime(&stats.st_mtimespec.tv_sec));
-#else
-        strftime(time_str, sizeof(time_str), "%d-%b-%Y %R",
-                 gmtime(&stats.st_mtim.tv_sec));
-#endif
-
-        // Get the size of the file, if applicable
-        sprintf(size_str, "<td %s>", align_right);
-        if (stats.st_size && (dir[x]->d_type != DT_DIR))
-            // Not casting throws a warning on macOS
-            sprintf(size_str + strlen(size_str), "%ld</td>\n",
-                    (long) stats.st_size);
-        else
-            sprintf(size_str + strlen(size_str), "-<td>\n");
-
-        // Create an entry in the table for the current file/directory
-        snprintf(table_row, row_max,
-                 "<tr>\n"
-                 "<td><a href=\"/%s%s\">%s%s</a></td>\n"
-                 "<td>%s</td>\n"
-                 "%s"
-                 "</tr>\n",
-                 local_path, (dir[x]->d_type == DT_DIR) ? "/" : "",
-                 dir[x]->d_name, (dir[x]->d_type == DT_DIR) ? "/" : "",
-                 time_str, size_str);
-
-        // Make sure the buffer is large enough
-        if (buff_resize(buffer, b_size, (buff_len + strlen(table_row) + 1))
-            != 0)
-        {
-            free(local_path);
-            free(table_row);
-            free(size_str);
-            free_dir_list(dir, items);
-            return;
-        }
-
-        // Add the new entry's HTML to the total HTML
-        strcat(*buffer, table_row);
-        buff_len = strlen(*buffer);
-
-        free(size_str);
-        free(table_row);
-        free(local_path);
-    }
-
-create_dir_html_end:
-    // List of dirent structs is no longer needed
-    free_dir_list(dir, items);
-
-    // Make sure the buffer is large enough to hold the HTML footer
-    if (buff_resize(buffer, b_size, (buff_len + sizeof(end) + 1)) != 0)
-        return;
-
-    // Add the HTML footer and remove any unneeded space
-    strcat(*buffer, end);
-    buff_shrink_to_fit(buffer, b_size);
-}
-
-/**
- * @brief Get the requested file from the HTTP request
- * @param buffer The buffer containing the HTTP request
- * @param ret The return code generated by the function.
- * @see FileStatusCodes
- * @return The file requested
- * @attention Return value must be freed
- */
-char *get_requested_file(char *buffer, int *ret)
-{
-    size_t max_path = PATH_MAX - strlen(HTML_PATH);
-    char file[PATH_MAX + 1] = { 0 };
-    char *lineptr = NULL, *res = NULL, *word = NULL, *ver = NULL;
-    size_t path_size = 0, line_len = 0;
-    *ret = FILE_STATUS_CODES_SUCCESS;
-
-    FILE *fp = fmemopen(buffer, strlen(buffer), "r");
-    if (fp == NULL)
-    {
-        perror("fmemopen");
-        *ret = FILE_STATUS_CODES_SERVER_ERR;
-        goto get_requested_file_end;
-    }
-
-    if (getline(&lineptr, &line_len, fp) == -1)
-    {
-        perror("getline");
-        *ret = FILE_STATUS_CODES_SERVER_ERR;
-        goto get_requested_file_end;
-    }
-
-    word = strtok(lineptr, " ");
-    while ((word = strtok(NULL, " ")) != NULL && path_size < max_path)
-    {
-        word = trim(word);
-        // If we reached the HTTP version, we've parsed the whole filename
-        if (strcmp(word, HTTP_VER) == 0)
-            break;
-        if (path_size != 0)
-        {
-            snprintf(file + path_size, PATH_MAX - path_size, "\\ %s", word);
-            path_size += strlen(word) + 2; // One for backslash, one for space
-        }
-        else
-        {
-            // Remove forward slash
-            if (word[0] == '/')
-                word++;
-            strncpy(file, word, PATH_MAX);
-            path_size += strlen(word);
-        }
-    }
-
-    if (path_size >= max_path)
-    {
-        *ret = FILE_STATUS_CODES_FILE_ERR;
-        goto get_requested_file_end;
-    }
-
-    res = calloc(path_size + 1, sizeof(char));
-    if (res == NULL)
-    {
-        perror("calloc");
-        *ret = FILE_STATUS_CODES_SERVER_ERR;
-    }
-    else
-        strcpy(res, file);
-
-get_requested_file_end:
-    if (fp != NULL)
-        fclose(fp);
-    free(lineptr);
-    free(ver);
-    return res;
-}
-
-void send_requested_file(HttpRequest *req, int *sock)
-{
-    bool malloced = false;
-    char actual_path[PATH_MAX + 1] = { 0 };
-    char full_path[PATH_MAX + 1] = { 0 };
-    char *buff = NULL;
-    char *def = "/.";
-    char *dup = strdup(req->buff);
-    if (dup == NULL)
-    {
-        perror("strdup");
-        send_500_error(sock);
-        goto send_requested_file_end;
-    }
-
-    // Parse the file requested from the request
-    char *file = strtok(dup, " ");
-    file = strtok(NULL, " ");
-    if (strcmp(file, "/") == 0)
-    {
-        file = def;
-        file++; // Remove the forward slash
-    }
-    else
-    {
-        int ret = 0;
-        file = get_requested_file(req->buff, &ret);
-        if (file == NULL)
-        {
-            switch (ret)
-            {
-                case FILE_STATUS_CODES_FILE_ERR:
-                    send_431_error(sock);
-                    break;
-                case FILE_STATUS_CODES_SERVER_ERR:
-                    send_500_error(sock);
-                    break;
-                default:
-                    break;
-            }
-            goto send_requested_file_end;
-        }
-        malloced = true;
-    }
-
-    // Basic check to see if the request is invalid
-    size_t len = strlen(file);
-    if (len == 0) // Not checking this will result in memory read errors below
-    {
-        send_400_error(sock);
-        goto send_requested_file_end;
-    }
-    if (file[len - 1] == '\r' || file[len - 1] == '\n')
-    {
-        send_400_error(sock);
-        goto send_requested_file_end;
-    }
-
-    // Create the full path based on the configured HTML root directory
-    snprintf(full_path, PATH_MAX, "%s/%s", HTML_PATH, file);
-
-    // Validity check
-    if (realpath(full_path, actual_path) == NULL)
-    {
-        log_message("ERROR(bad path): ", full_path, false);
-        send_404_error(sock);
-        goto send_requested_file_end;
-    }
-
-    // Make sure we have permission to read the file
-    if (access(actual_path, R_OK) != 0)
-    {
-        log_message("ERROR(permission): ", actual_path, false);
-        send_403_error(sock);
-        goto send_requested_file_end;
-    }
-
-    // Verify we can open the file
-    FILE *fp = fopen(actual_path, "r");
-    if (fp == NULL)
-    {
-        log_message("ERROR(open): ", actual_path, false);
-        send_500_error(sock);
-        goto send_requested_file_end;
-    }
-
-    struct stat path_stat;
-    stat(actual_path, &path_stat);
-
-    // User requested a directory rather than a file
-    if (S_ISDIR(path_stat.st_mode))
-    {
-        fclose(fp);
-
-        // Create the path for index.html
-        const char index[] = "/index.html";
-        char *index_path = malloc(sizeof(index) + strlen(actual_path) + 1);
-        if (index_path == NULL)
-        {
-            send_500_error(sock);
-            goto send_requested_file_end;
-        }
-        sprintf(index_path, "%s%s", actual_path, index);
-
-        // Check if index.html exists in this directory
-        if (realpath(index_path, full_path) != NULL)
-        {
-            // Make sure we have permission to read the index.html file
-            if (access(index_path, R_OK) == 0)
-            {
-                fp = fopen(index_path, "r");
-                if (fp == NULL)
-                {
-                    send_500_error(sock);
-                    free(index_path);
-                    goto send_requested_file_end;
-                }
-                free(index_path);
-                goto send_requested_file_send;
-            }
-            log_message("ERROR(permission): ", index_path, false);
-            send_403_error(sock);
-            free(index_path);
-            goto send_requested_file_end;
-        }
-        free(index_path);
-
-        // index.html does not exist in this directory,
-        // show the directory's contents
-        size_t size = BUFF_SIZE;
-        char *buffer = calloc(size, sizeof(char));
-        if (buffer == NULL)
-        {
-            send_500_error(sock);
-            goto send_requested_file_end;
-        }
-        buff = buffer;
-        create_dir_html(file, actual_path, &buff, &size);
-
-        fp = fmemopen(buff, size, "r");
-        if (fp == NULL)
-        {
-            send_500_error(sock);
-            free(buffer);
-            goto send_requested_file_end;
-        }
-    }
-
-send_requested_file_send:
-    // Send the requested file, or directory contents, back to the user
-    send_200(sock, fp, actual_path, req->type);
-    fclose(fp);
-    if (buff != NULL)
-        free(buff);
-    close(*sock);
-
-send_requested_file_end:
-    if (malloced)
-        free(file);
-    free(dup);
-}
-
-/*=====================================*/
-/*       Success Response Codes        */
-/*=====================================*/
-
-void send_200(int *sock, FILE *fp, const char *file, uint8_t type)
-{
-    size_t bytes_read = 0;
-    char buffer[BUFF_SIZE];
-    memset(buffer, 0, BUFF_SIZE);
-    generate_resp_head(buffer, fp, file, "200 OK", type);
-    write(*sock, buffer, strlen(buffer));
-
-#ifdef VERBOSE
-    printf("%s", buffer);
-#endif
-
-    // Read file contents and send them to the client
-    memset(buffer, 0, BUFF_SIZE);
-    while ((bytes_read = fread(buffer, 1, BUFF_SIZE - 1, fp)) > 0)
-    {
-        // Prevents an error if the client closed the socket before all the
-        // data was sent
-        send(*sock, buffer, bytes_read, MSG_NOSIGNAL);
-    }
-
-#ifdef VERBOSE
-    printf("closing connection...\n");
-#endif
-}
-
-void send_204(int *sock, uint8_t type)
-{
-    char buffer[BUFF_SIZE];
-    memset(buffer, 0, BUFF_SIZE);
-    generate_resp_head(buffer, NULL, NULL, "204 No Content", type);
-    send_response(buffer, strlen(buffer), sock);
-}
-
-/*=====================================*/
-/*        Error Response Codes         */
-/*=====================================*/
-
-void send_400_error(int *sock)
-{
-    send_error("400 Bad Request", sock);
-}
-
-void send_403_error(int *sock)
-{
-    send_error("403 Forbidden", sock);
-}
-
-void send_404_error(int *sock)
-{
-    send_error("404 File not found", sock);
-}
-
-void send_405_error(int *sock)
-{
-    send_error("405 Method Not Allowed", sock);
-}
-
-void send_408_error(int *sock)
-{
-    send_error("408 Request Timeout", sock);
-}
-
-void send_413_error(int *sock)
-{
-    send_error("413 Content Too Large", sock);
-}
-
-#ifdef TEAPOT
-void send_418_error(int *sock)
-{
-    send_error("418 I'm a teapot", sock);
-}
-#endif /* TEAPOT */
-
-void send_431_error(int *sock)
-{
-    send_error("431 Request Header Fields Too Large", sock);
-}
-
-/*=====================================*/
-/*     Server Error Response Codes     */
-/*=====================================*/
-void send_500_error(int *sock)
-{
-    send_error("500 Internal Server Error", sock);
-}
-
-void send_505_error(int *sock)
-{
-    send_error("505 HTTP Version Not Supported", sock);
-}
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <unistd.h>
+
+#include "access_log.h"
+#include "arena.h"
+#include "compress.h"
+#include "content_map.h"
+#include "defaults.h"
+#include "dir_listing.h"
+#include "encoding.h"
+#include "file_cache.h"
+#include "http.h"
+#include "metrics.h"
+#include "range.h"
+#include "send_queue.h"
+#include "stdio.h"
+#include "utils.h"
+
+#define ERR_SIZE 256
+#define FOOT_SIZE 256
+#define HEAD_SIZE 64
+#define CONSOLE_WIDTH 80
+#define SENDFILE_CHUNK 0x7ffff000 // Most Linux will transfer in one call
+#define MAX_HEAD_PARTS 8          // Most pieces a response header is split in
+#define ETAG_SIZE 64              // W/"<inode>-<size>-<mtime>" in hex
+
+/**
+ * @def MIN(a, b)
+ * @brief Get the smallest of two values
+ * @param a First value to compare
+ * @param b Second value to compare
+ * @return The smaller of the two values
+ */
+#define MIN(a, b) ((a < b) ? a : b)
+
+static const char HTTP_VER[] = "HTTP/1.1";
+static const char ELLIPSES[] = " ... ";
+static const char *REQ_STRS[] = { "N/A",     "GET",  "POST",  "HEAD",
+                                  "OPTIONS", "PUT",  "PATCH", "DELETE",
+                                  "CONNECT", "TRACE" };
+static const int NUM_REQ_TYPES = sizeof(REQ_STRS) / sizeof(char *);
+
+/// List of supported HTTP methods
+static const uint8_t SUPPORTED[] = { REQUEST_TYPE_GET, REQUEST_TYPE_HEAD,
+                                     REQUEST_TYPE_OPTIONS };
+static const int NUM_SUPPORTED = sizeof(SUPPORTED) / sizeof(uint8_t);
+
+/// Status lines for the responses that are not errors
+static const char STATUS_200[] = "HTTP/1.1 200 OK\r\n";
+static const char STATUS_204[] = "HTTP/1.1 204 No Content\r\n";
+static const char STATUS_206[] = "HTTP/1.1 206 Partial Content\r\n";
+static const char STATUS_304[] = "HTTP/1.1 304 Not Modified\r\n";
+static const char STATUS_416[] = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+
+/// The end of every header, which also ends the header block
+static const char CONN_KEEP_ALIVE[] = "Connection: keep-alive\r\n\r\n";
+static const char CONN_CLOSE[] = "Connection: close\r\n\r\n";
+static const char CRLF[] = "\r\n";
+static const char LAST_CHUNK[] = "0\r\n\r\n";
+
+/// Header fields that never change, rendered by init_response_headers()
+static char server_field[HEAD_SIZE];
+static size_t server_field_len = 0;
+static char allow_field[HEAD_SIZE];
+static size_t allow_field_len = 0;
+
+/// Separates the parts of a multipart/byteranges body
+static char boundary[HEAD_SIZE];
+
+/**
+ * @struct ErrorResponse
+ * @brief An error response, rendered once at startup
+ */
+typedef struct
+{
+    const char *status; //!< The status code and reason
+    char *resp;         //!< The response, without its Date field
+    size_t line_len;    //!< Length of the status line, which comes before Date
+    size_t len;         //!< Length of resp
+    size_t page_len;    //!< Length of the page, which ends resp
+} ErrorResponse;
+
+static ErrorResponse ERRORS[NUM_ERROR_PAGES] = {
+    [ERROR_PAGE_400] = { "400 Bad Request" },
+    [ERROR_PAGE_403] = { "403 Forbidden" },
+    [ERROR_PAGE_404] = { "404 File not found" },
+    [ERROR_PAGE_405] = { "405 Method Not Allowed" },
+    [ERROR_PAGE_408] = { "408 Request Timeout" },
+    [ERROR_PAGE_413] = { "413 Content Too Large" },
+    [ERROR_PAGE_418] = { "418 I'm a teapot" },
+    [ERROR_PAGE_431] = { "431 Request Header Fields Too Large" },
+    [ERROR_PAGE_500] = { "500 Internal Server Error" },
+    [ERROR_PAGE_503] = { "503 Service Unavailable" },
+    [ERROR_PAGE_505] = { "505 HTTP Version Not Supported" },
+};
+
+/**
+ * @struct ResponseHead
+ * @brief The header of a response, in pieces ready to be sent with one call
+ *
+ * Most of the pieces are rendered once at startup. Only the fields that
+ * change between responses are written into fields
+ */
+typedef struct
+{
+    struct iovec parts[MAX_HEAD_PARTS + 1]; //!< The pieces, plus the body
+    int count;                              //!< Number of pieces
+    size_t fields_len;                      //!< Bytes used in fields
+    char fields[HEAD_SIZE * 8];             //!< Date, type, length, etc.
+} ResponseHead;
+
+/**
+ * @struct SentResponse
+ * @brief What was sent back for the request being handled, for the access
+ * log
+ */
+typedef struct
+{
+    uint16_t status;  //!< The status code, 0 if nothing was sent
+    uint64_t bytes;   //!< Bytes of body sent
+    uint64_t open_ns; //!< Time spent opening the path (unit: ns)
+} SentResponse;
+
+static _Thread_local SentResponse sent_resp = { 0, 0, 0 };
+
+/**
+ * @brief Note the status of the response being sent
+ * @param status The status code
+ */
+static void set_sent_status(uint16_t status)
+{
+    sent_resp.status = status;
+    metrics_count_response(status);
+}
+
+/**
+ * @brief Note bytes of the response body that were sent
+ * @param bytes The number of bytes
+ */
+static void add_sent_bytes(uint64_t bytes)
+{
+    sent_resp.bytes += bytes;
+    metrics_add_bytes(bytes);
+}
+
+/**
+ * @enum PathStatus
+ * @brief Status codes for the return value of decode_path
+ */
+enum PathStatus
+{
+    PATH_STATUS_SUCCESS = 0,
+    PATH_STATUS_INVALID = 1,
+    PATH_STATUS_TOO_LONG = 2
+};
+
+/**
+ * @brief Log the message, cut short to ensure it fits in the console
+ * @param preamble The start of the log message
+ * @param path The path to the file
+ * @param ver Should the version be displayed
+ */
+static void log_message(const char *preamble, const char *path, bool ver)
+{
+    char log[CONSOLE_WIDTH + 2] = { 0 };
+    size_t pre_len = strlen(preamble);
+    size_t path_len = strlen(path);
+    snprintf(log, CONSOLE_WIDTH + 1, "%s%s", preamble, path);
+
+    // Message is too long, truncate it
+    if ((pre_len + path_len) > CONSOLE_WIDTH)
+    {
+        size_t start = CONSOLE_WIDTH - sizeof(ELLIPSES);
+        start -= ver ? sizeof(HTTP_VER) : 0;
+        sprintf(log + start, "%s%s\n", ELLIPSES, ver ? HTTP_VER : "");
+    }
+    size_t len = strlen(log);
+    if (log[len - 1] != '\n')
+        log[len++] = '\n';
+    log_write(log, len);
+}
+
+/**
+ * @brief Check if the slice holds exactly the string
+ * @param slice The slice to check
+ * @param str The string to compare against
+ * @return True if they match
+ */
+static bool slice_equals(const StrSlice *slice, const char *str)
+{
+    return strlen(str) == slice->len
+           && memcmp(slice->ptr, str, slice->len) == 0;
+}
+
+/**
+ * @brief Check if the character can be part of a method or field name
+ * @param c The character to check
+ * @return True if the character is a token character
+ * @ref https://www.rfc-editor.org/rfc/rfc9110#section-5.6.2
+ */
+static bool is_tchar(char c)
+{
+    return isalnum((unsigned char) c)
+           || (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/**
+ * @brief Find the end of the line starting at pos
+ * @param pos The start of the line
+ * @param end The end of the buffer
+ * @param line Where to store the line, without its line ending
+ * @return The start of the next line, or NULL if the line has not ended
+ */
+static const char *next_line(const char *pos, const char *end, StrSlice *line)
+{
+    const char *nl = memchr(pos, '\n', end - pos);
+    if (nl == NULL)
+        return NULL;
+
+    line->ptr = pos;
+    line->len = nl - pos;
+    if (line->len > 0 && pos[line->len - 1] == '\r')
+        line->len--;
+    return nl + 1;
+}
+
+/**
+ * @brief Split the request line into its method, target and version
+ * @param req The HTTP request to store the slices in
+ * @param line The request line
+ * @return True if the request line is well formed
+ */
+static bool parse_request_line(HttpRequest *req, const StrSlice *line)
+{
+    const char *pos = line->ptr;
+    const char *end = line->ptr + line->len;
+
+    // The method is a token, followed by a single space
+    const char *start = pos;
+    while (pos < end && is_tchar(*pos))
+        pos++;
+    if (pos == start || pos == end || *pos != ' ')
+        return false;
+    req->method = (StrSlice) { start, pos - start };
+
+    // The target runs until the next space, and has no control characters
+    start = ++pos;
+    while (pos < end && *pos > ' ' && *pos != 0x7f)
+        pos++;
+    if (pos == start || pos == end || *pos != ' ')
+        return false;
+    req->target = (StrSlice) { start, pos - start };
+
+    // Anything left is the version, which must look like HTTP/x.y
+    start = ++pos;
+    req->version = (StrSlice) { start, end - start };
+    if (req->version.len != sizeof(HTTP_VER) - 1
+        || strncmp(start, "HTTP/", strlen("HTTP/")) != 0
+        || !isdigit((unsigned char) start[5]) || start[6] != '.'
+        || !isdigit((unsigned char) start[7]))
+        return false;
+
+    // Split off the query, if there is one
+    req->path = req->target;
+    req->query = (StrSlice) { req->target.ptr + req->target.len, 0 };
+    const char *query = memchr(req->target.ptr, '?', req->target.len);
+    if (query != NULL)
+    {
+        req->path.len = query - req->target.ptr;
+        req->query.ptr = query + 1;
+        req->query.len = req->target.len - req->path.len - 1;
+    }
+
+    // Compare the method against the list of possible HTTP requests
+    for (int type = 0; type < NUM_REQ_TYPES; type++)
+    {
+        if (slice_equals(&req->method, REQ_STRS[type]))
+        {
+            req->type = type;
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Split a header line into its field name and value
+ * @param line The header line
+ * @param header Where to store the field
+ * @return True if the header line is well formed
+ */
+static bool parse_header(const StrSlice *line, HttpHeader *header)
+{
+    const char *pos = line->ptr;
+    const char *end = line->ptr + line->len;
+
+    // No whitespace is allowed between the name and the colon
+    while (pos < end && is_tchar(*pos))
+        pos++;
+    if (pos == line->ptr || pos == end || *pos != ':')
+        return false;
+    header->name = (StrSlice) { line->ptr, pos - line->ptr };
+
+    // Strip the whitespace surrounding the value
+    pos++;
+    while (pos < end && (*pos == ' ' || *pos == '\t'))
+        pos++;
+    while (end > pos && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    header->value = (StrSlice) { pos, end - pos };
+    return true;
+}
+
+int parse_request(HttpRequest *req)
+{
+    const char *end = req->buff + req->size;
+    StrSlice line;
+    req->type = REQUEST_TYPE_INVALID;
+    req->num_headers = 0;
+    req->head_len = 0;
+
+    const char *pos = next_line(req->buff, end, &line);
+    if (pos == NULL)
+        return PARSE_STATUS_INCOMPLETE;
+    if (!parse_request_line(req, &line))
+        return PARSE_STATUS_INVALID;
+
+    // Every line up to the first empty one is a header field
+    while ((pos = next_line(pos, end, &line)) != NULL)
+    {
+        if (line.len == 0)
+        {
+            req->head_len = pos - req->buff;
+            return PARSE_STATUS_DONE;
+        }
+        if (req->num_headers == MAX_HEADERS)
+            return PARSE_STATUS_TOO_LARGE;
+        if (!parse_header(&line, &req->headers[req->num_headers]))
+            return PARSE_STATUS_INVALID;
+        req->num_headers++;
+    }
+    return PARSE_STATUS_INCOMPLETE;
+}
+
+const StrSlice *get_header(const HttpRequest *req, const char *name)
+{
+    size_t len = strlen(name);
+    for (int x = 0; x < req->num_headers; x++)
+    {
+        const HttpHeader *header = &req->headers[x];
+        if (header->name.len == len
+            && strncasecmp(header->name.ptr, name, len) == 0)
+            return &header->value;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check if the client asked for the connection to be closed
+ * @param req The parsed HTTP request
+ * @return True if "close" is one of the Connection header's options
+ */
+static bool connection_close(const HttpRequest *req)
+{
+    const StrSlice *value = get_header(req, "Connection");
+    if (value == NULL)
+        return false;
+
+    // The value is a comma separated list of options
+    const char *pos = value->ptr;
+    const char *end = value->ptr + value->len;
+    while (pos < end)
+    {
+        while (pos < end && (*pos == ',' || *pos == ' ' || *pos == '\t'))
+            pos++;
+        const char *start = pos;
+        while (pos < end && *pos != ',' && *pos != ' ' && *pos != '\t')
+            pos++;
+        if ((size_t) (pos - start) == strlen("close")
+            && strncasecmp(start, "close", pos - start) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Close the socket once the response is sent
+ *
+ * If part of the response is still waiting in the thread's send queue, the
+ * socket is left open and closed once the queue is sent
+ * @param sock The socket to close
+ */
+static void close_socket(int *sock)
+{
+    SendQueue *queue = send_queue_current();
+    if (queue != NULL && !send_queue_empty(queue))
+    {
+        queue->close_after = true;
+        return;
+    }
+
+    close(*sock);
+    *sock = SOCKET_ERROR;
+}
+
+/**
+ * @brief Close the socket, unless the connection is being kept alive
+ * @param req The HTTP request that was responded to
+ * @param sock The socket the response was sent on
+ */
+static void finish_response(HttpRequest *req, int *sock)
+{
+    if (req->keep_alive)
+        return;
+
+    close_socket(sock);
+#ifdef VERBOSE
+    log_printf("closing connection...\n");
+#endif
+}
+
+/**
+ * @brief Send the server's metrics
+ * @param req The HTTP request from the user
+ * @param sock The socket to send to
+ */
+static void send_status(HttpRequest *req, int *sock)
+{
+    size_t len = 0;
+    char *text = render_metrics(&len);
+    if (text == NULL)
+    {
+        send_500_error(sock);
+        return;
+    }
+
+    ResponseBody body = { .fd = -1, .data = text, .size = len,
+                          .type = METRICS_TYPE };
+    send_200(sock, &body, req);
+    finish_response(req, sock);
+}
+
+void handle_request(HttpRequest *req, int *sock)
+{
+    sent_resp.status = 0;
+    sent_resp.bytes = 0;
+    sent_resp.open_ns = 0;
+    uint64_t start = metrics_now();
+#ifdef ALLOC_STATS
+    uint64_t allocs = get_alloc_count();
+#endif
+
+    if (!slice_equals(&req->version, HTTP_VER))
+        send_505_error(sock);
+    else
+    {
+        if (req->keep_alive && connection_close(req))
+            req->keep_alive = false;
+
+        switch (req->type)
+        {
+            case REQUEST_TYPE_GET:
+            case REQUEST_TYPE_HEAD:
+                if (STATUS_PAGE && slice_equals(&req->path, STATUS_PATH))
+                    send_status(req, sock);
+                else
+                    send_requested_file(req, sock);
+                break;
+            case REQUEST_TYPE_OPTIONS:
+                send_204(sock, req);
+                break;
+            default:
+                send_405_error(sock);
+                break;
+        }
+    }
+
+    if (start != 0)
+        metrics_record(METRICS_PHASE_SEND,
+                       metrics_now() - start - sent_resp.open_ns);
+    if (sent_resp.status != 0)
+        access_log_request(req, sent_resp.status, sent_resp.bytes);
+
+    // Nothing the response took from the arena is used past this point
+    arena_reset();
+#ifdef ALLOC_STATS
+    metrics_add_allocs(get_alloc_count() - allocs);
+#endif
+}
+
+void reject_request(const HttpRequest *req, int page, int *sock)
+{
+    sent_resp.status = 0;
+    sent_resp.bytes = 0;
+    send_error(page, sock);
+    access_log_request(req, sent_resp.status, sent_resp.bytes);
+}
+
+/**
+ * @brief Send every buffer to the socket, picking up after partial sends
+ * @param sock The socket to send to
+ * @param iov The buffers to send, which are updated as they are sent
+ * @param count The number of buffers
+ * @param flags Flags for sendmsg, on top of MSG_NOSIGNAL
+ * @return True if everything was sent, or queued in the thread's send queue
+ */
+static bool send_all(int sock, struct iovec *iov, int count, int flags)
+{
+    SendQueue *queue = send_queue_current();
+    if (queue != NULL)
+        return send_queue_write(queue, sock, iov, count, flags);
+
+    struct msghdr msg = { 0 };
+    while (count > 0)
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(sock, &msg, flags | MSG_NOSIGNAL);
+        if (sent == SOCKET_ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Skip over the buffers that were fully sent
+        while (count > 0 && (size_t) sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Load a custom error page from the HTML root
+ * @param status The status of the error, starting with its code
+ * @param size Where to store the size of the page
+ * @return The page, or NULL if there is none
+ * @attention If the function does not return NULL, the returned page must be
+ * freed when done
+ */
+static char *load_error_page(const char *status, size_t *size)
+{
+    char path[PATH_MAX + 1] = { 0 };
+    snprintf(path, PATH_MAX, "%s/%.3s.html", HTML_PATH, status);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return NULL;
+
+    *size = get_file_size(fp);
+    char *page = malloc(*size + 1);
+    if (page != NULL && fread(page, 1, *size, fp) != *size)
+    {
+        free(page);
+        page = NULL;
+    }
+    fclose(fp);
+    return page;
+}
+
+/**
+ * @brief Render the whole error response, apart from the Date field
+ * @param err The error response to render
+ * @return 0 on success, 1 if something went wrong
+ */
+static int render_error(ErrorResponse *err)
+{
+    char page[HEAD_SIZE * 2];
+    size_t page_len = 0;
+    char *custom = ERROR_PAGES ? load_error_page(err->status, &page_len)
+                               : NULL;
+    if (custom == NULL)
+        page_len = snprintf(page, sizeof(page), "<h1>%s</h1>\n", err->status);
+
+    const char *fmt = "HTTP/1.1 %s\r\n%s"
+                      "Content-Type: text/html; charset=UTF-8\r\n"
+                      "Content-Length: %zu\r\n%s";
+    int head_len = snprintf(NULL, 0, fmt, err->status, server_field,
+                            page_len, CONN_CLOSE);
+    err->resp = malloc(head_len + page_len + 1);
+    if (err->resp == NULL)
+    {
+        free(custom);
+        return 1;
+    }
+
+    sprintf(err->resp, fmt, err->status, server_field, page_len, CONN_CLOSE);
+    memcpy(err->resp + head_len, (custom != NULL) ? custom : page, page_len);
+    err->line_len = strlen("HTTP/1.1 ") + strlen(err->status) + 2;
+    err->len = head_len + page_len;
+    err->page_len = page_len;
+    free(custom);
+    return 0;
+}
+
+void send_error(int page, int *sock)
+{
+    ErrorResponse *err = &ERRORS[page];
+    char date[HEAD_SIZE];
+    memcpy(date, "Date: ", 6);
+    get_http_date(date + 6);
+    memcpy(date + 6 + HTTP_DATE_LEN, "\r\n", 2);
+
+    // Everything but the date was rendered at startup
+    struct iovec iov[] = {
+        { err->resp, err->line_len },
+        { date, 6 + HTTP_DATE_LEN + 2 },
+        { err->resp + err->line_len, err->len - err->line_len },
+    };
+#ifdef VERBOSE
+    for (size_t x = 0; x < sizeof(iov) / sizeof(struct iovec); x++)
+        log_write(iov[x].iov_base, iov[x].iov_len);
+    log_printf("\nclosing connection...\n");
+#endif
+    set_sent_status(strtol(err->status, NULL, 10));
+    if (send_all(*sock, iov, sizeof(iov) / sizeof(struct iovec), 0))
+        add_sent_bytes(err->page_len);
+    close_socket(sock);
+}
+
+int init_response_headers(void)
+{
+    server_field_len = snprintf(server_field, sizeof(server_field),
+                                "Server: %s\r\n", SERVER_NAME);
+
+    strcpy(allow_field, "Allow:");
+    for (int x = 0; x < NUM_SUPPORTED; x++)
+        sprintf(allow_field + strlen(allow_field), " %s,",
+                REQ_STRS[SUPPORTED[x]]);
+    strcpy(allow_field + strlen(allow_field) - 1, "\r\n");
+    allow_field_len = strlen(allow_field);
+
+    // Only has to be unlikely to show up in the files being sent
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+             (unsigned long) time(NULL), (unsigned long) getpid());
+
+    // Make sure the shared date is ready before any threads use it
+    char date[HTTP_DATE_LEN + 1];
+    get_http_date(date);
+
+    for (int x = 0; x < NUM_ERROR_PAGES; x++)
+    {
+        if (render_error(&ERRORS[x]) != 0)
+        {
+            free_response_headers();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void free_response_headers(void)
+{
+    for (int x = 0; x < NUM_ERROR_PAGES; x++)
+    {
+        free(ERRORS[x].resp);
+        ERRORS[x].resp = NULL;
+    }
+}
+
+/**
+ * @brief Get the content type of the file
+ * @param file The file being accessed
+ * @return The content type, which lives for as long as the server does
+ * @note Not checking for all types
+ * @see get_type_from_map()
+ */
+static const char *get_content_type(const char *file)
+{
+    char ext[HEAD_SIZE] = { 0 };
+    strncpy(ext, get_filename_ext(file), sizeof(ext) - 1);
+    return get_type_from_map(lowerstr(ext));
+}
+
+/**
+ * @brief Get the Cache-Control value to send with the file
+ * @param file The file being sent
+ * @return The value from the matching cache_control rule, or NULL if there
+ * is none
+ */
+static const char *get_cache_control(const char *file)
+{
+    char ext[HEAD_SIZE] = { 0 };
+    strncpy(ext, get_filename_ext(file), sizeof(ext) - 1);
+    lowerstr(ext);
+
+    const char *fallback = NULL;
+    for (int x = 0; x < NUM_CACHE_RULES; x++)
+    {
+        if (strcmp(CACHE_RULES[x].ext, ext) == 0)
+            return CACHE_RULES[x].value;
+        if (fallback == NULL && strcmp(CACHE_RULES[x].ext, "*") == 0)
+            fallback = CACHE_RULES[x].value;
+    }
+    return fallback;
+}
+
+/**
+ * @brief Create the entity tag of the file from its inode, size and
+ * modification time
+ *
+ * A file modified in the current second could change again without its tag
+ * changing, so its tag is only weak. A body that is compressed gets the
+ * coding added, so it never shares a tag with the file as is
+ * @param body The body being sent, with stats set
+ * @param etag Where to store the tag, must hold ETAG_SIZE characters
+ * @return True if the tag is strong
+ * @ref https://www.rfc-editor.org/rfc/rfc7232#section-2.3
+ */
+static bool format_etag(const ResponseBody *body, char *etag)
+{
+    const struct stat *stats = body->stats;
+    bool strong = stats->st_mtime < time(NULL);
+    snprintf(etag, ETAG_SIZE, "%s\"%llx-%llx-%llx%s%s\"", strong ? "" : "W/",
+             (unsigned long long) stats->st_ino,
+             (unsigned long long) stats->st_size,
+             (unsigned long long) stats->st_mtime,
+             (body->encoding != NULL) ? "-" : "",
+             (body->encoding != NULL) ? body->encoding : "");
+    return strong;
+}
+
+/**
+ * @brief Check if any entity tag in the If-None-Match list matches the file
+ *
+ * Tags are compared weakly, so W/ prefixes are ignored
+ * @param list The value of the If-None-Match field
+ * @param etag The entity tag of the file
+ * @return True if the list is "*" or holds the tag
+ */
+static bool etag_list_matches(const StrSlice *list, const char *etag)
+{
+    if (etag[0] == 'W')
+        etag += 2;
+    size_t etag_len = strlen(etag);
+
+    const char *pos = list->ptr;
+    const char *end = list->ptr + list->len;
+    while (pos < end)
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+            pos++;
+        const char *tag = pos;
+        while (pos < end && *pos != ',')
+            pos++;
+        const char *tag_end = pos;
+        while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+            tag_end--;
+
+        if (tag_end - tag == 1 && *tag == '*')
+            return true;
+        if (tag_end - tag > 2 && tag[0] == 'W' && tag[1] == '/')
+            tag += 2;
+        if ((size_t) (tag_end - tag) == etag_len
+            && memcmp(tag, etag, etag_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Check if the client's copy of the file is still current
+ *
+ * If-None-Match is used when there is one, otherwise If-Modified-Since
+ * @param req The HTTP request from the user
+ * @param body The body that would be sent, with stats set
+ * @return True if the client can keep using its copy (304)
+ * @ref https://www.rfc-editor.org/rfc/rfc7232#section-6
+ */
+static bool is_not_modified(const HttpRequest *req, const ResponseBody *body)
+{
+    const StrSlice *match = get_header(req, "If-None-Match");
+    if (match != NULL)
+    {
+        char etag[ETAG_SIZE];
+        format_etag(body, etag);
+        return etag_list_matches(match, etag);
+    }
+
+    const StrSlice *since = get_header(req, "If-Modified-Since");
+    time_t date;
+    return since != NULL && parse_http_date(since->ptr, since->len, &date)
+           && body->stats->st_mtime <= date;
+}
+
+/**
+ * @brief Add a piece to the response header
+ * @param head The response header
+ * @param part The piece to add
+ * @param len The length of the piece
+ */
+static void add_head_part(ResponseHead *head, const char *part, size_t len)
+{
+    head->parts[head->count].iov_base = (void *) part;
+    head->parts[head->count].iov_len = len;
+    head->count++;
+}
+
+/**
+ * @brief Add a field that changes between responses to the response header
+ *
+ * Fields that do not fit are cut short, which never happens with the fields
+ * the server sends
+ * @param head The response header
+ * @param format printf style format of the field, ending in CRLF
+ * @param ... Values for the format
+ */
+static void add_head_field(ResponseHead *head, const char *format, ...)
+{
+    size_t room = sizeof(head->fields) - head->fields_len;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(head->fields + head->fields_len, room, format, args);
+    va_end(args);
+    if (len > 0)
+        head->fields_len += MIN((size_t) len, room - 1);
+}
+
+/**
+ * @brief Start the header to be sent back to the user
+ *
+ * Fields can then be added with add_head_field(), before ending the header
+ * with end_resp_head()
+ * @param head The response header to fill in
+ * @param status The status line of the response
+ * @param req The HTTP request from the user
+ */
+static void begin_resp_head(ResponseHead *head, const char *status,
+                            HttpRequest *req)
+{
+    char date[HTTP_DATE_LEN + 1];
+    get_http_date(date);
+    head->count = 0;
+    head->fields_len = 0;
+    add_head_part(head, status, strlen(status));
+    set_sent_status(strtol(status + sizeof(HTTP_VER), NULL, 10));
+    if (req->type == REQUEST_TYPE_OPTIONS)
+        add_head_part(head, allow_field, allow_field_len);
+    add_head_part(head, server_field, server_field_len);
+    add_head_field(head, "Date: %s\r\n", date);
+}
+
+/**
+ * @brief Finish the header, after all its fields have been added
+ * @param head The response header
+ * @param req The HTTP request from the user
+ */
+static void end_resp_head(ResponseHead *head, HttpRequest *req)
+{
+    add_head_part(head, head->fields, head->fields_len);
+    if (req->keep_alive)
+        add_head_part(head, CONN_KEEP_ALIVE, sizeof(CONN_KEEP_ALIVE) - 1);
+    else
+        add_head_part(head, CONN_CLOSE, sizeof(CONN_CLOSE) - 1);
+}
+
+/**
+ * @brief Add the fields a client uses to tell if its copy of the file is
+ * current, and how long it can keep it
+ * @param head The response header
+ * @param body The body being sent, with stats set
+ */
+static void add_validator_fields(ResponseHead *head, const ResponseBody *body)
+{
+    char etag[ETAG_SIZE];
+    char modified[HTTP_DATE_LEN + 1];
+    format_etag(body, etag);
+    format_http_date(body->stats->st_mtime, modified);
+    add_head_field(head, "ETag: %s\r\nLast-Modified: %s\r\n", etag, modified);
+    if (body->cache_control != NULL)
+        add_head_field(head, "Cache-Control: %s\r\n", body->cache_control);
+    if (body->vary != NULL)
+        add_head_field(head, "Vary: %s\r\n", body->vary);
+}
+
+#ifdef VERBOSE
+/**
+ * @brief Log the response header to the console
+ * @param head The response header
+ */
+static void print_resp_head(const ResponseHead *head)
+{
+    for (int x = 0; x < head->count; x++)
+        log_write(head->parts[x].iov_base, head->parts[x].iov_len);
+}
+#endif /* VERBOSE */
+
+/**
+ * @brief Hex digit to its value
+ * @param c The hex digit
+ * @return The value of the digit, or -1 if it is not a hex digit
+ */
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Percent-decode the path and remove any dot segments from it
+ *
+ * ".." can never climb above the root, so the result is always safe to
+ * append to HTML_PATH
+ * @param path The path from the request target
+ * @param out Where to store the path, without its leading slash
+ * @param size The size of out
+ * @return The resulting PathStatus
+ */
+static int decode_path(const StrSlice *path, char *out, size_t size)
+{
+    char decoded[PATH_MAX + 1];
+    size_t len = 0;
+    for (size_t x = 0; x < path->len; x++, len++)
+    {
+        if (len == PATH_MAX)
+            return PATH_STATUS_TOO_LONG;
+
+        decoded[len] = path->ptr[x];
+        if (decoded[len] != '%')
+            continue;
+
+        int high = (x + 2 < path->len) ? hex_value(path->ptr[x + 1]) : -1;
+        int low = (high != -1) ? hex_value(path->ptr[x + 2]) : -1;
+        if (low == -1 || (high == 0 && low == 0))
+            return PATH_STATUS_INVALID;
+        decoded[len] = (char) ((high << 4) | low);
+        x += 2;
+    }
+
+    // Rebuild the path one segment at a time
+    size_t out_len = 0;
+    for (size_t x = 0; x < len;)
+    {
+        size_t start = x;
+        while (x < len && decoded[x] != '/')
+            x++;
+        size_t seg_len = x - start;
+        const char *seg = decoded + start;
+        x++; // Skip the slash
+
+        if (seg_len == 0 || (seg_len == 1 && seg[0] == '.'))
+            continue;
+        if (seg_len == 2 && seg[0] == '.' && seg[1] == '.')
+        {
+            // Drop the last segment
+            while (out_len > 0 && out[out_len - 1] != '/')
+                out_len--;
+            if (out_len > 0)
+                out_len--;
+            continue;
+        }
+
+        if (out_len + seg_len + 2 > size)
+            return PATH_STATUS_TOO_LONG;
+        if (out_len > 0)
+            out[out_len++] = '/';
+        memcpy(out + out_len, seg, seg_len);
+        out_len += seg_len;
+    }
+
+    // The root itself
+    if (out_len == 0)
+        out[out_len++] = '.';
+    out[out_len] = '\0';
+    return PATH_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Check if the client would rather have the listing as JSON than HTML
+ * @param req The HTTP request from the user
+ * @return True if application/json is preferred over text/html
+ */
+static bool wants_json(const HttpRequest *req)
+{
+    const StrSlice *accept = get_header(req, "Accept");
+    if (accept == NULL)
+        return false;
+    return get_media_quality(accept, "application/json")
+           > get_media_quality(accept, "text/html");
+}
+
+/**
+ * @brief Compress the directory listing, if the client accepts it
+ * @param req The HTTP request from the user
+ * @param body The body holding the listing
+ */
+static void compress_listing(const HttpRequest *req, ResponseBody *body)
+{
+    if (!should_compress(body->type, body->size))
+        return;
+    body->vary = "Accept, Accept-Encoding";
+
+    int encoding = choose_compression(get_header(req, "Accept-Encoding"));
+    char *out = NULL;
+    size_t out_size = 0;
+    if (encoding == CONTENT_ENCODING_IDENTITY
+        || !compress_temp(body->data, body->size, encoding, &out, &out_size))
+        return;
+
+    body->data = out;
+    body->size = out_size;
+    body->encoding = get_encoding_name(encoding);
+}
+
+/**
+ * @struct ChunkedBody
+ * @brief A body sent with the chunked transfer coding, as it is produced
+ */
+typedef struct
+{
+    int sock;               //!< The socket to send to
+    DeflateStream *deflate; //!< Compresses the body before it is sent, or NULL
+} ChunkedBody;
+
+/**
+ * @brief Send a piece of the body as one chunk
+ * @param ctx The ChunkedBody
+ * @param data The piece of the body
+ * @param len The length of the piece
+ * @return True if the chunk was sent
+ */
+static bool send_chunk(void *ctx, const char *data, size_t len)
+{
+    const ChunkedBody *chunked = ctx;
+
+    // An empty chunk would end the body early
+    if (len == 0)
+        return true;
+
+    char size[HEAD_SIZE];
+    int size_len = snprintf(size, sizeof(size), "%zx\r\n", len);
+    struct iovec iov[] = {
+        { size, size_len },
+        { (void *) data, len },
+        { (void *) CRLF, sizeof(CRLF) - 1 },
+    };
+    if (!send_all(chunked->sock, iov, sizeof(iov) / sizeof(struct iovec), 0))
+        return false;
+    add_sent_bytes(len);
+    return true;
+}
+
+/**
+ * @brief Write the next piece of a chunked body, compressing it first if the
+ * body is being compressed
+ * @param ctx The ChunkedBody
+ * @param data The piece of the body
+ * @param len The length of the piece
+ * @return True if the piece was accepted
+ */
+static bool write_chunked(void *ctx, const char *data, size_t len)
+{
+    ChunkedBody *chunked = ctx;
+    if (chunked->deflate != NULL)
+        return deflate_stream_write(chunked->deflate, data, len, send_chunk,
+                                    chunked);
+    return send_chunk(chunked, data, len);
+}
+
+/**
+ * @brief Send the directory's listing as it is rendered
+ *
+ * The size of the page is not known until it is done, so it goes out with
+ * the chunked transfer coding. Only a bounded piece of it is held at a time
+ * @param req The HTTP request from the user
+ * @param sock The socket to send to
+ * @param path The local path to the directory
+ * @param full_path The resolved path to the directory
+ * @param stats The stats of the directory
+ * @param query The entries to list, and how
+ * @ref https://www.rfc-editor.org/rfc/rfc7230#section-4.1
+ */
+static void send_listing(HttpRequest *req, int *sock, const char *path,
+                         const char *full_path, const struct stat *stats,
+                         const ListingQuery *query)
+{
+    const char *type = get_listing_type(query);
+    const char *vary = "Accept";
+    ChunkedBody chunked = { *sock, NULL };
+    ResponseHead head;
+    begin_resp_head(&head, STATUS_200, req);
+    add_head_field(&head,
+                   "Content-Type: %s; charset=UTF-8\r\n"
+                   "Transfer-Encoding: chunked\r\n",
+                   type);
+
+    // The size is not known yet, so the page is taken to be large enough
+    if (should_compress(type, COMPRESS_MIN))
+    {
+        int encoding = choose_compression(get_header(req, "Accept-Encoding"));
+        if (encoding != CONTENT_ENCODING_IDENTITY)
+            chunked.deflate = deflate_stream_new(encoding);
+        if (chunked.deflate != NULL)
+            add_head_field(&head, "Content-Encoding: %s\r\n",
+                           get_encoding_name(encoding));
+        vary = "Accept, Accept-Encoding";
+    }
+    add_head_field(&head, "Vary: %s\r\n", vary);
+    end_resp_head(&head, req);
+#ifdef VERBOSE
+    print_resp_head(&head);
+#endif
+
+    int flags = 0;
+#ifdef MSG_MORE
+    flags |= MSG_MORE;
+#endif
+    struct iovec end = { (void *) LAST_CHUNK, sizeof(LAST_CHUNK) - 1 };
+    bool sent = send_all(*sock, head.parts, head.count, flags)
+                && stream_dir_listing(path, full_path, stats, query,
+                                      write_chunked, &chunked)
+                && (chunked.deflate == NULL
+                    || deflate_stream_finish(chunked.deflate, send_chunk,
+                                             &chunked))
+                && send_all(*sock, &end, 1, 0);
+    deflate_stream_free(chunked.deflate);
+
+    // A body cut short can only be told apart by closing the connection
+    if (!sent)
+        req->keep_alive = false;
+}
+
+/**
+ * @brief Send the error for a path that could not be opened
+ * @param status The PathCacheStatus of opening the path
+ * @param path The path that could not be opened
+ * @param sock The socket to send to
+ */
+static void send_path_error(int status, const char *path, int *sock)
+{
+    switch (status)
+    {
+        case PATH_CACHE_NOT_FOUND:
+            log_message("ERROR(bad path): ", path, false);
+            send_404_error(sock);
+            break;
+        case PATH_CACHE_FORBIDDEN:
+            log_message("ERROR(permission): ", path, false);
+            send_403_error(sock);
+            break;
+        default:
+            log_message("ERROR(open): ", path, false);
+            send_500_error(sock);
+            break;
+    }
+}
+
+/**
+ * @brief Send the file, or directory contents, the request resolved to
+ * @param req The HTTP request from the user
+ * @param sock The socket to send to
+ * @param file The decoded path from the request
+ * @param target The opened path the request resolved to
+ * @param path_stat The current stats of target
+ */
+static void send_target(HttpRequest *req, int *sock, const char *file,
+                        const CachedPath *target, struct stat *path_stat)
+{
+    char index_path[PATH_MAX + 1] = { 0 };
+    const CachedPath *source = target; // The file actually being sent
+    CachedPath *index = NULL;
+    CachedPath *copy = NULL;
+    CachedFile *cached = NULL;
+    CachedFile *listing = NULL;
+    ResponseBody body = { .fd = -1 };
+    int compression = CONTENT_ENCODING_IDENTITY;
+
+    // User requested a directory rather than a file
+    if (S_ISDIR(path_stat->st_mode))
+    {
+        struct stat dir_stat = *path_stat;
+
+        // Send the directory's index.html, if it has one
+        int index_status = PATH_CACHE_NOT_FOUND;
+        if (snprintf(index_path, PATH_MAX, "%s/index.html", target->real_path)
+            < PATH_MAX)
+            index_status = path_cache_open(index_path, &index, path_stat);
+
+        // An index that cannot be read must not be replaced by a listing of
+        // what it hides
+        if (index_status != PATH_CACHE_FOUND
+            && index_status != PATH_CACHE_NOT_FOUND)
+        {
+            send_path_error(index_status, index_path, sock);
+            return;
+        }
+        if (index_status == PATH_CACHE_FOUND && !S_ISDIR(path_stat->st_mode))
+            source = index;
+        else
+        {
+            path_cache_release(index);
+            index = NULL;
+
+            // index.html does not exist in this directory,
+            // show the directory's contents
+            ListingQuery query;
+            if (!parse_listing_query(&req->query, &query))
+            {
+                send_400_error(sock);
+                return;
+            }
+            query.json = wants_json(req);
+
+            listing = find_dir_listing(file, target->real_path, &dir_stat,
+                                       &query);
+            if (listing == NULL && req->type == REQUEST_TYPE_GET)
+            {
+                send_listing(req, sock, file, target->real_path, &dir_stat,
+                             &query);
+                finish_response(req, sock);
+                return;
+            }
+            if (listing == NULL)
+                listing = get_dir_listing(file, target->real_path, &dir_stat,
+                                          &query);
+            if (listing == NULL)
+            {
+                send_500_error(sock);
+                return;
+            }
+            body.data = listing->data;
+            body.size = listing->size;
+            body.type = listing->type;
+            body.vary = "Accept";
+            compress_listing(req, &body);
+            goto send_target_send;
+        }
+    }
+
+    body.type = get_content_type(source->real_path);
+    body.cache_control = get_cache_control(source->real_path);
+
+    // Send a precompressed copy of the file instead, if the client takes one
+    if (PRECOMPRESSED && is_compressible(body.type))
+    {
+        int encoding = find_precompressed(get_header(req, "Accept-Encoding"),
+                                          source->real_path, path_stat,
+                                          &copy);
+        if (encoding != CONTENT_ENCODING_IDENTITY)
+            source = copy;
+        body.encoding = get_encoding_name(encoding);
+        body.vary = "Accept-Encoding";
+    }
+
+    // Otherwise compress it here, if it is worth it. The compressed copy is
+    // only made once if it fits in the file cache, and takes no more room
+    // than the file, so larger files are sent as they are rather than
+    // compressed again on every request
+    if (body.encoding == NULL && should_compress(body.type, path_stat->st_size)
+        && file_cache_fits(path_stat->st_size))
+    {
+        compression = choose_compression(get_header(req, "Accept-Encoding"));
+        body.encoding = get_encoding_name(compression);
+        body.vary = "Accept-Encoding";
+    }
+    body.stats = path_stat;
+
+    // Files the client already has are not read at all
+    if (is_not_modified(req, &body))
+    {
+        send_304(sock, &body, req);
+        goto send_target_done;
+    }
+
+    // Files served recently are already in memory
+    if (compression != CONTENT_ENCODING_IDENTITY)
+    {
+        cached = compress_file(source->real_path, path_stat, compression,
+                               body.type);
+        if (cached != NULL)
+            goto send_target_send;
+        body.encoding = NULL; // Could not compress it, so send it as is
+    }
+    if ((cached = file_cache_get(source->real_path, path_stat)) != NULL)
+        goto send_target_send;
+
+    // Directories that are not readable have no file to send
+    if (source->fd == -1)
+    {
+        log_message("ERROR(permission): ", source->real_path, false);
+        send_403_error(sock);
+        goto send_target_cleanup;
+    }
+    body.fd = source->fd;
+    body.size = path_stat->st_size;
+
+    // Keep the file in memory for the next time it is requested
+    cached = file_cache_add(source->real_path, source->fd, path_stat,
+                            body.type);
+
+send_target_send:
+    if (cached != NULL)
+    {
+        body.fd = -1;
+        body.data = cached->data;
+        body.size = cached->size;
+        body.stats = &cached->stats;
+    }
+
+    // Send the requested file, or directory contents, back to the user
+    send_200(sock, &body, req);
+send_target_done:
+    finish_response(req, sock);
+send_target_cleanup:
+    file_cache_release(cached);
+    file_cache_release(listing);
+    path_cache_release(copy);
+    path_cache_release(index);
+}
+
+void send_requested_file(HttpRequest *req, int *sock)
+{
+    char file[PATH_MAX + 1] = { 0 };
+    char full_path[PATH_MAX + 1] = { 0 };
+    CachedPath *target = NULL;
+    struct stat path_stat;
+
+    // Only paths can be served, not "*" or absolute URLs
+    if (req->path.len == 0 || req->path.ptr[0] != '/')
+    {
+        send_400_error(sock);
+        return;
+    }
+
+    switch (decode_path(&req->path, file, sizeof(file)))
+    {
+        case PATH_STATUS_INVALID:
+            send_400_error(sock);
+            return;
+        case PATH_STATUS_TOO_LONG:
+            send_431_error(sock);
+            return;
+        default:
+            break;
+    }
+
+    // Create the full path based on the configured HTML root directory
+    if (snprintf(full_path, PATH_MAX, "%s/%s", HTML_PATH, file) >= PATH_MAX)
+    {
+        send_431_error(sock);
+        return;
+    }
+
+    // Paths served recently are already resolved, with their file still open
+    uint64_t start = metrics_now();
+    int status = path_cache_open(full_path, &target, &path_stat);
+    if (start != 0)
+    {
+        sent_resp.open_ns = metrics_now() - start;
+        metrics_record(METRICS_PHASE_OPEN, sent_resp.open_ns);
+    }
+    if (status != PATH_CACHE_FOUND)
+    {
+        send_path_error(status, full_path, sock);
+        return;
+    }
+    send_target(req, sock, file, target, &path_stat);
+    path_cache_release(target);
+}
+
+/*=====================================*/
+/*       Success Response Codes        */
+/*=====================================*/
+
+/**
+ * @brief Send part of the file to the client
+ *
+ * Regular files are handed straight from the page cache to the socket with
+ * sendfile. Elsewhere the file is copied through a buffer instead. Neither
+ * moves the file's offset, as the descriptor is shared with other threads.
+ * With a send queue, whatever the socket will not take yet is left to it
+ * @param sock The socket to send to
+ * @param fd File descriptor of the file being sent
+ * @param start Offset of the first byte to send
+ * @param len Number of bytes to send
+ * @return True if all the bytes were sent or queued
+ */
+static bool send_file_range(int sock, int fd, size_t start, size_t len)
+{
+    SendQueue *queue = send_queue_current();
+    if (queue != NULL)
+        return send_queue_file(queue, sock, fd, start, len);
+
+#ifdef __linux__
+    off_t offset = start;
+    while (len > 0)
+    {
+        ssize_t sent = sendfile(sock, fd, &offset, MIN(len, SENDFILE_CHUNK));
+        if (sent == SOCKET_ERROR && errno == EINTR)
+            continue;
+        if (sent <= 0) // File shrunk underneath us, or the send failed
+            return false;
+        len -= sent;
+    }
+    return true;
+#else
+    char buffer[BUFF_SIZE];
+    while (len > 0)
+    {
+        ssize_t bytes_read = pread(fd, buffer, MIN(len, (size_t) BUFF_SIZE),
+                                   start);
+        if (bytes_read == SOCKET_ERROR && errno == EINTR)
+            continue;
+        if (bytes_read <= 0) // File shrunk underneath us
+            return false;
+
+        struct iovec iov = { .iov_base = buffer, .iov_len = bytes_read };
+        if (!send_all(sock, &iov, 1, 0))
+            return false;
+        start += bytes_read;
+        len -= bytes_read;
+    }
+    return true;
+#endif
+}
+
+/**
+ * @brief Send the pieces, followed by part of the body
+ * @param sock The socket to send to
+ * @param parts The pieces to send first, with room for one more after them
+ * @param count Number of pieces
+ * @param body The body of the response
+ * @param start Offset of the first byte of the body to send
+ * @param len Number of bytes of the body to send
+ * @param more If more will be sent after this, so a partial packet is held
+ * back
+ * @return True if everything was sent
+ */
+static bool send_with_body(int sock, struct iovec *parts, int count,
+                           const ResponseBody *body, size_t start, size_t len,
+                           bool more)
+{
+    int flags = 0;
+#ifdef MSG_MORE
+    flags |= MSG_MORE;
+#endif
+
+    if (len == 0)
+        return send_all(sock, parts, count, more ? flags : 0);
+
+    bool sent;
+    if (body->data != NULL)
+    {
+        // Already in memory, so the pieces and body go out in one call
+        parts[count].iov_base = (void *) (body->data + start);
+        parts[count].iov_len = len;
+        sent = send_all(sock, parts, count + 1, more ? flags : 0);
+    }
+    else
+    {
+        // Hold the pieces back so they go out in the same packet as the
+        // start of the file, rather than on their own
+        sent = send_all(sock, parts, count, flags)
+               && send_file_range(sock, body->fd, start, len);
+    }
+
+    if (sent)
+        add_sent_bytes(len);
+    return sent;
+}
+
+/**
+ * @brief Add the fields describing the body to the response header
+ * @param head The response header
+ * @param body The body of the response
+ * @param size The number of bytes of the body being sent
+ */
+static void add_content_fields(ResponseHead *head, const ResponseBody *body,
+                               size_t size)
+{
+    add_head_field(head,
+                   "Content-Type: %s; charset=UTF-8\r\n"
+                   "Content-Length: %zu\r\n",
+                   body->type, size);
+    if (body->encoding != NULL)
+        add_head_field(head, "Content-Encoding: %s\r\n", body->encoding);
+}
+
+/**
+ * @brief Check if the ranges asked for still apply to the file
+ *
+ * If-Range holds the validator the client's copy of the file had, either
+ * its entity tag or modification date. Both have to be strong to match
+ * @param req The HTTP request from the user
+ * @param body The body being sent, with stats set
+ * @return True if there is no If-Range, or it matches the file
+ * @ref https://www.rfc-editor.org/rfc/rfc7233#section-3.2
+ */
+static bool if_range_matches(const HttpRequest *req, const ResponseBody *body)
+{
+    const struct stat *stats = body->stats;
+    const StrSlice *value = get_header(req, "If-Range");
+    if (value == NULL)
+        return true;
+
+    if (value->len > 0 && value->ptr[0] == '"')
+    {
+        char etag[ETAG_SIZE];
+        return format_etag(body, etag) && slice_equals(value, etag);
+    }
+
+    // A date is only strong if the file was not modified in the same second
+    char date[HTTP_DATE_LEN + 1];
+    format_http_date(stats->st_mtime, date);
+    return slice_equals(value, date) && stats->st_mtime < time(NULL);
+}
+
+/**
+ * @brief Send 206 Partial Content, holding the ranges of the body
+ *
+ * A single range is sent as is. More than one is sent as a
+ * multipart/byteranges body, each part with its own Content-Range
+ * @param sock The socket to send to
+ * @param body The body of the response
+ * @param req The HTTP request from the user
+ * @param ranges The ranges to send
+ * @param count Number of ranges
+ * @return True if the whole response was sent
+ */
+static bool send_206(int *sock, const ResponseBody *body, HttpRequest *req,
+                     const ByteRange *ranges, int count)
+{
+    ResponseHead head;
+    begin_resp_head(&head, STATUS_206, req);
+    add_head_field(&head, "Accept-Ranges: bytes\r\n");
+    add_validator_fields(&head, body);
+
+    if (count == 1)
+    {
+        add_content_fields(&head, body, ranges[0].len);
+        add_head_field(&head, "Content-Range: bytes %zu-%zu/%zu\r\n",
+                       ranges[0].start,
+                       ranges[0].start + ranges[0].len - 1, body->size);
+        end_resp_head(&head, req);
+#ifdef VERBOSE
+        print_resp_head(&head);
+#endif
+        return send_with_body(*sock, head.parts, head.count, body,
+                              ranges[0].start, ranges[0].len, false);
+    }
+
+    // Each part gets its own header, which has to be counted in the length
+    char part_heads[MAX_RANGES][HEAD_SIZE * 4];
+    int part_lens[MAX_RANGES];
+    char tail[HEAD_SIZE];
+    int tail_len = snprintf(tail, sizeof(tail), "\r\n--%s--\r\n", boundary);
+    size_t length = tail_len;
+    for (int x = 0; x < count; x++)
+    {
+        part_lens[x] = snprintf(part_heads[x], sizeof(part_heads[x]),
+                                "\r\n--%s\r\n"
+                                "Content-Type: %s; charset=UTF-8\r\n"
+                                "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                                boundary, body->type, ranges[x].start,
+                                ranges[x].start + ranges[x].len - 1,
+                                body->size);
+        part_lens[x] = MIN(part_lens[x], (int) sizeof(part_heads[x]) - 1);
+        length += part_lens[x] + ranges[x].len;
+    }
+
+    add_head_field(&head,
+                   "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                   "Content-Length: %zu\r\n",
+                   boundary, length);
+    end_resp_head(&head, req);
+#ifdef VERBOSE
+    print_resp_head(&head);
+#endif
+
+    int flags = 0;
+#ifdef MSG_MORE
+    flags |= MSG_MORE;
+#endif
+    if (!send_all(*sock, head.parts, head.count, flags))
+        return false;
+
+    for (int x = 0; x < count; x++)
+    {
+        struct iovec part[2] = { { .iov_base = part_heads[x],
+                                   .iov_len = part_lens[x] } };
+        if (!send_with_body(*sock, part, 1, body, ranges[x].start,
+                            ranges[x].len, true))
+            return false;
+    }
+
+    struct iovec end = { .iov_base = tail, .iov_len = tail_len };
+    return send_all(*sock, &end, 1, 0);
+}
+
+/**
+ * @brief Send 416 Range Not Satisfiable, telling the client the body's size
+ * @param sock The socket to send to
+ * @param body The body of the response
+ * @param req The HTTP request from the user
+ * @return True if the response was sent
+ */
+static bool send_416(int *sock, const ResponseBody *body, HttpRequest *req)
+{
+    ResponseHead head;
+    begin_resp_head(&head, STATUS_416, req);
+    add_head_field(&head,
+                   "Content-Range: bytes */%zu\r\n"
+                   "Content-Length: 0\r\n",
+                   body->size);
+    end_resp_head(&head, req);
+#ifdef VERBOSE
+    print_resp_head(&head);
+#endif
+    return send_all(*sock, head.parts, head.count, 0);
+}
+
+void send_200(int *sock, const ResponseBody *body, HttpRequest *req)
+{
+    bool sent;
+    const StrSlice *range = get_header(req, "Range");
+    if (range != NULL && body->stats != NULL
+        && req->type == REQUEST_TYPE_GET
+        && if_range_matches(req, body))
+    {
+        ByteRange ranges[MAX_RANGES];
+        int count = 0;
+        switch (parse_range(range, body->size, ranges, &count))
+        {
+            case RANGE_STATUS_OK:
+                // The parts of a compressed body could not be decoded alone
+                if (count > 1 && body->encoding != NULL)
+                    break;
+                sent = send_206(sock, body, req, ranges, count);
+                goto send_200_done;
+            case RANGE_STATUS_UNSATISFIABLE:
+                sent = send_416(sock, body, req);
+                goto send_200_done;
+            default:
+                break; // Send the whole body instead
+        }
+    }
+
+    ResponseHead head;
+    begin_resp_head(&head, STATUS_200, req);
+    add_content_fields(&head, body, body->size);
+    if (body->stats != NULL)
+    {
+        add_head_field(&head, "Accept-Ranges: bytes\r\n");
+        add_validator_fields(&head, body);
+    }
+    else if (body->vary != NULL)
+        add_head_field(&head, "Vary: %s\r\n", body->vary);
+    end_resp_head(&head, req);
+
+#ifdef VERBOSE
+    print_resp_head(&head);
+#endif
+
+    // HEAD requests only get the header
+    sent = send_with_body(*sock, head.parts, head.count, body, 0,
+                          (req->type == REQUEST_TYPE_HEAD) ? 0 : body->size,
+                          false);
+
+send_200_done:
+    // No point in keeping a connection the client is done with
+    if (!sent)
+        req->keep_alive = false;
+}
+
+void send_304(int *sock, const ResponseBody *body, HttpRequest *req)
+{
+    ResponseHead head;
+    begin_resp_head(&head, STATUS_304, req);
+    add_validator_fields(&head, body);
+    end_resp_head(&head, req);
+#ifdef VERBOSE
+    print_resp_head(&head);
+#endif
+    if (!send_all(*sock, head.parts, head.count, 0))
+        req->keep_alive = false;
+}
+
+void send_204(int *sock, HttpRequest *req)
+{
+    ResponseHead head;
+    begin_resp_head(&head, STATUS_204, req);
+    end_resp_head(&head, req);
+#ifdef VERBOSE
+    print_resp_head(&head);
+#endif
+    if (!send_all(*sock, head.parts, head.count, 0))
+        req->keep_alive = false;
+    finish_response(req, sock);
+}
+
+/*=====================================*/
+/*        Error Response Codes         */
+/*=====================================*/
+
+void send_400_error(int *sock)
+{
+    send_error(ERROR_PAGE_400, sock);
+}
+
+void send_403_error(int *sock)
+{
+    send_error(ERROR_PAGE_403, sock);
+}
+
+void send_404_error(int *sock)
+{
+    send_error(ERROR_PAGE_404, sock);
+}
+
+void send_405_error(int *sock)
+{
+    send_error(ERROR_PAGE_405, sock);
+}
+
+void send_408_error(int *sock)
+{
+    send_error(ERROR_PAGE_408, sock);
+}
+
+void send_413_error(int *sock)
+{
+    send_error(ERROR_PAGE_413, sock);
+}
+
+#ifdef TEAPOT
+void send_418_error(int *sock)
+{
+    send_error(ERROR_PAGE_418, sock);
+}
+#endif /* TEAPOT */
+
+void send_431_error(int *sock)
+{
+    send_error(ERROR_PAGE_431, sock);
+}
+
+/*=====================================*/
+/*     Server Error Response Codes     */
+/*=====================================*/
+void send_500_error(int *sock)
+{
+    send_error(ERROR_PAGE_500, sock);
+}
+
+void send_503_error(int *sock)
+{
+    send_error(ERROR_PAGE_503, sock);
+}
+
+void send_505_error(int *sock)
+{
+    send_error(ERROR_PAGE_505, sock);
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lru_table.h"
+
+/**
+ * @brief Remove the entry from the LRU list
+ * @param shard The shard holding the entry
+ * @param entry The entry to remove
+ */
+static void lru_unlink(LruShard *shard, LruEntry *entry)
+{
+    if (entry->lru_prev == NULL)
+        shard->lru_head = entry->lru_next;
+    else
+        entry->lru_prev->lru_next = entry->lru_next;
+
+    if (entry->lru_next == NULL)
+        shard->lru_tail = entry->lru_prev;
+    else
+        entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+/**
+ * @brief Add the entry to the front of the LRU list
+ * @param shard The shard holding the entry
+ * @param entry The entry to add
+ */
+static void lru_push_front(LruShard *shard, LruEntry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head == NULL)
+        shard->lru_tail = entry;
+    else
+        shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+}
+
+uint32_t lru_hash(const char *key)
+{
+    uint32_t hash = 2166136261u;
+    for (; *key != '\0'; key++)
+    {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int lru_table_init(LruTable *table)
+{
+    for (int x = 0; x < LRU_SHARDS; x++)
+    {
+        memset(&table->shards[x], 0, sizeof(LruShard));
+        if (pthread_mutex_init(&table->shards[x].lock, NULL) != 0)
+        {
+            perror("pthread_mutex_init");
+            while (x-- > 0)
+                pthread_mutex_destroy(&table->shards[x].lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void lru_table_destroy(LruTable *table)
+{
+    for (int x = 0; x < LRU_SHARDS; x++)
+        pthread_mutex_destroy(&table->shards[x].lock);
+}
+
+LruShard *lru_table_shard(LruTable *table, uint32_t hash)
+{
+    return &table->shards[hash % LRU_SHARDS];
+}
+
+LruEntry *lru_find(LruShard *shard, const char *key, uint32_t hash)
+{
+    LruEntry *entry = shard->buckets[hash % LRU_BUCKETS];
+    for (; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+void lru_insert(LruShard *shard, LruEntry *entry)
+{
+    LruEntry **bucket = &shard->buckets[entry->hash % LRU_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+}
+
+void lru_remove(LruShard *shard, LruEntry *entry)
+{
+    LruEntry **link = &shard->buckets[entry->hash % LRU_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    lru_unlink(shard, entry);
+}
+
+void lru_touch(LruShard *shard, LruEntry *entry)
+{
+    if (shard->lru_head == entry)
+        return;
+    lru_unlink(shard, entry);
+    lru_push_front(shard, entry);
+}
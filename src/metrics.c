@@ -0,0 +1,442 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "defaults.h"
+#include "metrics.h"
+#include "queue.h"
+
+#define CACHE_LINE 64
+#define MAX_SHARDS 1024     // Most threads that can count
+#define MAX_STATUS_CODE 600 // Status codes go from 100 to 599
+#define SUB_BUCKET_BITS 4   // 16 buckets for each power of two
+#define MAX_VALUE_BITS 40   // Longest time kept, about 18 minutes in ns
+#define NUM_BUCKETS ((MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS)
+
+/**
+ * @struct Histogram
+ * @brief How long a phase took, counted in buckets that grow with the time
+ */
+typedef struct
+{
+    atomic_uint_fast64_t buckets[NUM_BUCKETS]; //!< Times in each bucket
+    atomic_uint_fast64_t count;                //!< Times recorded
+    atomic_uint_fast64_t sum;                  //!< Sum of the times (ns)
+} Histogram;
+
+/**
+ * @struct MetricsShard
+ * @brief Everything one thread has counted
+ *
+ * Only the owning thread writes to its shard, and render_metrics() only
+ * reads it, so the counters never need a locked instruction
+ */
+typedef struct
+{
+    /// Responses sent, by status code
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t responses[MAX_STATUS_CODE];
+    atomic_uint_fast64_t bytes;           //!< Bytes of body sent
+    atomic_uint_fast64_t opened;          //!< Connections opened
+    atomic_uint_fast64_t closed;          //!< Connections closed
+    atomic_uint_fast64_t busy_ns;         //!< Time spent serving (ns)
+    atomic_uint_fast64_t allocs;          //!< Heap allocations by requests
+    Histogram phases[NUM_METRICS_PHASES]; //!< Times of each MetricsPhase
+} MetricsShard;
+
+/**
+ * @struct MetricsText
+ * @brief The rendered metrics
+ */
+typedef struct
+{
+    char *data; //!< The text
+    size_t len; //!< Bytes used in data
+    size_t max; //!< Size of data
+} MetricsText;
+
+/// Names of the MetricsPhases, as they are labelled
+static const char *PHASE_NAMES[NUM_METRICS_PHASES] = {
+    [METRICS_PHASE_QUEUE] = "queue",
+    [METRICS_PHASE_PARSE] = "parse",
+    [METRICS_PHASE_OPEN] = "open",
+    [METRICS_PHASE_SEND] = "send",
+};
+
+/// The quantiles reported for each phase
+static const double QUANTILES[] = { 0.5, 0.99, 0.999 };
+static const int NUM_QUANTILES = sizeof(QUANTILES) / sizeof(double);
+
+static MetricsShard *_Atomic shards[MAX_SHARDS];
+static atomic_size_t num_shards = 0;
+static _Thread_local MetricsShard *shard = NULL;
+static _Thread_local bool shard_failed = false;
+
+static bool collecting = false;
+static uint64_t start_ns = 0;
+
+/**
+ * @brief Get the current time of the monotonic clock
+ * @return Time since an unspecified starting point (unit: ns)
+ */
+static uint64_t get_monotonic_ns(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/**
+ * @brief Get the shard of the calling thread, creating it the first time
+ * @return The shard, or NULL if metrics are off or the thread cannot have one
+ */
+static MetricsShard *get_shard(void)
+{
+    if (shard != NULL || shard_failed || !collecting)
+        return shard;
+
+    shard_failed = true;
+    size_t index = atomic_fetch_add(&num_shards, 1);
+    if (index >= MAX_SHARDS)
+        return NULL;
+
+    MetricsShard *new_shard = aligned_alloc(CACHE_LINE, sizeof(MetricsShard));
+    if (new_shard == NULL)
+        return NULL;
+    memset(new_shard, 0, sizeof(MetricsShard));
+
+    // Publishing the shard last means it is never read half made
+    atomic_store_explicit(&shards[index], new_shard, memory_order_release);
+    shard_failed = false;
+    shard = new_shard;
+    return shard;
+}
+
+/**
+ * @brief Add to a counter in the calling thread's shard
+ *
+ * Nothing else writes to the counter, so a plain load and store is enough
+ * @param counter The counter
+ * @param value The amount to add
+ */
+static void shard_add(atomic_uint_fast64_t *counter, uint64_t value)
+{
+    uint64_t old = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, old + value, memory_order_relaxed);
+}
+
+/**
+ * @brief Get the bucket a time is counted in
+ *
+ * Times below 16ns get a bucket each. Past that, each power of two is split
+ * into 16 buckets
+ * @param ns The time (unit: ns)
+ * @return The index of the bucket
+ */
+static size_t bucket_of(uint64_t ns)
+{
+    if (ns >= (1ULL << MAX_VALUE_BITS))
+        ns = (1ULL << MAX_VALUE_BITS) - 1;
+    if (ns < (1 << SUB_BUCKET_BITS))
+        return ns;
+
+    int shift = (63 - __builtin_clzll(ns)) - SUB_BUCKET_BITS;
+    return ((size_t) (shift + 1) << SUB_BUCKET_BITS)
+           + ((ns >> shift) - (1 << SUB_BUCKET_BITS));
+}
+
+/**
+ * @brief Get the longest time counted in a bucket
+ * @param bucket The index of the bucket
+ * @return The time (unit: ns)
+ */
+static uint64_t bucket_max(size_t bucket)
+{
+    if (bucket < (1 << SUB_BUCKET_BITS))
+        return bucket;
+
+    int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+    uint64_t sub = (bucket & ((1 << SUB_BUCKET_BITS) - 1))
+                   + (1 << SUB_BUCKET_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void metrics_init(bool enabled)
+{
+    collecting = enabled;
+    start_ns = get_monotonic_ns();
+}
+
+void metrics_free(void)
+{
+    size_t count = atomic_load(&num_shards);
+    for (size_t x = 0; x < count && x < MAX_SHARDS; x++)
+    {
+        free(atomic_load(&shards[x]));
+        atomic_store(&shards[x], NULL);
+    }
+    atomic_store(&num_shards, 0);
+    shard = NULL;
+    shard_failed = false;
+    collecting = false;
+}
+
+uint64_t metrics_now(void)
+{
+    return collecting ? get_monotonic_ns() : 0;
+}
+
+void metrics_record(int phase, uint64_t ns)
+{
+    MetricsShard *own = get_shard();
+    if (own == NULL)
+        return;
+
+    Histogram *hist = &own->phases[phase];
+    shard_add(&hist->buckets[bucket_of(ns)], 1);
+    shard_add(&hist->count, 1);
+    shard_add(&hist->sum, ns);
+}
+
+void metrics_count_response(uint16_t status)
+{
+    MetricsShard *own = get_shard();
+    if (own != NULL && status < MAX_STATUS_CODE)
+        shard_add(&own->responses[status], 1);
+}
+
+void metrics_add_bytes(uint64_t bytes)
+{
+    MetricsShard *own = get_shard();
+    if (own != NULL)
+        shard_add(&own->bytes, bytes);
+}
+
+void metrics_conn_opened(void)
+{
+    MetricsShard *own = get_shard();
+    if (own != NULL)
+        shard_add(&own->opened, 1);
+}
+
+void metrics_conn_closed(void)
+{
+    MetricsShard *own = get_shard();
+    if (own != NULL)
+        shard_add(&own->closed, 1);
+}
+
+void metrics_add_busy(uint64_t ns)
+{
+    MetricsShard *own = get_shard();
+    if (own != NULL)
+        shard_add(&own->busy_ns, ns);
+}
+
+void metrics_add_allocs(uint64_t allocs)
+{
+    MetricsShard *own = get_shard();
+    if (own != NULL)
+        shard_add(&own->allocs, allocs);
+}
+
+/**
+ * @brief Add to the rendered metrics
+ *
+ * Text that does not fit is cut short, which never happens with the room
+ * render_metrics() makes
+ * @param text The rendered metrics
+ * @param format printf style format of the text
+ * @param ... Values for the format
+ */
+static void add_text(MetricsText *text, const char *format, ...)
+{
+    size_t room = text->max - text->len;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text->data + text->len, room, format, args);
+    va_end(args);
+    if (len > 0)
+        text->len += ((size_t) len < room) ? (size_t) len : room - 1;
+}
+
+/**
+ * @brief Add the HELP and TYPE lines of a metric
+ * @param text The rendered metrics
+ * @param name The name of the metric
+ * @param type The type of the metric
+ * @param help What the metric is
+ */
+static void add_metric_head(MetricsText *text, const char *name,
+                            const char *type, const char *help)
+{
+    add_text(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Sum a counter across every shard
+ * @param offset Offset of the counter in MetricsShard
+ * @return The sum
+ */
+static uint64_t sum_counter(size_t offset)
+{
+    uint64_t sum = 0;
+    size_t count = atomic_load(&num_shards);
+    for (size_t x = 0; x < count && x < MAX_SHARDS; x++)
+    {
+        MetricsShard *from = atomic_load_explicit(&shards[x],
+                                                  memory_order_acquire);
+        if (from != NULL)
+            sum += atomic_load_explicit(
+                (atomic_uint_fast64_t *) ((char *) from + offset),
+                memory_order_relaxed);
+    }
+    return sum;
+}
+
+/**
+ * @brief Add the quantiles, sum and count of a phase as a summary
+ * @param text The rendered metrics
+ * @param phase The MetricsPhase to add
+ */
+static void add_phase(MetricsText *text, int phase)
+{
+    const char *name = PHASE_NAMES[phase];
+    size_t offset = offsetof(MetricsShard, phases)
+                    + phase * sizeof(Histogram);
+    uint64_t count = sum_counter(offset + offsetof(Histogram, count));
+    uint64_t sum = sum_counter(offset + offsetof(Histogram, sum));
+
+    // Walk the buckets once, picking up each quantile as it is reached
+    int quantile = 0;
+    uint64_t seen = 0;
+    for (size_t x = 0; x < NUM_BUCKETS && quantile < NUM_QUANTILES; x++)
+    {
+        seen += sum_counter(offset + offsetof(Histogram, buckets)
+                            + x * sizeof(atomic_uint_fast64_t));
+        while (quantile < NUM_QUANTILES && count > 0
+               && seen >= QUANTILES[quantile] * count)
+        {
+            add_text(text,
+                     "http_phase_duration_seconds{phase=\"%s\","
+                     "quantile=\"%g\"} %.9f\n",
+                     name, QUANTILES[quantile], bucket_max(x) / 1e9);
+            quantile++;
+        }
+    }
+    for (; quantile < NUM_QUANTILES; quantile++)
+        add_text(text,
+                 "http_phase_duration_seconds{phase=\"%s\",quantile=\"%g\"} "
+                 "NaN\n",
+                 name, QUANTILES[quantile]);
+
+    add_text(text, "http_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n",
+             name, sum / 1e9);
+    add_text(text,
+             "http_phase_duration_seconds_count{phase=\"%s\"} %llu\n", name,
+             (unsigned long long) count);
+}
+
+char *render_metrics(size_t *len)
+{
+    // Every status code could show up, along with a line per thread
+    size_t count = atomic_load(&num_shards);
+    MetricsText text = { NULL, 0, 8192 + (MAX_STATUS_CODE + count) * 64 };
+    text.data = arena_alloc(text.max);
+    if (text.data == NULL)
+        return NULL;
+
+    add_metric_head(&text, "http_responses_total", "counter",
+                    "Responses sent, by status code.");
+    for (int code = 0; code < MAX_STATUS_CODE; code++)
+    {
+        uint64_t sent = sum_counter(offsetof(MetricsShard, responses)
+                                    + code * sizeof(atomic_uint_fast64_t));
+        if (sent > 0)
+            add_text(&text, "http_responses_total{code=\"%d\"} %llu\n", code,
+                     (unsigned long long) sent);
+    }
+
+    add_metric_head(&text, "http_response_bytes_total", "counter",
+                    "Bytes of response body sent.");
+    add_text(&text, "http_response_bytes_total %llu\n",
+             (unsigned long long) sum_counter(offsetof(MetricsShard, bytes)));
+
+    CompressStats compress;
+    get_compress_stats(&compress);
+    add_metric_head(&text, "http_compressed_bodies_total", "counter",
+                    "Bodies compressed by the server.");
+    add_text(&text, "http_compressed_bodies_total %llu\n",
+             (unsigned long long) compress.count);
+    add_metric_head(&text, "http_compress_input_bytes_total", "counter",
+                    "Bytes of body before compressing.");
+    add_text(&text, "http_compress_input_bytes_total %llu\n",
+             (unsigned long long) compress.bytes_in);
+    add_metric_head(&text, "http_compress_output_bytes_total", "counter",
+                    "Bytes of body after compressing.");
+    add_text(&text, "http_compress_output_bytes_total %llu\n",
+             (unsigned long long) compress.bytes_out);
+    add_metric_head(&text, "http_compress_cpu_seconds_total", "counter",
+                    "CPU time spent compressing bodies.");
+    add_text(&text, "http_compress_cpu_seconds_total %.9f\n",
+             compress.cpu_ns / 1e9);
+
+    uint64_t opened = sum_counter(offsetof(MetricsShard, opened));
+    uint64_t closed = sum_counter(offsetof(MetricsShard, closed));
+    add_metric_head(&text, "http_connections_total", "counter",
+                    "Connections opened.");
+    add_text(&text, "http_connections_total %llu\n",
+             (unsigned long long) opened);
+    add_metric_head(&text, "http_connections_active", "gauge",
+                    "Connections open right now.");
+    add_text(&text, "http_connections_active %llu\n",
+             (unsigned long long) (opened - closed));
+    add_metric_head(&text, "http_connections_queued", "gauge",
+                    "Connections waiting for a thread.");
+    add_text(&text, "http_connections_queued %zu\n", queue_length());
+
+    // Only threads that served connections are workers
+    uint64_t uptime = get_monotonic_ns() - start_ns;
+    uint64_t busy = sum_counter(offsetof(MetricsShard, busy_ns));
+    add_metric_head(&text, "http_worker_busy_seconds_total", "counter",
+                    "Time each worker spent serving connections.");
+    for (size_t x = 0; x < count && x < MAX_SHARDS; x++)
+    {
+        MetricsShard *from = atomic_load_explicit(&shards[x],
+                                                  memory_order_acquire);
+        uint64_t ns = (from != NULL) ? atomic_load(&from->busy_ns) : 0;
+        if (ns > 0)
+            add_text(&text,
+                     "http_worker_busy_seconds_total{thread=\"%zu\"} %.9f\n",
+                     x, ns / 1e9);
+    }
+    add_metric_head(&text, "http_worker_utilisation", "gauge",
+                    "Share of the workers' time spent serving connections "
+                    "since the server started.");
+    add_text(&text, "http_worker_utilisation %.6f\n",
+             (uptime > 0 && THREAD_POOL_SIZE > 0)
+                 ? (double) busy / ((double) uptime * THREAD_POOL_SIZE)
+                 : 0.0);
+#ifdef ALLOC_STATS
+    add_metric_head(&text, "http_request_heap_allocations_total", "counter",
+                    "Heap allocations made while handling requests.");
+    add_text(&text, "http_request_heap_allocations_total %llu\n",
+             (unsigned long long) sum_counter(offsetof(MetricsShard, allocs)));
+#endif /* ALLOC_STATS */
+    add_metric_head(&text, "http_uptime_seconds", "gauge",
+                    "Time since the server started.");
+    add_text(&text, "http_uptime_seconds %.3f\n", uptime / 1e9);
+
+    add_metric_head(&text, "http_phase_duration_seconds", "summary",
+                    "Time spent in each phase of serving a request.");
+    for (int phase = 0; phase < NUM_METRICS_PHASES; phase++)
+        add_phase(&text, phase);
+
+    *len = text.len;
+    return text.data;
+}
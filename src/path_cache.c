@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "lru_table.h"
+#include "path_cache.h"
+#include "utils.h"
+
+#define FD_SHARE 4  // At most 1 / FD_SHARE of the process's files are cached
+#define SWEEP_LEN 8 // Entries checked for expiry each time one is added
+
+static LruTable table;
+static size_t shard_max = 0;
+static uint32_t ttl_ms = 0;
+static bool enabled = false;
+
+/**
+ * @brief Close the file and free the entry's memory
+ * @param entry The entry to free
+ */
+static void free_entry(CachedPath *entry)
+{
+    if (entry->fd != -1)
+        close(entry->fd);
+    free(entry->real_path);
+    free(entry->entry.key);
+    free(entry);
+}
+
+/**
+ * @brief Drop one reference to the entry, freeing it if it was the last
+ * @param entry The entry to drop a reference to
+ * @note The shard's lock must be held
+ */
+static void drop_ref(CachedPath *entry)
+{
+    if (--entry->refs == 0)
+        free_entry(entry);
+}
+
+/**
+ * @brief Find the path in the shard
+ * @param shard The shard to search
+ * @param path The path as it was asked for
+ * @param hash The hash of the path
+ * @return The entry, or NULL if it is not in the shard
+ */
+static CachedPath *find_entry(LruShard *shard, const char *path,
+                              uint32_t hash)
+{
+    return (CachedPath *) lru_find(shard, path, hash);
+}
+
+/**
+ * @brief Take the entry out of the cache
+ *
+ * The file is only closed once the last thread using it releases it
+ * @param shard The shard holding the entry
+ * @param entry The entry to remove
+ */
+static void remove_entry(LruShard *shard, CachedPath *entry)
+{
+    lru_remove(shard, &entry->entry);
+    shard->used--;
+    drop_ref(entry);
+}
+
+/**
+ * @brief Resolve the path and open the file, without the cache
+ * @param path The path to open
+ * @param hash The hash of the path
+ * @return The new entry, with refs still 0, or NULL if out of memory
+ */
+static CachedPath *resolve_path(const char *path, uint32_t hash)
+{
+    CachedPath *entry = calloc(1, sizeof(CachedPath));
+    if (entry == NULL)
+        return NULL;
+    entry->fd = -1;
+    entry->entry.hash = hash;
+    entry->entry.key = strdup(path);
+    if (entry->entry.key == NULL)
+    {
+        free_entry(entry);
+        return NULL;
+    }
+
+    char real_path[PATH_MAX + 1];
+    if (realpath(path, real_path) == NULL)
+    {
+        entry->status = PATH_CACHE_NOT_FOUND;
+        return entry;
+    }
+    entry->real_path = strdup(real_path);
+    if (entry->real_path == NULL)
+    {
+        free_entry(entry);
+        return NULL;
+    }
+
+    entry->fd = open(real_path, O_RDONLY);
+    if (entry->fd == -1 && (errno == EMFILE || errno == ENFILE)
+        && path_cache_shed() > 0)
+        entry->fd = open(real_path, O_RDONLY);
+    if (entry->fd == -1)
+    {
+        // Directories only need to be searchable, not readable
+        int error = errno;
+        if (error == EACCES && stat(real_path, &entry->stats) == 0
+            && S_ISDIR(entry->stats.st_mode))
+            entry->status = PATH_CACHE_FOUND;
+        else if (error == EACCES)
+            entry->status = PATH_CACHE_FORBIDDEN;
+        else if (error == ENOENT || error == ENOTDIR)
+            entry->status = PATH_CACHE_NOT_FOUND;
+        else
+            entry->status = PATH_CACHE_ERROR;
+        return entry;
+    }
+    if (fstat(entry->fd, &entry->stats) != 0)
+    {
+        perror("fstat");
+        close(entry->fd);
+        entry->fd = -1;
+        entry->status = PATH_CACHE_ERROR;
+        return entry;
+    }
+    entry->status = PATH_CACHE_FOUND;
+    return entry;
+}
+
+/**
+ * @brief Check that a cached entry still leads to a file that exists
+ * @param entry The cached entry
+ * @param stats Where to store the current stats of the file
+ * @return True if the entry can be used
+ */
+static bool still_valid(const CachedPath *entry, struct stat *stats)
+{
+    // Missing paths are trusted until they expire
+    if (entry->status != PATH_CACHE_FOUND)
+        return true;
+
+    int res = (entry->fd != -1) ? fstat(entry->fd, stats)
+                                : stat(entry->real_path, stats);
+
+    // A file that was deleted, or replaced by renaming another over it, has
+    // no links left
+    return res == 0 && stats->st_nlink > 0;
+}
+
+/**
+ * @brief Remove expired entries from the cold end of the shard
+ *
+ * Only a few are checked, so adding an entry stays cheap, while the files of
+ * paths that are no longer asked for are still closed before the shard fills
+ * @param shard The shard to sweep
+ * @note The shard's lock must be held
+ */
+static void sweep_expired(LruShard *shard)
+{
+    uint64_t now = get_monotonic_ms();
+    LruEntry *node = shard->lru_tail;
+    for (int x = 0; node != NULL && x < SWEEP_LEN; x++)
+    {
+        CachedPath *cold = (CachedPath *) node;
+        node = node->lru_prev;
+        if (cold->expires <= now)
+            remove_entry(shard, cold);
+    }
+}
+
+/**
+ * @brief Put a newly resolved entry into the cache
+ * @param entry The entry, which gets one reference for the caller
+ */
+static void keep_entry(CachedPath *entry)
+{
+    // Failures such as running out of file descriptors should not stick
+    if (!enabled || entry->status == PATH_CACHE_ERROR)
+    {
+        entry->refs = 1;
+        return;
+    }
+    entry->refs = 2; // One for the cache, one for the caller
+    entry->expires = get_monotonic_ms() + ttl_ms;
+
+    LruShard *shard = lru_table_shard(&table, entry->entry.hash);
+    pthread_mutex_lock(&shard->lock);
+
+    // Another thread may have resolved the path at the same time
+    CachedPath *old = find_entry(shard, entry->entry.key, entry->entry.hash);
+    if (old != NULL)
+        remove_entry(shard, old);
+
+    sweep_expired(shard);
+    while (shard->lru_tail != NULL && shard->used >= shard_max)
+        remove_entry(shard, (CachedPath *) shard->lru_tail);
+
+    lru_insert(shard, &entry->entry);
+    shard->used++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Hand the entry to the caller if the path was found
+ * @param found The entry
+ * @param entry Where to store the entry
+ * @return The PathCacheStatus of the entry
+ */
+static int use_entry(CachedPath *found, CachedPath **entry)
+{
+    int status = found->status;
+    if (status == PATH_CACHE_FOUND)
+        *entry = found;
+    else
+        path_cache_release(found);
+    return status;
+}
+
+int path_cache_init(size_t max_entries, uint32_t ttl)
+{
+    // Leave most descriptors for connections and files that are not cached
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+        && max_entries > limit.rlim_cur / FD_SHARE)
+        max_entries = limit.rlim_cur / FD_SHARE;
+
+    shard_max = (max_entries + LRU_SHARDS - 1) / LRU_SHARDS;
+    ttl_ms = ttl;
+    enabled = false;
+    if (lru_table_init(&table) != 0)
+        return 1;
+    enabled = max_entries > 0 && ttl > 0;
+    return 0;
+}
+
+void path_cache_free(void)
+{
+    for (int x = 0; x < LRU_SHARDS; x++)
+    {
+        LruShard *shard = &table.shards[x];
+        while (shard->lru_head != NULL)
+            remove_entry(shard, (CachedPath *) shard->lru_head);
+    }
+    lru_table_destroy(&table);
+    enabled = false;
+}
+
+int path_cache_open(const char *path, CachedPath **entry, struct stat *stats)
+{
+    uint32_t hash = lru_hash(path);
+    LruShard *shard = lru_table_shard(&table, hash);
+    CachedPath *found = NULL;
+    if (enabled)
+    {
+        pthread_mutex_lock(&shard->lock);
+        found = find_entry(shard, path, hash);
+        if (found != NULL && found->expires <= get_monotonic_ms())
+        {
+            remove_entry(shard, found);
+            found = NULL;
+        }
+        else if (found != NULL)
+        {
+            found->refs++;
+            lru_touch(shard, &found->entry);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    if (found != NULL)
+    {
+        if (still_valid(found, stats))
+            return use_entry(found, entry);
+
+        pthread_mutex_lock(&shard->lock);
+        if (find_entry(shard, path, hash) == found)
+        {
+            // Our own reference is still held, so this one is never the last
+            lru_remove(shard, &found->entry);
+            shard->used--;
+            found->refs--;
+        }
+        drop_ref(found);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    // Resolve it before taking the lock, so other threads are not held up
+    found = resolve_path(path, hash);
+    if (found == NULL)
+        return PATH_CACHE_ERROR;
+    *stats = found->stats;
+    keep_entry(found);
+    return use_entry(found, entry);
+}
+
+size_t path_cache_shed(void)
+{
+    if (!enabled)
+        return 0;
+
+    size_t closed = 0;
+    uint64_t now = get_monotonic_ms();
+    for (int x = 0; x < LRU_SHARDS; x++)
+    {
+        LruShard *shard = &table.shards[x];
+        pthread_mutex_lock(&shard->lock);
+
+        // Expired entries go first, then the least recently used half
+        LruEntry *node = shard->lru_tail;
+        size_t keep = shard->used / 2;
+        while (node != NULL)
+        {
+            CachedPath *cold = (CachedPath *) node;
+            node = node->lru_prev;
+            if (cold->expires > now && shard->used <= keep)
+                continue;
+            if (cold->fd != -1 && cold->refs == 1)
+                closed++;
+            remove_entry(shard, cold);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return closed;
+}
+
+void path_cache_release(CachedPath *entry)
+{
+    if (entry == NULL)
+        return;
+
+    LruShard *shard = lru_table_shard(&table, entry->entry.hash);
+    pthread_mutex_lock(&shard->lock);
+    drop_ref(entry);
+    pthread_mutex_unlock(&shard->lock);
+}
@@ -1,64 +1,235 @@
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "queue.h"
 
-node_t *head = NULL;
-node_t *tail = NULL;
+#define CACHE_LINE 64
 
-void enqueue(int *client_socket)
+/**
+ * @struct QueueCell
+ * @brief A single slot in the ring
+ *
+ * The sequence tells each side whose turn it is. It equals the position when
+ * the cell is free to be written to, and the position + 1 once it holds a
+ * connection ready to be read. Each cell has a cache line to itself, so
+ * threads working on neighbouring cells do not fight over it
+ * @ref https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+typedef struct
 {
-    node_t *new_node = malloc(sizeof(node_t));
-    if (new_node == NULL)
-        return;
+    _Alignas(CACHE_LINE) atomic_size_t sequence; //!< Which turn the cell is on
+    Connection conn;                             //!< The connection in the cell
+} QueueCell;
 
-    new_node->conn = malloc(sizeof(Connection));
-    if (new_node->conn == NULL)
+static QueueCell *cells = NULL;
+static size_t mask = 0;
+
+// Keep both ends of the queue on their own cache line, so producers and
+// consumers do not fight over the same line
+static _Alignas(CACHE_LINE) atomic_size_t enqueue_pos = 0;
+static _Alignas(CACHE_LINE) atomic_size_t dequeue_pos = 0;
+
+// Threads that went to sleep on an empty queue and have not been claimed by
+// a producer yet. Each claim is paired with exactly one post to wakeup
+static _Alignas(CACHE_LINE) atomic_int sleepers = 0;
+static sem_t wakeup;
+
+// Set while a thread has been woken up and has not taken a connection yet.
+// Only one is woken at a time, and it wakes the next if more are waiting, so
+// a burst of connections does not wake every thread for one each
+static atomic_bool waking = false;
+
+/**
+ * @brief Claim one of the sleeping threads, if there are any
+ * @return True if a thread was claimed, and must be posted to
+ */
+static bool claim_sleeper(void)
+{
+    int waiting = atomic_load(&sleepers);
+    while (waiting > 0)
+    {
+        if (atomic_compare_exchange_weak(&sleepers, &waiting, waiting - 1))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Wake up a sleeping thread, unless one is already on its way
+ */
+static void wake_one(void)
+{
+    while (atomic_load(&sleepers) > 0)
+    {
+        bool expected = false;
+        if (!atomic_compare_exchange_strong(&waking, &expected, true))
+            return;
+        if (claim_sleeper())
+        {
+            sem_post(&wakeup);
+            return;
+        }
+
+        // Everyone woke up on their own. Another producer may have seen the
+        // flag and left it to us, so look again
+        atomic_store(&waking, false);
+        if (queue_length() == 0)
+            return;
+    }
+}
+
+int queue_init(size_t depth)
+{
+    size_t size = 2;
+    while (size < depth)
+        size <<= 1;
+
+    cells = aligned_alloc(CACHE_LINE, sizeof(QueueCell) * size);
+    if (cells == NULL)
+        return 1;
+
+    for (size_t x = 0; x < size; x++)
+        atomic_init(&cells[x].sequence, x);
+    mask = size - 1;
+    atomic_init(&enqueue_pos, 0);
+    atomic_init(&dequeue_pos, 0);
+    atomic_init(&sleepers, 0);
+    atomic_init(&waking, false);
+    if (sem_init(&wakeup, 0, 0) != 0)
+    {
+        queue_free();
+        return 1;
+    }
+    return 0;
+}
+
+void queue_free(void)
+{
+    if (cells != NULL)
+        sem_destroy(&wakeup);
+    free(cells);
+    cells = NULL;
+}
+
+bool enqueue_conn(const Connection *conn)
+{
+    QueueCell *cell;
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    while (true)
     {
-        free(new_node);
-        return;
+        cell = &cells[pos & mask];
+        size_t seq = atomic_load_explicit(&cell->sequence,
+                                          memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        // Cell is free, try and claim it
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(
+                    &enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) // Cell still has last lap's connection, so full
+            return false;
+        else // Another producer beat us to it
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
     }
 
-    new_node->conn->socket = client_socket;
-    new_node->conn->raw_ip = 0;
-    new_node->next = NULL;
+    cell->conn = *conn;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
 
-    if (tail == NULL)
-        head = new_node;
-    else
-        tail->next = new_node;
+    // Pairs with the fences in dequeue_wait(), so either we see the sleeper
+    // and that no one is waking, or it sees this connection
+    atomic_thread_fence(memory_order_seq_cst);
+    wake_one();
+    return true;
+}
 
-    tail = new_node;
+bool dequeue(Connection *conn)
+{
+    QueueCell *cell;
+    size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        size_t seq = atomic_load_explicit(&cell->sequence,
+                                          memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        // Cell has a connection, try and claim it
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(
+                    &dequeue_pos, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) // Nothing has been written to the cell, so empty
+            return false;
+        else // Another consumer beat us to it
+            pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    }
+
+    *conn = cell->conn;
+
+    // Free the cell up for the producer's next lap around the ring
+    atomic_store_explicit(&cell->sequence, pos + mask + 1,
+                          memory_order_release);
+    return true;
 }
 
-void enqueue_conn(Connection *conn)
+size_t queue_length(void)
 {
-    node_t *new_node = malloc(sizeof(node_t));
-    if (new_node == NULL)
-        return;
+    size_t head = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
 
-    new_node->conn = conn;
-    new_node->next = NULL;
+    // The two are loaded at different times, so the head can be ahead
+    return (tail > head) ? tail - head : 0;
+}
 
-    if (tail == NULL)
-        head = new_node;
-    else
-        tail->next = new_node;
+/**
+ * @brief Sleep until a producer posts to this thread
+ */
+static void sleep_until_woken(void)
+{
+    while (sem_wait(&wakeup) != 0)
+        ;
 
-    tail = new_node;
+    // Let the next connection wake another thread. Pairs with the fence in
+    // enqueue_conn(), so either the producer sees the flag clear, or this
+    // thread sees its connection
+    atomic_store(&waking, false);
+    atomic_thread_fence(memory_order_seq_cst);
 }
 
-Connection *dequeue(void)
+void dequeue_wait(Connection *conn)
 {
-    if (head == NULL)
-        return NULL;
+    bool woken = false;
+    while (!dequeue(conn))
+    {
+        atomic_fetch_add(&sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
 
-    Connection *result = head->conn;
-    node_t *temp = head;
-    head = head->next;
+        // A connection may have been added before we were counted
+        if (dequeue(conn))
+        {
+            // If a producer already claimed us, take the post it is making
+            if (!claim_sleeper())
+            {
+                sleep_until_woken();
+                woken = true;
+            }
+            break;
+        }
 
-    if (head == NULL)
-        tail = NULL;
+        sleep_until_woken();
+        woken = true;
+    }
 
-    free(temp);
-    return result;
+    // Producers left the connections behind this one to us
+    if (woken && queue_length() > 0)
+        wake_one();
 }
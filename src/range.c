@@ -0,0 +1,106 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "range.h"
+
+/**
+ * @brief Skip over any spaces and tabs
+ * @param pos The current position
+ * @param end The end of the value
+ * @return The first position that is not whitespace
+ */
+static const char *skip_ows(const char *pos, const char *end)
+{
+    while (pos < end && (*pos == ' ' || *pos == '\t'))
+        pos++;
+    return pos;
+}
+
+/**
+ * @brief Parse a run of digits, saturating instead of overflowing
+ * @param pos The current position, moved past the digits
+ * @param end The end of the value
+ * @param value Where to store the number, left alone if there are no digits
+ * @return True if there was at least one digit
+ */
+static bool parse_number(const char **pos, const char *end, size_t *value)
+{
+    const char *start = *pos;
+    size_t result = 0;
+    for (; *pos < end && **pos >= '0' && **pos <= '9'; (*pos)++)
+    {
+        size_t digit = **pos - '0';
+        result = (result > (SIZE_MAX - digit) / 10) ? SIZE_MAX
+                                                    : (result * 10) + digit;
+    }
+    if (*pos == start)
+        return false;
+    *value = result;
+    return true;
+}
+
+int parse_range(const StrSlice *value, size_t size, ByteRange *ranges,
+                int *count)
+{
+    const char *pos = skip_ows(value->ptr, value->ptr + value->len);
+    const char *end = value->ptr + value->len;
+    *count = 0;
+
+    // Bytes are the only unit there is
+    const char unit[] = "bytes";
+    if ((size_t) (end - pos) < sizeof(unit) - 1
+        || strncasecmp(pos, unit, sizeof(unit) - 1) != 0)
+        return RANGE_STATUS_IGNORE;
+    pos = skip_ows(pos + sizeof(unit) - 1, end);
+    if (pos == end || *pos != '=')
+        return RANGE_STATUS_IGNORE;
+
+    bool any = false;
+    while (pos < end)
+    {
+        // Empty list elements are allowed
+        pos = skip_ows(pos + 1, end);
+        if (pos == end || *pos == ',')
+            continue;
+        any = true;
+
+        size_t first = 0, last = SIZE_MAX, suffix = 0;
+        bool has_first = parse_number(&pos, end, &first);
+        if (pos == end || *pos != '-')
+            return RANGE_STATUS_IGNORE;
+        pos++;
+        if (has_first)
+            parse_number(&pos, end, &last);
+        else if (!parse_number(&pos, end, &suffix))
+            return RANGE_STATUS_IGNORE;
+        pos = skip_ows(pos, end);
+        if ((pos < end && *pos != ',') || last < first)
+            return RANGE_STATUS_IGNORE;
+
+        // Turn the range into an offset and length within the file
+        ByteRange range;
+        if (has_first)
+        {
+            if (first >= size)
+                continue; // Not satisfiable, but the others might be
+            range.start = first;
+            range.len = ((last < size) ? last + 1 : size) - first;
+        }
+        else
+        {
+            if (suffix == 0 || size == 0)
+                continue;
+            range.start = (suffix < size) ? size - suffix : 0;
+            range.len = size - range.start;
+        }
+
+        if (*count == MAX_RANGES)
+            return RANGE_STATUS_IGNORE;
+        ranges[(*count)++] = range;
+    }
+
+    if (!any)
+        return RANGE_STATUS_IGNORE;
+    return (*count > 0) ? RANGE_STATUS_OK : RANGE_STATUS_UNSATISFIABLE;
+}
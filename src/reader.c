@@ -0,0 +1,200 @@
+#define _GNU_SOURCE // Needed for memmem
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "metrics.h"
+#include "reader.h"
+
+#define READER_INIT_SIZE 1024 // Enough for most requests
+
+static const char HEAD_END[] = "\r\n\r\n";
+static const size_t HEAD_END_LEN = sizeof(HEAD_END) - 1;
+
+/**
+ * @brief Parse the value of a Content-Length field
+ * @param value The value of the field
+ * @param length Where to store the length
+ * @return True if the value is a valid length
+ */
+static bool parse_length(const StrSlice *value, size_t *length)
+{
+    if (value->len == 0)
+        return false;
+
+    size_t result = 0;
+    for (size_t x = 0; x < value->len; x++)
+    {
+        if (value->ptr[x] < '0' || value->ptr[x] > '9')
+            return false;
+        if (result > (SIZE_MAX - 9) / 10)
+            return false;
+        result = (result * 10) + (value->ptr[x] - '0');
+    }
+    *length = result;
+    return true;
+}
+
+int reader_init(RequestReader *reader)
+{
+    memset(reader, 0, sizeof(RequestReader));
+    reader->capacity = (BUFF_SIZE < READER_INIT_SIZE) ? BUFF_SIZE
+                                                      : READER_INIT_SIZE;
+    reader->buff = malloc(reader->capacity + 1);
+    if (reader->buff == NULL)
+        return 1;
+
+    reader->buff[0] = '\0';
+    return 0;
+}
+
+void reader_free(RequestReader *reader)
+{
+    free(reader->buff);
+    reader->buff = NULL;
+    reader->size = reader->capacity = 0;
+}
+
+void reader_reset(RequestReader *reader)
+{
+    reader->size = reader->scanned = 0;
+    reader->head_len = reader->req_len = 0;
+    if (reader->buff != NULL)
+        reader->buff[0] = '\0';
+}
+
+ssize_t reader_recv(RequestReader *reader, int sock)
+{
+    // Make room, doubling the buffer until it reaches BUFF_SIZE
+    if (reader->size == reader->capacity)
+    {
+        if (reader->capacity >= BUFF_SIZE)
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        size_t capacity = reader->capacity * 2;
+        capacity = (capacity < BUFF_SIZE) ? capacity : BUFF_SIZE;
+        char *tmp = realloc(reader->buff, capacity + 1);
+        if (tmp == NULL)
+            return -1;
+        reader->buff = tmp;
+        reader->capacity = capacity;
+    }
+
+    ssize_t bytes_read = read(sock, reader->buff + reader->size,
+                              reader->capacity - reader->size);
+    if (bytes_read > 0)
+    {
+        reader->size += bytes_read;
+        reader->buff[reader->size] = '\0';
+    }
+    return bytes_read;
+}
+
+int reader_check(RequestReader *reader, HttpRequest *req)
+{
+    if (reader->head_len == 0)
+    {
+        // Back up far enough to catch an ending split across two reads
+        size_t from = (reader->scanned > HEAD_END_LEN - 1)
+                          ? reader->scanned - (HEAD_END_LEN - 1)
+                          : 0;
+        const char *end = memmem(reader->buff + from, reader->size - from,
+                                 HEAD_END, HEAD_END_LEN);
+        if (end == NULL)
+        {
+            reader->scanned = reader->size;
+            return (reader->size >= BUFF_SIZE) ? READER_STATUS_HEAD_TOO_LARGE
+                                               : READER_STATUS_NEED_MORE;
+        }
+        reader->head_len = (end - reader->buff) + HEAD_END_LEN;
+    }
+
+    // The buffer may have moved since the last check, so always parse the
+    // request again. It is only the headers, so this is cheap
+    req->buff = reader->buff;
+    req->size = reader->head_len;
+    uint64_t start = metrics_now();
+    int parsed = parse_request(req);
+    if (start != 0)
+        metrics_record(METRICS_PHASE_PARSE, metrics_now() - start);
+    switch (parsed)
+    {
+        case PARSE_STATUS_DONE:
+            break;
+        case PARSE_STATUS_TOO_LARGE:
+            return READER_STATUS_HEAD_TOO_LARGE;
+        default:
+            return READER_STATUS_INVALID;
+    }
+
+    // Work out where the body ends, so the next request can be found. Only
+    // bodies with a known length are supported
+    if (reader->req_len == 0)
+    {
+        size_t body_len = 0;
+        const StrSlice *length = get_header(req, "Content-Length");
+        if (get_header(req, "Transfer-Encoding") != NULL
+            || (length != NULL && !parse_length(length, &body_len)))
+            return READER_STATUS_INVALID;
+        if (body_len > BUFF_SIZE - reader->head_len)
+            return READER_STATUS_TOO_LARGE;
+        reader->req_len = reader->head_len + body_len;
+    }
+
+    if (reader->size < reader->req_len)
+        return READER_STATUS_NEED_MORE;
+
+    req->size = reader->req_len;
+    return READER_STATUS_READY;
+}
+
+void reader_consume(RequestReader *reader)
+{
+    size_t used = (reader->req_len > 0) ? reader->req_len : reader->size;
+    size_t left = reader->size - used;
+    memmove(reader->buff, reader->buff + used, left);
+    reader->size = left;
+    reader->buff[left] = '\0';
+    reader->scanned = 0;
+    reader->head_len = 0;
+    reader->req_len = 0;
+}
+
+void reader_reject(const RequestReader *reader, HttpRequest *req, int status,
+                   int *sock)
+{
+    int page;
+    switch (status)
+    {
+        case READER_STATUS_INVALID:
+            page = ERROR_PAGE_400;
+            break;
+        case READER_STATUS_TOO_LARGE:
+            page = ERROR_PAGE_413;
+            break;
+        case READER_STATUS_HEAD_TOO_LARGE:
+            page = ERROR_PAGE_431;
+            break;
+        default:
+            return;
+    }
+
+    // The log takes the request line to run from the method to the version
+    const char *end = memchr(reader->buff, '\n', reader->size);
+    size_t len = (end != NULL) ? (size_t) (end - reader->buff) : reader->size;
+    if (len > 0 && reader->buff[len - 1] == '\r')
+        len--;
+    req->method.ptr = reader->buff;
+    req->method.len = len;
+    req->version.ptr = reader->buff + len;
+    req->version.len = 0;
+    req->num_headers = 0;
+    reject_request(req, page, sock);
+}
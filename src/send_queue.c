@@ -0,0 +1,289 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "defaults.h"
+#include "send_queue.h"
+#include "utils.h"
+
+#define SEND_CHUNK 0x7ffff000 // Most Linux will transfer in one call
+
+static _Thread_local SendQueue *current = NULL;
+
+void send_queue_attach(SendQueue *queue)
+{
+    current = queue;
+}
+
+SendQueue *send_queue_current(void)
+{
+    return current;
+}
+
+/**
+ * @brief Add the segment to the end of the queue
+ * @param queue The queue to add to
+ * @param seg The segment to add
+ */
+static void queue_append(SendQueue *queue, SendSegment *seg)
+{
+    seg->next = NULL;
+    if (queue->tail == NULL)
+        queue->head = seg;
+    else
+        queue->tail->next = seg;
+    queue->tail = seg;
+}
+
+/**
+ * @brief Remove the segment at the front of the queue, which was sent
+ * @param queue The queue to remove from
+ */
+static void queue_pop(SendQueue *queue)
+{
+    SendSegment *seg = queue->head;
+    queue->head = seg->next;
+    if (queue->head == NULL)
+        queue->tail = NULL;
+    if (seg->fd != -1)
+        close(seg->fd);
+    free(seg);
+}
+
+/**
+ * @brief Send from the segment at the front of the queue, once
+ * @param seg The segment to send from, updated with what was sent
+ * @param sock The socket to send to
+ * @return Bytes sent, 0 if the file ended early, or -1 on error (errno is
+ * set)
+ */
+static ssize_t send_segment(SendSegment *seg, int sock)
+{
+    ssize_t sent;
+    if (seg->fd == -1)
+        sent = send(sock, seg->data + seg->offset, seg->len,
+                    MSG_NOSIGNAL | MSG_DONTWAIT);
+    else
+    {
+#ifdef __linux__
+        off_t offset = seg->offset;
+        sent = sendfile(sock, seg->fd, &offset,
+                        (seg->len < SEND_CHUNK) ? seg->len : SEND_CHUNK);
+#else
+        // Only read what the socket is likely to take, as the rest is read
+        // again next time
+        char buffer[65536];
+        sent = pread(seg->fd, buffer,
+                     (seg->len < sizeof(buffer)) ? seg->len : sizeof(buffer),
+                     seg->offset);
+        if (sent > 0)
+            sent = send(sock, buffer, sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+    }
+
+    if (sent > 0)
+    {
+        seg->offset += sent;
+        seg->len -= sent;
+    }
+    return sent;
+}
+
+int send_queue_flush(SendQueue *queue, int sock, bool *progress)
+{
+    *progress = false;
+    while (!queue->failed && queue->head != NULL)
+    {
+        SendSegment *seg = queue->head;
+        ssize_t sent = send_segment(seg, sock);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return SEND_QUEUE_AGAIN;
+        if (sent <= 0) // The send failed, or the file shrunk underneath us
+        {
+            queue->failed = true;
+            break;
+        }
+
+        *progress = true;
+        if (seg->fd == -1)
+            queue->bytes -= sent;
+        if (seg->len == 0)
+            queue_pop(queue);
+    }
+    return queue->failed ? SEND_QUEUE_ERROR : SEND_QUEUE_DONE;
+}
+
+/**
+ * @brief Wait for the client to take bytes off the queue, until no more than
+ * the limit are left
+ *
+ * Only needed when a body is produced faster than the client reads it, so
+ * the time the thread is held up is bounded by CONN_TIMEOUT_LEN
+ * @param queue The queue of the socket
+ * @param sock The socket to send to
+ * @param limit Most bytes to leave in the queue
+ * @return False if the connection failed or timed out
+ */
+static bool queue_drain(SendQueue *queue, int sock, size_t limit)
+{
+    uint64_t deadline = get_monotonic_ms() + CONN_TIMEOUT_LEN;
+    while (queue->bytes > limit)
+    {
+        bool progress;
+        int status = send_queue_flush(queue, sock, &progress);
+        if (status == SEND_QUEUE_ERROR)
+            return false;
+        if (status == SEND_QUEUE_DONE)
+            break;
+
+        uint64_t now = get_monotonic_ms();
+        if (progress)
+            deadline = now + CONN_TIMEOUT_LEN;
+        else if (now >= deadline)
+        {
+            queue->failed = true;
+            return false;
+        }
+
+        struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+        if (poll(&pfd, 1, (int) (deadline - now)) == -1 && errno != EINTR)
+        {
+            queue->failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool send_queue_write(SendQueue *queue, int sock, struct iovec *iov,
+                      int count, int flags)
+{
+    if (queue->failed)
+        return false;
+
+    // Only send straight away if nothing is waiting to go out before it
+    struct msghdr msg = { 0 };
+    while (queue->head == NULL && count > 0)
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(sock, &msg,
+                               flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent == -1)
+        {
+            queue->failed = true;
+            return false;
+        }
+
+        // Skip over the buffers that were fully sent
+        while (count > 0 && (size_t) sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    if (count == 0)
+        return true;
+
+    // Copy what is left, as the buffers are gone once the response is
+    size_t len = 0;
+    for (int x = 0; x < count; x++)
+        len += iov[x].iov_len;
+    SendSegment *seg = malloc(sizeof(SendSegment) + len);
+    if (seg == NULL)
+    {
+        queue->failed = true;
+        return false;
+    }
+    seg->fd = -1;
+    seg->offset = 0;
+    seg->len = len;
+    size_t pos = 0;
+    for (int x = 0; x < count; x++)
+    {
+        memcpy(seg->data + pos, iov[x].iov_base, iov[x].iov_len);
+        pos += iov[x].iov_len;
+    }
+    queue_append(queue, seg);
+    queue->bytes += len;
+
+    return queue->bytes <= SEND_QUEUE_MAX
+           || queue_drain(queue, sock, SEND_QUEUE_MAX / 2);
+}
+
+bool send_queue_file(SendQueue *queue, int sock, int fd, off_t offset,
+                     size_t len)
+{
+    if (queue->failed)
+        return false;
+
+    // Only send straight away if nothing is waiting to go out before it
+    SendSegment local = { .fd = fd, .offset = offset, .len = len };
+    while (queue->head == NULL && local.len > 0)
+    {
+        ssize_t sent = send_segment(&local, sock);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent <= 0) // The send failed, or the file shrunk underneath us
+        {
+            queue->failed = true;
+            return false;
+        }
+    }
+    if (local.len == 0)
+        return true;
+
+    // The descriptor may be closed once the response is, so keep our own
+    SendSegment *seg = malloc(sizeof(SendSegment));
+    if (seg == NULL)
+    {
+        queue->failed = true;
+        return false;
+    }
+    *seg = local;
+    seg->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (seg->fd == -1)
+    {
+        free(seg);
+        queue->failed = true;
+        return false;
+    }
+    queue_append(queue, seg);
+    return true;
+}
+
+bool send_queue_empty(const SendQueue *queue)
+{
+    return queue->head == NULL;
+}
+
+void send_queue_clear(SendQueue *queue)
+{
+    while (queue->head != NULL)
+        queue_pop(queue);
+    queue->bytes = 0;
+    queue->close_after = false;
+    queue->failed = false;
+}
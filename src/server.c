@@ -1,5 +1,11 @@
+#define _GNU_SOURCE // Needed for pthread_setaffinity_np
+
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -12,14 +18,23 @@
 #include <unistd.h>
 
 #include "defaults.h"
+#include "event_loop.h"
+#include "access_log.h"
+#include "arena.h"
+#include "compress.h"
+#include "dir_listing.h"
+#include "file_cache.h"
 #include "http.h"
+#include "metrics.h"
+#include "path_cache.h"
 #include "queue.h"
+#include "reader.h"
 #include "utils.h"
 
-#define SOCKET_ERROR (-1)
 #define SEC_TO_MS 1000
 #define MICRO_TO_MS 1000
-#define NANO_TO_MS (0.000001)
+#define IDLE_CHECK_LEN 50 // How often idle connections check the queue (ms)
+#define FD_RETRY_LEN 100  // Wait after running out of descriptors (unit: ms)
 
 #ifdef TEAPOT
 #define COUNT_RESET 0x7134 // Reset the teapot response count
@@ -39,16 +54,64 @@ uint16_t THREAD_POOL_SIZE = DEFAULT_THREAD_POOL_SIZE;
 uint16_t SERVER_BACKLOG = DEFAULT_BACKLOG;
 uint16_t BUFF_SIZE = DEFAULT_BUFF_SIZE;
 uint32_t CONN_TIMEOUT_LEN = DEFAULT_TIMEOUT;
+uint8_t SERVER_MODE = DEFAULT_SERVER_MODE;
+uint32_t KEEP_ALIVE_LEN = DEFAULT_POOL_KEEP_ALIVE_TIMEOUT;
+uint16_t MAX_REQUESTS = DEFAULT_MAX_REQUESTS;
+uint32_t QUEUE_DEPTH = DEFAULT_QUEUE_DEPTH;
+bool REUSE_PORT = DEFAULT_REUSE_PORT;
+bool CPU_AFFINITY = DEFAULT_CPU_AFFINITY;
+uint32_t CACHE_SIZE = DEFAULT_CACHE_SIZE;
+uint32_t CACHE_MAX_FILE = DEFAULT_CACHE_MAX_FILE;
+bool CACHE_REVALIDATE = DEFAULT_CACHE_REVALIDATE;
+uint32_t DIR_INDEX_CACHE = DEFAULT_DIR_INDEX_CACHE;
+uint32_t PATH_CACHE_SIZE = DEFAULT_PATH_CACHE_SIZE;
+uint32_t PATH_CACHE_TTL = DEFAULT_PATH_CACHE_TTL;
+bool ERROR_PAGES = DEFAULT_ERROR_PAGES;
+bool PRECOMPRESSED = DEFAULT_PRECOMPRESSED;
+bool COMPRESSION = DEFAULT_COMPRESSION;
+uint8_t COMPRESS_LEVEL = DEFAULT_COMPRESS_LEVEL;
+uint32_t COMPRESS_MIN = DEFAULT_COMPRESS_MIN_SIZE;
+char COMPRESS_TYPES[COMPRESS_TYPES_LEN] = DEFAULT_COMPRESS_TYPES;
+char ACCESS_LOG[PATH_MAX + 1] = DEFAULT_ACCESS_LOG;
+uint8_t LOG_FORMAT = DEFAULT_LOG_FORMAT;
+bool STATUS_PAGE = DEFAULT_STATUS_PAGE;
+CacheRule CACHE_RULES[MAX_CACHE_RULES];
+uint8_t NUM_CACHE_RULES = 0;
 
 pthread_t *thread_pool = NULL;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond_var = PTHREAD_COND_INITIALIZER;
+int *listeners = NULL; // Each thread's own listening socket, with REUSE_PORT
 
 /**
  * @brief Initialize the server by parsing and setting the config options
  */
 void init_server(void);
 
+/**
+ * @brief Create a TCP socket listening on SERVER_PORT
+ *
+ * With REUSE_PORT, any number of these can be listening at once, and the
+ * kernel will spread the incoming connections across them
+ * @return The listening socket
+ */
+int create_listener(void);
+
+/**
+ * @brief Create the threads in the thread pool
+ *
+ * Depending on the SERVER_MODE, the threads will either wait for connections
+ * to be queued by the main thread, or run their own event loop on server_sock.
+ * With REUSE_PORT, each thread gets its own listening socket instead
+ * @param server_sock Pointer to the listening socket
+ */
+void start_thread_pool(int *server_sock);
+
+/**
+ * @brief Pin the thread to a single CPU
+ * @param thread The thread to pin
+ * @param index The index of the thread in the thread pool
+ */
+void pin_thread(pthread_t thread, int index);
+
 /**
  * @brief Print the running config of the server
  */
@@ -75,6 +138,15 @@ void join_thread_pool(void);
  */
 int check(int exp, const char *msg);
 
+/**
+ * @brief Check if a failed accept() is worth trying again
+ *
+ * Running out of file descriptors passes once connections close, so the
+ * thread backs off for a moment rather than the server giving up
+ * @return True if accepting should carry on
+ */
+bool accept_can_retry(void);
+
 /**
  * @brief Function to manage the thread pool and check if there is work to do
  * @param arg Args passed in to be used by the thread (unused)
@@ -83,11 +155,60 @@ int check(int exp, const char *msg);
 void *thread_function(void *arg);
 
 /**
- * @brief Function to handle what to do with an incoming connection
- * @param pclient The connection
+ * @brief Function for each thread to accept and serve its own connections
+ * @param arg Pointer to the thread's listening socket
  * @return NULL
  */
-void *handle_connection(void *pclient);
+void *acceptor_thread(void *arg);
+
+/**
+ * @brief Serve requests on the connection until it is closed
+ * @param conn The connection
+ * @param reader The thread's reader, which is emptied first
+ */
+void handle_connection(const Connection *conn, RequestReader *reader);
+
+/**
+ * @brief Read and parse a single HTTP request from the socket
+ *
+ * Reads are added to the reader until it holds a full request, which may
+ * already be there if the client pipelined it. If anything goes wrong, the
+ * client is sent the appropriate error and the socket is closed and set to
+ * SOCKET_ERROR
+ * @param sock The socket to read from
+ * @param reader The reader holding what has been read from the socket
+ * @param req Where to store the parsed request
+ * @param idle If the connection has been idle since its last request
+ * @return True if a request was read
+ */
+bool read_request(int *sock, RequestReader *reader, HttpRequest *req,
+                  bool idle);
+
+/**
+ * @brief Wait for the next request on an idle connection
+ *
+ * The wait is cut short once connections are waiting for a thread, as the
+ * idle one would hold up the thread they need
+ * @param sock The socket of the connection
+ * @return True if the client sent something, or the socket has an error to
+ * report, before KEEP_ALIVE_LEN ran out
+ */
+bool wait_for_request(int sock);
+
+/**
+ * @brief Set how long reads from the socket can block for
+ * @param sock The socket to set the timeout on
+ * @param timeout The timeout length (unit: ms)
+ */
+void set_socket_timeout(int sock, uint32_t timeout);
+
+/**
+ * @brief Set how long sends to the socket can block for without progress, so
+ * a client that stops reading only holds its thread for so long
+ * @param sock The socket to set the timeout on
+ * @param timeout The timeout length (unit: ms)
+ */
+void set_send_timeout(int sock, uint32_t timeout);
 
 /**
  * @brief Free memory allocated to global strings
@@ -96,86 +217,69 @@ void free_strings(void);
 
 int main(int argc, char **argv)
 {
-    int server_sock, client_sock, addr_size;
-    SA_IN server_addr, client_addr;
+    int server_sock = SOCKET_ERROR, client_sock, addr_size;
+    SA_IN client_addr;
 
     init_server();
 
     // Capture SIGINT (CTRL + C) so we can exit gracefully
     signal(SIGINT, SIGINT_handler);
 
-    // Create a TCP socket and check if it failed or not
-    check((server_sock = socket(AF_INET, SOCK_STREAM, 0)),
-          "Failed to create socket");
+    // Writing to a client that already hung up should only fail that write,
+    // which is much more likely now that connections are kept alive
+    signal(SIGPIPE, SIG_IGN);
 
-    // Initialize address struct
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
-    int optval = 1;
-
-    // Add options to our socket
-    check(setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &optval,
-                     sizeof(optval)),
-          "Setting socket options failed\n");
+    // With REUSE_PORT, the threads create their own sockets
+    if (!REUSE_PORT)
+        server_sock = create_listener();
 
-    // Binds the socket to the port
-    check(bind(server_sock, (SA *) &server_addr, sizeof(server_addr)),
-          "Bind Failed");
-
-    // Listens on that port
-    check(listen(server_sock, SERVER_BACKLOG), "Listen Failed");
+    start_thread_pool(&server_sock);
 
 #ifndef VERBOSE
     // Used to let you know the server is running and not stalled
     printf("Waiting for connections...\n");
 #endif
 
+    // The threads accept their own connections, so there is nothing left
+    // for this thread to do
+    if (SERVER_MODE == SERVER_MODE_EVENT_LOOP || REUSE_PORT)
+    {
+        while (running)
+            pause();
+        return 0;
+    }
+
     while (running)
     {
 #ifdef VERBOSE
-        printf("Waiting for connections...\n");
+        log_printf("Waiting for connections...\n");
 #endif
         // Wait for and accept incoming connections
         addr_size = sizeof(SA_IN);
-        check((client_sock = accept(server_sock, (SA *) &client_addr,
-                                    (socklen_t *) &addr_size)),
-              "Accept Failed");
+        client_sock = accept(server_sock, (SA *) &client_addr,
+                             (socklen_t *) &addr_size);
+        if (client_sock == SOCKET_ERROR && running && accept_can_retry())
+            continue;
+        check(client_sock, "Accept Failed");
 
         // Sets a timeout for the socket
-        struct timeval tv;
-        tv.tv_sec = CONN_TIMEOUT_LEN / SEC_TO_MS;
-        tv.tv_usec = (CONN_TIMEOUT_LEN % SEC_TO_MS) * MICRO_TO_MS;
-        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, (const char *) &tv,
-                   sizeof(tv));
+        set_socket_timeout(client_sock, CONN_TIMEOUT_LEN);
+        set_send_timeout(client_sock, CONN_TIMEOUT_LEN);
 
 #ifdef VERBOSE
         // Prints out IP Address of the connected client
-        printf("Connected to %s\n", inet_ntoa(client_addr.sin_addr));
+        log_printf("Connected to %s\n", inet_ntoa(client_addr.sin_addr));
 #endif
 
-        // Allocate memory for the new connection
-        Connection *pclient = malloc(sizeof(Connection));
-        if (pclient == NULL)
-        {
-            perror("malloc");
-            break;
-        }
-        pclient->socket = malloc(sizeof(int));
-        if (pclient->socket == NULL)
+        // Puts the connection in queue for thread to pull from
+        Connection conn = { client_sock, client_addr.sin_addr.s_addr,
+                            metrics_now() };
+        if (!enqueue_conn(&conn))
         {
-            free(pclient);
-            perror("malloc");
-            break;
+            // Every thread is busy and the queue is full, shed the load
+            // rather than making the client wait even longer
+            send_503_error(&client_sock);
         }
-
-        // Puts the connection in queue for thread to pull from
-        *pclient->socket = client_sock;
-        pclient->raw_ip = client_addr.sin_addr.s_addr;
-        pthread_mutex_lock(&mutex);
-        enqueue_conn(pclient);
-        pthread_cond_signal(&cond_var);
-        pthread_mutex_unlock(&mutex);
     }
 
     return 0;
@@ -211,6 +315,29 @@ void init_server(void)
         CONN_TIMEOUT_LEN = co.timeout;
         SERVER_BACKLOG = co.backlog;
         BUFF_SIZE = co.buff_size;
+        SERVER_MODE = co.mode;
+        QUEUE_DEPTH = co.queue_depth;
+        REUSE_PORT = co.reuse_port;
+        CPU_AFFINITY = co.cpu_affinity;
+        CACHE_SIZE = co.cache_size;
+        CACHE_MAX_FILE = co.cache_max_file;
+        CACHE_REVALIDATE = co.cache_revalidate;
+        DIR_INDEX_CACHE = co.dir_index;
+        PATH_CACHE_SIZE = co.path_cache_max;
+        PATH_CACHE_TTL = co.path_cache_ttl;
+        ERROR_PAGES = co.error_pages;
+        PRECOMPRESSED = co.precompressed;
+        COMPRESSION = co.compression;
+        COMPRESS_LEVEL = co.compress_level;
+        COMPRESS_MIN = co.compress_min;
+        strcpy(COMPRESS_TYPES, co.compress_types);
+        strcpy(ACCESS_LOG, co.access_log);
+        LOG_FORMAT = co.log_format;
+        STATUS_PAGE = co.status_page;
+        NUM_CACHE_RULES = co.num_cache_rules;
+        memcpy(CACHE_RULES, co.cache_rules, sizeof(CACHE_RULES));
+        KEEP_ALIVE_LEN = co.keep_alive;
+        MAX_REQUESTS = co.max_requests;
         strcpy(SERVER_NAME, co.server_name);
         strcpy(HTML_PATH, co.path);
         fclose(cfg);
@@ -218,6 +345,105 @@ void init_server(void)
     else // No config exists, make one
         gen_http_cfg();
 
+    if (init_response_headers() != 0)
+    {
+        fprintf(stderr, "Error: Unable to render the responses\n");
+        free_strings();
+        exit(1);
+    }
+    if (file_cache_init((size_t) CACHE_SIZE * 1024,
+                        (size_t) CACHE_MAX_FILE * 1024, CACHE_REVALIDATE)
+        != 0)
+        fprintf(stderr, "Error: Unable to create the file cache\n");
+    else if (CACHE_SIZE > 0
+             && dir_listing_init((size_t) DIR_INDEX_CACHE * 1024,
+                                 CACHE_REVALIDATE)
+                    != 0)
+        fprintf(stderr, "Error: Unable to watch directories for changes\n");
+    if (path_cache_init(PATH_CACHE_SIZE, PATH_CACHE_TTL) != 0)
+        fprintf(stderr, "Error: Unable to create the path cache\n");
+
+#ifdef VERBOSE
+    print_running();
+#endif
+    metrics_init(STATUS_PAGE);
+    if (access_log_init(ACCESS_LOG, LOG_FORMAT) != 0)
+        fprintf(stderr, "Error: Unable to open the access log\n");
+}
+
+int create_listener(void)
+{
+    int server_sock;
+    SA_IN server_addr;
+
+    // Create a TCP socket and check if it failed or not
+    check((server_sock = socket(AF_INET, SOCK_STREAM, 0)),
+          "Failed to create socket");
+
+    // Initialize address struct
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(SERVER_PORT);
+    int optval = 1;
+
+    // Add options to our socket
+    check(setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &optval,
+                     sizeof(optval)),
+          "Setting socket options failed\n");
+#ifdef SO_REUSEPORT
+    if (REUSE_PORT)
+        check(setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &optval,
+                         sizeof(optval)),
+              "Setting socket options failed\n");
+#endif
+
+    // Binds the socket to the port
+    check(bind(server_sock, (SA *) &server_addr, sizeof(server_addr)),
+          "Bind Failed");
+
+    // Listens on that port
+    check(listen(server_sock, SERVER_BACKLOG), "Listen Failed");
+
+    // The event loop threads accept until there are no connections left, so
+    // the listening socket must not block
+    if (SERVER_MODE == SERVER_MODE_EVENT_LOOP)
+    {
+        int flags = fcntl(server_sock, F_GETFL, 0);
+        check(fcntl(server_sock, F_SETFL, flags | O_NONBLOCK),
+              "Setting socket to non-blocking failed");
+    }
+    return server_sock;
+}
+
+void start_thread_pool(int *server_sock)
+{
+    void *(*worker)(void *) = thread_function;
+    if (SERVER_MODE == SERVER_MODE_EVENT_LOOP)
+        worker = event_loop_thread;
+    else if (REUSE_PORT)
+        worker = acceptor_thread;
+    else if (queue_init(QUEUE_DEPTH) != 0)
+    {
+        perror("queue_init");
+        free_strings();
+        exit(1);
+    }
+
+    if (REUSE_PORT)
+    {
+        listeners = malloc(sizeof(int) * THREAD_POOL_SIZE);
+        if (listeners == NULL)
+        {
+            perror("malloc");
+            free_strings();
+            exit(1);
+        }
+        for (int x = 0; x < THREAD_POOL_SIZE; x++)
+            listeners[x] = SOCKET_ERROR;
+        for (int x = 0; x < THREAD_POOL_SIZE; x++)
+            listeners[x] = create_listener();
+    }
+
     // Create thread pool
     thread_pool = malloc(sizeof(pthread_t) * THREAD_POOL_SIZE);
     if (thread_pool == NULL)
@@ -227,10 +453,26 @@ void init_server(void)
         exit(1);
     }
     for (int x = 0; x < THREAD_POOL_SIZE; x++)
-        pthread_create(&thread_pool[x], NULL, thread_function, NULL);
+    {
+        int *sock = REUSE_PORT ? &listeners[x] : server_sock;
+        pthread_create(&thread_pool[x], NULL, worker, sock);
+        if (CPU_AFFINITY)
+            pin_thread(thread_pool[x], x);
+    }
+}
 
-#ifdef VERBOSE
-    print_running();
+void pin_thread(pthread_t thread, int index)
+{
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cpus, &set);
+    if (pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set) != 0)
+        fprintf(stderr, "Error: Unable to pin thread %d to a CPU\n", index);
 #endif
 }
 
@@ -242,8 +484,42 @@ void print_running(void)
     printf(" - Server Port:               %d\n", SERVER_PORT);
     printf(" - Number of Threads:         %d\n", THREAD_POOL_SIZE);
     printf(" - Connection Timeout Length: %dms\n", CONN_TIMEOUT_LEN);
+    printf(" - Keep-Alive Timeout Length: %dms\n", KEEP_ALIVE_LEN);
+    printf(" - Max Requests per Conn:     %d\n", MAX_REQUESTS);
     printf(" - Backlog length:            %d\n", SERVER_BACKLOG);
     printf(" - Buffer size:               %d\n", BUFF_SIZE);
+    printf(" - Queue depth:               %d\n", QUEUE_DEPTH);
+    printf(" - Mode:                      %s\n",
+           (SERVER_MODE == SERVER_MODE_EVENT_LOOP) ? "event_loop"
+                                                   : "thread_pool");
+    printf(" - Listener per thread:       %s\n", REUSE_PORT ? "on" : "off");
+    printf(" - Pin threads to CPUs:       %s\n", CPU_AFFINITY ? "on" : "off");
+    printf(" - File cache size:           %dKB\n", CACHE_SIZE);
+    printf(" - Largest cached file:       %dKB\n", CACHE_MAX_FILE);
+    printf(" - Revalidate cached files:   %s\n",
+           CACHE_REVALIDATE ? "on" : "off");
+    printf(" - Directory index cache:     %dKB\n", DIR_INDEX_CACHE);
+    printf(" - Path cache size:           %d\n", PATH_CACHE_SIZE);
+    printf(" - Path cache TTL:            %dms\n", PATH_CACHE_TTL);
+    printf(" - Custom error pages:        %s\n", ERROR_PAGES ? "on" : "off");
+    printf(" - Precompressed files:       %s\n",
+           PRECOMPRESSED ? "on" : "off");
+    printf(" - Compression:               %s\n", COMPRESSION ? "on" : "off");
+    if (COMPRESSION)
+    {
+        printf(" - Compression level:         %d\n", COMPRESS_LEVEL);
+        printf(" - Smallest compressed body:  %dB\n", COMPRESS_MIN);
+        printf(" - Compressed types:          %s\n", COMPRESS_TYPES);
+    }
+    printf(" - Access log:                %s\n", ACCESS_LOG);
+    printf(" - Log format:                %s\n",
+           (LOG_FORMAT == LOG_FORMAT_COMBINED) ? "combined" : "common");
+    printf(" - Status page:               %s\n",
+           STATUS_PAGE ? STATUS_PATH : "off");
+    for (int x = 0; x < NUM_CACHE_RULES; x++)
+        printf(" - Cache-Control (%s):%*s%s\n", CACHE_RULES[x].ext,
+               (int) (10 - strlen(CACHE_RULES[x].ext)), "",
+               CACHE_RULES[x].value);
 }
 
 void SIGINT_handler(int signal)
@@ -253,30 +529,51 @@ void SIGINT_handler(int signal)
     printf("\nCaught signal: %d\nShutting down...\n", signal);
 #endif
     join_thread_pool();
+    if (COMPRESSION)
+    {
+        CompressStats stats;
+        get_compress_stats(&stats);
+        printf("Compressed %llu bodies, %llu -> %llu bytes, in %.3fms of "
+               "CPU time\n",
+               (unsigned long long) stats.count,
+               (unsigned long long) stats.bytes_in,
+               (unsigned long long) stats.bytes_out, stats.cpu_ns / 1e6);
+    }
+    uint64_t dropped = get_log_dropped();
+    access_log_free();
+    if (dropped > 0)
+        printf("Dropped %llu log records in total\n",
+               (unsigned long long) dropped);
+    metrics_free();
+    dir_listing_free();
+    file_cache_free();
+    path_cache_free();
+    free_response_headers();
     free_strings();
     exit(EXIT_SUCCESS);
 }
 
 void join_thread_pool(void)
 {
-    if (running)
+    if (running || thread_pool == NULL)
         return;
 
-    // Add data to the queue so the threads will join
-    for (int x = 0; x < THREAD_POOL_SIZE; x++)
+    // Add data to the queue so the threads will join. Event loop threads
+    // notice we are no longer running on their own
+    // Threads blocked on their own listener are woken by shutting it down
+    for (int x = 0; x < THREAD_POOL_SIZE && listeners != NULL; x++)
     {
-        int *dummy = malloc(sizeof(int));
-        if (dummy == NULL)
-        {
-            perror("malloc");
-            exit(1);
-        }
+        if (listeners[x] != SOCKET_ERROR)
+            shutdown(listeners[x], SHUT_RDWR);
+    }
 
-        *dummy = SOCKET_ERROR;
-        pthread_mutex_lock(&mutex);
-        enqueue(dummy);
-        pthread_cond_signal(&cond_var);
-        pthread_mutex_unlock(&mutex);
+    bool pooled = SERVER_MODE == SERVER_MODE_THREAD_POOL && !REUSE_PORT;
+    Connection dummy = { SOCKET_ERROR, 0 };
+    for (int x = 0; x < THREAD_POOL_SIZE && pooled; x++)
+    {
+        // Wait for the threads to make room, if the queue is full
+        while (!enqueue_conn(&dummy))
+            sched_yield();
     }
 
     for (int x = 0; x < THREAD_POOL_SIZE; x++)
@@ -284,12 +581,22 @@ void join_thread_pool(void)
 
     // Free thread pool memory and any items remaining in the queue
     free(thread_pool);
-    Connection *p;
-    while ((p = dequeue()) != NULL)
+    for (int x = 0; x < THREAD_POOL_SIZE && listeners != NULL; x++)
     {
-        free(p->socket);
-        free(p);
+        if (listeners[x] != SOCKET_ERROR)
+            close(listeners[x]);
     }
+    free(listeners);
+    if (!pooled)
+        return;
+
+    Connection conn;
+    while (dequeue(&conn))
+    {
+        if (conn.socket != SOCKET_ERROR)
+            close(conn.socket);
+    }
+    queue_free();
 }
 
 int check(int exp, const char *msg)
@@ -305,39 +612,88 @@ int check(int exp, const char *msg)
     return exp;
 }
 
+bool accept_can_retry(void)
+{
+    if (errno == EINTR || errno == ECONNABORTED)
+        return true;
+    if (errno != EMFILE && errno != ENFILE)
+        return false;
+
+    perror("accept");
+
+    // The connection stays in the backlog, so trying again straight away
+    // would only spin
+    struct timespec wait = { 0, FD_RETRY_LEN * 1000000L };
+    nanosleep(&wait, NULL);
+    return true;
+}
+
 void *thread_function(void *arg)
 {
+    // Kept for every connection the thread serves, so it is only allocated
+    // once
+    RequestReader reader = { 0 };
     while (running)
     {
-        Connection *pclient;
-        pthread_mutex_lock(&mutex);
-        if ((pclient = dequeue()) == NULL)
-        {
-            pthread_cond_wait(&cond_var, &mutex);
-            pclient = dequeue();
-        }
-        pthread_mutex_unlock(&mutex);
-        if (pclient != NULL)
-        {
-            // We have a connection
-            handle_connection(pclient);
-        }
+        // Sleep until there is a connection in the queue
+        Connection conn;
+        dequeue_wait(&conn);
+        uint64_t start = metrics_now();
+        if (conn.queued_at != 0)
+            metrics_record(METRICS_PHASE_QUEUE, start - conn.queued_at);
+
+        // We have a connection
+        handle_connection(&conn, &reader);
+        if (start != 0)
+            metrics_add_busy(metrics_now() - start);
     }
+    reader_free(&reader);
+    arena_free();
     return NULL;
 }
 
-void *handle_connection(void *pclient)
+void *acceptor_thread(void *arg)
 {
-    Connection *tmp = (Connection *) pclient;
-    Connection conn = *tmp;
-    int client_sock = *conn.socket;
+    int server_sock = *(int *) arg;
+    RequestReader reader = { 0 };
+    while (running)
+    {
+        // Wait for and accept incoming connections
+        SA_IN client_addr;
+        socklen_t addr_size = sizeof(SA_IN);
+        int client_sock = accept(server_sock, (SA *) &client_addr,
+                                 &addr_size);
+        if (client_sock == SOCKET_ERROR)
+        {
+            // The listener is shut down when the server is
+            if (!running)
+                break;
+            if (!accept_can_retry())
+                perror("accept");
+            continue;
+        }
 
-    // Free pointers since we don't need them
-    free(tmp->socket);
-    free(tmp);
+        // Sets a timeout for the socket
+        set_socket_timeout(client_sock, CONN_TIMEOUT_LEN);
+        set_send_timeout(client_sock, CONN_TIMEOUT_LEN);
+
+        Connection conn = { client_sock, client_addr.sin_addr.s_addr, 0 };
+        uint64_t start = metrics_now();
+        handle_connection(&conn, &reader);
+        if (start != 0)
+            metrics_add_busy(metrics_now() - start);
+    }
+    reader_free(&reader);
+    arena_free();
+    return NULL;
+}
 
+void handle_connection(const Connection *conn, RequestReader *reader)
+{
+    int client_sock = conn->socket;
     if (client_sock == SOCKET_ERROR)
-        return NULL;
+        return;
+    metrics_conn_opened();
 
 #ifdef TEAPOT
     count++;
@@ -346,97 +702,141 @@ void *handle_connection(void *pclient)
     {
         send_418_error(&client_sock);
         count = (count == COUNT_RESET) ? 0 : count;
-        return NULL;
+        metrics_conn_closed();
+        return;
     }
 #endif /* TEAPOT */
 
-    char buffer[BUFF_SIZE];
-    memset(buffer, 0, BUFF_SIZE);
-    size_t bytes_read = 0;
-    size_t msg_size = 0;
+    if (reader->buff == NULL && reader_init(reader) != 0)
+    {
+        send_500_error(&client_sock);
+        metrics_conn_closed();
+        return;
+    }
+    reader_reset(reader);
 
-    // Create timers to check for connection timeout
-    struct timespec t_start = { 0, 0 }, t_end = { 0, 0 };
-    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    uint16_t served = 0;
+    while (client_sock != SOCKET_ERROR)
+    {
+        HttpRequest req = { 0 };
+        inet_ntop(AF_INET, &conn->raw_ip, req.ip, sizeof(req.ip));
+        if (!read_request(&client_sock, reader, &req, served > 0))
+            break;
+
+#ifdef VERBOSE
+        log_write(req.buff, req.head_len);
+        log_write("\n", 1);
+#endif
+
+        // Respond to the HTTP request
+        served++;
+        // An idle connection holds on to its thread, so give it up for the
+        // connections that are waiting for one
+        req.keep_alive = KEEP_ALIVE_LEN > 0 && served < MAX_REQUESTS
+                         && queue_length() == 0;
+        handle_request(&req, &client_sock);
+        reader_consume(reader);
+    }
+    metrics_conn_closed();
+}
 
-    // Read the client's message up to BUFF_SIZE, until the end of a HTTP
-    // request, or an error occurs (this includes the connection timing out)
-    while ((bytes_read = read(client_sock, buffer, BUFF_SIZE)) > 0)
+bool read_request(int *sock, RequestReader *reader, HttpRequest *req,
+                  bool idle)
+{
+    // An idle connection has no way of knowing when the client started
+    // sending, so its timer starts with the first bytes of the request
+    bool timed = !idle || reader->size > 0;
+    uint64_t start = get_monotonic_ms();
+
+    // Reads are only timed by CONN_TIMEOUT_LEN, so wait out the time between
+    // requests here
+    if (!timed && !wait_for_request(*sock))
     {
-        msg_size += bytes_read;
-
-        // Calculate the time passed in milliseconds to determine if this is
-        // a timeout
-        clock_gettime(CLOCK_MONOTONIC, &t_end);
-        time_t start = (t_start.tv_sec * SEC_TO_MS)
-                       + (t_start.tv_nsec * NANO_TO_MS);
-        time_t end = (t_end.tv_sec * SEC_TO_MS) + (t_end.tv_nsec * NANO_TO_MS);
-        time_t millis = end - start;
-        if (millis >= CONN_TIMEOUT_LEN)
-        {
-            // Request timeout
-            send_408_error(&client_sock);
-            return NULL;
-        }
-        else if (msg_size > (BUFF_SIZE - 1))
+        close(*sock);
+        *sock = SOCKET_ERROR;
+        return false;
+    }
+    ssize_t bytes_read;
+    while (true)
+    {
+        int status = reader_check(reader, req);
+        if (status == READER_STATUS_READY)
+            return true;
+        if (status != READER_STATUS_NEED_MORE)
         {
-            // Message to large
-            send_413_error(&client_sock);
-            return NULL;
+            reader_reject(reader, req, status, sock);
+            return false;
         }
-        else if (http_ending(buffer, msg_size))
+
+        if (timed && (get_monotonic_ms() - start) >= CONN_TIMEOUT_LEN)
         {
-            // Possibly valid message, go handle it
-            break;
+            // Request timeout
+            send_408_error(sock);
+            return false;
         }
-        else
+
+        bytes_read = reader_recv(reader, *sock);
+        if (bytes_read > 0)
         {
-            // Bad message format
-            send_400_error(&client_sock);
-            return NULL;
+            if (!timed)
+            {
+                timed = true;
+                start = get_monotonic_ms();
+            }
+            continue;
         }
+        if (bytes_read == SOCKET_ERROR && errno == EINTR)
+            continue;
+        break;
     }
 
-    check(bytes_read, "Recieve Error");
-    if (msg_size < 1) // If this is zero the below will crash
-        return NULL;
-
-    buffer[msg_size - 1] = 0; // Ensure message is null terminated
-
-#ifdef VERBOSE
-    printf("%s\n", buffer);
-#endif
-
-    // Create the HTTP request
-    struct in_addr addr = { conn.raw_ip };
-    HttpRequest req = { 0 };
-    strncpy(req.ip, inet_ntoa(addr), sizeof(req.ip) - 1);
-    req.buff = buffer;
-    req.size = msg_size;
-    req.type = REQUEST_TYPE_INVALID;
-
-    parse_reqest_type(&req);
-    if (!validate_http_ver(&req))
+    // Nothing more is coming. Only a request that was started, or the first
+    // one, has been promised a response
+    if (bytes_read == SOCKET_ERROR && timed
+        && (errno == EAGAIN || errno == EWOULDBLOCK))
+        send_408_error(sock);
+    else
     {
-        send_505_error(&client_sock);
-        return NULL;
+        close(*sock);
+        *sock = SOCKET_ERROR;
     }
-    switch (req.type)
+    return false;
+}
+
+bool wait_for_request(int sock)
+{
+    uint64_t deadline = get_monotonic_ms() + KEEP_ALIVE_LEN;
+    while (running)
     {
-        case REQUEST_TYPE_GET:
-        case REQUEST_TYPE_HEAD:
-            send_requested_file(&req, &client_sock);
-            break;
-        case REQUEST_TYPE_OPTIONS:
-            send_204(&client_sock, req.type);
-            break;
-        default:
-            send_405_error(&client_sock);
-            break;
+        uint64_t now = get_monotonic_ms();
+        if (now >= deadline || queue_length() > 0)
+            return false;
+
+        uint64_t wait = deadline - now;
+        if (wait > IDLE_CHECK_LEN)
+            wait = IDLE_CHECK_LEN;
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        int ready = poll(&pfd, 1, (int) wait);
+        if (ready > 0 || (ready == SOCKET_ERROR && errno != EINTR))
+            return true;
     }
+    return false;
+}
 
-    fflush(stdout);
-    return NULL;
+void set_socket_timeout(int sock, uint32_t timeout)
+{
+    struct timeval tv;
+    tv.tv_sec = timeout / SEC_TO_MS;
+    tv.tv_usec = (timeout % SEC_TO_MS) * MICRO_TO_MS;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *) &tv, sizeof(tv));
+}
+
+void set_send_timeout(int sock, uint32_t timeout)
+{
+    struct timeval tv;
+    tv.tv_sec = timeout / SEC_TO_MS;
+    tv.tv_usec = (timeout % SEC_TO_MS) * MICRO_TO_MS;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char *) &tv, sizeof(tv));
 }
 
 void free_strings(void)
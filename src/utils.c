@@ -1,298 +1,799 @@
-#include <ctype.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-
-#include "defaults.h"
-#include "limits.h"
-#include "utils.h"
-
-/**
- * @def MAX(a, b)
- * @brief Get the largest of two values
- * @param a First value to compare
- * @param b Second value to compare
- * @return The larger of the two values
- */
-#define MAX(a, b) ((a > b) ? a : b)
-
-void get_time(char *time_str)
-{
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    char temp[64] = { 0 };
-    // Example date output: Thu, 14 Nov 24, 15:04:45 PST
-    strftime(temp, sizeof(temp), "%a, %d %b %y, %H:%M:%S %Z", tm);
-    memcpy(time_str, temp, sizeof(temp));
-}
-
-size_t get_file_size(FILE *fp)
-{
-    fseek(fp, 0L, SEEK_END);
-    size_t sz = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-    return sz;
-}
-
-const char *get_filename_ext(const char *filename)
-{
-    const char *dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
-        return "";
-
-    return dot + 1;
-}
-
-ConfigOptions init_config_opts(void)
-{
-    ConfigOptions co = { 0 };
-    strcpy(co.server_name, DEFAULT_SERVER_NAME);
-    strcpy(co.path, DEFAULT_PATH);
-    co.timeout = DEFAULT_TIMEOUT;
-    co.threads = DEFAULT_THREAD_POOL_SIZE;
-    co.port = DEFAULT_SERVER_PORT;
-    co.backlog = DEFAULT_BACKLOG;
-    co.buff_size = DEFAULT_BUFF_SIZE;
-    return co;
-}
-
-ConfigOptions parse_config(FILE *config)
-{
-    ConfigOptions co = init_config_opts();
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t nread;
-    while ((nread = getline(&line, &len, config)) != -1)
-    {
-        // Ignore # (comments) and new lines
-        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
-            continue;
-
-        // Get the key and the value
-        char *result = trim(line);
-        char *value = strchr(result, ' ') + 1;
-        char key[(value - result)];
-        strncpy(key, result, sizeof(key) - 1);
-        key[sizeof(key) - 1] = '\0';
-        lowerstr(key);
-
-        if (strcmp(key, "name") == 0)
-            strncpy(co.server_name, value, sizeof(co.server_name) - 1);
-
-        else if (strcmp(key, "html_root") == 0)
-        {
-            // Only set the root path if it is valid
-            char tmp[PATH_MAX - 1] = { 0 };
-            if (realpath(value, tmp) != NULL)
-                strncpy(co.path, tmp, PATH_MAX);
-        }
-        else if (strcmp(key, "threads") == 0)
-        {
-            int threads = strtol(value, NULL, 10);
-            if (threads <= 0)
-                co.threads = DEFAULT_THREAD_POOL_SIZE;
-            else
-                co.threads = threads;
-        }
-        else if (strcmp(key, "port") == 0)
-        {
-            int port = strtol(value, NULL, 10);
-            if (port <= 0)
-                co.port = DEFAULT_SERVER_PORT;
-            else
-                co.port = port;
-        }
-        else if (strcmp(key, "timeout") == 0)
-        {
-            int timeout = strtol(value, NULL, 10);
-            if (timeout <= 0)
-                co.timeout = DEFAULT_TIMEOUT;
-            else
-                co.timeout = timeout;
-        }
-        else if (strcmp(key, "backlog") == 0)
-        {
-            int backlog = strtol(value, NULL, 10);
-            if (backlog <= 0)
-                co.backlog = DEFAULT_BACKLOG;
-            else
-                co.backlog = backlog;
-        }
-        else if (strcmp(key, "buff_size") == 0)
-        {
-            int buff_size = strtol(value, NULL, 10);
-            if (buff_size <= 0)
-                co.buff_size = DEFAULT_BUFF_SIZE;
-            else
-                co.buff_size = MAX(MIN_BUFF_SIZE, buff_size);
-        }
-    }
-    free(line);
-    return co;
-}
-
-char *trim(char *str)
-{
-    // Trim leading whitespace
-    while (isspace((unsigned char) *str))
-        str++;
-
-    if (*str == 0)
-        return str;
-
-    // Trim trailing whitespace
-    char *end = &str[strlen(str) - 1];
-    do
-    {
-        end--;
-    } while (isspace((unsigned char) *end));
-    end++;
-
-    // No end whitespace
-    if (!isspace((unsigned char) *end))
-        return str;
-
-    // Set the first whitespace character after the string to null terminator
-    *end = '\0';
-    return str;
-}
-
-char *lowerstr(char *str)
-{
-    unsigned char *p = (unsigned char *) str;
-    while (*p)
-    {
-        *p = tolower(*p);
-        p++;
-    }
-    return str;
-}
-
-int buff_resize(char **buffer, size_t *max, size_t required)
-{
-    // Already have enough space
-    if (required < (*max - 1))
-        return 0;
-
-    // Keep doubling until we have enough space
-    size_t new_size = *max;
-    do
-    {
-        new_size *= 2;
-    } while ((new_size + 1) < required);
-
-    // Try and resize
-    char *tmp = realloc(*buffer, new_size);
-    if (tmp == NULL)
-        return 1;
-
-    // Resize succeeded, update values
-    *buffer = tmp;
-    *max = new_size;
-    return 0;
-}
-
-int buff_shrink_to_fit(char **buffer, size_t *size)
-{
-    // Check if we can shrink
-    size_t len = strnlen(*buffer, *size) + 1;
-    if ((len - 1) == *size)
-        return 0;
-
-    char *tmp = realloc(*buffer, len);
-    if (tmp == NULL)
-        return 1;
-
-    // Ensure we null terminate (shouldn't be needed, but just to be safe)
-    tmp[len - 1] = '\0';
-
-    *buffer = tmp;
-    *size = len;
-
-    return 0;
-}
-
-int compare_dir_elms(const void *a, const void *b)
-{
-    struct dirent **e1 = (struct dirent **) a;
-    struct dirent **e2 = (struct dirent **) b;
-
-    // Both are either files or directories so they can be compared
-    if ((*e1)->d_type == (*e2)->d_type)
-    {
-        int result = 0;
-        char *n1 = NULL, *n2 = NULL;
-
-        // Duplicate the names so we can convert them to lowercase without
-        // modifying the original file/directory name
-        n1 = strdup((*e1)->d_name);
-        if (n1 == NULL)
-        {
-            // strdup failed, try and compare what we have
-            return strcmp((*e1)->d_name, (*e2)->d_name);
-        }
-
-        n2 = strdup((*e2)->d_name);
-        if (n2 == NULL)
-        {
-            // strdup failed, try and compare what we have
-            free(n1);
-            return strcmp((*e1)->d_name, (*e2)->d_name);
-        }
-
-        // Ensure the names are all lowercase and compare
-        result = strcmp(lowerstr(n1), lowerstr(n2));
-        free(n1);
-        free(n2);
-        return result;
-    }
-    // e1 is a directory, and e2 is not, so e1 comes first
-    else if ((*e1)->d_type == DT_DIR && (*e2)->d_type != DT_DIR)
-        return -1;
-    else // e2 is a directory, and e1 is not, so e2 comes first
-        return 1;
-}
-
-void free_dir_list(struct dirent **dir, size_t size)
-{
-    for (int x = 0; x < (int) size; x++)
-        free(dir[x]);
-    free(dir);
-}
-
-void gen_http_cfg(void)
-{
-    FILE *cfg = fopen(CFG_FILE, "w");
-    if (cfg != NULL)
-    {
-        fprintf(cfg, "##### HTTP Server Config File #####\n\n");
-        fprintf(cfg, "# The name you wish to call the server.\n# name %s\n\n",
-                DEFAULT_SERVER_NAME);
-        fprintf(cfg,
-                "# The location where the HTTP servers files are located.\n"
-                "# html_root %s\n\n",
-                DEFAULT_PATH);
-        fprintf(cfg,
-                "# The number of threads you want the server to run with."
-                "\n# threads %d\n\n",
-                DEFAULT_THREAD_POOL_SIZE);
-        fprintf(cfg,
-                "# The port you want the server to run on.\n# port %d\n\n",
-                DEFAULT_SERVER_PORT);
-        fprintf(cfg,
-                "# The amount of time (in milliseconds) before the "
-                "connection times out.\n# timeout %d\n\n",
-                DEFAULT_TIMEOUT);
-        fprintf(cfg,
-                "# The maximum length to which the queue of pending "
-                "connections for sockfd\n# may grow.\n# backlog %d\n\n",
-                DEFAULT_BACKLOG);
-        fprintf(cfg,
-                "# The size each buffer should be for reading and writing "
-                "messages to the\n# client. If a value less than the minimum "
-                "buffer size (%d) is entered, it\n# will force the buffer "
-                "size to be %d.\n# buff_size %d\n\n",
-                MIN_BUFF_SIZE, MIN_BUFF_SIZE, DEFAULT_BUFF_SIZE);
-        fclose(cfg);
-    }
-}
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "limits.h"
+#include "utils.h"
+
+/**
+ * @def MAX(a, b)
+ * @brief Get the largest of two values
+ * @param a First value to compare
+ * @param b Second value to compare
+ * @return The larger of the two values
+ */
+#define MAX(a, b) ((a > b) ? a : b)
+
+static const char DAYS[][4] = { "Sun", "Mon", "Tue", "Wed",
+                                "Thu", "Fri", "Sat" };
+static const char MONTHS[][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+// The current date, shared by every thread and rebuilt once a second
+static char shared_date[HTTP_DATE_LEN + 1];
+static _Atomic time_t date_sec = 0;
+static atomic_uint date_seq = 0;
+static atomic_flag date_lock = ATOMIC_FLAG_INIT;
+
+/**
+ * @brief Parse an on/off value from the config file
+ * @param value The value to parse
+ * @return True if the value is "on", "true", "yes" or "1"
+ */
+static bool parse_bool(char *value)
+{
+    lowerstr(value);
+    return strcmp(value, "on") == 0 || strcmp(value, "true") == 0
+           || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0;
+}
+
+/**
+ * @brief Parse the cache_control option, adding a rule for each extension
+ *
+ * The value is a comma separated list of extensions, followed by the
+ * Cache-Control value to send with them, such as "css,js max-age=86400"
+ * @param co The config options to add the rules to
+ * @param value The value of the option
+ */
+static void parse_cache_rules(ConfigOptions *co, char *value)
+{
+    char *directives = strchr(value, ' ');
+    if (directives == NULL)
+        return;
+    *directives++ = '\0';
+    directives = trim(directives);
+
+    for (char *ext = strtok(value, ","); ext != NULL; ext = strtok(NULL, ","))
+    {
+        if (co->num_cache_rules == MAX_CACHE_RULES)
+        {
+            fprintf(stderr, "Error: Too many cache_control rules\n");
+            return;
+        }
+        CacheRule *rule = &co->cache_rules[co->num_cache_rules++];
+        strncpy(rule->ext, lowerstr(ext), sizeof(rule->ext) - 1);
+        strncpy(rule->value, directives, sizeof(rule->value) - 1);
+    }
+}
+
+/**
+ * @brief Parse the digits of a number, the whole string must be digits
+ * @param str The digits to parse
+ * @param digits How many digits there are
+ * @param value Where to store the number
+ * @return True if every character was a digit
+ */
+static bool get_digits(const char *str, int digits, int *value)
+{
+    *value = 0;
+    for (int x = 0; x < digits; x++)
+    {
+        if (str[x] < '0' || str[x] > '9')
+            return false;
+        *value = (*value * 10) + (str[x] - '0');
+    }
+    return true;
+}
+
+/**
+ * @brief Write the separator followed by a zero padded number
+ * @param pos Where to write to
+ * @param sep The separator to write first
+ * @param value The number to write
+ * @param digits How many digits to write
+ * @return The position just past what was written
+ */
+static char *put_digits(char *pos, const char *sep, int value, int digits)
+{
+    while (*sep != '\0')
+        *pos++ = *sep++;
+    for (int x = digits - 1; x >= 0; x--)
+    {
+        pos[x] = '0' + (value % 10);
+        value /= 10;
+    }
+    return pos + digits;
+}
+
+void format_http_date(time_t t, char *date_str)
+{
+    // Spelled out by hand, since strftime() would use the locale's names
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char *pos = date_str;
+    memcpy(pos, DAYS[tm.tm_wday % 7], 3);
+    pos = put_digits(pos + 3, ", ", tm.tm_mday, 2);
+    *pos++ = ' ';
+    memcpy(pos, MONTHS[tm.tm_mon % 12], 3);
+    pos = put_digits(pos + 3, " ", tm.tm_year + 1900, 4);
+    pos = put_digits(pos, " ", tm.tm_hour, 2);
+    pos = put_digits(pos, ":", tm.tm_min, 2);
+    pos = put_digits(pos, ":", tm.tm_sec, 2);
+    strcpy(pos, " GMT");
+}
+
+bool parse_http_date(const char *str, size_t len, time_t *t)
+{
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    if (len != HTTP_DATE_LEN || memcmp(str + 3, ", ", 2) != 0
+        || str[7] != ' ' || str[11] != ' ' || str[16] != ' ' || str[19] != ':'
+        || str[22] != ':' || memcmp(str + 25, " GMT", 4) != 0)
+        return false;
+
+    struct tm tm = { 0 };
+    tm.tm_mon = -1;
+    for (int x = 0; x < 12; x++)
+    {
+        if (memcmp(str + 8, MONTHS[x], 3) == 0)
+            tm.tm_mon = x;
+    }
+    int year;
+    if (tm.tm_mon < 0 || !get_digits(str + 5, 2, &tm.tm_mday)
+        || !get_digits(str + 12, 4, &year)
+        || !get_digits(str + 17, 2, &tm.tm_hour)
+        || !get_digits(str + 20, 2, &tm.tm_min)
+        || !get_digits(str + 23, 2, &tm.tm_sec))
+        return false;
+    tm.tm_year = year - 1900;
+
+    *t = timegm(&tm);
+    return *t != (time_t) -1;
+}
+
+void get_http_date(char *date_str)
+{
+    // Only the first thread to notice the second has changed rebuilds the
+    // date. The sequence is odd while it is being rewritten
+    time_t now = time(NULL);
+    if (now != atomic_load(&date_sec) && !atomic_flag_test_and_set(&date_lock))
+    {
+        atomic_fetch_add(&date_seq, 1);
+        format_http_date(now, shared_date);
+        atomic_store(&date_sec, now);
+        atomic_fetch_add(&date_seq, 1);
+        atomic_flag_clear(&date_lock);
+    }
+
+    // Copy the date, trying again if it was rewritten while copying
+    unsigned int seq;
+    do
+    {
+        seq = atomic_load_explicit(&date_seq, memory_order_acquire);
+        memcpy(date_str, shared_date, HTTP_DATE_LEN);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1)
+             || seq != atomic_load_explicit(&date_seq, memory_order_relaxed));
+    date_str[HTTP_DATE_LEN] = '\0';
+}
+
+uint64_t get_monotonic_ms(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+size_t get_file_size(FILE *fp)
+{
+    fseek(fp, 0L, SEEK_END);
+    size_t sz = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    return sz;
+}
+
+bool same_file_stats(const struct stat *a, const struct stat *b)
+{
+#if __APPLE__
+    return a->st_ino == b->st_ino && a->st_size == b->st_size
+           && a->st_mtimespec.tv_sec == b->st_mtimespec.tv_sec
+           && a->st_mtimespec.tv_nsec == b->st_mtimespec.tv_nsec
+           && a->st_ctimespec.tv_sec == b->st_ctimespec.tv_sec
+           && a->st_ctimespec.tv_nsec == b->st_ctimespec.tv_nsec;
+#else
+    return a->st_ino == b->st_ino && a->st_size == b->st_size
+           && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+           && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+           && a->st_ctim.tv_sec == b->st_ctim.tv_sec
+           && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+#endif
+}
+
+char *read_file_data(int fd, size_t size)
+{
+    char *data = malloc(size ? size : 1);
+    if (data == NULL)
+        return NULL;
+
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t bytes_read = pread(fd, data + total, size - total, total);
+        if (bytes_read > 0)
+            total += bytes_read;
+        else if (bytes_read == 0 || errno != EINTR)
+        {
+            // File shrunk underneath us or could not be read
+            free(data);
+            return NULL;
+        }
+    }
+    return data;
+}
+
+const char *get_filename_ext(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+        return "";
+
+    return dot + 1;
+}
+
+/**
+ * @brief Get how long idle connections are kept open by default
+ *
+ * A thread_pool worker is tied up for as long as its connection is open, so
+ * keep-alive is only on by default in event_loop mode
+ * @param mode The ServerMode the server runs in
+ * @return The timeout (unit: ms)
+ */
+static uint32_t default_keep_alive(uint8_t mode)
+{
+    return (mode == SERVER_MODE_EVENT_LOOP) ? DEFAULT_KEEP_ALIVE_TIMEOUT
+                                            : DEFAULT_POOL_KEEP_ALIVE_TIMEOUT;
+}
+
+ConfigOptions init_config_opts(void)
+{
+    ConfigOptions co = { 0 };
+    strcpy(co.server_name, DEFAULT_SERVER_NAME);
+    strcpy(co.path, DEFAULT_PATH);
+    co.timeout = DEFAULT_TIMEOUT;
+    co.keep_alive = default_keep_alive(DEFAULT_SERVER_MODE);
+    co.threads = DEFAULT_THREAD_POOL_SIZE;
+    co.port = DEFAULT_SERVER_PORT;
+    co.backlog = DEFAULT_BACKLOG;
+    co.buff_size = DEFAULT_BUFF_SIZE;
+    co.mode = DEFAULT_SERVER_MODE;
+    co.max_requests = DEFAULT_MAX_REQUESTS;
+    co.queue_depth = DEFAULT_QUEUE_DEPTH;
+    co.reuse_port = DEFAULT_REUSE_PORT;
+    co.cpu_affinity = DEFAULT_CPU_AFFINITY;
+    co.cache_size = DEFAULT_CACHE_SIZE;
+    co.cache_max_file = DEFAULT_CACHE_MAX_FILE;
+    co.cache_revalidate = DEFAULT_CACHE_REVALIDATE;
+    co.dir_index = DEFAULT_DIR_INDEX_CACHE;
+    co.path_cache_max = DEFAULT_PATH_CACHE_SIZE;
+    co.path_cache_ttl = DEFAULT_PATH_CACHE_TTL;
+    co.error_pages = DEFAULT_ERROR_PAGES;
+    co.precompressed = DEFAULT_PRECOMPRESSED;
+    co.compression = DEFAULT_COMPRESSION;
+    co.compress_level = DEFAULT_COMPRESS_LEVEL;
+    co.compress_min = DEFAULT_COMPRESS_MIN_SIZE;
+    strcpy(co.compress_types, DEFAULT_COMPRESS_TYPES);
+    strcpy(co.access_log, DEFAULT_ACCESS_LOG);
+    co.log_format = DEFAULT_LOG_FORMAT;
+    co.status_page = DEFAULT_STATUS_PAGE;
+    return co;
+}
+
+ConfigOptions parse_config(FILE *config)
+{
+    ConfigOptions co = init_config_opts();
+    bool keep_alive_set = false; // The default depends on the mode
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t nread;
+    while ((nread = getline(&line, &len, config)) != -1)
+    {
+        // Ignore # (comments) and new lines
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+            continue;
+
+        // Get the key and the value
+        char *result = trim(line);
+        char *value = strchr(result, ' ') + 1;
+        char key[(value - result)];
+        strncpy(key, result, sizeof(key) - 1);
+        key[sizeof(key) - 1] = '\0';
+        lowerstr(key);
+
+        if (strcmp(key, "name") == 0)
+            strncpy(co.server_name, value, sizeof(co.server_name) - 1);
+
+        else if (strcmp(key, "html_root") == 0)
+        {
+            // Only set the root path if it is valid
+            char tmp[PATH_MAX - 1] = { 0 };
+            if (realpath(value, tmp) != NULL)
+                strncpy(co.path, tmp, PATH_MAX);
+        }
+        else if (strcmp(key, "threads") == 0)
+        {
+            int threads = strtol(value, NULL, 10);
+            if (threads <= 0)
+                co.threads = DEFAULT_THREAD_POOL_SIZE;
+            else
+                co.threads = threads;
+        }
+        else if (strcmp(key, "port") == 0)
+        {
+            int port = strtol(value, NULL, 10);
+            if (port <= 0)
+                co.port = DEFAULT_SERVER_PORT;
+            else
+                co.port = port;
+        }
+        else if (strcmp(key, "timeout") == 0)
+        {
+            int timeout = strtol(value, NULL, 10);
+            if (timeout <= 0)
+                co.timeout = DEFAULT_TIMEOUT;
+            else
+                co.timeout = timeout;
+        }
+        else if (strcmp(key, "backlog") == 0)
+        {
+            int backlog = strtol(value, NULL, 10);
+            if (backlog <= 0)
+                co.backlog = DEFAULT_BACKLOG;
+            else
+                co.backlog = backlog;
+        }
+        else if (strcmp(key, "buff_size") == 0)
+        {
+            int buff_size = strtol(value, NULL, 10);
+            if (buff_size <= 0)
+                co.buff_size = DEFAULT_BUFF_SIZE;
+            else
+                co.buff_size = MAX(MIN_BUFF_SIZE, buff_size);
+        }
+        else if (strcmp(key, "keep_alive") == 0)
+        {
+            // Zero is valid here, it turns keep-alive off
+            int keep_alive = strtol(value, NULL, 10);
+            keep_alive_set = keep_alive >= 0;
+            if (keep_alive_set)
+                co.keep_alive = keep_alive;
+        }
+        else if (strcmp(key, "max_requests") == 0)
+        {
+            int max_requests = strtol(value, NULL, 10);
+            if (max_requests <= 0)
+                co.max_requests = DEFAULT_MAX_REQUESTS;
+            else
+                co.max_requests = max_requests;
+        }
+        else if (strcmp(key, "queue_depth") == 0)
+        {
+            long queue_depth = strtol(value, NULL, 10);
+            if (queue_depth <= 0)
+                co.queue_depth = DEFAULT_QUEUE_DEPTH;
+            else
+                co.queue_depth = queue_depth;
+        }
+        else if (strcmp(key, "reuse_port") == 0)
+            co.reuse_port = parse_bool(value);
+        else if (strcmp(key, "cpu_affinity") == 0)
+            co.cpu_affinity = parse_bool(value);
+        else if (strcmp(key, "cache_size") == 0)
+        {
+            // Zero is valid here, it turns the cache off
+            long cache_size = strtol(value, NULL, 10);
+            if (cache_size < 0)
+                co.cache_size = DEFAULT_CACHE_SIZE;
+            else
+                co.cache_size = cache_size;
+        }
+        else if (strcmp(key, "cache_max_file") == 0)
+        {
+            long cache_max_file = strtol(value, NULL, 10);
+            if (cache_max_file <= 0)
+                co.cache_max_file = DEFAULT_CACHE_MAX_FILE;
+            else
+                co.cache_max_file = cache_max_file;
+        }
+        else if (strcmp(key, "cache_revalidate") == 0)
+            co.cache_revalidate = parse_bool(value);
+        else if (strcmp(key, "dir_index_cache") == 0)
+        {
+            // Zero is valid here, it turns the cache off
+            long dir_index = strtol(value, NULL, 10);
+            if (dir_index < 0)
+                co.dir_index = DEFAULT_DIR_INDEX_CACHE;
+            else
+                co.dir_index = dir_index;
+        }
+        else if (strcmp(key, "path_cache_size") == 0)
+        {
+            // Zero is valid here, it turns the cache off
+            long path_cache_size = strtol(value, NULL, 10);
+            if (path_cache_size < 0)
+                co.path_cache_max = DEFAULT_PATH_CACHE_SIZE;
+            else
+                co.path_cache_max = path_cache_size;
+        }
+        else if (strcmp(key, "path_cache_ttl") == 0)
+        {
+            long path_cache_ttl = strtol(value, NULL, 10);
+            if (path_cache_ttl < 0)
+                co.path_cache_ttl = DEFAULT_PATH_CACHE_TTL;
+            else
+                co.path_cache_ttl = path_cache_ttl;
+        }
+        else if (strcmp(key, "error_pages") == 0)
+            co.error_pages = parse_bool(value);
+        else if (strcmp(key, "precompressed") == 0)
+            co.precompressed = parse_bool(value);
+        else if (strcmp(key, "compression") == 0)
+            co.compression = parse_bool(value);
+        else if (strcmp(key, "compression_level") == 0)
+        {
+            int level = strtol(value, NULL, 10);
+            if (level < 1 || level > 9)
+                co.compress_level = DEFAULT_COMPRESS_LEVEL;
+            else
+                co.compress_level = level;
+        }
+        else if (strcmp(key, "compression_min_size") == 0)
+        {
+            long min_size = strtol(value, NULL, 10);
+            if (min_size < 0)
+                co.compress_min = DEFAULT_COMPRESS_MIN_SIZE;
+            else
+                co.compress_min = min_size;
+        }
+        else if (strcmp(key, "compression_types") == 0)
+        {
+            // Spaces after the commas are dropped
+            size_t len = 0;
+            for (char *pos = lowerstr(value); *pos != '\0'; pos++)
+            {
+                if (*pos != ' ' && len < sizeof(co.compress_types) - 1)
+                    co.compress_types[len++] = *pos;
+            }
+            co.compress_types[len] = '\0';
+        }
+        else if (strcmp(key, "cache_control") == 0)
+            parse_cache_rules(&co, value);
+        else if (strcmp(key, "mode") == 0)
+        {
+            if (strcmp(lowerstr(value), "event_loop") == 0)
+                co.mode = SERVER_MODE_EVENT_LOOP;
+            else
+                co.mode = SERVER_MODE_THREAD_POOL;
+        }
+        else if (strcmp(key, "access_log") == 0)
+        {
+            // Anything other than the two keywords is a path to the file
+            if (strcasecmp(value, "stdout") == 0)
+                strcpy(co.access_log, "stdout");
+            else if (strcasecmp(value, "off") == 0)
+                strcpy(co.access_log, "off");
+            else
+                strncpy(co.access_log, value, sizeof(co.access_log) - 1);
+        }
+        else if (strcmp(key, "log_format") == 0)
+        {
+            if (strcmp(lowerstr(value), "combined") == 0)
+                co.log_format = LOG_FORMAT_COMBINED;
+            else
+                co.log_format = LOG_FORMAT_COMMON;
+        }
+        else if (strcmp(key, "status_page") == 0)
+            co.status_page = parse_bool(value);
+    }
+    free(line);
+    if (!keep_alive_set)
+        co.keep_alive = default_keep_alive(co.mode);
+    return co;
+}
+
+char *trim(char *str)
+{
+    // Trim leading whitespace
+    while (isspace((unsigned char) *str))
+        str++;
+
+    if (*str == 0)
+        return str;
+
+    // Trim trailing whitespace
+    char *end = &str[strlen(str) - 1];
+    do
+    {
+        end--;
+    } while (isspace((unsigned char) *end));
+    end++;
+
+    // No end whitespace
+    if (!isspace((unsigned char) *end))
+        return str;
+
+    // Set the first whitespace character after the string to null terminator
+    *end = '\0';
+    return str;
+}
+
+char *lowerstr(char *str)
+{
+    unsigned char *p = (unsigned char *) str;
+    while (*p)
+    {
+        *p = tolower(*p);
+        p++;
+    }
+    return str;
+}
+
+/**
+ * @brief Make room for more characters in the builder
+ * @param sb The builder to grow
+ * @param extra Number of characters that need to fit, not counting the NUL
+ * @return True if there is room
+ */
+static bool str_builder_reserve(StrBuilder *sb, size_t extra)
+{
+    if (sb->failed)
+        return false;
+    if (sb->len + extra < sb->max)
+        return true;
+
+    // Doubling keeps appending linear overall
+    size_t new_max = sb->max;
+    while (new_max <= sb->len + extra)
+        new_max *= 2;
+    char *tmp = realloc(sb->data, new_max);
+    if (tmp == NULL)
+    {
+        sb->failed = true;
+        return false;
+    }
+    sb->data = tmp;
+    sb->max = new_max;
+    return true;
+}
+
+bool str_builder_init(StrBuilder *sb, size_t size)
+{
+    sb->len = 0;
+    sb->max = MAX(size, 16);
+    sb->data = malloc(sb->max);
+    sb->failed = sb->data == NULL;
+    if (sb->data != NULL)
+        sb->data[0] = '\0';
+    return !sb->failed;
+}
+
+void str_builder_append(StrBuilder *sb, const char *str, size_t len)
+{
+    if (!str_builder_reserve(sb, len))
+        return;
+    memcpy(sb->data + sb->len, str, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+void str_builder_appendf(StrBuilder *sb, const char *fmt, ...)
+{
+    if (sb->failed)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(sb->data + sb->len, sb->max - sb->len, fmt, args);
+    va_end(args);
+    if (len < 0)
+    {
+        sb->failed = true;
+        return;
+    }
+
+    // Did not fit, so grow and format it again
+    if ((size_t) len >= sb->max - sb->len)
+    {
+        if (!str_builder_reserve(sb, len))
+            return;
+        va_start(args, fmt);
+        vsnprintf(sb->data + sb->len, sb->max - sb->len, fmt, args);
+        va_end(args);
+    }
+    sb->len += len;
+}
+
+char *str_builder_take(StrBuilder *sb, size_t *len)
+{
+    char *data = sb->data;
+    sb->data = NULL;
+    if (sb->failed)
+    {
+        free(data);
+        return NULL;
+    }
+
+    // Give back the room that was never used
+    char *tmp = realloc(data, sb->len + 1);
+    if (tmp != NULL)
+        data = tmp;
+    if (len != NULL)
+        *len = sb->len;
+    return data;
+}
+
+void str_builder_free(StrBuilder *sb)
+{
+    free(sb->data);
+    sb->data = NULL;
+}
+
+void gen_http_cfg(void)
+{
+    FILE *cfg = fopen(CFG_FILE, "w");
+    if (cfg != NULL)
+    {
+        fprintf(cfg, "##### HTTP Server Config File #####\n\n");
+        fprintf(cfg, "# The name you wish to call the server.\n# name %s\n\n",
+                DEFAULT_SERVER_NAME);
+        fprintf(cfg,
+                "# The location where the HTTP servers files are located.\n"
+                "# html_root %s\n\n",
+                DEFAULT_PATH);
+        fprintf(cfg,
+                "# The number of threads you want the server to run with."
+                "\n# threads %d\n\n",
+                DEFAULT_THREAD_POOL_SIZE);
+        fprintf(cfg,
+                "# The port you want the server to run on.\n# port %d\n\n",
+                DEFAULT_SERVER_PORT);
+        fprintf(cfg,
+                "# The amount of time (in milliseconds) before the "
+                "connection times out.\n# timeout %d\n\n",
+                DEFAULT_TIMEOUT);
+        fprintf(cfg,
+                "# The amount of time (in milliseconds) an idle connection is "
+                "kept open,\n# waiting for the next request. Set to 0 to "
+                "close the connection after\n# every response.\n"
+                "# In thread_pool mode, an open connection holds on to its "
+                "thread, so keep-alive\n# is off unless set here, and ends "
+                "early once connections are waiting for a\n# thread. "
+                "Defaults to %d in event_loop mode.\n"
+                "# keep_alive %d\n\n",
+                DEFAULT_KEEP_ALIVE_TIMEOUT, DEFAULT_POOL_KEEP_ALIVE_TIMEOUT);
+        fprintf(cfg,
+                "# The maximum number of requests to serve over a single "
+                "connection.\n# max_requests %d\n\n",
+                DEFAULT_MAX_REQUESTS);
+        fprintf(cfg,
+                "# The maximum length to which the queue of pending "
+                "connections for sockfd\n# may grow.\n# backlog %d\n\n",
+                DEFAULT_BACKLOG);
+        fprintf(cfg,
+                "# The size each buffer should be for reading and writing "
+                "messages to the\n# client. If a value less than the minimum "
+                "buffer size (%d) is entered, it\n# will force the buffer "
+                "size to be %d.\n# buff_size %d\n\n",
+                MIN_BUFF_SIZE, MIN_BUFF_SIZE, DEFAULT_BUFF_SIZE);
+        fprintf(cfg,
+                "# The number of accepted connections that can wait for a "
+                "thread. Once full,\n# new connections are turned away with "
+                "a 503. Rounded up to a power of two.\n# queue_depth %d\n\n",
+                DEFAULT_QUEUE_DEPTH);
+        fprintf(cfg,
+                "# How connections are handled. 'thread_pool' gives each "
+                "connection its own\n# thread until it is done. 'event_loop' "
+                "multiplexes non-blocking sockets\n# across the threads "
+                "using epoll, so slow clients do not tie up a thread.\n"
+                "# mode thread_pool\n\n");
+        fprintf(cfg,
+                "# Give each thread its own listening socket with "
+                "SO_REUSEPORT, and let the\n# kernel spread new connections "
+                "across them, rather than having a single\n# thread accept "
+                "every connection.\n# reuse_port off\n\n");
+        fprintf(cfg,
+                "# Pin each thread to its own CPU, so it keeps its caches "
+                "warm.\n# cpu_affinity off\n\n");
+        fprintf(cfg,
+                "# The amount of memory (in kilobytes) used to keep recently "
+                "served files\n# in memory. Set to 0 to read every file from "
+                "disk.\n# cache_size %d\n\n",
+                DEFAULT_CACHE_SIZE);
+        fprintf(cfg,
+                "# Files larger than this (in kilobytes) are never cached, "
+                "and are sent\n# straight from disk instead.\n"
+                "# cache_max_file %d\n\n",
+                DEFAULT_CACHE_MAX_FILE);
+        fprintf(cfg,
+                "# Check that a cached file has not changed on disk before "
+                "serving it. Turn\n# off if the files never change while "
+                "the server is running.\n# cache_revalidate on\n\n");
+        fprintf(cfg,
+                "# The amount of memory (in kilobytes) used to keep the "
+                "sorted contents of\n# listed directories, so any page of "
+                "a listing is rendered without reading\n# the directory "
+                "again. Kept apart from cache_size, as the index of a large"
+                "\n# directory is larger than cache_max_file. Set to 0 to "
+                "read the directory\n# for every page.\n"
+                "# dir_index_cache %d\n\n",
+                DEFAULT_DIR_INDEX_CACHE);
+        fprintf(cfg,
+                "# The number of resolved paths to keep, along with their "
+                "open files, so\n# serving a file again skips resolving and "
+                "opening it. Set to 0 to\n# resolve every path on every "
+                "request. No more than a quarter of the open\n# file limit "
+                "(ulimit -n) is used.\n# path_cache_size %d\n\n",
+                DEFAULT_PATH_CACHE_SIZE);
+        fprintf(cfg,
+                "# How long (in milliseconds) a resolved path is kept. New "
+                "files, and\n# changed symbolic links, can take this long to "
+                "be seen. Deleted or\n# replaced files are noticed straight "
+                "away. Set to 0 to turn the cache off.\n"
+                "# path_cache_ttl %d\n\n",
+                DEFAULT_PATH_CACHE_TTL);
+        fprintf(cfg,
+                "# Send custom error pages, such as 404.html, from the root "
+                "of html_root\n# instead of the built in ones. They are "
+                "loaded once at startup.\n# error_pages off\n\n");
+        fprintf(cfg,
+                "# Send a precompressed copy of a text file, such as "
+                "style.css.br,\n# style.css.zst or style.css.gz, to clients "
+                "that accept it. Copies older\n# than the file are ignored.\n"
+                "# precompressed on\n\n");
+        fprintf(cfg,
+                "# Compress responses with gzip or deflate as they are sent, "
+                "for clients\n# that accept it. Compressed files are kept in "
+                "the file cache, so each\n# version of a file is only "
+                "compressed once. Files too large for the\n# cache "
+                "(cache_max_file) are sent as they are, unless a "
+                "precompressed copy\n# exists.\n# compression off\n\n");
+        fprintf(cfg,
+                "# How hard to compress, from 1 (fastest) to 9 "
+                "(smallest).\n# compression_level %d\n\n",
+                DEFAULT_COMPRESS_LEVEL);
+        fprintf(cfg,
+                "# Bodies smaller than this (in bytes) are not worth "
+                "compressing.\n# compression_min_size %d\n\n",
+                DEFAULT_COMPRESS_MIN_SIZE);
+        fprintf(cfg,
+                "# The content types to compress, separated by commas.\n"
+                "# compression_types %s\n\n",
+                DEFAULT_COMPRESS_TYPES);
+        fprintf(cfg,
+                "# The Cache-Control field to send with files, by extension. "
+                "Can be given\n# more than once, and '*' matches any file "
+                "without a rule of its own.\n"
+                "# cache_control css,js,png public, max-age=86400\n"
+                "# cache_control * no-cache\n\n");
+        fprintf(cfg,
+                "# Where to write a line for each request: stdout, off, or "
+                "the path of a\n# file to append to. Lines are written by a "
+                "thread of their own, so a slow\n# disk or terminal never "
+                "holds up a request.\n# access_log %s\n\n",
+                DEFAULT_ACCESS_LOG);
+        fprintf(cfg,
+                "# The format of the access log, common or combined. "
+                "Combined adds the\n# Referer and User-Agent of each "
+                "request.\n# log_format common\n\n");
+        fprintf(cfg,
+                "# Serve counters and latency percentiles at /_status, in "
+                "the Prometheus text\n# format. Anyone who can reach the "
+                "server can read them.\n# status_page off\n\n");
+        fclose(cfg);
+    }
+}